@@ -0,0 +1,8 @@
+CREATE TABLE indexqueue (
+       url TEXT PRIMARY KEY,
+       priority INTEGER NOT NULL DEFAULT 0,
+       status INTEGER NOT NULL DEFAULT 0);
+
+CREATE INDEX indexqueue_status_idx ON indexqueue(status, priority);
+
+CREATE INDEX item_parent_idx ON item(parent);
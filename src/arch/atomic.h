@@ -40,7 +40,7 @@ atomic_inc(atomic_t *a)
 static inline int __attribute__((warn_unused_result))
 atomic_add_and_fetch(atomic_t *a, int v)
 {
-  return __sync_add_and_fetch(&a->v, 1);
+  return __sync_add_and_fetch(&a->v, v);
 }
 
 static inline int
@@ -61,6 +61,26 @@ atomic_set(atomic_t *a, int v)
   return a->v = v;
 }
 
+/**
+ * Pointer compare-and-swap. Returns the previous value of *p
+ */
+static inline void *
+atomic_cas_ptr(void **p, void *oldval, void *newval)
+{
+  return __sync_val_compare_and_swap(p, oldval, newval);
+}
+
+/**
+ * Swap in a new pointer, returns the previous value of *p
+ */
+static inline void *
+atomic_xchg_ptr(void **p, void *newval)
+{
+  void *old = __sync_lock_test_and_set(p, newval);
+  __sync_synchronize();
+  return old;
+}
+
 #elif defined(_MSC_VER)
 
 #include <Windows.h>
@@ -100,6 +120,18 @@ atomic_set(atomic_t *a, int v)
   return a->v = v;
 }
 
+static __inline void *
+atomic_cas_ptr(void **p, void *oldval, void *newval)
+{
+  return InterlockedCompareExchangePointer(p, newval, oldval);
+}
+
+static __inline void *
+atomic_xchg_ptr(void **p, void *newval)
+{
+  return InterlockedExchangePointer(p, newval);
+}
+
 #else
 #error Missing atomic ops
 #endif
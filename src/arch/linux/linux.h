@@ -33,6 +33,8 @@ void linux_webpopup_check(void);
 
 void linux_init_monitors(void);
 
+int linux_pin_thread(int cpu);
+
 struct prop;
 
 typedef struct linux_ui {
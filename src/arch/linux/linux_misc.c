@@ -87,6 +87,20 @@ get_system_concurrency(void)
 }
 
 
+/**
+ * Bind the calling thread to a single CPU
+ */
+int
+linux_pin_thread(int cpu)
+{
+  cpu_set_t mask;
+
+  CPU_ZERO(&mask);
+  CPU_SET(cpu, &mask);
+  return sched_setaffinity(0, sizeof(mask), &mask);
+}
+
+
 
 /**
  *
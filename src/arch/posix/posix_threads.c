@@ -45,6 +45,24 @@ hts_mutex_init_recursive(hts_mutex_t *m)
   pthread_mutexattr_destroy(&a);
 }
 
+
+/**
+ * Writers are preferred where supported, otherwise a steady stream of
+ * readers can keep them out forever
+ */
+void
+hts_rwlock_init(hts_rwlock_t *l)
+{
+  pthread_rwlockattr_t a;
+  pthread_rwlockattr_init(&a);
+#if defined(__GLIBC__)
+  pthread_rwlockattr_setkind_np(&a,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(l, &a);
+  pthread_rwlockattr_destroy(&a);
+}
+
 /**
  *
  */
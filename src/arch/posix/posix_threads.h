@@ -56,6 +56,23 @@ hts_mutex_trylock(pthread_mutex_t *m)
   return pthread_mutex_trylock(m) == EBUSY;
 }
 
+/**
+ * Reader/writer locks
+ */
+typedef pthread_rwlock_t hts_rwlock_t;
+
+extern void hts_rwlock_init(hts_rwlock_t *l);
+#define hts_rwlock_rdlock(l)         pthread_rwlock_rdlock(l)
+#define hts_rwlock_wrlock(l)         pthread_rwlock_wrlock(l)
+#define hts_rwlock_unlock(l)         pthread_rwlock_unlock(l)
+#define hts_rwlock_destroy(l)        pthread_rwlock_destroy(l)
+
+static inline int
+hts_rwlock_trywrlock(pthread_rwlock_t *l)
+{
+  return pthread_rwlock_trywrlock(l) == EBUSY;
+}
+
 /**
  * Condition variables
  */
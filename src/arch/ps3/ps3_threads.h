@@ -99,6 +99,18 @@ extern void hts_mutex_destroyx(hts_mutex_t *m, const char *file, int line);
 
 #endif
 
+/**
+ * Reader/writer locks, plain mutexes for now
+ */
+typedef hts_mutex_t hts_rwlock_t;
+
+#define hts_rwlock_init(l)           hts_mutex_init(l)
+#define hts_rwlock_rdlock(l)         hts_mutex_lock(l)
+#define hts_rwlock_wrlock(l)         hts_mutex_lock(l)
+#define hts_rwlock_trywrlock(l)      hts_mutex_trylock(l)
+#define hts_rwlock_unlock(l)         hts_mutex_unlock(l)
+#define hts_rwlock_destroy(l)        hts_mutex_destroy(l)
+
 /**
  * Condition variables
  */
@@ -335,6 +335,10 @@ typedef struct torrent {
   char to_new_valid_piece;
   char to_need_updated_interest;
   char to_corrupt_piece;
+  char to_need_more_peers;
+  char to_dying; // Peers closed, main loop will destroy it
+
+  int to_loop; // asyncio loop that runs all peers of this torrent
 
   char to_errbuf[256];
 
@@ -423,6 +427,8 @@ void torrent_announce_all(torrent_t *to);
 
 void torrent_attempt_more_peers(torrent_t *to);
 
+void torrent_wakeup(torrent_t *to);
+
 void torrent_io_do_requests(torrent_t *to);
 
 void torrent_receive_block(torrent_block_t *tb, const void *buf,
@@ -146,8 +146,10 @@ peer_send_keepalive(void *aux)
 {
   peer_t *p = aux;
   uint8_t buf[4] = {0};
+  hts_mutex_lock(&bittorrent_mutex);
   asyncio_send(p->p_connection, buf, sizeof(buf), 0);
   peer_arm_ka_timer(p);
+  hts_mutex_unlock(&bittorrent_mutex);
 }
 
 
@@ -197,6 +199,8 @@ peer_error_cb(void *opaque, const char *error)
 {
   peer_t *p = opaque;
 
+  hts_mutex_lock(&bittorrent_mutex);
+
   if(error == NULL) {
     p->p_am_choking = 1;
     p->p_am_interested = 0;
@@ -207,6 +211,7 @@ peer_error_cb(void *opaque, const char *error)
     asyncio_set_timeout(p->p_connection, async_now + 15 * 1000000);
     p->p_state = PEER_STATE_WAIT_HANDSHAKE;
     peer_trace(p, PEER_DBG_CONN, "Connected");
+    hts_mutex_unlock(&bittorrent_mutex);
     return;
   }
 
@@ -216,6 +221,7 @@ peer_error_cb(void *opaque, const char *error)
   peer_shutdown(p, p->p_state == PEER_STATE_RUNNING ? 
 		PEER_STATE_DISCONNECTED :
 		PEER_STATE_CONNECT_FAIL, 1);
+  hts_mutex_unlock(&bittorrent_mutex);
 }
 
 
@@ -777,46 +783,67 @@ peer_connect(peer_t *p)
 
 
 /**
+ * A complete message cut out of the socket buffer
+ */
+typedef struct peer_msg {
+  struct peer_msg *pm_next;
+  uint8_t pm_msgid;
+  uint32_t pm_len;
+  uint8_t pm_data[0];
+} peer_msg_t;
+
+
+/**
+ * Cut all complete messages out of the socket buffer and append them to
+ * '*tailp'. Only the connection's own buffer is touched so this does not
+ * need bittorrent_mutex, which keeps the copying out of the lock that
+ * all loops share.
  *
+ * Returns an error string if the stream is broken
  */
-static int
-recv_message(peer_t *p, htsbuf_queue_t *q)
+static const char *
+peer_read_messages(htsbuf_queue_t *q, peer_msg_t ***tailp)
 {
   uint32_t len;
-  uint8_t msgid;
+  peer_msg_t *pm;
 
-  if(htsbuf_peek(q, &len, sizeof(len)) != sizeof(len))
-    return 1;
-  len = ntohl(len);
+  while(1) {
+    if(htsbuf_peek(q, &len, sizeof(len)) != sizeof(len))
+      return NULL;
+    len = ntohl(len);
 
-  if(len > 0x100000) { // Arbitrary
-    peer_disconnect(p, "Bad message length");
-    return 1;
-  }
+    if(len > 0x100000) // Arbitrary
+      return "Bad message length";
 
-  if(q->hq_size < len + 4)
-    return 1; // Not enoguh bytes in buffer yet
+    if(q->hq_size < len + 4)
+      return NULL; // Not enoguh bytes in buffer yet
 
-  htsbuf_drop(q, 4);
+    htsbuf_drop(q, 4);
 
-  if(len == 0) {
-    return 0; // Keep alive
-  }
-  htsbuf_read(q, &msgid, 1);
-  len--;
+    if(len == 0)
+      continue; // Keep alive
 
-  void *data = NULL;
+    pm = mymalloc(sizeof(peer_msg_t) + len - 1);
+    if(pm == NULL)
+      return "Out of memory";
 
-  if(len) {
-    data = mymalloc(len);
-    if(data == NULL) {
-      peer_disconnect(p, "Out of memory");
-      return 1;
-    }
+    htsbuf_read(q, &pm->pm_msgid, 1);
+    pm->pm_len = len - 1;
+    htsbuf_read(q, pm->pm_data, pm->pm_len);
 
-    htsbuf_read(q, data, len);
+    pm->pm_next = NULL;
+    **tailp = pm;
+    *tailp = &pm->pm_next;
   }
+}
+
 
+/**
+ *
+ */
+static int
+recv_message(peer_t *p, uint8_t msgid, const uint8_t *data, uint32_t len)
+{
   int r = 0;
 
   switch(msgid) {
@@ -855,7 +882,7 @@ recv_message(peer_t *p, htsbuf_queue_t *q)
     break;
 
   case BT_MSGID_PIECE:
-    recv_piece(p, data, len);
+    r = recv_piece(p, data, len);
     break;
 
   case BT_MSGID_INTERESTED:
@@ -894,7 +921,6 @@ recv_message(peer_t *p, htsbuf_queue_t *q)
     break;
   }
 
-  free(data);
   return r;
 }
 
@@ -906,16 +932,22 @@ static void
 peer_read_cb(void *opaque, htsbuf_queue_t *q)
 {
   peer_t *p = opaque;
+  peer_msg_t *msgs = NULL, **tail = &msgs, *pm;
+  const char *err;
   int timeout;
 
+  hts_mutex_lock(&bittorrent_mutex);
+
   switch(p->p_state) {
 
   default:
     abort();
 
   case PEER_STATE_WAIT_HANDSHAKE:
-    if(recv_handshake(p, q))
+    if(recv_handshake(p, q)) {
+      hts_mutex_unlock(&bittorrent_mutex);
       return;
+    }
     LIST_INSERT_HEAD(&p->p_torrent->to_running_peers, p, p_running_link);
     p->p_state = PEER_STATE_RUNNING;
     // FALLTHRU
@@ -923,16 +955,38 @@ peer_read_cb(void *opaque, htsbuf_queue_t *q)
     p->p_disconnected = 0;
 
   case PEER_STATE_RUNNING:
-    while(1) {
-      if(recv_message(p, q))
-        break;
+    break;
+  }
+
+  hts_mutex_unlock(&bittorrent_mutex);
+
+  err = peer_read_messages(q, &tail);
+
+  hts_mutex_lock(&bittorrent_mutex);
+
+  while((pm = msgs) != NULL) {
+    msgs = pm->pm_next;
+    int r = recv_message(p, pm->pm_msgid, pm->pm_data, pm->pm_len);
+    free(pm);
+
+    if(r) {
+      // Peer has been disconnected and is gone
+      while((pm = msgs) != NULL) {
+        msgs = pm->pm_next;
+        free(pm);
+      }
+      hts_mutex_unlock(&bittorrent_mutex);
+      return;
     }
+  }
 
+  if(err != NULL) {
+    peer_disconnect(p, "%s", err);
+  } else {
     timeout = 300;
-
     asyncio_set_timeout(p->p_connection, async_now + timeout * 1000000);
-    break;
   }
+  hts_mutex_unlock(&bittorrent_mutex);
 }
 
 
@@ -1150,7 +1204,16 @@ peer_add(torrent_t *to, const net_addr_t *na)
     TAILQ_INSERT_TAIL(&to->to_inactive_peers, p, p_queue_link);
     return;
   }
-  
+
+  if(to->to_loop != asyncio_current_loop()) {
+    // Peers must be connected from the torrent's own loop
+    p->p_state = PEER_STATE_INACTIVE;
+    TAILQ_INSERT_TAIL(&to->to_inactive_peers, p, p_queue_link);
+    to->to_need_more_peers = 1;
+    torrent_wakeup(to);
+    return;
+  }
+
   peer_connect(p);
 }
 
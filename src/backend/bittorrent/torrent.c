@@ -36,12 +36,12 @@
 
 //----------------------------------------------------------------
 
-static asyncio_timer_t torrent_periodic_timer;
+static asyncio_timer_t torrent_periodic_timer[ASYNCIO_MAX_LOOPS];
 bt_global_t btg;
 HTS_MUTEX_DECL(bittorrent_mutex);
 struct torrent_list torrents;
-static int torrent_pendings_signal;
-static int torrent_boot_periodic_signal;
+static int torrent_pendings_signal[ASYNCIO_MAX_LOOPS];
+static int torrent_boot_periodic_signal[ASYNCIO_MAX_LOOPS];
 static int torrent_hash_thread_running;
 static int torrent_debug = 0;
 
@@ -158,12 +158,12 @@ torrent_create(buf_t *b, char *errbuf, size_t errlen)
 
   if(to == NULL) {
 
-    if(LIST_FIRST(&torrents) == NULL)
-      asyncio_wakeup_worker(torrent_boot_periodic_signal);
-
     to = calloc(1, sizeof(torrent_t));
     memcpy(to->to_info_hash, info_hash, 20);
+    to->to_loop = asyncio_shard(info_hash[0] | info_hash[1] << 8 |
+                                info_hash[2] << 16 | info_hash[3] << 24);
     LIST_INSERT_HEAD(&torrents, to, to_link);
+    asyncio_wakeup_worker(torrent_boot_periodic_signal[to->to_loop]);
     TAILQ_INIT(&to->to_inactive_peers);
     TAILQ_INIT(&to->to_disconnected_peers);
     TAILQ_INIT(&to->to_connect_failed_peers);
@@ -184,6 +184,10 @@ torrent_create(buf_t *b, char *errbuf, size_t errlen)
 
     torrent_diskio_open(to);
 
+  } else if(to->to_dying) {
+    // Picked up again before the main loop got to destroy it
+    to->to_dying = 0;
+    asyncio_wakeup_worker(torrent_boot_periodic_signal[to->to_loop]);
   }
   htsmsg_release(doc);
   return to;
@@ -662,7 +666,7 @@ torrent_piece_enqueue_requests(torrent_t *to, torrent_piece_t *tp)
   }
 
   to->to_need_updated_interest = 1;
-  asyncio_wakeup_worker(torrent_pendings_signal);
+  torrent_wakeup(to);
 }
 
 
@@ -762,7 +766,7 @@ torrent_load(torrent_t *to, void *buf, uint64_t offset, size_t size,
     piece_update_deadline(to, tp);
 
     if(!tp->tp_hash_computed) {
-      asyncio_wakeup_worker(torrent_pendings_signal);
+      torrent_wakeup(to);
 
       while(!tp->tp_hash_ok)
         hts_cond_wait(&torrent_piece_verified_cond, &bittorrent_mutex);
@@ -1263,17 +1267,32 @@ torrent_reload_corrupt_pieces(torrent_t *to)
 }
 
 
+/**
+ * Signal the loop that runs the torrent's peers
+ */
+void
+torrent_wakeup(torrent_t *to)
+{
+  asyncio_wakeup_worker(torrent_pendings_signal[to->to_loop]);
+}
+
+
 /**
  *
  */
 static void
 torrent_check_pendings(void)
 {
+  const int loop = asyncio_current_loop();
+
   hts_mutex_lock(&bittorrent_mutex);
 
   torrent_t *to;
   LIST_FOREACH(to, &torrents, to_link) {
 
+    if(to->to_loop != loop || to->to_dying)
+      continue;
+
     if(to->to_new_valid_piece) {
       to->to_new_valid_piece = 0;
       torrent_send_have(to);
@@ -1289,6 +1308,14 @@ torrent_check_pendings(void)
       torrent_reload_corrupt_pieces(to);
     }
 
+    if(to->to_need_more_peers) {
+      to->to_need_more_peers = 0;
+      while(TAILQ_FIRST(&to->to_inactive_peers) != NULL &&
+            to->to_active_peers  < btg.btg_max_peers_torrent &&
+            btg.btg_active_peers < btg.btg_max_peers_global)
+        torrent_attempt_more_peers(to);
+    }
+
     torrent_io_do_requests(to);
   }
   hts_mutex_unlock(&bittorrent_mutex);
@@ -1320,29 +1347,56 @@ torrent_periodic_one(torrent_t *to, int second)
 
 
 /**
- * Run every second
+ * Run every second on each loop that has torrents
  */
 static void
 torrent_periodic(void *aux)
 {
   const int second = async_now / 1000000;
+  const int loop = asyncio_current_loop();
+  int active = 0;
 
   hts_mutex_lock(&bittorrent_mutex);
 
   torrent_t *to, *next;
   for(to = LIST_FIRST(&torrents); to != NULL; to = next) {
     next = LIST_NEXT(to, to_link);
+
+    if(loop == 0 && to->to_dying && to->to_refcount == 0) {
+      torrent_destroy(to);
+      continue;
+    }
+
+    if(to->to_loop != loop)
+      continue;
+
     if(to->to_refcount == 0) {
+      if(loop != 0) {
+        /**
+         * Trackers live on the main loop so we can't destroy the
+         * torrent here. Close our peers and let the main loop do it.
+         * The torrent stays on our loop in case it's picked up again
+         */
+        if(!to->to_dying) {
+          peer_shutdown_all(to);
+          to->to_dying = 1;
+          asyncio_wakeup_worker(torrent_boot_periodic_signal[0]);
+        }
+        continue;
+      }
       torrent_destroy(to);
       continue;
     }
 
+    to->to_dying = 0;
+
     torrent_io_do_requests(to);
     torrent_periodic_one(to, second);
+    active = 1;
   }
 
-  if(LIST_FIRST(&torrents) != NULL)
-    asyncio_timer_arm(&torrent_periodic_timer, async_now + 1000000);
+  if(active)
+    asyncio_timer_arm(&torrent_periodic_timer[loop], async_now + 1000000);
   hts_mutex_unlock(&bittorrent_mutex);
 }
 
@@ -1355,11 +1409,16 @@ torrent_periodic(void *aux)
 static void
 torrent_boot_periodic(void)
 {
+  const int loop = asyncio_current_loop();
+  torrent_t *to;
+
   hts_mutex_lock(&bittorrent_mutex);
-  if(LIST_FIRST(&torrents) != NULL &&
-     !asyncio_timer_is_armed(&torrent_periodic_timer)) {
-    asyncio_timer_arm(&torrent_periodic_timer, async_now + 1000000);
-  }
+  LIST_FOREACH(to, &torrents, to_link)
+    if(to->to_loop == loop || (loop == 0 && to->to_dying))
+      break;
+
+  if(to != NULL && !asyncio_timer_is_armed(&torrent_periodic_timer[loop]))
+    asyncio_timer_arm(&torrent_periodic_timer[loop], async_now + 1000000);
   hts_mutex_unlock(&bittorrent_mutex);
 }
 
@@ -1401,7 +1460,7 @@ torrent_piece_verify_hash(torrent_t *to, torrent_piece_t *tp)
     tp->tp_complete = 0;
   }
 
-  asyncio_wakeup_worker(torrent_pendings_signal);
+  torrent_wakeup(to);
 
   torrent_piece_release(tp);
   torrent_release(to);
@@ -1476,10 +1535,13 @@ torrent_io_init(void)
   btg.btg_max_peers_global = 200;
   btg.btg_max_peers_torrent = 50;
 
-  asyncio_timer_init(&torrent_periodic_timer, torrent_periodic, NULL);
-
-  torrent_pendings_signal = asyncio_add_worker(torrent_check_pendings);
-  torrent_boot_periodic_signal = asyncio_add_worker(torrent_boot_periodic);
+  for(int i = 0; i < asyncio_num_loops(); i++) {
+    asyncio_timer_init(&torrent_periodic_timer[i], torrent_periodic, NULL);
+    torrent_pendings_signal[i] =
+      asyncio_add_worker_on(i, torrent_check_pendings);
+    torrent_boot_periodic_signal[i] =
+      asyncio_add_worker_on(i, torrent_boot_periodic);
+  }
 
   hts_cond_init(&torrent_piece_hash_needed_cond, &bittorrent_mutex);
   hts_cond_init(&torrent_piece_io_needed_cond, &bittorrent_mutex);
@@ -161,6 +161,8 @@ tracker_torrent_periodic(void *aux)
 {
   tracker_torrent_t *tt = aux;
 
+  hts_mutex_lock(&bittorrent_mutex);
+
   if(tt->tt_torrent == NULL) {
     tt->tt_attempt++;
     if(tt->tt_attempt == 5) {
@@ -169,10 +171,10 @@ tracker_torrent_periodic(void *aux)
       // Resend stop request
       asyncio_timer_arm(&tt->tt_timer, async_now + 5000000LL);
     }
-    return;
+  } else {
+    tt->tt_tracker->t_announce(tt, 2);
   }
-
-  tt->tt_tracker->t_announce(tt, 2);
+  hts_mutex_unlock(&bittorrent_mutex);
 }
 
 
@@ -204,10 +206,12 @@ tracker_new_torrent(void)
   tracker_t *t;
   tracker_torrent_t *tt;
 
+  hts_mutex_lock(&bittorrent_mutex);
   LIST_FOREACH(t, &trackers, t_link)
     LIST_FOREACH(tt, &t->t_torrents, tt_tracker_link)
       if(tt->tt_tentative)
         t->t_announce(tt, 2);
+  hts_mutex_unlock(&bittorrent_mutex);
 }
 
 
@@ -52,6 +52,8 @@ http_callback(http_req_aux_t *req, void *opaque)
   htsmsg_t *msg;
   net_addr_t na;
 
+  hts_mutex_lock(&bittorrent_mutex);
+
   assert(tt->tt_http_req != NULL);
   tt->tt_http_req = NULL;
 
@@ -106,6 +108,7 @@ http_callback(http_req_aux_t *req, void *opaque)
   }
  done:
   asyncio_timer_arm(&tt->tt_timer, async_now + tt->tt_interval * 1000000LL);
+  hts_mutex_unlock(&bittorrent_mutex);
 }
 
 
@@ -23,6 +23,7 @@
 
 #include <libavformat/avformat.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/aes.h>
 
 
 #include "navigator.h"
@@ -43,6 +44,10 @@
 #include "subtitles/subtitles.h"
 #include "usage.h"
 #include "misc/minmax.h"
+#include "misc/cancellable.h"
+#include "misc/fs.h"
+#include "task.h"
+#include "hls_abr.h"
 
 /**
  * Relevant docs:
@@ -101,6 +106,8 @@ typedef struct hls_segment {
   int64_t hs_opened_at;
   int hs_block_cnt;
 
+  buf_t *hs_data; // Prefetched (and decrypted) segment backing hs_fctx
+
 } hls_segment_t;
 
 
@@ -122,7 +129,7 @@ typedef struct hls_variant {
   int hv_h264_level;
   int hv_target_duration;
 
-  time_t hv_loaded; /* last time it was loaded successfully
+  time_t hv_loaded; /* first time it was loaded successfully
                      *  0 means not loaded
                      */
 
@@ -148,6 +155,8 @@ typedef struct hls_variant {
   rstr_t *hv_key_url;
   buf_t *hv_key;
 
+  struct hls_refresher *hv_refresher; // Background reload of live playlists
+
 } hls_variant_t;
 
 
@@ -166,6 +175,10 @@ typedef struct hls_demuxer {
 
   int hd_bw;
 
+  hls_abr_t *hd_abr;
+  hls_variant_t **hd_levels; // Variants known by hd_abr, lowest bitrate first
+  int hd_num_levels;
+
   int64_t hd_delta_ts;
 
   media_codec_t *hd_audio_codec;
@@ -195,6 +208,8 @@ typedef struct hls {
 
   int h_playback_priority;
 
+  struct hls_prefetcher *h_prefetcher;
+
 } hls_t;
 
 #define HLS_TRACE(h, x, ...) do {                               \
@@ -239,16 +254,28 @@ get_attrib(char *v, const char **keyp, const char **valuep)
  *
  */
 static void
-segment_destroy(hls_segment_t *hs)
+segment_free(hls_segment_t *hs)
 {
   assert(hs->hs_fctx == NULL);
-  TAILQ_REMOVE(&hs->hs_variant->hv_segments, hs, hs_link);
   free(hs->hs_url);
   rstr_release(hs->hs_key_url);
   free(hs);
 }
 
 
+/**
+ *
+ */
+static void
+segment_destroy(hls_segment_t *hs)
+{
+  TAILQ_REMOVE(&hs->hs_variant->hv_segments, hs, hs_link);
+  segment_free(hs);
+}
+
+
+static void hls_refresher_destroy(struct hls_refresher *hr);
+
 /**
  *
  */
@@ -256,6 +283,10 @@ static void
 variant_destroy(hls_variant_t *hv)
 {
   hls_segment_t *hs;
+
+  if(hv->hv_refresher != NULL)
+    hls_refresher_destroy(hv->hv_refresher);
+
   while((hs = TAILQ_FIRST(&hv->hv_segments)) != NULL)
     segment_destroy(hs);
 
@@ -294,20 +325,6 @@ variant_create(void)
 }
 
 
-/**
- *
- */
-static hls_segment_t *
-hv_add_segment(hls_variant_t *hv, const char *url)
-{
-  hls_segment_t *hs = calloc(1, sizeof(hls_segment_t));
-  hs->hs_url = url_resolve_relative_from_base(hv->hv_url, url);
-  hs->hs_variant = hv;
-  TAILQ_INSERT_TAIL(&hv->hv_segments, hs, hs_link);
-  return hs;
-}
-
-
 /**
  *
  */
@@ -394,55 +411,59 @@ hv_parse_key(hls_variant_parser_t *hvp, const char *baseurl, const char *V)
 #define VARIANT_EMPTY      2
 
 /**
- *
+ * Segments parsed from a playlist
  */
-static int
-variant_update(hls_variant_t *hv, hls_t *h)
-{
-  char errbuf[1024];
-  if(hv->hv_frozen)
-    return 0;
-
-  time_t now;
-  time(&now);
+typedef struct hls_playlist_update {
+  struct hls_playlist_update *hpu_next; // Link in refresher inbox
+  struct hls_segment_queue hpu_segments;
+  int hpu_items;  // Number of segments in playlist, including old ones
+  int hpu_target_duration;
+  char hpu_frozen;
+} hls_playlist_update_t;
 
-  if(hv->hv_loaded == now)
-    return 0;
-
-  HLS_TRACE(h, "Updating variant %d", hv->hv_bitrate);
 
-  buf_t *b = fa_load(hv->hv_url,
-                      FA_LOAD_ERRBUF(errbuf, sizeof(errbuf)),
-                      FA_LOAD_FLAGS(FA_COMPRESSION),
-                      NULL);
-
-  if(b == NULL) {
-    TRACE(TRACE_ERROR, "HLS", "Unable to open %s -- %s", hv->hv_url, errbuf);
-    return VARIANT_UNLOADABLE;
+/**
+ *
+ */
+static void
+playlist_update_free(hls_playlist_update_t *hpu)
+{
+  hls_segment_t *hs;
+  while((hs = TAILQ_FIRST(&hpu->hpu_segments)) != NULL) {
+    TAILQ_REMOVE(&hpu->hpu_segments, hs, hs_link);
+    segment_free(hs);
   }
+  free(hpu);
+}
 
-  hv->hv_loaded = now;
-
-  b = buf_make_writable(b);
 
+/**
+ * Parse a playlist for 'hv'. Only segments with a sequence number
+ * above 'last_seq' are created, the rest are just counted. Nothing in
+ * 'hv' but the (constant) URL is accessed so this is safe to call from
+ * any thread
+ */
+static hls_playlist_update_t *
+variant_parse(hls_variant_t *hv, char *playlist, int last_seq)
+{
+  hls_playlist_update_t *hpu = calloc(1, sizeof(hls_playlist_update_t));
   double duration = 0;
   int byte_offset = -1;
   int byte_size = -1;
   int seq = 1;
-  int items = 0;
   hls_variant_parser_t hvp;
 
-
+  TAILQ_INIT(&hpu->hpu_segments);
   memset(&hvp, 0, sizeof(hvp));
 
-  LINEPARSE(s, buf_str(b)) {
+  LINEPARSE(s, playlist) {
     const char *v;
     if((v = mystrbegins(s, "#EXTINF:")) != NULL) {
       duration = my_str2double(v, NULL);
     } else if((v = mystrbegins(s, "#EXT-X-ENDLIST")) != NULL) {
-      hv->hv_frozen = 1;
+      hpu->hpu_frozen = 1;
     } else if((v = mystrbegins(s, "#EXT-X-TARGETDURATION")) != NULL) {
-      hv->hv_target_duration = atoi(v);
+      hpu->hpu_target_duration = atoi(v);
     } else if((v = mystrbegins(s, "#EXT-X-KEY:")) != NULL) {
       hv_parse_key(&hvp, hv->hv_url, v);
     } else if((v = mystrbegins(s, "#EXT-X-MEDIA-SEQUENCE:")) != NULL) {
@@ -453,152 +474,1275 @@ variant_update(hls_variant_t *hv, hls_t *h)
       if(o != NULL)
         byte_offset = atoi(o+1);
 
-    } else if(s[0] != '#') {
+    } else if(s[0] != '#') {
+
+      hpu->hpu_items++;
+
+      if(seq > last_seq) {
+
+	hls_segment_t *hs = calloc(1, sizeof(hls_segment_t));
+	hs->hs_url = url_resolve_relative_from_base(hv->hv_url, s);
+	hs->hs_variant     = hv;
+	hs->hs_byte_offset = byte_offset;
+	hs->hs_byte_size   = byte_size;
+	hs->hs_duration    = duration * 1000000LL;
+	hs->hs_crypto      = hvp.hvp_crypto;
+	hs->hs_key_url     = rstr_dup(hvp.hvp_key_url);
+
+	if(hvp.hvp_explicit_iv) {
+	  memcpy(hs->hs_iv, hvp.hvp_iv, 16);
+	} else {
+	  memset(hs->hs_iv, 0, 12);
+	  hs->hs_iv[12] = seq >> 24;
+	  hs->hs_iv[13] = seq >> 16;
+	  hs->hs_iv[14] = seq >> 8;
+	  hs->hs_iv[15] = seq;
+	}
+
+	hs->hs_seq = seq;
+	duration = 0;
+	byte_offset = -1;
+	byte_size = -1;
+
+	TAILQ_INSERT_TAIL(&hpu->hpu_segments, hs, hs_link);
+      }
+      seq++;
+    }
+  }
+
+  rstr_release(hvp.hvp_key_url);
+  return hpu;
+}
+
+
+/**
+ * Append new segments to the variant, consumes 'hpu'
+ */
+static void
+variant_apply_update(hls_t *h, hls_variant_t *hv, hls_playlist_update_t *hpu)
+{
+  hls_segment_t *hs;
+
+  if(hpu->hpu_target_duration)
+    hv->hv_target_duration = hpu->hpu_target_duration;
+
+  while((hs = TAILQ_FIRST(&hpu->hpu_segments)) != NULL) {
+    TAILQ_REMOVE(&hpu->hpu_segments, hs, hs_link);
+
+    if(hs->hs_seq <= hv->hv_last_seq) {
+      segment_free(hs);
+      continue;
+    }
+
+    if(hv->hv_first_seq == 0)
+      hv->hv_first_seq = hs->hs_seq;
+
+    if(hv->hv_target_duration == 0)
+      hv->hv_target_duration = hs->hs_duration / 1000000;
+
+    hs->hs_time_offset = hv->hv_duration;
+    hv->hv_duration   += hs->hs_duration;
+    hv->hv_last_seq    = hs->hs_seq;
+    TAILQ_INSERT_TAIL(&hv->hv_segments, hs, hs_link);
+
+    HLS_TRACE(h, "Added new seq %d", hs->hs_seq);
+  }
+
+  if(hpu->hpu_frozen)
+    hv->hv_frozen = 1;
+
+  free(hpu);
+}
+
+
+/**
+ * Live playlist refresher
+ *
+ * Once a live variant has been loaded, a thread reloads its playlist in
+ * the background so the demuxer never waits for the network (or for
+ * parsing a long sliding window) at a segment boundary.
+ *
+ * Reloads are conditional GETs (If-None-Match / If-Modified-Since) and
+ * are done one target duration apart, or half of that if the playlist
+ * did not change (as suggested by the HLS spec). Only segments beyond
+ * the last sequence number already handed over are created. They are
+ * pushed onto hr_inbox, a lock free stack that variant_update() in the
+ * demux thread drains, so hv_segments is only ever touched by the
+ * demuxer.
+ *
+ * The thread exits when its variant has not been asked for updates
+ * during HLS_REFRESH_IDLE reloads, ie. when we've switched to another
+ * variant. variant_update() starts it again.
+ */
+
+#ifndef HLS_REFRESH_IDLE
+#define HLS_REFRESH_IDLE 4
+#endif
+
+#define HLS_REFRESH_MIN_INTERVAL 500   // ms
+#define HLS_REFRESH_TIMEOUT      10000 // ms
+
+typedef struct hls_refresher {
+  hls_variant_t *hr_variant;
+  hts_mutex_t hr_mutex;
+  hts_cond_t hr_cond;
+  hts_thread_t hr_tid;
+  cancellable_t hr_cancellable;
+
+  hls_playlist_update_t *hr_inbox; // Newest first
+
+  atomic_t hr_wanted;  // Bumped each time the demuxer asks for updates
+  atomic_t hr_failed;  // Last reload failed
+
+  int hr_run;     // Protected by hr_mutex
+  int hr_running; // Protected by hr_mutex
+  int hr_joinable;
+  int hr_poll_now; // Reload without waiting first
+
+  // Only accessed from whoever loads the playlist
+  int hr_last_seq;
+  int hr_target_duration;
+  int hr_debug;
+  char *hr_etag;
+  char *hr_last_modified;
+
+} hls_refresher_t;
+
+
+/**
+ *
+ */
+static hls_refresher_t *
+hls_refresher_create(hls_t *h, hls_variant_t *hv)
+{
+  hls_refresher_t *hr = calloc(1, sizeof(hls_refresher_t));
+  hr->hr_variant = hv;
+  hr->hr_debug = h->h_debug;
+  hts_mutex_init(&hr->hr_mutex);
+  hts_cond_init(&hr->hr_cond, &hr->hr_mutex);
+  return hr;
+}
+
+
+/**
+ * Load the playlist, returns NOT_MODIFIED if the server says so
+ */
+static buf_t *
+hls_refresher_load(hls_refresher_t *hr, char *errbuf, size_t errlen)
+{
+  const char *url = hr->hr_variant->hv_url;
+  struct http_header_list response_headers;
+  const char *v;
+  buf_t *b = NULL;
+
+  if(mystrbegins(url, "http://") == NULL &&
+     mystrbegins(url, "https://") == NULL)
+    return fa_load(url,
+                   FA_LOAD_ERRBUF(errbuf, errlen),
+                   FA_LOAD_FLAGS(FA_COMPRESSION),
+                   FA_LOAD_CANCELLABLE(&hr->hr_cancellable),
+                   NULL);
+
+  LIST_INIT(&response_headers);
+
+  int r = http_req(url,
+                   HTTP_RESULT_PTR(&b),
+                   HTTP_ERRBUF(errbuf, errlen),
+                   HTTP_FLAGS(FA_COMPRESSION),
+                   HTTP_REQUEST_HEADER("If-None-Match", hr->hr_etag),
+                   HTTP_REQUEST_HEADER("If-Modified-Since",
+                                       hr->hr_last_modified),
+                   HTTP_RESPONSE_HEADERS(&response_headers),
+                   HTTP_CANCELLABLE(&hr->hr_cancellable),
+                   HTTP_CONNECT_TIMEOUT(HLS_REFRESH_TIMEOUT),
+                   HTTP_READ_TIMEOUT(HLS_REFRESH_TIMEOUT),
+                   NULL);
+
+  if(r == 304) {
+    http_headers_free(&response_headers);
+    return NOT_MODIFIED;
+  }
+
+  if(r)
+    return NULL;
+
+  v = http_header_get(&response_headers, "etag");
+  mystrset(&hr->hr_etag, v);
+  v = http_header_get(&response_headers, "last-modified");
+  mystrset(&hr->hr_last_modified, v);
+  http_headers_free(&response_headers);
+  return b;
+}
+
+
+/**
+ * Push an update to the demuxer
+ */
+static void
+hls_refresher_push(hls_refresher_t *hr, hls_playlist_update_t *hpu)
+{
+  hls_playlist_update_t *old = NULL, *cur;
+
+  while(1) {
+    hpu->hpu_next = old;
+    cur = atomic_cas_ptr((void **)&hr->hr_inbox, old, hpu);
+    if(cur == old)
+      break;
+    old = cur;
+  }
+}
+
+
+/**
+ * Reload the playlist and hand over new segments. Returns 1 if there
+ * were new segments, 0 if not and -1 on error
+ */
+static int
+hls_refresher_poll(hls_refresher_t *hr)
+{
+  hls_variant_t *hv = hr->hr_variant;
+  char errbuf[256];
+
+  if(hr->hr_debug)
+    TRACE(TRACE_DEBUG, "HLS", "Updating variant %d", hv->hv_bitrate);
+
+  buf_t *b = hls_refresher_load(hr, errbuf, sizeof(errbuf));
+
+  if(b == NOT_MODIFIED) {
+    atomic_set(&hr->hr_failed, 0);
+    return 0;
+  }
+
+  if(b == NULL) {
+    if(!cancellable_is_cancelled(&hr->hr_cancellable))
+      TRACE(TRACE_ERROR, "HLS", "Unable to open %s -- %s",
+            hv->hv_url, errbuf);
+    atomic_set(&hr->hr_failed, 1);
+    return -1;
+  }
+
+  b = buf_make_writable(b);
+  hls_playlist_update_t *hpu = variant_parse(hv, buf_str(b),
+                                             hr->hr_last_seq);
+  buf_release(b);
+
+  atomic_set(&hr->hr_failed, 0);
+
+  if(hpu->hpu_target_duration)
+    hr->hr_target_duration = hpu->hpu_target_duration;
+
+  hls_segment_t *last = TAILQ_LAST(&hpu->hpu_segments, hls_segment_queue);
+
+  if(last == NULL && hpu->hpu_items && !hpu->hpu_frozen) {
+    playlist_update_free(hpu);
+    return 0;
+  }
+
+  if(last != NULL)
+    hr->hr_last_seq = last->hs_seq;
+
+  if(hpu->hpu_frozen) {
+    hts_mutex_lock(&hr->hr_mutex);
+    hr->hr_run = 0;
+    hts_mutex_unlock(&hr->hr_mutex);
+  }
+
+  hls_refresher_push(hr, hpu);
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void *
+hls_refresher_thread(void *aux)
+{
+  hls_refresher_t *hr = aux;
+  int last_wanted = atomic_get(&hr->hr_wanted);
+  int changed = 1;
+  int idle = 0;
+
+  hts_mutex_lock(&hr->hr_mutex);
+
+  while(hr->hr_run) {
+
+    int delay = hr->hr_target_duration * 1000;
+    if(!changed)
+      delay /= 2;
+
+    if(hr->hr_poll_now)
+      hr->hr_poll_now = 0;
+    else
+      hts_cond_wait_timeout(&hr->hr_cond, &hr->hr_mutex,
+                            MAX(delay, HLS_REFRESH_MIN_INTERVAL));
+
+    if(!hr->hr_run)
+      break;
+
+    int wanted = atomic_get(&hr->hr_wanted);
+    if(wanted != last_wanted) {
+      last_wanted = wanted;
+      idle = 0;
+    } else if(++idle == HLS_REFRESH_IDLE) {
+      break;
+    }
+
+    hts_mutex_unlock(&hr->hr_mutex);
+    changed = hls_refresher_poll(hr) != 0;
+    hts_mutex_lock(&hr->hr_mutex);
+  }
+
+  if(hr->hr_debug)
+    TRACE(TRACE_DEBUG, "HLS", "Refresher for variant %d stopped",
+          hr->hr_variant->hv_bitrate);
+
+  hr->hr_running = 0;
+  hts_mutex_unlock(&hr->hr_mutex);
+  return NULL;
+}
+
+
+/**
+ * Start the refresher thread unless it's already running
+ */
+static void
+hls_refresher_start(hls_refresher_t *hr)
+{
+  hts_mutex_lock(&hr->hr_mutex);
+  if(hr->hr_running) {
+    hts_mutex_unlock(&hr->hr_mutex);
+    return;
+  }
+  hts_mutex_unlock(&hr->hr_mutex);
+
+  // If we've been stopped before the playlist we have is stale
+  hr->hr_poll_now = hr->hr_joinable;
+
+  if(hr->hr_joinable)
+    hts_thread_join(&hr->hr_tid);
+
+  hr->hr_target_duration = hr->hr_variant->hv_target_duration;
+  hr->hr_run = 1;
+  hr->hr_running = 1;
+  hr->hr_joinable = 1;
+  cancellable_reset(&hr->hr_cancellable);
+  hts_thread_create_joinable("HLS refresher", &hr->hr_tid,
+                             hls_refresher_thread, hr,
+                             THREAD_PRIO_DEMUXER);
+}
+
+
+/**
+ *
+ */
+static void
+hls_refresher_destroy(hls_refresher_t *hr)
+{
+  hls_playlist_update_t *hpu, *next;
+
+  hts_mutex_lock(&hr->hr_mutex);
+  hr->hr_run = 0;
+  cancellable_cancel(&hr->hr_cancellable);
+  hts_cond_signal(&hr->hr_cond);
+  hts_mutex_unlock(&hr->hr_mutex);
+
+  if(hr->hr_joinable)
+    hts_thread_join(&hr->hr_tid);
+
+  for(hpu = hr->hr_inbox; hpu != NULL; hpu = next) {
+    next = hpu->hpu_next;
+    playlist_update_free(hpu);
+  }
+
+  hts_cond_destroy(&hr->hr_cond);
+  hts_mutex_destroy(&hr->hr_mutex);
+  free(hr->hr_etag);
+  free(hr->hr_last_modified);
+  free(hr);
+}
+
+
+/**
+ * Live variants are loaded synchronously the first time, after that
+ * we just pick up whatever the refresher has found
+ */
+static int
+variant_update(hls_variant_t *hv, hls_t *h)
+{
+  hls_refresher_t *hr = hv->hv_refresher;
+  hls_playlist_update_t *hpu, *next, *list = NULL;
+  char errbuf[1024];
+  int empty = 0;
+
+  if(hv->hv_frozen)
+    return 0;
+
+  if(hv->hv_loaded) {
+    atomic_inc(&hr->hr_wanted);
+
+    for(hpu = atomic_xchg_ptr((void **)&hr->hr_inbox, NULL); hpu != NULL;
+        hpu = next) {
+      next = hpu->hpu_next;
+      hpu->hpu_next = list;
+      list = hpu;
+    }
+
+    for(hpu = list; hpu != NULL; hpu = next) {
+      next = hpu->hpu_next;
+      empty = hpu->hpu_items == 0;
+      variant_apply_update(h, hv, hpu);
+    }
+
+    if(!hv->hv_frozen)
+      hls_refresher_start(hr);
+
+    if(empty)
+      return VARIANT_EMPTY;
+    if(atomic_get(&hr->hr_failed))
+      return VARIANT_UNLOADABLE;
+    return 0;
+  }
+
+  if(hr == NULL)
+    hr = hv->hv_refresher = hls_refresher_create(h, hv);
+
+  HLS_TRACE(h, "Loading variant %d", hv->hv_bitrate);
+
+  buf_t *b = hls_refresher_load(hr, errbuf, sizeof(errbuf));
+
+  if(b == NULL || b == NOT_MODIFIED) {
+    TRACE(TRACE_ERROR, "HLS", "Unable to open %s -- %s", hv->hv_url,
+          b == NULL ? errbuf : "Not modified");
+    return VARIANT_UNLOADABLE;
+  }
+
+  time(&hv->hv_loaded);
+
+  b = buf_make_writable(b);
+  hpu = variant_parse(hv, buf_str(b), hv->hv_last_seq);
+  buf_release(b);
+
+  empty = hpu->hpu_items == 0;
+  variant_apply_update(h, hv, hpu);
+
+  hr->hr_last_seq = hv->hv_last_seq;
+
+  if(!hv->hv_frozen)
+    hls_refresher_start(hr);
+
+  return empty ? VARIANT_EMPTY : 0;
+}
+
+
+/**
+ *
+ */
+static void
+hls_dump(const hls_t *h)
+{
+  const hls_variant_t *hv;
+  const char *txt;
+  HLS_TRACE(h, "Base URL: %s", h->h_baseurl);
+  HLS_TRACE(h, "Variants");
+  TAILQ_FOREACH(hv, &h->h_primary.hd_variants, hv_link) {
+    HLS_TRACE(h, "  %s", hv->hv_url);
+    HLS_TRACE(h, "    bitrate:    %d", hv->hv_bitrate);
+
+    if(hv->hv_audio_only) {
+      HLS_TRACE(h, "    Audio only\n");
+      continue;
+    }
+
+    switch(hv->hv_h264_profile) {
+    case 66:
+      txt = "h264 Baseline";
+      break;
+    case 77:
+      txt = "h264 Main";
+      break;
+    default:
+      txt = "<unknown>";
+      break;
+    }
+
+    HLS_TRACE(h, "    Video resolution: %d x %d  Profile: %s  Level: %d.%d",
+              hv->hv_width, hv->hv_height, txt,
+              hv->hv_h264_level / 10,
+              hv->hv_h264_level % 10);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+check_audio_only(hls_t *h)
+{
+  hls_variant_t *hv;
+  int streams = 0;
+  int audio_only = 0;
+  TAILQ_FOREACH(hv, &h->h_primary.hd_variants, hv_link) {
+    streams++;
+    if(hv->hv_audio_only)
+      audio_only++;
+  }
+
+  if(streams == audio_only) {
+    // Most likely not _all_ variants are audio only, so we clear the flag
+    TAILQ_FOREACH(hv, &h->h_primary.hd_variants, hv_link) {
+      hv->hv_audio_only = 0;
+    }
+  }
+}
+
+
+
+/**
+ *
+ */
+static int64_t
+rescale(AVFormatContext *fctx, int64_t ts, int si)
+{
+  if(ts == AV_NOPTS_VALUE)
+    return AV_NOPTS_VALUE;
+
+  return av_rescale_q(ts, fctx->streams[si]->time_base, AV_TIME_BASE_Q);
+}
+
+
+/**
+ *
+ */
+static void
+variant_close_current_seg(hls_variant_t *hv)
+{
+  if(hv->hv_current_seg == NULL)
+    return;
+
+  hls_segment_t *hs = hv->hv_current_seg;
+
+  if(hs->hs_fctx != NULL)
+    fa_libav_close_format(hs->hs_fctx);
+  hs->hs_fctx = NULL;
+
+  buf_release(hs->hs_data);
+  hs->hs_data = NULL;
+
+  hv->hv_current_seg = NULL;
+}
+
+
+/**
+ * Load the key for 'hs' into its variant unless already loaded
+ */
+static int
+variant_load_key(hls_variant_t *hv, const hls_segment_t *hs)
+{
+  char errbuf[256];
+
+  if(rstr_eq(hs->hs_key_url, hv->hv_key_url))
+    return 0;
+
+  buf_release(hv->hv_key);
+  hv->hv_key = fa_load(rstr_get(hs->hs_key_url),
+                        FA_LOAD_ERRBUF(errbuf, sizeof(errbuf)),
+                        NULL);
+  if(hv->hv_key == NULL || buf_len(hv->hv_key) < 16) {
+    TRACE(TRACE_ERROR, "HLS", "Unable to load key file %s -- %s",
+          rstr_get(hs->hs_key_url),
+          hv->hv_key == NULL ? errbuf : "Key too short");
+    buf_release(hv->hv_key);
+    hv->hv_key = NULL;
+    rstr_set(&hv->hv_key_url, NULL);
+    return -1;
+  }
+
+  rstr_set(&hv->hv_key_url, hs->hs_key_url);
+  return 0;
+}
+
+
+/**
+ * Segment prefetcher
+ *
+ * While a segment is being demuxed the following HLS_PREFETCH_SEGMENTS
+ * segments of the same variant are downloaded in parallel using the
+ * asynchronous HTTP client. The total amount of downloaded but not yet
+ * consumed data is bounded by HLS_PREFETCH_MAX_BYTES. AES-128 segments
+ * are decrypted on a task thread as soon as they arrive so
+ * segment_open() can hand the plaintext straight to libavformat.
+ *
+ * Entries that are dropped while their request (or decryption) is
+ * still running are orphaned and freed by the completion callback.
+ * Each such entry holds a reference on the prefetcher so it stays
+ * around until the last callback is done.
+ */
+
+#ifndef HLS_PREFETCH_SEGMENTS
+#define HLS_PREFETCH_SEGMENTS 3
+#endif
+
+#ifndef HLS_PREFETCH_MAX_BYTES
+#define HLS_PREFETCH_MAX_BYTES (32 * 1024 * 1024)
+#endif
+
+#define HLS_PREFETCH_CONNECT_TIMEOUT 5000  // ms
+#define HLS_PREFETCH_READ_TIMEOUT    10000 // ms
+
+// Max time the demuxer waits for a prefetch before streaming the segment
+#define HLS_PREFETCH_WAIT            HLS_PREFETCH_READ_TIMEOUT
+#define HLS_PREFETCH_WAIT_FAST_FAIL  2000  // ms, same as fast fail open
+#define HLS_PREFETCH_WAIT_POLL       100   // ms
+
+TAILQ_HEAD(hls_prefetch_queue, hls_prefetch);
+
+typedef enum {
+  HP_PENDING,
+  HP_DECRYPTING,
+  HP_READY,
+  HP_FAILED,
+} hls_prefetch_state_t;
+
+typedef struct hls_prefetch {
+  TAILQ_ENTRY(hls_prefetch) hp_link;
+  struct hls_prefetcher *hp_hpf;
+  hls_segment_t *hp_segment; // NULL if orphaned
+  hls_prefetch_state_t hp_state;
+  int hp_byte_size;
+  buf_t *hp_data;
+  buf_t *hp_key;
+  uint8_t hp_iv[16];
+  cancellable_t hp_cancellable;
+  int64_t hp_wait_since; // When the demuxer started waiting for it
+} hls_prefetch_t;
+
+typedef struct hls_prefetcher {
+  hts_mutex_t hpf_mutex;
+  hts_cond_t hpf_cond;
+  int hpf_refcount;
+
+  struct hls_prefetch_queue hpf_entries;
+
+  int hpf_inflight;
+  int64_t hpf_bytes;     // Downloaded but not yet consumed
+
+  int64_t hpf_busy_since;
+  int64_t hpf_busy_time; // Time spent with at least one request in flight
+  int64_t hpf_received;  // Total bytes downloaded
+
+  int64_t hpf_bw_busy_time;
+  int64_t hpf_bw_received;
+
+  int hpf_stalls;
+  int64_t hpf_stall_time;
+
+  int hpf_debug;
+
+  prop_t *hpf_prop_root;
+  prop_t *hpf_prop_depth;
+  prop_t *hpf_prop_inflight;
+  prop_t *hpf_prop_bytes;
+  prop_t *hpf_prop_stalls;
+  prop_t *hpf_prop_stall_time;
+} hls_prefetcher_t;
+
+
+/**
+ *
+ */
+static hls_prefetcher_t *
+hls_prefetcher_create(hls_t *h)
+{
+  hls_prefetcher_t *hpf = calloc(1, sizeof(hls_prefetcher_t));
+  hts_mutex_init(&hpf->hpf_mutex);
+  hts_cond_init(&hpf->hpf_cond, &hpf->hpf_mutex);
+  TAILQ_INIT(&hpf->hpf_entries);
+  hpf->hpf_refcount = 1;
+  hpf->hpf_debug = h->h_debug;
+
+  prop_t *p = prop_create_r(h->h_mp->mp_prop_io, "prefetch");
+  hpf->hpf_prop_root       = p;
+  hpf->hpf_prop_depth      = prop_create_r(p, "depth");
+  hpf->hpf_prop_inflight   = prop_create_r(p, "inflight");
+  hpf->hpf_prop_bytes      = prop_create_r(p, "bytes");
+  hpf->hpf_prop_stalls     = prop_create_r(p, "stalls");
+  hpf->hpf_prop_stall_time = prop_create_r(p, "stallTime");
+  prop_set(p, "maxDepth", PROP_SET_INT, HLS_PREFETCH_SEGMENTS);
+  return hpf;
+}
+
+
+/**
+ * Drop a reference, hpf_mutex must be held and is unlocked
+ */
+static void
+hls_prefetcher_release(hls_prefetcher_t *hpf)
+{
+  int last = --hpf->hpf_refcount == 0;
+  hts_mutex_unlock(&hpf->hpf_mutex);
+
+  if(!last)
+    return;
+
+  assert(TAILQ_FIRST(&hpf->hpf_entries) == NULL);
+  hts_cond_destroy(&hpf->hpf_cond);
+  hts_mutex_destroy(&hpf->hpf_mutex);
+  free(hpf);
+}
+
+
+/**
+ *
+ */
+static void
+hls_prefetch_free(hls_prefetch_t *hp)
+{
+  buf_release(hp->hp_data);
+  buf_release(hp->hp_key);
+  free(hp);
+}
+
+
+/**
+ * Account for a request leaving the network, hpf_mutex must be held
+ */
+static void
+hls_prefetch_done_inflight(hls_prefetcher_t *hpf)
+{
+  if(--hpf->hpf_inflight == 0)
+    hpf->hpf_busy_time += showtime_get_ts() - hpf->hpf_busy_since;
+}
+
+
+/**
+ * Publish stats on the media pipe, hpf_mutex must be held
+ */
+static void
+hls_prefetch_update_stats(hls_prefetcher_t *hpf)
+{
+  hls_prefetch_t *hp;
+  int depth = 0;
+
+  TAILQ_FOREACH(hp, &hpf->hpf_entries, hp_link)
+    if(hp->hp_state == HP_READY)
+      depth++;
+
+  prop_set_int(hpf->hpf_prop_depth, depth);
+  prop_set_int(hpf->hpf_prop_inflight, hpf->hpf_inflight);
+  prop_set_int(hpf->hpf_prop_bytes, hpf->hpf_bytes);
+  prop_set_int(hpf->hpf_prop_stalls, hpf->hpf_stalls);
+  prop_set_int(hpf->hpf_prop_stall_time, hpf->hpf_stall_time / 1000);
+}
+
+
+/**
+ * Remove an entry from the queue, hpf_mutex must be held
+ */
+static void
+hls_prefetch_drop(hls_prefetcher_t *hpf, hls_prefetch_t *hp)
+{
+  TAILQ_REMOVE(&hpf->hpf_entries, hp, hp_link);
+
+  switch(hp->hp_state) {
+  case HP_PENDING:
+    hp->hp_segment = NULL;
+    cancellable_cancel(&hp->hp_cancellable);
+    break;
+
+  case HP_DECRYPTING:
+    hpf->hpf_bytes -= buf_len(hp->hp_data);
+    hp->hp_segment = NULL;
+    break;
+
+  case HP_READY:
+    hpf->hpf_bytes -= buf_len(hp->hp_data);
+    // FALLTHRU
+  case HP_FAILED:
+    hls_prefetch_free(hp);
+    break;
+  }
+}
+
+
+/**
+ * Decrypt segment in place. Returns length without the PKCS7 padding
+ * or -1 on error
+ */
+static int
+hls_prefetch_decrypt_buf(buf_t *b, const uint8_t *key, const uint8_t *iv0)
+{
+  uint8_t iv[16];
+  uint8_t *data = b->b_ptr;
+  size_t len = buf_len(b);
+
+  if(len == 0 || len & 15)
+    return -1;
+
+  struct AVAES *aes = av_aes_alloc();
+  if(aes == NULL)
+    return -1;
+
+  memcpy(iv, iv0, 16);
+  av_aes_init(aes, key, 128, 1);
+  av_aes_crypt(aes, data, data, len / 16, iv, 1);
+  av_free(aes);
+
+  const int pad = data[len - 1];
+  if(pad < 1 || pad > 16)
+    return -1;
+
+  return len - pad;
+}
+
+
+/**
+ * Runs on a task thread
+ */
+static void
+hls_prefetch_decrypt(void *aux)
+{
+  hls_prefetch_t *hp = aux;
+  hls_prefetcher_t *hpf = hp->hp_hpf;
+
+  int len = hls_prefetch_decrypt_buf(hp->hp_data, buf_c8(hp->hp_key),
+                                     hp->hp_iv);
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+
+  if(hp->hp_segment == NULL) {
+    hls_prefetch_free(hp);
+  } else {
+    hpf->hpf_bytes -= buf_len(hp->hp_data);
+
+    if(len < 0) {
+      hp->hp_state = HP_FAILED;
+      buf_release(hp->hp_data);
+      hp->hp_data = NULL;
+    } else {
+      hp->hp_state = HP_READY;
+      hp->hp_data->b_size = len;
+      hpf->hpf_bytes += len;
+    }
+    hts_cond_broadcast(&hpf->hpf_cond);
+  }
+  hls_prefetcher_release(hpf);
+}
+
+
+/**
+ * HTTP completion callback, runs on an asyncio (or task) thread
+ */
+static void
+hls_prefetch_cb(http_req_aux_t *hra, void *opaque, int error)
+{
+  hls_prefetch_t *hp = opaque;
+  hls_prefetcher_t *hpf = hp->hp_hpf;
+  buf_t *b = error ? NULL : http_req_get_result(hra);
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+
+  hls_prefetch_done_inflight(hpf);
+
+  if(b != NULL)
+    hpf->hpf_received += buf_len(b);
+
+  if(hp->hp_segment == NULL) {
+    hls_prefetch_free(hp);
+    hls_prefetcher_release(hpf);
+    return;
+  }
+
+  if(b == NULL || (hp->hp_byte_size != -1 && buf_len(b) != hp->hp_byte_size)) {
+    if(hpf->hpf_debug)
+      TRACE(TRACE_DEBUG, "HLS", "Prefetch of segment %d failed (%d)",
+            hp->hp_segment->hs_seq, error);
+    hp->hp_state = HP_FAILED;
+    hts_cond_broadcast(&hpf->hpf_cond);
+    hls_prefetcher_release(hpf);
+    return;
+  }
+
+  hp->hp_data = buf_retain(b);
+  hpf->hpf_bytes += buf_len(b);
+
+  if(hp->hp_key != NULL) {
+    hp->hp_state = HP_DECRYPTING;
+    hts_mutex_unlock(&hpf->hpf_mutex);
+    task_run(hls_prefetch_decrypt, hp); // Keeps the reference
+    return;
+  }
+
+  hp->hp_state = HP_READY;
+  hts_cond_broadcast(&hpf->hpf_cond);
+  hls_prefetcher_release(hpf);
+}
+
+
+/**
+ *
+ */
+static void
+hls_prefetch_req(const char *url, hls_prefetch_t *hp, ...)
+{
+  va_list ap;
+  va_start(ap, hp);
+  http_reqv(url, ap, hls_prefetch_cb, hp);
+  va_end(ap);
+}
+
+
+/**
+ * Start a download of 'hs', hpf_mutex must be held
+ */
+static void
+hls_prefetch_start(hls_prefetcher_t *hpf, hls_segment_t *hs)
+{
+  char range[64];
+  const char *rangep = NULL;
+  hls_variant_t *hv = hs->hs_variant;
+  hls_prefetch_t *hp = calloc(1, sizeof(hls_prefetch_t));
+
+  hp->hp_hpf = hpf;
+  hp->hp_segment = hs;
+  hp->hp_state = HP_PENDING;
+  hp->hp_byte_size = -1;
+
+  if(hs->hs_crypto == HLS_CRYPTO_AES128) {
+    hp->hp_key = buf_retain(hv->hv_key);
+    memcpy(hp->hp_iv, hs->hs_iv, 16);
+  }
+
+  if(hs->hs_byte_size != -1 && hs->hs_byte_offset != -1) {
+    snprintf(range, sizeof(range), "bytes=%d-%d",
+             hs->hs_byte_offset, hs->hs_byte_offset + hs->hs_byte_size - 1);
+    rangep = range;
+    hp->hp_byte_size = hs->hs_byte_size;
+  }
+
+  TAILQ_INSERT_TAIL(&hpf->hpf_entries, hp, hp_link);
+  hpf->hpf_refcount++;
 
-      items++;
+  if(hpf->hpf_inflight++ == 0)
+    hpf->hpf_busy_since = showtime_get_ts();
 
-      if(seq > hv->hv_last_seq) {
+  if(hpf->hpf_debug)
+    TRACE(TRACE_DEBUG, "HLS", "Prefetching segment %d in %d bps",
+          hs->hs_seq, hv->hv_bitrate);
 
-	if(hv->hv_first_seq == 0)
-	  hv->hv_first_seq = seq;
+  hls_prefetch_req(hs->hs_url, hp,
+                   HTTP_RESULT_PTR(HTTP_BUFFER_INTERNALLY),
+                   HTTP_REQUEST_HEADER("Range", rangep),
+                   HTTP_CANCELLABLE(&hp->hp_cancellable),
+                   HTTP_CONNECT_TIMEOUT(HLS_PREFETCH_CONNECT_TIMEOUT),
+                   HTTP_READ_TIMEOUT(HLS_PREFETCH_READ_TIMEOUT),
+                   NULL);
+}
 
-	hls_segment_t *hs = hv_add_segment(hv, s);
-	hs->hs_byte_offset = byte_offset;
-	hs->hs_byte_size   = byte_size;
-	hs->hs_time_offset = hv->hv_duration;
-	hs->hs_duration    = duration * 1000000LL;
-	hs->hs_crypto      = hvp.hvp_crypto;
-	hs->hs_key_url     = rstr_dup(hvp.hvp_key_url);
-	hv->hv_duration   += hs->hs_duration;
 
-	if(hvp.hvp_explicit_iv) {
-	  memcpy(hs->hs_iv, hvp.hvp_iv, 16);
-	} else {
-	  memset(hs->hs_iv, 0, 12);
-	  hs->hs_iv[12] = seq >> 24;
-	  hs->hs_iv[13] = seq >> 16;
-	  hs->hs_iv[14] = seq >> 8;
-	  hs->hs_iv[15] = seq;
-	}
+/**
+ *
+ */
+static hls_prefetch_t *
+hls_prefetch_find(hls_prefetcher_t *hpf, const hls_segment_t *hs)
+{
+  hls_prefetch_t *hp;
+  TAILQ_FOREACH(hp, &hpf->hpf_entries, hp_link)
+    if(hp->hp_segment == hs)
+      break;
+  return hp;
+}
 
-	if(hv->hv_target_duration == 0)
-	  hv->hv_target_duration = duration;
 
-	hs->hs_seq = seq;
-	duration = 0;
-	byte_offset = -1;
-	byte_size = -1;
+/**
+ * Returns the entry for sequence number 'seq' in any variant
+ */
+static hls_prefetch_t *
+hls_prefetch_find_seq(hls_prefetcher_t *hpf, int seq)
+{
+  hls_prefetch_t *hp;
+  TAILQ_FOREACH(hp, &hpf->hpf_entries, hp_link)
+    if(hp->hp_segment->hs_seq == seq)
+      break;
+  return hp;
+}
 
-	hv->hv_last_seq = hs->hs_seq;
 
-	HLS_TRACE(h, "Added new seq %d", hs->hs_seq);
-      }
-      seq++;
+/**
+ * Returns true if a switch from 'hv' to 'target' should wait until
+ * segment 'seq' of 'hv' has been played. That is the case if the
+ * segment is downloaded, or if it's still downloading and we are
+ * switching up. Same rules as hls_prefetch_fill() uses for keeping
+ * entries around
+ */
+static int
+hls_prefetch_have(hls_t *h, const hls_variant_t *hv,
+                  const hls_variant_t *target, int seq)
+{
+  hls_prefetcher_t *hpf = h->h_prefetcher;
+  hls_prefetch_t *hp;
+  int r = 0;
+
+  if(hpf == NULL)
+    return 0;
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+  hp = hls_prefetch_find_seq(hpf, seq);
+  if(hp != NULL && hp->hp_segment->hs_variant == hv) {
+    switch(hp->hp_state) {
+    case HP_READY:
+      r = 1;
+      break;
+    case HP_PENDING:
+    case HP_DECRYPTING:
+      r = target->hv_bitrate > hv->hv_bitrate;
+      break;
+    case HP_FAILED:
+      break;
     }
   }
+  hts_mutex_unlock(&hpf->hpf_mutex);
+  return r;
+}
 
-  buf_release(b);
-  rstr_release(hvp.hvp_key_url);
 
-  if(items == 0)
-    return VARIANT_EMPTY;
-  return 0;
+/**
+ * Duration of segments that are downloaded and ready to be demuxed
+ */
+static int64_t
+hls_prefetch_buffered(hls_t *h)
+{
+  hls_prefetcher_t *hpf = h->h_prefetcher;
+  hls_prefetch_t *hp;
+  int64_t d = 0;
+
+  if(hpf == NULL)
+    return 0;
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+  TAILQ_FOREACH(hp, &hpf->hpf_entries, hp_link)
+    if(hp->hp_state == HP_READY)
+      d += hp->hp_segment->hs_duration;
+  hts_mutex_unlock(&hpf->hpf_mutex);
+  return d;
 }
 
 
 /**
+ * Make sure the segments following 'cur' are being prefetched from
+ * 'target' and drop what's no longer needed.
  *
+ * Segments that are already downloaded are kept even if they are from
+ * another variant. When switching up, downloads of the current variant
+ * are allowed to finish as well. The demuxer plays those before it
+ * switches, so a switch never throws away data or waits for a download
+ * that could have been avoided.
  */
 static void
-hls_dump(const hls_t *h)
+hls_prefetch_fill(hls_t *h, hls_segment_t *cur, hls_variant_t *target)
 {
-  const hls_variant_t *hv;
-  const char *txt;
-  HLS_TRACE(h, "Base URL: %s", h->h_baseurl);
-  HLS_TRACE(h, "Variants");
-  TAILQ_FOREACH(hv, &h->h_primary.hd_variants, hv_link) {
-    HLS_TRACE(h, "  %s", hv->hv_url);
-    HLS_TRACE(h, "    bitrate:    %d", hv->hv_bitrate);
+  hls_prefetcher_t *hpf = h->h_prefetcher;
+  hls_variant_t *hv = cur->hs_variant;
+  hls_prefetch_t *hp, *next;
+  hls_segment_t *hs;
 
-    if(hv->hv_audio_only) {
-      HLS_TRACE(h, "    Audio only\n");
+  if(hpf == NULL)
+    return;
+
+  if(target == NULL)
+    target = hv;
+
+  if(target != hv)
+    variant_update(target, h);
+
+  const int upswitch = target->hv_bitrate > hv->hv_bitrate;
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+
+  for(hp = TAILQ_FIRST(&hpf->hpf_entries); hp != NULL; hp = next) {
+    next = TAILQ_NEXT(hp, hp_link);
+    hs = hp->hp_segment;
+    if(hs->hs_seq <= cur->hs_seq ||
+       hs->hs_seq > cur->hs_seq + HLS_PREFETCH_SEGMENTS)
+      hls_prefetch_drop(hpf, hp);
+    else if(hs->hs_variant == target || hp->hp_state == HP_READY)
       continue;
-    }
+    else if(!(upswitch && hs->hs_variant == hv))
+      hls_prefetch_drop(hpf, hp);
+  }
 
-    switch(hv->hv_h264_profile) {
-    case 66:
-      txt = "h264 Baseline";
+  for(hs = hv_find_segment_by_seq(target, cur->hs_seq + 1); hs != NULL;
+      hs = TAILQ_NEXT(hs, hs_link)) {
+
+    if(hs->hs_seq > cur->hs_seq + HLS_PREFETCH_SEGMENTS)
       break;
-    case 77:
-      txt = "h264 Main";
+
+    if(hpf->hpf_bytes >= HLS_PREFETCH_MAX_BYTES)
       break;
-    default:
-      txt = "<unknown>";
+
+    if(strncmp(hs->hs_url, "http://", 7) && strncmp(hs->hs_url, "https://", 8))
       break;
-    }
 
-    HLS_TRACE(h, "    Video resolution: %d x %d  Profile: %s  Level: %d.%d",
-              hv->hv_width, hv->hv_height, txt,
-              hv->hv_h264_level / 10,
-              hv->hv_h264_level % 10);
+    if(hls_prefetch_find_seq(hpf, hs->hs_seq) != NULL)
+      continue;
+
+    if(hs->hs_crypto == HLS_CRYPTO_AES128) {
+      // Loading the key may block, don't hold the lock meanwhile
+      hts_mutex_unlock(&hpf->hpf_mutex);
+      int err = variant_load_key(target, hs);
+      hts_mutex_lock(&hpf->hpf_mutex);
+      if(err)
+        break;
+    }
+    hls_prefetch_start(hpf, hs);
   }
+
+  hls_prefetch_update_stats(hpf);
+  hts_mutex_unlock(&hpf->hpf_mutex);
 }
 
 
 /**
+ * Take the prefetched data for 'hs'. Waits for it if it's still being
+ * downloaded, but not longer than HLS_PREFETCH_WAIT (or
+ * HLS_PREFETCH_WAIT_FAST_FAIL) in total. After that the download is
+ * cancelled and the caller should stream the segment instead.
  *
+ * Returns NULL if the segment was not prefetched, if the prefetch
+ * failed or if we gave up waiting. If an event arrives on the media
+ * pipe while waiting, '*interrupted' is set and NULL is returned. The
+ * entry is kept so the caller can come back for it once the event has
+ * been dealt with
  */
-static void
-check_audio_only(hls_t *h)
+static buf_t *
+hls_prefetch_take(hls_t *h, hls_segment_t *hs, int fast_fail,
+                  int *interrupted)
 {
-  hls_variant_t *hv;
-  int streams = 0;
-  int audio_only = 0;
-  TAILQ_FOREACH(hv, &h->h_primary.hd_variants, hv_link) {
-    streams++;
-    if(hv->hv_audio_only)
-      audio_only++;
-  }
+  hls_prefetcher_t *hpf = h->h_prefetcher;
+  hls_prefetch_t *hp;
+  buf_t *b = NULL;
 
-  if(streams == audio_only) {
-    // Most likely not _all_ variants are audio only, so we clear the flag
-    TAILQ_FOREACH(hv, &h->h_primary.hd_variants, hv_link) {
-      hv->hv_audio_only = 0;
+  if(hpf == NULL)
+    return NULL;
+
+  hts_mutex_lock(&hpf->hpf_mutex);
+
+  if((hp = hls_prefetch_find(hpf, hs)) != NULL) {
+
+    if(hp->hp_state == HP_PENDING || hp->hp_state == HP_DECRYPTING) {
+      const int64_t ts = showtime_get_ts();
+
+      if(hp->hp_wait_since == 0) {
+        hp->hp_wait_since = ts;
+        hpf->hpf_stalls++;
+        HLS_TRACE(h, "Waiting for prefetch of segment %d", hs->hs_seq);
+      }
+
+      const int64_t deadline = hp->hp_wait_since + 1000LL *
+        (fast_fail ? HLS_PREFETCH_WAIT_FAST_FAIL : HLS_PREFETCH_WAIT);
+
+      while(hp->hp_state == HP_PENDING || hp->hp_state == HP_DECRYPTING) {
+
+        if(showtime_get_ts() >= deadline)
+          break;
+
+        // Only we remove entries from the queue so 'hp' stays around
+        hts_mutex_unlock(&hpf->hpf_mutex);
+        *interrupted = mp_event_pending(h->h_mp);
+        hts_mutex_lock(&hpf->hpf_mutex);
+
+        if(*interrupted)
+          break;
+
+        hts_cond_wait_timeout(&hpf->hpf_cond, &hpf->hpf_mutex,
+                              HLS_PREFETCH_WAIT_POLL);
+      }
+
+      hpf->hpf_stall_time += showtime_get_ts() - ts;
+
+      if(*interrupted) {
+        hls_prefetch_update_stats(hpf);
+        hts_mutex_unlock(&hpf->hpf_mutex);
+        return NULL;
+      }
+
+      if(hp->hp_state == HP_PENDING || hp->hp_state == HP_DECRYPTING) {
+        HLS_TRACE(h, "Prefetch of segment %d too slow, streaming it instead",
+                  hs->hs_seq);
+        hls_prefetch_drop(hpf, hp);
+        hp = NULL;
+      }
+    }
+
+    if(hp != NULL) {
+      if(hp->hp_state == HP_READY) {
+        b = hp->hp_data;
+        hp->hp_data = NULL;
+        hpf->hpf_bytes -= buf_len(b);
+      }
+      TAILQ_REMOVE(&hpf->hpf_entries, hp, hp_link);
+      hls_prefetch_free(hp);
     }
   }
-}
 
+  hls_prefetch_update_stats(hpf);
+  hts_mutex_unlock(&hpf->hpf_mutex);
+  return b;
+}
 
 
 /**
- *
+ * Aggregate bandwidth of the prefetcher since the last call.
+ * Returns 0 if there is not enough data yet
  */
-static int64_t
-rescale(AVFormatContext *fctx, int64_t ts, int si)
+static int
+hls_prefetch_bandwidth(hls_prefetcher_t *hpf)
 {
-  if(ts == AV_NOPTS_VALUE)
-    return AV_NOPTS_VALUE;
+  int bw = 0;
 
-  return av_rescale_q(ts, fctx->streams[si]->time_base, AV_TIME_BASE_Q);
+  hts_mutex_lock(&hpf->hpf_mutex);
+
+  int64_t busy = hpf->hpf_busy_time;
+  if(hpf->hpf_inflight)
+    busy += showtime_get_ts() - hpf->hpf_busy_since;
+
+  const int64_t t = busy - hpf->hpf_bw_busy_time;
+  const int64_t bytes = hpf->hpf_received - hpf->hpf_bw_received;
+
+  if(t > 0 && bytes > 0) {
+    bw = 8000000LL * bytes / t;
+    hpf->hpf_bw_busy_time = busy;
+    hpf->hpf_bw_received = hpf->hpf_received;
+  }
+
+  hts_mutex_unlock(&hpf->hpf_mutex);
+  return bw;
 }
 
 
 /**
- *
+ * Cancel everything and drop the owner's reference
  */
 static void
-variant_close_current_seg(hls_variant_t *hv)
+hls_prefetcher_close(hls_prefetcher_t *hpf)
 {
-  if(hv->hv_current_seg == NULL)
-    return;
+  hls_prefetch_t *hp;
 
-  hls_segment_t *hs = hv->hv_current_seg;
+  hts_mutex_lock(&hpf->hpf_mutex);
 
-  if(hs->hs_fctx != NULL)
-    fa_libav_close_format(hs->hs_fctx);
-  hs->hs_fctx = NULL;
+  while((hp = TAILQ_FIRST(&hpf->hpf_entries)) != NULL)
+    hls_prefetch_drop(hpf, hp);
 
-  hv->hv_current_seg = NULL;
+  prop_destroy(hpf->hpf_prop_root);
+  prop_ref_dec(hpf->hpf_prop_root);
+  prop_ref_dec(hpf->hpf_prop_depth);
+  prop_ref_dec(hpf->hpf_prop_inflight);
+  prop_ref_dec(hpf->hpf_prop_bytes);
+  prop_ref_dec(hpf->hpf_prop_stalls);
+  prop_ref_dec(hpf->hpf_prop_stall_time);
+
+  hls_prefetcher_release(hpf);
 }
 
 
@@ -610,23 +1754,28 @@ demuxer_update_bw(hls_t *h, hls_demuxer_t *hd)
 {
   hls_variant_t *hv = hd->hd_current;
   hls_segment_t *hs = hv->hv_current_seg;
+  int bw;
 
   if(hs == NULL || !hs->hs_opened_at)
     return;
 
-  int ts = showtime_get_ts() - hs->hs_opened_at;
-  if(h->h_blocked != hs->hs_block_cnt)
-    return;
-
-  int bw = 8000000LL * hs->hs_size / ts;
-
-  if(hd->hd_bw == 0) {
-    hd->hd_bw = bw;
-  } else if (bw < hd->hd_bw) {
-    hd->hd_bw = bw;
+  if(hs->hs_data != NULL) {
+    // Segment came from the prefetcher, use its aggregate throughput
+    if((bw = hls_prefetch_bandwidth(h->h_prefetcher)) == 0)
+      return;
   } else {
-    hd->hd_bw = (bw + hd->hd_bw * 3) / 4;
+    int ts = showtime_get_ts() - hs->hs_opened_at;
+    if(h->h_blocked != hs->hs_block_cnt)
+      return;
+
+    bw = 8000000LL * hs->hs_size / ts;
   }
+
+  if(hd->hd_abr == NULL)
+    return;
+
+  hls_abr_sample(hd->hd_abr, bw, showtime_get_ts());
+  hd->hd_bw = hls_abr_throughput(hd->hd_abr);
   HLS_TRACE(h, "Estimated bandwidth: %d bps (filtered: %d bps)",
 	    bw, hd->hd_bw);
 }
@@ -636,21 +1785,17 @@ typedef enum {
   SEGMENT_OPEN_OK,
   SEGMENT_OPEN_NOT_FOUND,
   SEGMENT_OPEN_CORRUPT,
+  SEGMENT_OPEN_INTERRUPTED,
 } segment_open_result_t;
 
 /**
- *
+ * Open segment from the network
  */
-static segment_open_result_t
-segment_open(hls_t *h, hls_demuxer_t *hd, hls_segment_t *hs, int fast_fail,
-             int find_stream_info)
+static fa_handle_t *
+segment_open_stream(hls_t *h, hls_segment_t *hs, int fast_fail)
 {
-  int err, j;
   fa_handle_t *fh;
   char errbuf[256];
-
-  assert(hs->hs_fctx == NULL);
-
   hls_variant_t *hv = hs->hs_variant;
 
   int flags = FA_STREAMING;
@@ -658,9 +1803,6 @@ segment_open(hls_t *h, hls_demuxer_t *hd, hls_segment_t *hs, int fast_fail,
   if(hs->hs_byte_size != -1 && hs->hs_byte_offset != -1)
     flags |= FA_BUFFERED_SMALL;
 
-  hs->hs_opened_at = showtime_get_ts();
-  hs->hs_block_cnt = h->h_blocked;
-  
   HLS_TRACE(h, "Open segment %d in %d bps @ %s",
 	    hs->hs_seq, hs->hs_variant->hv_bitrate, hs->hs_url);
 
@@ -673,7 +1815,7 @@ segment_open(hls_t *h, hls_demuxer_t *hd, hls_segment_t *hs, int fast_fail,
   if(fh == NULL) {
     TRACE(TRACE_INFO, "HLS", "Unable to open segment %s -- %s",
 	  hs->hs_url, errbuf);
-    return SEGMENT_OPEN_NOT_FOUND;
+    return NULL;
   }
   
   if(hs->hs_byte_size != -1 && hs->hs_byte_offset != -1)
@@ -685,23 +1827,47 @@ segment_open(hls_t *h, hls_demuxer_t *hd, hls_segment_t *hs, int fast_fail,
   switch(hs->hs_crypto) {
   case HLS_CRYPTO_AES128:
 
-    if(!rstr_eq(hs->hs_key_url, hv->hv_key_url)) {
-      buf_release(hv->hv_key);
-      hv->hv_key = fa_load(rstr_get(hs->hs_key_url),
-                            FA_LOAD_ERRBUF(errbuf, sizeof(errbuf)),
-                            NULL);
-      if(hv->hv_key == NULL) {
-	TRACE(TRACE_ERROR, "HLS", "Unable to load key file %s",
-	      rstr_get(hs->hs_key_url));
-	fa_close(fh);
-	return SEGMENT_OPEN_NOT_FOUND;
-      }
-
-      rstr_set(&hv->hv_key_url, hs->hs_key_url);
+    if(variant_load_key(hv, hs)) {
+      fa_close(fh);
+      return NULL;
     }
       
     fh = fa_aescbc_open(fh, hs->hs_iv, buf_c8(hv->hv_key));
   }
+  return fh;
+}
+
+
+/**
+ *
+ */
+static segment_open_result_t
+segment_open(hls_t *h, hls_demuxer_t *hd, hls_segment_t *hs, int fast_fail,
+             int find_stream_info)
+{
+  int err, j, interrupted = 0;
+  fa_handle_t *fh;
+
+  assert(hs->hs_fctx == NULL);
+
+  hs->hs_opened_at = showtime_get_ts();
+  hs->hs_block_cnt = h->h_blocked;
+
+  hs->hs_data = hls_prefetch_take(h, hs, fast_fail, &interrupted);
+
+  if(interrupted)
+    return SEGMENT_OPEN_INTERRUPTED;
+
+  if(hs->hs_data != NULL) {
+    HLS_TRACE(h, "Open segment %d in %d bps from prefetch (%zd bytes)",
+              hs->hs_seq, hs->hs_variant->hv_bitrate, buf_len(hs->hs_data));
+    hs->hs_size = buf_len(hs->hs_data);
+    fh = memfile_make(buf_data(hs->hs_data), buf_len(hs->hs_data));
+  } else {
+    fh = segment_open_stream(h, hs, fast_fail);
+    if(fh == NULL)
+      return SEGMENT_OPEN_NOT_FOUND;
+  }
 
   AVIOContext *avio = fa_libav_reopen(fh, 0);
   hs->hs_fctx = avformat_alloc_context();
@@ -714,6 +1880,8 @@ segment_open(hls_t *h, hls_demuxer_t *hd, hls_segment_t *hs, int fast_fail,
 	  hs->hs_url, hs->hs_seq, err);
 
     fa_libav_close(avio);
+    buf_release(hs->hs_data);
+    hs->hs_data = NULL;
     return SEGMENT_OPEN_CORRUPT;
   }
 
@@ -722,6 +1890,8 @@ segment_open(hls_t *h, hls_demuxer_t *hd, hls_segment_t *hs, int fast_fail,
     if(avformat_find_stream_info(hs->hs_fctx, NULL) < 0) {
       fa_libav_close_format(hs->hs_fctx);
       hs->hs_fctx = NULL;
+      buf_release(hs->hs_data);
+      hs->hs_data = NULL;
       return SEGMENT_OPEN_CORRUPT;
     }
   }
@@ -868,7 +2038,15 @@ demuxer_get_segment(hls_t *h, hls_demuxer_t *hd)
   }
 
   // Need to switch variant? Need to close current segment if so
-  if(hd->hd_req != hd->hd_current) {
+  if(hd->hd_req != hd->hd_current && hd->hd_current != NULL &&
+     hd->hd_seek_to == PTS_UNSET &&
+     hls_prefetch_have(h, hd->hd_current, hd->hd_req, hd->hd_seq)) {
+
+    // Play what's already been downloaded first, switch after that
+    HLS_TRACE(h, "Deferring switch to %d bps, segment %d is prefetched",
+              hd->hd_req->hv_bitrate, hd->hd_seq);
+
+  } else if(hd->hd_req != hd->hd_current) {
 
     if(hd->hd_current != NULL)
       variant_close_current_seg(hd->hd_current);
@@ -1006,6 +2184,10 @@ demuxer_get_segment(hls_t *h, hls_demuxer_t *hd)
       variant_problem(h, hv, "Stream corrupt");
       hd->hd_req = NULL;
       goto again;
+
+    case SEGMENT_OPEN_INTERRUPTED:
+      // Let the caller handle the event (seek, stop, ...) and come back
+      return HLS_SEGMENT_NYA;
     }
 
     hd->hd_seek_to = PTS_UNSET;
@@ -1013,6 +2195,7 @@ demuxer_get_segment(hls_t *h, hls_demuxer_t *hd)
     hv->hv_current_seg = hs;
     hd->hd_seq = hs->hs_seq;
     variant_update_metadata(h, hv, hd->hd_bw);
+    hls_prefetch_fill(h, hs, hd->hd_req);
   }
 
   hls_segment_t *hs = hv->hv_current_seg;
@@ -1051,70 +2234,51 @@ hls_seek(hls_t *h, int64_t pts, int64_t ts, int initial, media_buf_t **mbp)
 
 
 /**
- *
+ * Variant to use after the current segment
  */
 static void
-demuxer_select_variant_simple(hls_t *h, hls_demuxer_t *hd)
+demuxer_select_variant(hls_t *h, hls_demuxer_t *hd)
 {
-  hls_variant_t *hv;
-
-  TAILQ_FOREACH(hv, &hd->hd_variants, hv_link) {
-    if(hv->hv_corrupt_counter >= HV_CORRUPT_LIMIT)
-      continue;
-
-    if(hv->hv_bitrate < hd->hd_bw)
-      break;
-  }
-
-  hd->hd_req = hv;
-}
+  media_pipe_t *mp = h->h_mp;
+  hls_abr_input_t hai;
+  int i, q;
 
+  if(hd->hd_abr == NULL)
+    return;
 
-/**
- *
- */
-static void
-demuxer_select_variant_random(hls_t *h, hls_demuxer_t *hd)
-{
-  hls_variant_t *hv;
-  int cnt = 0;
+  hai.hai_buffer = mp->mp_buffer_delay == INT32_MAX ? 0 : mp->mp_buffer_delay;
+  hai.hai_buffer += hls_prefetch_buffered(h);
+  hai.hai_seq = hd->hd_seq;
+  hai.hai_current = -1;
 
-  TAILQ_FOREACH(hv, &hd->hd_variants, hv_link) {
-    if(hv->hv_corrupt_counter >= HV_CORRUPT_LIMIT)
-      continue;
+  for(i = 0; i < hd->hd_num_levels; i++)
+    if(hd->hd_levels[i] == hd->hd_current)
+      hai.hai_current = i;
 
-    if(!hv->hv_audio_only)
-      cnt++;
-  
-  }
+  const hls_segment_t *hs = hd->hd_current != NULL ?
+    hv_find_segment_by_seq(hd->hd_current, hd->hd_seq) : NULL;
+  hai.hai_seg_duration = hs != NULL ? hs->hs_duration :
+    hd->hd_current != NULL ? hd->hd_current->hv_target_duration * 1000000LL :
+    0;
 
-  int r = rand() % cnt;
-  cnt = 0;
-  TAILQ_FOREACH(hv, &hd->hd_variants, hv_link) {
-    if(hv->hv_corrupt_counter >= HV_CORRUPT_LIMIT)
-      continue;
+  q = hls_abr_select(hd->hd_abr, &hai, showtime_get_ts());
 
-    if(hv->hv_audio_only)
-      continue;
-    if(r == cnt)
+  // Stay away from variants known to be broken
+  for(i = q; i >= 0; i--)
+    if(hd->hd_levels[i]->hv_corrupt_counter < HV_CORRUPT_LIMIT)
       break;
-    cnt++;
-  }
 
-  HLS_TRACE(h, "Randomly selected bitrate %d", hv ? hv->hv_bitrate : 0);
-  hd->hd_req = hv;
-}
+  if(i < 0)
+    for(i = q + 1; i < hd->hd_num_levels; i++)
+      if(hd->hd_levels[i]->hv_corrupt_counter < HV_CORRUPT_LIMIT)
+        break;
 
-/**
- *
- */
-static void
-demuxer_select_variant(hls_t *h, hls_demuxer_t *hd)
-{
-  if(1)
-    demuxer_select_variant_simple(h, hd);
-  else
-    demuxer_select_variant_random(h, hd);
+  hd->hd_req = i < hd->hd_num_levels ? hd->hd_levels[i] : NULL;
+
+  if(hd->hd_req != hd->hd_current && hd->hd_req != NULL)
+    HLS_TRACE(h, "Switching to %d bps (buffer: %.1fs, throughput: %d bps)",
+              hd->hd_req->hv_bitrate, hai.hai_buffer / 1000000.0,
+              hd->hd_bw);
 }
 
 
@@ -1514,12 +2678,58 @@ hls_demuxer_init(hls_demuxer_t *hd)
 }
 
 
+/**
+ * Setup bitrate adaption for all variants that carry video
+ */
+static void
+hls_demuxer_abr_init(hls_t *h, hls_demuxer_t *hd)
+{
+  const hls_abr_algo_t *algo = hls_abr_algo_find(HLS_ABR_DEFAULT);
+  hls_variant_t *hv;
+  char path[1024];
+  const char *logpath = NULL;
+  int n = 0;
+
+  TAILQ_FOREACH(hv, &hd->hd_variants, hv_link)
+    if(!hv->hv_audio_only)
+      n++;
+
+  if(n == 0 || algo == NULL)
+    return;
+
+  hd->hd_levels = malloc(sizeof(hls_variant_t *) * n);
+  int levels[n];
+
+  // hd_variants is sorted highest bitrate first
+  TAILQ_FOREACH_REVERSE(hv, &hd->hd_variants, hls_variant_queue, hv_link) {
+    if(hv->hv_audio_only)
+      continue;
+    levels[hd->hd_num_levels] = hv->hv_bitrate;
+    hd->hd_levels[hd->hd_num_levels++] = hv;
+  }
+
+  if(gconf.enable_hls_abr_log && gconf.cache_path != NULL) {
+    snprintf(path, sizeof(path), "%s/hlsabr", gconf.cache_path);
+    makedirs(path);
+    snprintf(path, sizeof(path), "%s/hlsabr/%d.log",
+             gconf.cache_path, (int)time(NULL));
+    logpath = path;
+  }
+
+  hd->hd_abr = hls_abr_create(algo, levels, n, logpath);
+  HLS_TRACE(h, "Using %s bitrate adaption for %d variants", algo->haa_name, n);
+}
+
+
 /**
  *
  */
 static void
 hls_demuxer_close(hls_demuxer_t *hd)
 {
+  if(hd->hd_abr != NULL)
+    hls_abr_destroy(hd->hd_abr);
+  free(hd->hd_levels);
   variants_destroy(&hd->hd_variants);
   if(hd->hd_audio_codec != NULL)
     media_codec_deref(hd->hd_audio_codec);
@@ -1551,6 +2761,7 @@ hls_play_extm3u(char *buf, const char *url, media_pipe_t *mp,
   h.h_fmt = av_find_input_format("mpegts");
   h.h_codec_h264 = media_codec_create(AV_CODEC_ID_H264, 0, NULL, NULL, NULL, mp);
   h.h_debug = gconf.enable_hls_debug;
+  h.h_prefetcher = hls_prefetcher_create(&h);
 
   hls_variant_t *hv = NULL;
 
@@ -1575,8 +2786,12 @@ hls_play_extm3u(char *buf, const char *url, media_pipe_t *mp,
 
   hls_dump(&h);
 
+  hls_demuxer_abr_init(&h, &h.h_primary);
+
   event_t *e = hls_play(&h, mp, errbuf, errlen, va0);
 
+  hls_prefetcher_close(h.h_prefetcher);
+
   hls_demuxer_close(&h.h_primary);
 
   media_codec_deref(h.h_codec_h264);
@@ -0,0 +1,489 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "showtime.h"
+#include "misc/str.h"
+#include "misc/minmax.h"
+#include "hls_abr.h"
+
+/**
+ * Relevant docs:
+ *
+ * BOLA: Near-Optimal Bitrate Adaptation for Online Videos
+ *    http://arxiv.org/abs/1601.06748
+ *
+ * From Theory to Practice: Improving Bitrate Adaptation in the DASH
+ * Reference Player
+ *    https://dl.acm.org/doi/10.1145/3204949.3204953
+ */
+
+#ifndef HLS_ABR_SAMPLES
+#define HLS_ABR_SAMPLES 5  // Throughput samples in the harmonic mean
+#endif
+
+#ifndef HLS_ABR_SAFETY
+#define HLS_ABR_SAFETY 0.9 // Fraction of throughput we dare to use
+#endif
+
+#ifndef HLS_ABR_BUFFER_TARGET
+#define HLS_ABR_BUFFER_TARGET 30 // Seconds of buffer BOLA aims for
+#endif
+
+#define HLS_ABR_BOLA_MIN_BUFFER       10 // s
+#define HLS_ABR_BOLA_BUFFER_PER_LEVEL 2  // s
+
+// Hysteresis for switching between throughput and BOLA in 'dynamic'
+#define HLS_ABR_DYNAMIC_BOLA_ON  10000000 // µs
+#define HLS_ABR_DYNAMIC_BOLA_OFF 5000000  // µs
+
+/**
+ *
+ */
+struct hls_abr {
+  const hls_abr_algo_t *ha_algo;
+
+  int ha_num_levels;
+  int *ha_levels; // bps, lowest first
+
+  int ha_samples[HLS_ABR_SAMPLES];
+  int ha_num_samples;
+  int ha_sample_ptr;
+
+  int ha_filtered; // Min/EMA filtered throughput for 'simple'
+
+  // BOLA
+  double *ha_utilities;
+  double ha_bola_vp;
+  double ha_bola_gp;
+
+  int ha_bola_active; // 'dynamic' currently uses BOLA
+
+  FILE *ha_log;
+  int64_t ha_log_epoch;
+};
+
+
+/**
+ * Highest level that fits in 'bps', or the lowest level
+ */
+static int
+level_for_bitrate(const hls_abr_t *ha, double bps)
+{
+  int i;
+  for(i = ha->ha_num_levels - 1; i > 0; i--)
+    if(ha->ha_levels[i] <= bps)
+      break;
+  return i;
+}
+
+
+/**
+ *
+ */
+static int
+abr_throughput_level(const hls_abr_t *ha, const hls_abr_input_t *hai)
+{
+  const int tput = hls_abr_throughput(ha);
+
+  if(tput == 0)
+    return hai->hai_current == -1 ? 0 : hai->hai_current;
+
+  return level_for_bitrate(ha, tput * HLS_ABR_SAFETY);
+}
+
+
+/**
+ * Pick by throughput alone
+ */
+static int
+abr_throughput_select(hls_abr_t *ha, const hls_abr_input_t *hai)
+{
+  return abr_throughput_level(ha, hai);
+}
+
+
+/**
+ * BOLA-O. Maximizes (Vp * (utility + gp) - buffer) / bitrate, with the
+ * oscillation guard from the paper: never switch up past what the
+ * throughput can sustain unless we're already there
+ */
+static int
+abr_bola_level(const hls_abr_t *ha, const hls_abr_input_t *hai)
+{
+  const double buffer = hai->hai_buffer / 1000000.0;
+  double best_score = 0;
+  int i, q = 0;
+
+  if(hai->hai_current == -1)
+    return abr_throughput_level(ha, hai);
+
+  for(i = 0; i < ha->ha_num_levels; i++) {
+    const double score =
+      (ha->ha_bola_vp * (ha->ha_utilities[i] + ha->ha_bola_gp) - buffer) /
+      ha->ha_levels[i];
+
+    if(i == 0 || score >= best_score) {
+      best_score = score;
+      q = i;
+    }
+  }
+
+  if(q > hai->hai_current) {
+    const int tput = hls_abr_throughput(ha);
+    const int limit = tput ? level_for_bitrate(ha, tput) : hai->hai_current;
+    q = MIN(q, MAX(limit, hai->hai_current));
+  }
+  return q;
+}
+
+
+/**
+ *
+ */
+static int
+abr_bola_select(hls_abr_t *ha, const hls_abr_input_t *hai)
+{
+  return abr_bola_level(ha, hai);
+}
+
+
+/**
+ * Throughput based while the buffer is small (startup, after seek and
+ * after a stall), BOLA once it has grown
+ */
+static int
+abr_dynamic_select(hls_abr_t *ha, const hls_abr_input_t *hai)
+{
+  const int qt = abr_throughput_level(ha, hai);
+  const int qb = abr_bola_level(ha, hai);
+
+  if(ha->ha_bola_active) {
+    if(hai->hai_buffer < HLS_ABR_DYNAMIC_BOLA_OFF && qb < qt)
+      ha->ha_bola_active = 0;
+  } else {
+    if(hai->hai_buffer >= HLS_ABR_DYNAMIC_BOLA_ON && qb >= qt)
+      ha->ha_bola_active = 1;
+  }
+  return ha->ha_bola_active ? qb : qt;
+}
+
+
+/**
+ * What hls.c used to do: Highest level below a filtered estimate that
+ * follows drops immediately and rises slowly
+ */
+static int
+abr_simple_select(hls_abr_t *ha, const hls_abr_input_t *hai)
+{
+  int i;
+  for(i = ha->ha_num_levels - 1; i > 0; i--)
+    if(ha->ha_levels[i] < ha->ha_filtered)
+      break;
+  return i;
+}
+
+
+/**
+ * For testing switching
+ */
+static int
+abr_random_select(hls_abr_t *ha, const hls_abr_input_t *hai)
+{
+  return rand() % ha->ha_num_levels;
+}
+
+
+static const hls_abr_algo_t abr_throughput = {
+  .haa_name = "throughput",
+  .haa_select = abr_throughput_select,
+};
+
+static const hls_abr_algo_t abr_bola = {
+  .haa_name = "bola",
+  .haa_select = abr_bola_select,
+};
+
+static const hls_abr_algo_t abr_dynamic = {
+  .haa_name = "dynamic",
+  .haa_select = abr_dynamic_select,
+};
+
+static const hls_abr_algo_t abr_simple = {
+  .haa_name = "simple",
+  .haa_select = abr_simple_select,
+};
+
+static const hls_abr_algo_t abr_random = {
+  .haa_name = "random",
+  .haa_select = abr_random_select,
+};
+
+const hls_abr_algo_t *hls_abr_algos[] = {
+  &abr_dynamic,
+  &abr_bola,
+  &abr_throughput,
+  &abr_simple,
+  &abr_random,
+  NULL
+};
+
+
+/**
+ *
+ */
+const hls_abr_algo_t *
+hls_abr_algo_find(const char *name)
+{
+  for(int i = 0; hls_abr_algos[i] != NULL; i++)
+    if(!strcmp(hls_abr_algos[i]->haa_name, name))
+      return hls_abr_algos[i];
+  return NULL;
+}
+
+
+/**
+ * Derive BOLA parameters from the levels, same way as dash.js
+ */
+static void
+abr_bola_init(hls_abr_t *ha)
+{
+  const int n = ha->ha_num_levels;
+  int i;
+
+  ha->ha_utilities = malloc(sizeof(double) * n);
+  for(i = 0; i < n; i++)
+    ha->ha_utilities[i] = log((double)ha->ha_levels[i] / ha->ha_levels[0]) + 1;
+
+  if(n < 2 || ha->ha_utilities[n - 1] <= 1) {
+    // Nothing to choose from, any parameters will do
+    ha->ha_bola_gp = 1;
+    ha->ha_bola_vp = HLS_ABR_BOLA_MIN_BUFFER;
+    return;
+  }
+
+  const double target =
+    MAX(HLS_ABR_BUFFER_TARGET,
+        HLS_ABR_BOLA_MIN_BUFFER + HLS_ABR_BOLA_BUFFER_PER_LEVEL * n);
+
+  ha->ha_bola_gp = (ha->ha_utilities[n - 1] - 1) /
+    (target / HLS_ABR_BOLA_MIN_BUFFER - 1);
+  ha->ha_bola_vp = HLS_ABR_BOLA_MIN_BUFFER / ha->ha_bola_gp;
+}
+
+
+/**
+ * 'levels' must be sorted lowest first
+ */
+hls_abr_t *
+hls_abr_create(const hls_abr_algo_t *algo, const int *levels, int num_levels,
+               const char *logpath)
+{
+  hls_abr_t *ha = calloc(1, sizeof(hls_abr_t));
+  int i;
+
+  assert(num_levels > 0);
+
+  ha->ha_algo = algo;
+  ha->ha_num_levels = num_levels;
+  ha->ha_levels = malloc(sizeof(int) * num_levels);
+  for(i = 0; i < num_levels; i++)
+    ha->ha_levels[i] = MAX(levels[i], 1);
+
+  abr_bola_init(ha);
+
+  if(logpath != NULL) {
+    ha->ha_log = fopen(logpath, "w");
+    if(ha->ha_log == NULL) {
+      TRACE(TRACE_ERROR, "HLS", "Unable to create ABR log %s", logpath);
+    } else {
+      fprintf(ha->ha_log, "# HLS ABR log, algorithm: %s\nL", algo->haa_name);
+      for(i = 0; i < num_levels; i++)
+        fprintf(ha->ha_log, " %d", ha->ha_levels[i]);
+      fprintf(ha->ha_log, "\n");
+    }
+  }
+  return ha;
+}
+
+
+/**
+ *
+ */
+void
+hls_abr_destroy(hls_abr_t *ha)
+{
+  if(ha->ha_log != NULL)
+    fclose(ha->ha_log);
+  free(ha->ha_utilities);
+  free(ha->ha_levels);
+  free(ha);
+}
+
+
+/**
+ * Timestamp for the log
+ */
+static int
+abr_log_time(hls_abr_t *ha, int64_t now)
+{
+  if(ha->ha_log_epoch == 0)
+    ha->ha_log_epoch = now;
+  return (now - ha->ha_log_epoch) / 1000;
+}
+
+
+/**
+ *
+ */
+void
+hls_abr_sample(hls_abr_t *ha, int bps, int64_t now)
+{
+  if(bps <= 0)
+    return;
+
+  ha->ha_samples[ha->ha_sample_ptr] = bps;
+  ha->ha_sample_ptr = (ha->ha_sample_ptr + 1) % HLS_ABR_SAMPLES;
+  if(ha->ha_num_samples < HLS_ABR_SAMPLES)
+    ha->ha_num_samples++;
+
+  if(ha->ha_filtered == 0 || bps < ha->ha_filtered)
+    ha->ha_filtered = bps;
+  else
+    ha->ha_filtered = (bps + ha->ha_filtered * 3) / 4;
+
+  if(ha->ha_log != NULL)
+    fprintf(ha->ha_log, "S %d %d\n", abr_log_time(ha, now), bps);
+}
+
+
+/**
+ * Harmonic mean of the recent samples. Unlike the arithmetic mean it's
+ * dominated by the low samples, which is what we want when the cost of
+ * overestimating is a stall. Returns 0 if there are no samples yet
+ */
+int
+hls_abr_throughput(const hls_abr_t *ha)
+{
+  double sum = 0;
+
+  if(ha->ha_num_samples == 0)
+    return 0;
+
+  for(int i = 0; i < ha->ha_num_samples; i++)
+    sum += 1.0 / ha->ha_samples[i];
+
+  return ha->ha_num_samples / sum;
+}
+
+
+/**
+ * Returns the level to use for the next segment
+ */
+int
+hls_abr_select(hls_abr_t *ha, const hls_abr_input_t *hai, int64_t now)
+{
+  int q = ha->ha_algo->haa_select(ha, hai);
+
+  q = MAX(0, MIN(q, ha->ha_num_levels - 1));
+
+  if(ha->ha_log != NULL) {
+    fprintf(ha->ha_log, "D %d %d %d %d %d %d\n",
+            abr_log_time(ha, now), hai->hai_seq,
+            (int)(hai->hai_buffer / 1000),
+            (int)(hai->hai_seg_duration / 1000),
+            hai->hai_current, q);
+    fflush(ha->ha_log);
+  }
+  return q;
+}
+
+
+/**
+ * Feed a log from hls_abr_create() through 'algo'. Decisions are made
+ * with the recorded inputs (open loop, the recorded level is assumed
+ * to have been played regardless of what 'algo' says). Returns -1 if
+ * the log can't be parsed
+ */
+int
+hls_abr_replay(char *log, const hls_abr_algo_t *algo,
+               int *decisions, int *differ)
+{
+  hls_abr_t *ha = NULL;
+  const char *v;
+
+  *decisions = 0;
+  *differ = 0;
+
+  LINEPARSE(s, log) {
+    if((v = mystrbegins(s, "L ")) != NULL) {
+      int levels[64];
+      int n = 0;
+      char *end;
+
+      while(n < 64) {
+        levels[n] = strtol(v, &end, 10);
+        if(end == v)
+          break;
+        v = end;
+        n++;
+      }
+      if(ha != NULL || n == 0)
+        break;
+      ha = hls_abr_create(algo, levels, n, NULL);
+
+    } else if(ha == NULL) {
+      continue;
+
+    } else if((v = mystrbegins(s, "S ")) != NULL) {
+      int ts, bps;
+      if(sscanf(v, "%d %d", &ts, &bps) == 2)
+        hls_abr_sample(ha, bps, ts * 1000LL);
+
+    } else if((v = mystrbegins(s, "D ")) != NULL) {
+      int ts, seq, buffer, segdur, current, chosen;
+      hls_abr_input_t hai;
+
+      if(sscanf(v, "%d %d %d %d %d %d",
+                &ts, &seq, &buffer, &segdur, &current, &chosen) != 6)
+        continue;
+
+      hai.hai_buffer       = buffer * 1000LL;
+      hai.hai_seg_duration = segdur * 1000LL;
+      hai.hai_current      = current < ha->ha_num_levels ? current : -1;
+      hai.hai_seq          = seq;
+
+      (*decisions)++;
+      if(hls_abr_select(ha, &hai, ts * 1000LL) != chosen)
+        (*differ)++;
+    }
+  }
+
+  if(ha == NULL)
+    return -1;
+
+  hls_abr_destroy(ha);
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Adaptive bitrate selection for HLS
+ *
+ * The engine knows nothing about playlists or media pipes. It is given
+ * the bitrates of the available variants ("levels", lowest first),
+ * throughput samples as segments are downloaded and, at each segment
+ * boundary, the amount of media buffered. It answers with the level to
+ * use for the next segment.
+ *
+ * The decision algorithm is pluggable, see hls_abr_algos[].
+ *
+ * If a log path is given every sample and decision is written to it.
+ * Such a log can be fed through any algorithm with hls_abr_replay()
+ * and its samples double as a recorded bandwidth trace for the
+ * benchmark (--enable-hlsabrbench).
+ */
+
+typedef struct hls_abr hls_abr_t;
+
+/**
+ * Input for a decision
+ */
+typedef struct hls_abr_input {
+  int64_t hai_buffer;       // Media buffered ahead of playhead (µs)
+  int64_t hai_seg_duration; // Duration of next segment (µs)
+  int hai_current;          // Level currently played, -1 if none yet
+  int hai_seq;              // Sequence number of next segment (for logging)
+} hls_abr_input_t;
+
+
+typedef struct hls_abr_algo {
+  const char *haa_name;
+  int (*haa_select)(hls_abr_t *ha, const hls_abr_input_t *hai);
+} hls_abr_algo_t;
+
+extern const hls_abr_algo_t *hls_abr_algos[]; // NULL terminated
+
+#ifndef HLS_ABR_DEFAULT
+#define HLS_ABR_DEFAULT "dynamic"
+#endif
+
+const hls_abr_algo_t *hls_abr_algo_find(const char *name);
+
+hls_abr_t *hls_abr_create(const hls_abr_algo_t *algo,
+                          const int *levels, int num_levels,
+                          const char *logpath);
+
+void hls_abr_destroy(hls_abr_t *ha);
+
+void hls_abr_sample(hls_abr_t *ha, int bps, int64_t now);
+
+int hls_abr_throughput(const hls_abr_t *ha);
+
+int hls_abr_select(hls_abr_t *ha, const hls_abr_input_t *hai, int64_t now);
+
+int hls_abr_replay(char *log, const hls_abr_algo_t *algo,
+                   int *decisions, int *differ);
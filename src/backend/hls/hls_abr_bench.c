@@ -0,0 +1,545 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+/**
+ * HLS adaptive bitrate benchmark
+ *
+ * A local HTTP stand-in serves dummy segments with its output rate
+ * paced after a bandwidth trace. For each trace every ABR algorithm
+ * plays a simulated stream through the regular HTTP client: segments
+ * are downloaded back to back as long as the buffer is below
+ * HLS_ABR_BENCH_BUFFER and playback drains the buffer in simulated
+ * time. Average bitrate, rebuffering time and number of switches are
+ * reported for each run.
+ *
+ * Time runs HLS_ABR_BENCH_SPEEDUP times faster than the wall clock so
+ * a ten minute trace takes 30 seconds per algorithm.
+ *
+ * Besides the built-in traces, the throughput samples of any log
+ * recorded with the 'Record HLS bitrate switching decisions' setting
+ * (in <cache>/hlsabr) are used as traces. The decisions in those logs
+ * are also replayed through each algorithm.
+ *
+ * Enabled with --enable-hlsabrbench
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "showtime.h"
+#include "fileaccess/fileaccess.h"
+#include "misc/minmax.h"
+#include "hls_abr.h"
+
+#ifndef HLS_ABR_BENCH_SPEEDUP
+#define HLS_ABR_BENCH_SPEEDUP 20
+#endif
+
+#ifndef HLS_ABR_BENCH_SEGMENT
+#define HLS_ABR_BENCH_SEGMENT 4 // Segment duration in seconds
+#endif
+
+#ifndef HLS_ABR_BENCH_BUFFER
+#define HLS_ABR_BENCH_BUFFER 30 // Max seconds buffered, like the media pipe
+#endif
+
+#define HLS_ABR_BENCH_CHUNK 8192
+
+/**
+ * Variant bitrates, a typical ladder
+ */
+static const int bench_levels[] = {
+  400000, 800000, 1400000, 2400000, 4500000, 7000000
+};
+
+#define BENCH_NUM_LEVELS (sizeof(bench_levels) / sizeof(bench_levels[0]))
+
+/**
+ * A trace is a list of (duration, bandwidth) pairs
+ */
+typedef struct bench_point {
+  int bp_duration; // ms
+  int bp_kbps;
+} bench_point_t;
+
+typedef struct bench_trace {
+  const char *bt_name;
+  int bt_num_points;
+  bench_point_t *bt_points;
+  int64_t bt_duration; // µs
+} bench_trace_t;
+
+static bench_point_t trace_stable[] = {
+  { 600000, 6000 },
+};
+
+static bench_point_t trace_step[] = {
+  { 120000, 6000 },
+  { 120000, 1500 },
+  { 120000, 6000 },
+  { 120000, 600 },
+  { 120000, 3000 },
+};
+
+static bench_point_t trace_spiky[] = {
+  { 40000, 4000 }, { 4000, 300 },
+  { 60000, 4000 }, { 6000, 300 },
+  { 30000, 4000 }, { 3000, 200 },
+  { 80000, 4000 }, { 5000, 400 },
+  { 50000, 4000 }, { 4000, 300 },
+  { 90000, 4000 }, { 6000, 300 },
+  { 60000, 4000 }, { 3000, 200 },
+};
+
+static bench_point_t trace_cellular[] = {
+  { 8000, 2100 }, { 5000, 3400 }, { 7000, 1200 }, { 6000, 800 },
+  { 9000, 2600 }, { 5000, 4800 }, { 8000, 5200 }, { 6000, 3100 },
+  { 7000, 1600 }, { 5000, 900 },  { 8000, 450 },  { 6000, 1300 },
+  { 9000, 2900 }, { 7000, 3800 }, { 5000, 2200 }, { 8000, 1700 },
+  { 6000, 2500 }, { 9000, 4100 }, { 7000, 6300 }, { 5000, 5500 },
+  { 8000, 2700 }, { 6000, 1100 }, { 7000, 700 },  { 5000, 1900 },
+  { 9000, 3300 }, { 6000, 2400 }, { 8000, 1500 }, { 7000, 2800 },
+};
+
+#define BUILTIN_TRACE(name, points) \
+  { name, sizeof(points) / sizeof(points[0]), points }
+
+static bench_trace_t bench_builtin_traces[] = {
+  BUILTIN_TRACE("stable",   trace_stable),
+  BUILTIN_TRACE("step",     trace_step),
+  BUILTIN_TRACE("spiky",    trace_spiky),
+  BUILTIN_TRACE("cellular", trace_cellular),
+};
+
+#define BENCH_NUM_BUILTIN_TRACES \
+  (sizeof(bench_builtin_traces) / sizeof(bench_builtin_traces[0]))
+
+static HTS_MUTEX_DECL(bench_mutex);
+static const bench_trace_t *bench_trace; // Currently served trace
+static int64_t bench_epoch;              // Wall clock at simulated time 0
+
+
+/**
+ * Current simulated time (µs)
+ */
+static int64_t
+bench_now(void)
+{
+  return (showtime_get_ts() - bench_epoch) * HLS_ABR_BENCH_SPEEDUP;
+}
+
+
+/**
+ * Bandwidth of the served trace at simulated time 't'. Traces wrap
+ * around if the simulation outlasts them
+ */
+static int
+bench_kbps(int64_t t)
+{
+  const bench_trace_t *bt;
+  int64_t pos;
+
+  hts_mutex_lock(&bench_mutex);
+  bt = bench_trace;
+  pos = t % bt->bt_duration;
+
+  for(int i = 0; i < bt->bt_num_points; i++) {
+    pos -= bt->bt_points[i].bp_duration * 1000LL;
+    if(pos < 0) {
+      hts_mutex_unlock(&bench_mutex);
+      return bt->bt_points[i].bp_kbps;
+    }
+  }
+  hts_mutex_unlock(&bench_mutex);
+  return bt->bt_points[bt->bt_num_points - 1].bp_kbps;
+}
+
+
+/**
+ *
+ */
+static int
+bench_send(int fd, const void *data, int len)
+{
+#ifdef MSG_NOSIGNAL
+  return send(fd, data, len, MSG_NOSIGNAL) != len;
+#else
+  return send(fd, data, len, 0) != len;
+#endif
+}
+
+
+/**
+ * Send 'bytes' bytes of payload paced after the current trace
+ */
+static void
+bench_serve_body(int fd, int bytes)
+{
+  static char chunk[HLS_ABR_BENCH_CHUNK];
+  int64_t deadline = showtime_get_ts();
+
+  while(bytes > 0) {
+    int len = MIN(bytes, HLS_ABR_BENCH_CHUNK);
+    int kbps = MAX(bench_kbps(bench_now()), 1);
+
+    deadline += len * 8000LL / (kbps * HLS_ABR_BENCH_SPEEDUP);
+    int64_t now = showtime_get_ts();
+    if(deadline > now)
+      usleep(deadline - now);
+
+    if(bench_send(fd, chunk, len))
+      return;
+    bytes -= len;
+  }
+}
+
+
+/**
+ * The HTTP stand-in. Serves 'GET /<bytes>' one connection at a time,
+ * which is all the simulator needs
+ */
+static void *
+bench_server(void *aux)
+{
+  int lfd = (intptr_t)aux;
+  char req[1024], hdr[256];
+
+  while(1) {
+    int fd = accept(lfd, NULL, NULL);
+    if(fd == -1) {
+      if(errno == EINTR)
+        continue;
+      TRACE(TRACE_ERROR, "HLSABRBENCH", "accept() failed -- %s",
+            strerror(errno));
+      break;
+    }
+
+    int len = 0;
+    while(len < sizeof(req) - 1) {
+      int r = read(fd, req + len, sizeof(req) - 1 - len);
+      if(r <= 0)
+        break;
+      len += r;
+      req[len] = 0;
+      if(strstr(req, "\r\n\r\n") != NULL)
+        break;
+    }
+    req[len] = 0;
+
+    int bytes;
+    if(sscanf(req, "GET /%d ", &bytes) == 1 && bytes >= 0) {
+      snprintf(hdr, sizeof(hdr),
+               "HTTP/1.1 200 OK\r\n"
+               "Content-Type: video/mp2t\r\n"
+               "Content-Length: %d\r\n"
+               "Connection: close\r\n"
+               "\r\n", bytes);
+      if(!bench_send(fd, hdr, strlen(hdr)))
+        bench_serve_body(fd, bytes);
+    } else {
+      snprintf(hdr, sizeof(hdr),
+               "HTTP/1.1 400 Bad Request\r\n"
+               "Content-Length: 0\r\n"
+               "Connection: close\r\n"
+               "\r\n");
+      bench_send(fd, hdr, strlen(hdr));
+    }
+    close(fd);
+  }
+  close(lfd);
+  return NULL;
+}
+
+
+/**
+ * Returns the port we listen on, or -1 on failure
+ */
+static int
+bench_server_start(void)
+{
+  struct sockaddr_in sin = {0};
+  socklen_t slen = sizeof(sin);
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if(fd == -1)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) ||
+     listen(fd, 4) ||
+     getsockname(fd, (struct sockaddr *)&sin, &slen)) {
+    TRACE(TRACE_ERROR, "HLSABRBENCH", "Unable to listen -- %s",
+          strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  hts_thread_create_detached("hlsabrbench server", bench_server,
+                             (void *)(intptr_t)fd, THREAD_PRIO_BGTASK);
+  return ntohs(sin.sin_port);
+}
+
+
+/**
+ * Play 'bt' with 'algo'
+ */
+static void
+bench_run(const bench_trace_t *bt, const hls_abr_algo_t *algo, int port)
+{
+  const int64_t segdur = HLS_ABR_BENCH_SEGMENT * 1000000LL;
+  const int64_t maxbuf = HLS_ABR_BENCH_BUFFER * 1000000LL;
+  const int num_segments = bt->bt_duration / segdur;
+  hls_abr_t *ha = hls_abr_create(algo, bench_levels, BENCH_NUM_LEVELS, NULL);
+  int64_t buffer = 0, rebuffer = 0, startup = 0, bitsum = 0;
+  int current = -1, switches = 0, errors = 0;
+  char url[64], errbuf[256];
+
+  hts_mutex_lock(&bench_mutex);
+  bench_trace = bt;
+  bench_epoch = showtime_get_ts();
+  hts_mutex_unlock(&bench_mutex);
+
+  int64_t now = bench_now();
+
+  for(int seq = 0; seq < num_segments; seq++) {
+
+    if(buffer > maxbuf - segdur) {
+      // Buffer full, wait for playback to make room for a segment
+      usleep((buffer - (maxbuf - segdur)) / HLS_ABR_BENCH_SPEEDUP);
+      int64_t t = bench_now();
+      buffer = MAX(0, buffer - (t - now));
+      now = t;
+    }
+
+    hls_abr_input_t hai;
+    hai.hai_buffer       = buffer;
+    hai.hai_seg_duration = segdur;
+    hai.hai_current      = current;
+    hai.hai_seq          = seq;
+
+    int q = hls_abr_select(ha, &hai, now);
+    int bytes = (int64_t)bench_levels[q] * HLS_ABR_BENCH_SEGMENT / 8;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/%d", port, bytes);
+
+    buf_t *b = NULL;
+    int r = http_req(url,
+                     HTTP_RESULT_PTR(&b),
+                     HTTP_ERRBUF(errbuf, sizeof(errbuf)),
+                     HTTP_FLAGS(FA_NO_RETRIES),
+                     NULL);
+
+    int64_t t = bench_now();
+    int64_t delta = MAX(t - now, 1);
+    now = t;
+
+    // Playback drains the buffer while downloading, once started
+    if(current != -1) {
+      if(delta > buffer) {
+        rebuffer += delta - buffer;
+        buffer = 0;
+      } else {
+        buffer -= delta;
+      }
+    } else {
+      startup = delta;
+    }
+
+    if(r || b == NULL || buf_len(b) != bytes) {
+      errors++;
+      if(b != NULL)
+        buf_release(b);
+      continue;
+    }
+    buf_release(b);
+
+    hls_abr_sample(ha, bytes * 8000000LL / delta, now);
+
+    if(current != -1 && current != q)
+      switches++;
+    current = q;
+    buffer += segdur;
+    bitsum += bench_levels[q];
+  }
+
+  hls_abr_destroy(ha);
+
+  int played = num_segments - errors;
+
+  TRACE(TRACE_INFO, "HLSABRBENCH",
+        "%-10s %-10s avg bitrate: %5d kbps, startup: %5d ms, "
+        "rebuffering: %6d ms, switches: %3d, errors: %d",
+        bt->bt_name, algo->haa_name,
+        played ? (int)(bitsum / played / 1000) : 0,
+        (int)(startup / 1000), (int)(rebuffer / 1000), switches, errors);
+}
+
+
+/**
+ * Build a trace from the throughput samples in a recorded log. Each
+ * sample is assumed to hold from the previous sample until its own
+ * timestamp
+ */
+static bench_trace_t *
+bench_trace_from_log(const char *name, const char *log)
+{
+  bench_trace_t *bt = calloc(1, sizeof(bench_trace_t));
+  int capacity = 0, prev = 0, ts, bps;
+  const char *s = log;
+
+  while(s != NULL && *s) {
+    if(sscanf(s, "S %d %d", &ts, &bps) == 2 && ts > prev && bps > 0) {
+      if(bt->bt_num_points == capacity) {
+        capacity = MAX(64, capacity * 2);
+        bt->bt_points = realloc(bt->bt_points,
+                                capacity * sizeof(bench_point_t));
+      }
+      bench_point_t *bp = &bt->bt_points[bt->bt_num_points++];
+      bp->bp_duration = ts - prev;
+      bp->bp_kbps = bps / 1000;
+      bt->bt_duration += bp->bp_duration * 1000LL;
+      prev = ts;
+    }
+    if((s = strchr(s, '\n')) != NULL)
+      s++;
+  }
+
+  if(bt->bt_duration < HLS_ABR_BENCH_SEGMENT * 1000000LL) {
+    free(bt->bt_points);
+    free(bt);
+    return NULL;
+  }
+
+  bt->bt_name = strdup(name);
+  return bt;
+}
+
+
+/**
+ * Replay the decisions of a recorded log through all algorithms
+ */
+static void
+bench_replay(const char *name, const char *log)
+{
+  for(int i = 0; hls_abr_algos[i] != NULL; i++) {
+    const hls_abr_algo_t *algo = hls_abr_algos[i];
+    char *copy = strdup(log);
+    int decisions, differ;
+
+    if(!hls_abr_replay(copy, algo, &decisions, &differ))
+      TRACE(TRACE_INFO, "HLSABRBENCH",
+            "%s replayed with %s: %d of %d decisions differ",
+            name, algo->haa_name, differ, decisions);
+    free(copy);
+  }
+}
+
+
+/**
+ *
+ */
+static void *
+hls_abr_bench_thread(void *aux)
+{
+  int port = (intptr_t)aux;
+  bench_trace_t *recorded[64];
+  int num_recorded = 0;
+  char path[1024];
+  int i;
+
+  if(gconf.cache_path != NULL) {
+    snprintf(path, sizeof(path), "file://%s/hlsabr", gconf.cache_path);
+    fa_dir_t *fd = fa_scandir(path, NULL, 0);
+
+    if(fd != NULL) {
+      fa_dir_entry_t *fde;
+      RB_FOREACH(fde, &fd->fd_entries, fde_link) {
+        const char *name = rstr_get(fde->fde_filename);
+        buf_t *b = fa_load(rstr_get(fde->fde_url), NULL);
+        if(b == NULL)
+          continue;
+
+        const char *log = buf_cstr(b);
+
+        bench_replay(name, log);
+
+        if(num_recorded < 64) {
+          bench_trace_t *bt = bench_trace_from_log(name, log);
+          if(bt != NULL)
+            recorded[num_recorded++] = bt;
+        }
+        buf_release(b);
+      }
+      fa_dir_free(fd);
+    }
+  }
+
+  for(i = 0; i < BENCH_NUM_BUILTIN_TRACES; i++) {
+    bench_trace_t *bt = &bench_builtin_traces[i];
+    bt->bt_duration = 0;
+    for(int j = 0; j < bt->bt_num_points; j++)
+      bt->bt_duration += bt->bt_points[j].bp_duration * 1000LL;
+
+    for(int j = 0; hls_abr_algos[j] != NULL; j++)
+      bench_run(bt, hls_abr_algos[j], port);
+  }
+
+  for(i = 0; i < num_recorded; i++) {
+    for(int j = 0; hls_abr_algos[j] != NULL; j++)
+      bench_run(recorded[i], hls_abr_algos[j], port);
+
+    free((char *)recorded[i]->bt_name);
+    free(recorded[i]->bt_points);
+    free(recorded[i]);
+  }
+
+  TRACE(TRACE_INFO, "HLSABRBENCH", "Done");
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+hls_abr_bench_init(void)
+{
+  int port = bench_server_start();
+  if(port == -1)
+    return;
+
+  hts_thread_create_detached("hlsabrbench", hls_abr_bench_thread,
+                             (void *)(intptr_t)port, THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, hls_abr_bench_init);
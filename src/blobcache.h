@@ -37,6 +37,8 @@ int blobcache_put(const char *key, const char *stash, buf_t *buf,
 
 #define BLOBCACHE_IMPORTANT_ITEM 0x1
 
+void blobcache_set_compression(const char *stash, int on);
+
 void blobcache_init(void);
 
 void blobcache_fini(void);
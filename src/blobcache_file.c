@@ -31,6 +31,8 @@
 #include <limits.h>
 #include <errno.h>
 
+#include <zlib.h>
+
 #include "showtime.h"
 #include "blobcache.h"
 #include "misc/pool.h"
@@ -42,16 +44,67 @@
 #include "settings.h"
 #include "notifications.h"
 #include "misc/minmax.h"
+#include "misc/callout.h"
 #include "fileaccess/fileaccess.h"
+#include "prop/prop.h"
+
+#ifndef PS3
+#include <sys/mman.h>
+#define BC2_USE_MMAP
+#define BC2_USE_LINKS
+#endif
 
 // Flags
 
+#define BC2_MAGIC_08      0x62630208
 #define BC2_MAGIC_07      0x62630207
 #define BC2_MAGIC_06      0x62630206
 #define BC2_MAGIC_05      0x62630205
 
+/**
+ * The index is split in shards selected by the top bits of the key
+ * hash. Each shard has its own lock, an open addressing hash table
+ * (linear probing) and an index file (bc2/index-XX.dat) with fixed
+ * size records that is mmap()ed and updated in place. A shard is
+ * not loaded from disk until it's first accessed.
+ *
+ * Lock order is cache_lock -> shard locks (in ascending order)
+ *
+ * Eviction is segmented LRU sized by bytes. New items enter the
+ * probation segment and are promoted to the protected segment when
+ * they are hit again. The protected segment is capped at two thirds
+ * of a shard's share of the cache, overflow is demoted back to the
+ * head of probation. The flush thread evicts the oldest tail among
+ * all shards until the cache fits.
+ *
+ * Payloads are stored once per content hash (bc2/XX/cHASH, or zHASH
+ * when compressed) and key files are hard links to them, so the link
+ * count doubles as reference count: a blob with only one link left is
+ * garbage. Without hard links every key gets a file of its own.
+ */
+#define BC_SHARD_BITS 4
+#define BC_SHARDS     (1 << BC_SHARD_BITS)
+#define BC_SHARD(dk)  ((dk) >> (64 - BC_SHARD_BITS))
+
+/**
+ * Etags are stored inline in the fixed 128 byte index records (format
+ * 08) so they are capped. Items with longer etags are still cached,
+ * just without an etag to revalidate with
+ */
+#define BC_ETAG_MAX   88
+
+#define BC_SEG_PROBATION 0
+#define BC_SEG_PROTECTED 1
+#define BC_SEG_num       2
+
+#define BC_DI_PROTECTED  0x80  // In di_flags
+#define BC_DI_COMPRESSED 0x40
+
+TAILQ_HEAD(blobcache_item_queue, blobcache_item);
+
 typedef struct blobcache_item {
-  struct blobcache_item *bi_link;
+  TAILQ_ENTRY(blobcache_item) bi_lru_link;
+  buf_t *bi_pending;      // Not yet written to disk
   char *bi_etag;
   uint64_t bi_key_hash;
   uint64_t bi_content_hash;
@@ -59,8 +112,12 @@ typedef struct blobcache_item {
   uint32_t bi_expiry;
   uint32_t bi_modtime;
   uint32_t bi_size;
+  uint32_t bi_slot;       // Record in shard index file
   uint8_t bi_content_type_len;
   uint8_t bi_flags;
+  uint8_t bi_segment;
+  uint8_t bi_stash;
+  uint8_t bi_compressed;
 } blobcache_item_t;
 
 typedef struct blobcache_diskitem_06 {
@@ -88,213 +145,1087 @@ typedef struct blobcache_diskitem_07 {
   uint8_t di_etag[0];
 } __attribute__((packed)) blobcache_diskitem_07_t;
 
+typedef struct blobcache_diskitem_08 {
+  uint64_t di_key_hash;   // 0 if record is free
+  uint64_t di_content_hash;
+  uint32_t di_lastaccess;
+  uint32_t di_expiry;
+  uint32_t di_modtime;
+  uint32_t di_size;
+  uint32_t di_check;      // FNV-1a of record with di_check set to 0
+  uint8_t di_flags;
+  uint8_t di_etaglen;
+  uint8_t di_content_type_len;
+  uint8_t di_stash;
+  char di_etag[BC_ETAG_MAX];
+} __attribute__((packed)) blobcache_diskitem_08_t;
+
+static_assert(sizeof(blobcache_diskitem_08_t) == 128,
+              "blobcache_diskitem_08 has wrong size");
+
+typedef struct blobcache_shardhdr {
+  uint32_t sh_magic;
+  uint32_t sh_recsize;
+  uint32_t sh_timestamp;  // Last sync
+  uint32_t sh_items;      // Valid at last sync, used before shard is loaded
+  uint64_t sh_size;
+  uint8_t sh_reserved[40];
+} __attribute__((packed)) blobcache_shardhdr_t;
+
+static_assert(sizeof(blobcache_shardhdr_t) == 64,
+              "blobcache_shardhdr has wrong size");
+
+
+typedef struct blobcache_shard {
+  hts_mutex_t bs_lock;
+
+  blobcache_item_t **bs_items;
+  unsigned int bs_mask;
+  unsigned int bs_count;
+  uint64_t bs_size;
+  pool_t *bs_pool;
+
+  struct blobcache_item_queue bs_lru[BC_SEG_num];
+  uint64_t bs_seg_size[BC_SEG_num];
+  uint64_t bs_protected_max;
+
+  int bs_index;
+  char bs_loaded;
+  char bs_dirty;          // Needs header update and msync()
+
+  int bs_fd;
+  void *bs_map;
+  size_t bs_mapsize;
+  uint32_t bs_slots;
+
+  uint32_t *bs_free_slots;
+  uint32_t bs_num_free;
+} blobcache_shard_t;
+
+
+TAILQ_HEAD(blobcache_flush_queue, blobcache_flush);
+
+typedef struct blobcache_flush {
+  TAILQ_ENTRY(blobcache_flush) bf_link;
+  uint64_t bf_key_hash;
+  uint64_t bf_content_hash;
+  uint64_t bf_old_content_hash; // Blob to release, 0 if none
+  buf_t *bf_buf;
+  uint8_t bf_stash;
+} blobcache_flush_t;
+
+
+static blobcache_shard_t shards[BC_SHARDS];
+
+static struct blobcache_flush_queue flush_queue;
+
+static pool_t *flush_pool;
+static hts_mutex_t cache_lock;
+static hts_cond_t cache_cond;
+static hts_thread_t bcthread;
+static int bcrun = 1;
+static int index_dirty;
+static int need_prune_stale;
+#ifdef BC2_USE_LINKS
+static int bc_no_links;
+#else
+static int bc_no_links = 1;
+#endif
+
+#define BLOB_CACHE_MINSIZE   (10 * 1000 * 1000)
+#define BLOB_CACHE_MAXSIZE (1000 * 1000 * 1000)
+
+
+/**
+ * Per stash counters. Stashes are identified by an 8 bit hash of
+ * their name (also stored in the index records), stashes that
+ * collide share counters
+ */
+typedef struct blobcache_stash {
+  const char *bst_name;   // NULL until used in this session
+  atomic_t bst_hits;
+  atomic_t bst_misses;
+  atomic_t bst_evictions;
+  int bst_compress;
+
+  // Only updated by flushthread
+  uint64_t bst_dedup_saved;
+  uint64_t bst_compress_saved;
+
+  prop_t *bst_prop_hits;
+  prop_t *bst_prop_misses;
+  prop_t *bst_prop_evictions;
+  prop_t *bst_prop_dedup_saved;
+  prop_t *bst_prop_compress_saved;
+} blobcache_stash_t;
+
+static blobcache_stash_t stashes[256];
+static HTS_MUTEX_DECL(stash_mutex);
+
+static callout_t blobcache_stats_timer;
+static prop_t *blobcache_prop_root;
+static prop_t *blobcache_prop_stashes;
+static prop_t *blobcache_prop_size;
+static prop_t *blobcache_prop_items;
+static prop_t *blobcache_prop_maxsize;
+static uint64_t blobcache_maxsize;
+
+
+/**
+ *
+ */
+static blobcache_stash_t *
+stash_get(const char *name)
+{
+  uint8_t id = 0;
+  const char *s;
+  blobcache_stash_t *bst;
+
+  for(s = name; *s; s++)
+    id = (id * 31) + *s;
+
+  bst = &stashes[id];
+  if(bst->bst_name == NULL) {
+    hts_mutex_lock(&stash_mutex);
+    if(bst->bst_name == NULL)
+      bst->bst_name = strdup(name);
+    hts_mutex_unlock(&stash_mutex);
+  }
+  return bst;
+}
+
+
+/**
+ *
+ */
+void
+blobcache_set_compression(const char *stash, int on)
+{
+  stash_get(stash)->bst_compress = on;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+blobcache_compute_maxsize(uint64_t current_cache_size)
+{
+  char path[PATH_MAX];
+  fa_fsinfo_t ffi;
+
+  snprintf(path, sizeof(path), "file://%s", gconf.cache_path);
+  if(!fa_fsinfo(path, &ffi)) {
+    uint64_t avail = ffi.ffi_avail + current_cache_size;
+    avail = MAX(BLOB_CACHE_MINSIZE, MIN(avail / 10, BLOB_CACHE_MAXSIZE));
+    return avail;
+  }
+  return BLOB_CACHE_MINSIZE;
+}
+
+
+/**
+ * Zero is reserved for free index records
+ */
+static uint64_t
+digest_key(const char *key, const char *stash)
+{
+  union {
+    uint8_t d[20];
+    uint64_t u64;
+  } u;
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, (const uint8_t *)key, strlen(key));
+  sha1_update(shactx, (const uint8_t *)stash, strlen(stash));
+  sha1_final(shactx, u.d);
+  return u.u64 ?: 1;
+}
+
+
+/**
+ * Only the payload is digested so blobs written by earlier versions
+ * are still found. The hash is just a name, bc_blob_equal() checks
+ * that a blob really holds the same content type and payload before
+ * anything is linked to it
+ */
+static uint64_t
+digest_content(const void *data, size_t len)
+{
+  union {
+    uint8_t d[16];
+    uint64_t u64;
+  } u;
+  md5_decl(ctx);
+  md5_init(ctx);
+  md5_update(ctx, data, len);
+  md5_final(ctx, u.d);
+  return u.u64;
+}
+
+
+/**
+ *
+ */
+static void
+make_filename(char *buf, size_t len, uint64_t hash, int for_write)
+{
+  uint8_t dir = hash;
+  if(for_write) {
+    snprintf(buf, len, "%s/bc2/%02x", gconf.cache_path, dir);
+    mkdir(buf, 0777);
+  }
+  snprintf(buf, len, "%s/bc2/%02x/%016"PRIx64, gconf.cache_path, dir, hash);
+}
+
+
+/**
+ *
+ */
+static void
+make_blobname(char *buf, size_t len, uint64_t hash, int compressed,
+              int for_write)
+{
+  uint8_t dir = hash;
+  if(for_write) {
+    snprintf(buf, len, "%s/bc2/%02x", gconf.cache_path, dir);
+    mkdir(buf, 0777);
+  }
+  snprintf(buf, len, "%s/bc2/%02x/%c%016"PRIx64, gconf.cache_path, dir,
+           compressed ? 'z' : 'c', hash);
+}
+
+
+/**
+ * Remove the blob if no key links to it anymore
+ */
+static void
+bc_blob_release(uint64_t content_hash)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  int compressed;
+
+  if(bc_no_links)
+    return;
+
+  for(compressed = 0; compressed < 2; compressed++) {
+    make_blobname(path, sizeof(path), content_hash, compressed, 0);
+    if(!stat(path, &st) && st.st_nlink == 1)
+      unlink(path);
+  }
+}
+
+
+/**
+ *
+ */
+static int
+bc_compressible(const buf_t *b)
+{
+  const char *ct;
+
+  if(b->b_size < 256)
+    return 0;
+
+  if(b->b_content_type == NULL)
+    return 1;
+
+  ct = rstr_get(b->b_content_type);
+  return !mystrbegins(ct, "image/") && !mystrbegins(ct, "video/") &&
+    !mystrbegins(ct, "audio/");
+}
+
+
+/**
+ *
+ */
+static int
+bc_write_file(const char *path, const buf_t *b, const void *data, size_t len)
+{
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+  int r = 0;
+
+  if(fd == -1)
+    return -1;
+
+  if(b->b_content_type != NULL) {
+    const char *str = rstr_get(b->b_content_type);
+    size_t slen = strlen(str);
+    if(write(fd, str, slen) != slen)
+      r = -1;
+  }
+
+  if(write(fd, data, len) != len)
+    r = -1;
+
+  if(close(fd))
+    r = -1;
+  return r;
+}
+
+
+/**
+ * Check that the blob at 'path' is byte for byte what bc_write_file()
+ * would write for 'b'. Content hashes are only 64 bits, so a blob with
+ * the right name is not proof of equal content
+ */
+static int
+bc_blob_equal(const char *path, const buf_t *b, int compressed)
+{
+  const char *ct = b->b_content_type ? rstr_get(b->b_content_type) : "";
+  const size_t ctlen = strlen(ct);
+  struct stat st;
+  uint8_t *data, *plain;
+  uLongf outlen;
+  int fd, r = 0;
+
+  if((fd = open(path, O_RDONLY, 0)) == -1)
+    return 0;
+
+  if(fstat(fd, &st) || st.st_size < (off_t)ctlen ||
+     (!compressed && st.st_size != ctlen + b->b_size)) {
+    close(fd);
+    return 0;
+  }
+
+  data = mymalloc(st.st_size + 1);
+  if(data == NULL || read(fd, data, st.st_size) != st.st_size ||
+     memcmp(data, ct, ctlen)) {
+    free(data);
+    close(fd);
+    return 0;
+  }
+  close(fd);
+
+  if(!compressed) {
+    r = !memcmp(data + ctlen, b->b_ptr, b->b_size);
+  } else {
+    outlen = b->b_size;
+    plain = mymalloc(b->b_size + 1);
+    r = plain != NULL &&
+      uncompress(plain, &outlen, data + ctlen, st.st_size - ctlen) == Z_OK &&
+      outlen == b->b_size && !memcmp(plain, b->b_ptr, b->b_size);
+    free(plain);
+  }
+  free(data);
+  return r;
+}
+
+
+/**
+ * Store the payload of a flush entry. Link to an existing blob with the
+ * same content if possible, otherwise write (and maybe compress) a new
+ * one. Blobs are never modified in place since other keys may link to
+ * them, new files are written to a temporary name and renamed. A blob
+ * that merely shares our hash is replaced by the new one, keys linked
+ * to it keep the old inode.
+ *
+ * Returns 1 if stored compressed, 0 if not and -1 on error
+ */
+static int
+bc_write_item(const blobcache_flush_t *bf)
+{
+  blobcache_stash_t *bst = &stashes[bf->bf_stash];
+  const buf_t *b = bf->bf_buf;
+  char kpath[PATH_MAX], bpath[PATH_MAX], tmp[PATH_MAX];
+  void *zdata = NULL;
+  uLongf zlen = 0;
+  int compressed;
+
+  make_filename(kpath, sizeof(kpath), bf->bf_key_hash, 1);
+
+  if(!bc_no_links) {
+    unlink(kpath);
+    for(compressed = 1; compressed >= 0; compressed--) {
+      make_blobname(bpath, sizeof(bpath), bf->bf_content_hash, compressed, 0);
+      if(bc_blob_equal(bpath, b, compressed) && !link(bpath, kpath)) {
+        bst->bst_dedup_saved += b->b_size;
+        goto done;
+      }
+    }
+  }
+
+  if(bst->bst_compress && bc_compressible(b)) {
+    zlen = compressBound(b->b_size);
+    zdata = mymalloc(zlen);
+    if(zdata != NULL &&
+       (compress2(zdata, &zlen, (const void *)b->b_ptr, b->b_size,
+                  Z_DEFAULT_COMPRESSION) != Z_OK ||
+        zlen > b->b_size - b->b_size / 8)) {
+      // Not worth it
+      free(zdata);
+      zdata = NULL;
+    }
+  }
+  compressed = zdata != NULL;
+
+  snprintf(tmp, sizeof(tmp), "%s/bc2/tmp", gconf.cache_path);
+  if(bc_write_file(tmp, b, zdata ?: b->b_ptr, zdata ? zlen : b->b_size)) {
+    free(zdata);
+    unlink(tmp);
+    return -1;
+  }
+
+  if(zdata != NULL)
+    bst->bst_compress_saved += b->b_size - zlen;
+  free(zdata);
+
+  if(!bc_no_links) {
+    make_blobname(bpath, sizeof(bpath), bf->bf_content_hash, compressed, 1);
+    if(!link(tmp, kpath)) {
+      rename(tmp, bpath);
+      goto done;
+    }
+
+    if(errno == EPERM || errno == ENOTSUP || errno == ENOSYS) {
+      TRACE(TRACE_INFO, "blobcache",
+            "Hard links not supported (%s), deduplication disabled",
+            strerror(errno));
+      bc_no_links = 1;
+    }
+  }
+
+  if(rename(tmp, kpath)) {
+    unlink(tmp);
+    return -1;
+  }
+
+ done:
+  if(bf->bf_old_content_hash)
+    bc_blob_release(bf->bf_old_content_hash);
+  return compressed;
+}
+
+
+/**
+ *
+ */
+static __inline blobcache_shardhdr_t *
+bs_hdr(const blobcache_shard_t *bs)
+{
+  return bs->bs_map;
+}
+
+
+/**
+ *
+ */
+static __inline blobcache_diskitem_08_t *
+bs_rec(const blobcache_shard_t *bs, uint32_t slot)
+{
+  return (blobcache_diskitem_08_t *)
+    ((char *)bs->bs_map + sizeof(blobcache_shardhdr_t)) + slot;
+}
+
+
+/**
+ * Called after modifying the mapped index. Without mmap() the change
+ * is written through to the file
+ */
+static void
+bs_writeback(blobcache_shard_t *bs, const void *ptr, size_t len)
+{
+#ifndef BC2_USE_MMAP
+  off_t off = (const char *)ptr - (const char *)bs->bs_map;
+
+  if(lseek(bs->bs_fd, off, SEEK_SET) != off ||
+     write(bs->bs_fd, ptr, len) != len)
+    TRACE(TRACE_ERROR, "blobcache", "Unable to write index %02x -- %s",
+          bs->bs_index, strerror(errno));
+#endif
+}
+
+
+/**
+ * (Re)map the index file with the given number of records
+ */
+static int
+bs_map_slots(blobcache_shard_t *bs, uint32_t slots)
+{
+  size_t size = sizeof(blobcache_shardhdr_t) +
+    (size_t)slots * sizeof(blobcache_diskitem_08_t);
+  void *m;
+
+#ifdef BC2_USE_MMAP
+  if(ftruncate(bs->bs_fd, size))
+    return -1;
+
+  m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, bs->bs_fd, 0);
+  if(m == MAP_FAILED)
+    return -1;
+
+  if(bs->bs_map != NULL)
+    munmap(bs->bs_map, bs->bs_mapsize);
+#else
+  // Keep a copy in memory, bs_writeback() takes care of the file
+  if((m = realloc(bs->bs_map, size)) == NULL)
+    return -1;
+  if(size > bs->bs_mapsize)
+    memset((char *)m + bs->bs_mapsize, 0, size - bs->bs_mapsize);
+#endif
+  bs->bs_map = m;
+  bs->bs_mapsize = size;
+  bs->bs_slots = slots;
+  return 0;
+}
+
+
+/**
+ * Map the index file and verify its header. Records are not looked at
+ * until the shard is loaded
+ */
+static void
+bs_open(blobcache_shard_t *bs)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  uint32_t slots = 0;
+  blobcache_shardhdr_t *sh;
+
+  snprintf(path, sizeof(path), "%s/bc2/index-%02x.dat",
+           gconf.cache_path, bs->bs_index);
+
+  if((bs->bs_fd = open(path, O_CREAT | O_RDWR, 0666)) == -1) {
+    TRACE(TRACE_ERROR, "blobcache", "Unable to open %s -- %s",
+          path, strerror(errno));
+    return;
+  }
+
+  if(!fstat(bs->bs_fd, &st) && st.st_size >= sizeof(blobcache_shardhdr_t))
+    slots = (st.st_size - sizeof(blobcache_shardhdr_t)) /
+      sizeof(blobcache_diskitem_08_t);
+
+  if(bs_map_slots(bs, slots)) {
+    TRACE(TRACE_ERROR, "blobcache", "Unable to map %s -- %s",
+          path, strerror(errno));
+    close(bs->bs_fd);
+    bs->bs_fd = -1;
+    return;
+  }
+
+#ifndef BC2_USE_MMAP
+  if(read(bs->bs_fd, bs->bs_map, bs->bs_mapsize) != bs->bs_mapsize)
+    memset(bs->bs_map, 0, bs->bs_mapsize);
+#endif
+
+  sh = bs_hdr(bs);
+
+  if(sh->sh_magic == BC2_MAGIC_08 &&
+     sh->sh_recsize == sizeof(blobcache_diskitem_08_t)) {
+    if(sh->sh_timestamp <= time(NULL))
+      return;
+    TRACE(TRACE_INFO, "blobcache",
+          "Clock going backwards, throwing away index %s", path);
+  }
+
+  if(st.st_size > 0)
+    need_prune_stale = 1;
+
+  memset(bs->bs_map, 0, bs->bs_mapsize);
+  sh->sh_magic = BC2_MAGIC_08;
+  sh->sh_recsize = sizeof(blobcache_diskitem_08_t);
+  sh->sh_timestamp = time(NULL);
+  bs_writeback(bs, bs->bs_map, bs->bs_mapsize);
+}
+
+
+/**
+ *
+ */
+static uint32_t
+bc_record_check(const blobcache_diskitem_08_t *di)
+{
+  blobcache_diskitem_08_t tmp = *di;
+  const uint8_t *d = (const uint8_t *)&tmp;
+  uint32_t h = 0x811c9dc5;
+  int i;
+
+  tmp.di_check = 0;
+  for(i = 0; i < sizeof(tmp); i++)
+    h = (h ^ d[i]) * 0x01000193;
+  return h;
+}
+
+
+/**
+ *
+ */
+static void
+bs_rehash(blobcache_shard_t *bs, unsigned int size)
+{
+  blobcache_item_t **v = calloc(size, sizeof(blobcache_item_t *));
+  const unsigned int mask = size - 1;
+  blobcache_item_t *p;
+  unsigned int i, j;
+
+  if(bs->bs_items != NULL) {
+    for(i = 0; i <= bs->bs_mask; i++) {
+      if((p = bs->bs_items[i]) == NULL)
+        continue;
+      j = p->bi_key_hash & mask;
+      while(v[j] != NULL)
+        j = (j + 1) & mask;
+      v[j] = p;
+    }
+    free(bs->bs_items);
+  }
+  bs->bs_items = v;
+  bs->bs_mask = mask;
+}
+
+
+/**
+ *
+ */
+static int
+bs_find(const blobcache_shard_t *bs, uint64_t dk)
+{
+  unsigned int i = dk & bs->bs_mask;
+  const blobcache_item_t *p;
+
+  while((p = bs->bs_items[i]) != NULL) {
+    if(p->bi_key_hash == dk)
+      return i;
+    i = (i + 1) & bs->bs_mask;
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void
+bs_insert(blobcache_shard_t *bs, blobcache_item_t *p)
+{
+  unsigned int i;
+
+  if((bs->bs_count + 1) * 4 > (bs->bs_mask + 1) * 3)
+    bs_rehash(bs, (bs->bs_mask + 1) * 2);
+
+  i = p->bi_key_hash & bs->bs_mask;
+  while(bs->bs_items[i] != NULL)
+    i = (i + 1) & bs->bs_mask;
+  bs->bs_items[i] = p;
+  bs->bs_count++;
+}
+
+
+/**
+ * Backward shift deletion, no tombstones
+ */
+static void
+bs_remove_at(blobcache_shard_t *bs, unsigned int i)
+{
+  const unsigned int mask = bs->bs_mask;
+  unsigned int j = i, k;
+  blobcache_item_t *p;
+
+  bs->bs_items[i] = NULL;
+
+  while(1) {
+    j = (j + 1) & mask;
+    if((p = bs->bs_items[j]) == NULL)
+      break;
+
+    k = p->bi_key_hash & mask;
+
+    // Leave it if its home slot is cyclically in (i, j]
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+
+    bs->bs_items[i] = p;
+    bs->bs_items[j] = NULL;
+    i = j;
+  }
+  bs->bs_count--;
+}
+
+
+/**
+ *
+ */
+static void
+bs_lru_insert(blobcache_shard_t *bs, blobcache_item_t *p, int segment)
+{
+  p->bi_segment = segment;
+  TAILQ_INSERT_HEAD(&bs->bs_lru[segment], p, bi_lru_link);
+  bs->bs_seg_size[segment] += p->bi_size;
+}
+
+
+/**
+ *
+ */
+static void
+bs_lru_remove(blobcache_shard_t *bs, blobcache_item_t *p)
+{
+  TAILQ_REMOVE(&bs->bs_lru[p->bi_segment], p, bi_lru_link);
+  bs->bs_seg_size[p->bi_segment] -= p->bi_size;
+}
+
+
+/**
+ * Demote from the protected segment until it fits
+ */
+static void
+bs_lru_balance(blobcache_shard_t *bs)
+{
+  blobcache_item_t *p;
+
+  while(bs->bs_seg_size[BC_SEG_PROTECTED] > bs->bs_protected_max &&
+        (p = TAILQ_LAST(&bs->bs_lru[BC_SEG_PROTECTED],
+                        blobcache_item_queue)) != NULL) {
+    bs_lru_remove(bs, p);
+    bs_lru_insert(bs, p, BC_SEG_PROBATION);
+  }
+}
+
+
+/**
+ * Called on every hit
+ */
+static void
+bs_lru_touch(blobcache_shard_t *bs, blobcache_item_t *p)
+{
+  bs_lru_remove(bs, p);
+  bs_lru_insert(bs, p, BC_SEG_PROTECTED);
+  bs_lru_balance(bs);
+}
+
+
+/**
+ *
+ */
+static int
+bs_slot_alloc(blobcache_shard_t *bs, uint32_t *slotp)
+{
+  if(bs->bs_num_free == 0) {
+    const uint32_t old = bs->bs_slots;
+    const uint32_t slots = MAX(256, old * 2);
+    uint32_t *fs, s;
+
+    if(bs->bs_fd == -1)
+      return -1;
+
+    fs = realloc(bs->bs_free_slots, sizeof(uint32_t) * slots);
+    if(fs == NULL)
+      return -1;
+    bs->bs_free_slots = fs;
+
+    if(bs_map_slots(bs, slots))
+      return -1;
+
+    for(s = slots; s-- > old;)
+      bs->bs_free_slots[bs->bs_num_free++] = s;
+  }
+  *slotp = bs->bs_free_slots[--bs->bs_num_free];
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+bs_item_store(blobcache_shard_t *bs, const blobcache_item_t *p)
+{
+  blobcache_diskitem_08_t *di = bs_rec(bs, p->bi_slot);
+  const int etaglen = p->bi_etag ? strlen(p->bi_etag) : 0;
+
+  memset(di, 0, sizeof(blobcache_diskitem_08_t));
+  di->di_key_hash     = p->bi_key_hash;
+  di->di_content_hash = p->bi_content_hash;
+  di->di_lastaccess   = p->bi_lastaccess;
+  di->di_expiry       = p->bi_expiry;
+  di->di_modtime      = p->bi_modtime;
+  di->di_size         = p->bi_size;
+  di->di_flags        = p->bi_flags;
+  if(p->bi_segment == BC_SEG_PROTECTED)
+    di->di_flags     |= BC_DI_PROTECTED;
+  if(p->bi_compressed)
+    di->di_flags     |= BC_DI_COMPRESSED;
+  di->di_stash        = p->bi_stash;
+  di->di_etaglen      = etaglen;
+  di->di_content_type_len = p->bi_content_type_len;
+  if(etaglen)
+    memcpy(di->di_etag, p->bi_etag, etaglen);
+  di->di_check = bc_record_check(di);
+
+  bs_writeback(bs, di, sizeof(blobcache_diskitem_08_t));
+  bs->bs_dirty = 1;
+}
+
+
+/**
+ *
+ */
+static void
+bs_item_destroy(blobcache_shard_t *bs, unsigned int idx)
+{
+  blobcache_item_t *p = bs->bs_items[idx];
+  blobcache_diskitem_08_t *di = bs_rec(bs, p->bi_slot);
+  char filename[PATH_MAX];
+
+  make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
+  unlink(filename);
+  bc_blob_release(p->bi_content_hash);
+
+  bs_remove_at(bs, idx);
+  bs_lru_remove(bs, p);
+
+  memset(di, 0, sizeof(blobcache_diskitem_08_t));
+  bs_writeback(bs, di, sizeof(blobcache_diskitem_08_t));
+  bs->bs_dirty = 1;
+  bs->bs_free_slots[bs->bs_num_free++] = p->bi_slot;
+
+  bs->bs_size -= p->bi_size;
+  if(p->bi_pending != NULL)
+    buf_release(p->bi_pending);
+  free(p->bi_etag);
+  pool_put(bs->bs_pool, p);
+}
+
+
+/**
+ *
+ */
+static int
+lastaccesscmp(const void *A, const void *B)
+{
+  const blobcache_item_t *a = *(const blobcache_item_t **)A;
+  const blobcache_item_t *b = *(const blobcache_item_t **)B;
 
-TAILQ_HEAD(blobcache_flush_queue, blobcache_flush);
+  return a->bi_lastaccess < b->bi_lastaccess ? -1 :
+    a->bi_lastaccess > b->bi_lastaccess;
+}
 
-typedef struct blobcache_flush {
-  TAILQ_ENTRY(blobcache_flush) bf_link;
-  uint64_t bf_key_hash;
-  buf_t *bf_buf;
-} blobcache_flush_t;
 
+/**
+ * Build the in-memory table from the index records
+ */
+static void
+bs_load(blobcache_shard_t *bs)
+{
+  unsigned int size = 256, i, n = 0;
+  blobcache_diskitem_08_t *di;
+  blobcache_item_t *p, **sv;
+  uint32_t slot;
 
+  bs->bs_loaded = 1;
 
-#define ITEM_HASH_SIZE 256
-#define ITEM_HASH_MASK (ITEM_HASH_SIZE - 1)
+  if(bs->bs_map != NULL)
+    while(size * 3 < bs_hdr(bs)->sh_items * 4)
+      size *= 2;
 
-static blobcache_item_t *hashvector[ITEM_HASH_SIZE];
+  bs_rehash(bs, size);
 
-static struct blobcache_flush_queue flush_queue;
+  if(bs->bs_map == NULL)
+    return;
 
-static pool_t *item_pool;
-static hts_mutex_t cache_lock;
-static hts_cond_t cache_cond;
-static hts_thread_t bcthread;
-static int bcrun = 1;
-static int index_dirty;
+  bs->bs_free_slots = malloc(sizeof(uint32_t) * MAX(1, bs->bs_slots));
+  sv = malloc(sizeof(blobcache_item_t *) * MAX(1, bs->bs_slots));
 
-#define BLOB_CACHE_MINSIZE   (10 * 1000 * 1000)
-#define BLOB_CACHE_MAXSIZE (1000 * 1000 * 1000)
+  // Backwards so the lowest free slots end up on top of the stack
+  for(slot = bs->bs_slots; slot-- > 0;) {
+    di = bs_rec(bs, slot);
 
-static uint64_t current_cache_size;
+    if(di->di_key_hash == 0 ||
+       di->di_check != bc_record_check(di) ||
+       BC_SHARD(di->di_key_hash) != bs->bs_index ||
+       di->di_etaglen > BC_ETAG_MAX ||
+       bs_find(bs, di->di_key_hash) != -1) {
 
+      if(di->di_key_hash != 0) {
+        memset(di, 0, sizeof(blobcache_diskitem_08_t));
+        bs_writeback(bs, di, sizeof(blobcache_diskitem_08_t));
+        need_prune_stale = 1;
+      }
+      bs->bs_free_slots[bs->bs_num_free++] = slot;
+      continue;
+    }
 
-/**
- *
- */
-static uint64_t
-blobcache_compute_maxsize(void)
-{
-  char path[PATH_MAX];
-  fa_fsinfo_t ffi;
+    p = pool_get(bs->bs_pool);
+    p->bi_pending          = NULL;
+    p->bi_key_hash         = di->di_key_hash;
+    p->bi_content_hash     = di->di_content_hash;
+    p->bi_lastaccess       = di->di_lastaccess;
+    p->bi_expiry           = di->di_expiry;
+    p->bi_modtime          = di->di_modtime;
+    p->bi_size             = di->di_size;
+    p->bi_content_type_len = di->di_content_type_len;
+    p->bi_flags            = di->di_flags &
+      ~(BC_DI_PROTECTED | BC_DI_COMPRESSED);
+    p->bi_compressed       = !!(di->di_flags & BC_DI_COMPRESSED);
+    p->bi_segment          = di->di_flags & BC_DI_PROTECTED ?
+      BC_SEG_PROTECTED : BC_SEG_PROBATION;
+    p->bi_stash            = di->di_stash;
+    p->bi_slot             = slot;
+
+    if(di->di_etaglen) {
+      p->bi_etag = malloc(di->di_etaglen + 1);
+      memcpy(p->bi_etag, di->di_etag, di->di_etaglen);
+      p->bi_etag[di->di_etaglen] = 0;
+    } else {
+      p->bi_etag = NULL;
+    }
 
-  snprintf(path, sizeof(path), "file://%s", gconf.cache_path);
-  if(!fa_fsinfo(path, &ffi)) {
-    uint64_t avail = ffi.ffi_avail + current_cache_size;
-    avail = MAX(BLOB_CACHE_MINSIZE, MIN(avail / 10, BLOB_CACHE_MAXSIZE));
-    return avail;
+    bs_insert(bs, p);
+    bs->bs_size += p->bi_size;
+    sv[n++] = p;
   }
-  return BLOB_CACHE_MINSIZE;
+
+  // Rebuild the LRU order, oldest first as items are inserted at head
+  qsort(sv, n, sizeof(blobcache_item_t *), lastaccesscmp);
+  for(i = 0; i < n; i++)
+    bs_lru_insert(bs, sv[i], sv[i]->bi_segment);
+  free(sv);
+  bs_lru_balance(bs);
 }
 
 
 /**
  *
  */
-static uint64_t
-digest_key(const char *key, const char *stash)
+static void
+bs_enter(blobcache_shard_t *bs)
 {
-  union {
-    uint8_t d[20];
-    uint64_t u64;
-  } u;
-  sha1_decl(shactx);
-  sha1_init(shactx);
-  sha1_update(shactx, (const uint8_t *)key, strlen(key));
-  sha1_update(shactx, (const uint8_t *)stash, strlen(stash));
-  sha1_final(shactx, u.d);
-  return u.u64;
+  hts_mutex_lock(&bs->bs_lock);
+  if(!bs->bs_loaded)
+    bs_load(bs);
 }
 
 
 /**
  *
  */
-static uint64_t
-digest_content(const void *data, size_t len)
+static blobcache_shard_t *
+bs_lock(uint64_t dk)
 {
-  union {
-    uint8_t d[16];
-    uint64_t u64;
-  } u;
-  md5_decl(ctx);
-  md5_init(ctx);
-  md5_update(ctx, data, len);
-  md5_final(ctx, u.d);
-  return u.u64;
+  blobcache_shard_t *bs = &shards[BC_SHARD(dk)];
+  bs_enter(bs);
+  return bs;
 }
 
 
 /**
- *
+ * Total size of all items, unloaded shards use the figures from the
+ * last sync
  */
-static void
-make_filename(char *buf, size_t len, uint64_t hash, int for_write)
+static uint64_t
+blobcache_size(int *itemsp)
 {
-  uint8_t dir = hash;
-  if(for_write) {
-    snprintf(buf, len, "%s/bc2/%02x", gconf.cache_path, dir);
-    mkdir(buf, 0777);
+  uint64_t size = 0;
+  int i, items = 0;
+
+  for(i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_lock(&bs->bs_lock);
+    if(bs->bs_loaded) {
+      size  += bs->bs_size;
+      items += bs->bs_count;
+    } else if(bs->bs_map != NULL) {
+      size  += bs_hdr(bs)->sh_size;
+      items += bs_hdr(bs)->sh_items;
+    }
+    hts_mutex_unlock(&bs->bs_lock);
   }
-  snprintf(buf, len, "%s/bc2/%02x/%016"PRIx64, gconf.cache_path, dir, hash);
+  if(itemsp != NULL)
+    *itemsp = items;
+  return size;
 }
 
 
 /**
- *
+ * Update headers of modified shards and push records to disk
  */
 static void
-save_index(void)
+blobcache_sync(int wait)
 {
-  char filename[PATH_MAX];
-  uint8_t *out, *base;
   int i;
-  blobcache_item_t *p;
-  blobcache_diskitem_07_t *di;
-  size_t siz;
-
-  if(!index_dirty)
-    return;
-
-  snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
-  
-  int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-  if(fd == -1)
-    return;
-  
-  int items = 0;
-  siz = 12 + 20;
-
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      siz += sizeof(blobcache_diskitem_07_t);
-      siz += p->bi_etag ? strlen(p->bi_etag) : 0;
-      items++;
-    }
-  }
 
-  base = out = mymalloc(siz);
-  if(out == NULL) {
-    close(fd);
-    return;
-  }
-  *(uint32_t *)out = BC2_MAGIC_07;
-  out += 4;
-  *(uint32_t *)out = items;
-  out += 4;
-  *(uint32_t *)out = time(NULL);
-  out += 4;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      const int etaglen = p->bi_etag ? strlen(p->bi_etag) : 0;
-      di = (blobcache_diskitem_07_t *)out;
-      di->di_key_hash     = p->bi_key_hash;
-      di->di_content_hash = p->bi_content_hash;
-      di->di_lastaccess   = p->bi_lastaccess;
-      di->di_expiry       = p->bi_expiry;
-      di->di_modtime      = p->bi_modtime;
-      di->di_size         = p->bi_size;
-      di->di_flags        = p->bi_flags;
-      di->di_etaglen      = etaglen;
-      di->di_content_type_len = p->bi_content_type_len;
-      out += sizeof(blobcache_diskitem_07_t);
-      if(etaglen) {
-	memcpy(out, p->bi_etag, etaglen);
-	out += etaglen;
+  for(i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_lock(&bs->bs_lock);
+    if(bs->bs_dirty && bs->bs_map != NULL) {
+      blobcache_shardhdr_t *sh = bs_hdr(bs);
+      sh->sh_timestamp = time(NULL);
+      if(bs->bs_loaded) {
+        sh->sh_items = bs->bs_count;
+        sh->sh_size  = bs->bs_size;
       }
-
+      bs_writeback(bs, sh, sizeof(blobcache_shardhdr_t));
+#ifdef BC2_USE_MMAP
+      msync(bs->bs_map, bs->bs_mapsize, wait ? MS_SYNC : MS_ASYNC);
+#endif
+      bs->bs_dirty = 0;
     }
+    hts_mutex_unlock(&bs->bs_lock);
   }
+  index_dirty = 0;
+}
 
-  sha1_decl(shactx);
-  sha1_init(shactx);
-  sha1_update(shactx, base, siz - 20);
-  sha1_final(shactx, out);
 
-  if(write(fd, base, siz) != siz) {
-    TRACE(TRACE_INFO, "blobcache", "Unable to store index file %s -- %s",
-	  filename, strerror(errno));
-  } else {
-    index_dirty = 0;
+/**
+ *
+ */
+static void
+import_item(const blobcache_item_t *src, const uint8_t *etag, int etaglen)
+{
+  blobcache_shard_t *bs = bs_lock(src->bi_key_hash);
+  blobcache_item_t *p;
+  uint32_t slot;
+
+  if(src->bi_key_hash != 0 && bs_find(bs, src->bi_key_hash) == -1 &&
+     !bs_slot_alloc(bs, &slot)) {
+    p = pool_get(bs->bs_pool);
+    *p = *src;
+    p->bi_pending = NULL;
+    p->bi_slot = slot;
+    p->bi_stash = 0;
+    p->bi_compressed = 0;
+
+    if(etaglen > 0 && etaglen <= BC_ETAG_MAX) {
+      p->bi_etag = malloc(etaglen + 1);
+      memcpy(p->bi_etag, etag, etaglen);
+      p->bi_etag[etaglen] = 0;
+    } else {
+      p->bi_etag = NULL;
+    }
+    bs_insert(bs, p);
+    bs->bs_size += p->bi_size;
+    bs_lru_insert(bs, p, BC_SEG_PROBATION);
+    bs_item_store(bs, p);
   }
-
-  free(base);
-  close(fd);
-
+  hts_mutex_unlock(&bs->bs_lock);
 }
 
 
-
 /**
- *
+ * Move items from an index.dat written by older versions into the
+ * shards and remove it
  */
 static void
-load_index(void)
+import_legacy_index(void)
 {
   char filename[PATH_MAX];
   const uint8_t *in;
   void *base;
   int i;
-  blobcache_item_t *p;
+  blobcache_item_t tmp;
   struct stat st;
   uint8_t digest[20];
 
   snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
-  
+
   int fd = open(filename, O_RDONLY, 0);
   if(fd == -1)
     return;
 
+  unlink(filename);
+  need_prune_stale = 1;
+
   if(fstat(fd, &st) || st.st_size <= 20) {
     close(fd);
     return;
@@ -334,8 +1265,6 @@ load_index(void)
 
   switch(magic) {
   case BC2_MAGIC_06:
-    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
-    // FALLTHRU
   case BC2_MAGIC_07: {
     if(*(uint32_t *)in > time(NULL)) {
       TRACE(TRACE_INFO, "blobcache",
@@ -348,7 +1277,6 @@ load_index(void)
   }
 
   case BC2_MAGIC_05:
-    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
     break;
 
   default:
@@ -357,9 +1285,9 @@ load_index(void)
     return;
   }
 
+  TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
 
   for(i = 0; i < items; i++) {
-    p = pool_get(item_pool);
     int etaglen;
 
     switch(magic) {
@@ -367,15 +1295,15 @@ load_index(void)
     case BC2_MAGIC_06: {
       const blobcache_diskitem_06_t *di = (blobcache_diskitem_06_t *)in;
 
-      p->bi_key_hash         = di->di_key_hash;
-      p->bi_content_hash     = di->di_content_hash;
-      p->bi_lastaccess       = di->di_lastaccess;
-      p->bi_expiry           = di->di_expiry;
-      p->bi_modtime          = di->di_modtime;
-      p->bi_size             = di->di_size;
-      p->bi_content_type_len = di->di_content_type_len;
-      p->bi_flags            = 0;
-      etaglen                = di->di_etaglen;
+      tmp.bi_key_hash         = di->di_key_hash;
+      tmp.bi_content_hash     = di->di_content_hash;
+      tmp.bi_lastaccess       = di->di_lastaccess;
+      tmp.bi_expiry           = di->di_expiry;
+      tmp.bi_modtime          = di->di_modtime;
+      tmp.bi_size             = di->di_size;
+      tmp.bi_content_type_len = di->di_content_type_len;
+      tmp.bi_flags            = 0;
+      etaglen                 = di->di_etaglen;
       in += sizeof(blobcache_diskitem_06_t);
     }
       break;
@@ -383,15 +1311,15 @@ load_index(void)
     case BC2_MAGIC_07: {
       const blobcache_diskitem_07_t *di = (blobcache_diskitem_07_t *)in;
 
-      p->bi_key_hash         = di->di_key_hash;
-      p->bi_content_hash     = di->di_content_hash;
-      p->bi_lastaccess       = di->di_lastaccess;
-      p->bi_expiry           = di->di_expiry;
-      p->bi_modtime          = di->di_modtime;
-      p->bi_size             = di->di_size;
-      p->bi_content_type_len = di->di_content_type_len;
-      p->bi_flags            = di->di_flags;
-      etaglen                = di->di_etaglen;
+      tmp.bi_key_hash         = di->di_key_hash;
+      tmp.bi_content_hash     = di->di_content_hash;
+      tmp.bi_lastaccess       = di->di_lastaccess;
+      tmp.bi_expiry           = di->di_expiry;
+      tmp.bi_modtime          = di->di_modtime;
+      tmp.bi_size             = di->di_size;
+      tmp.bi_content_type_len = di->di_content_type_len;
+      tmp.bi_flags            = di->di_flags;
+      etaglen                 = di->di_etaglen;
       in += sizeof(blobcache_diskitem_07_t);
     }
       break;
@@ -399,19 +1327,11 @@ load_index(void)
       abort(); // Prevent compilers whining about etaglen not initialized
     }
 
-    if(etaglen) {
-      p->bi_etag = malloc(etaglen+1);
-      memcpy(p->bi_etag, in, etaglen);
-      p->bi_etag[etaglen] = 0;
-      in += etaglen;
-    } else {
-      p->bi_etag = NULL;
-    }
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
-    current_cache_size += p->bi_size;
+    import_item(&tmp, in, etaglen);
+    in += etaglen;
   }
   free(base);
+  blobcache_sync(1);
 }
 
 
@@ -427,65 +1347,92 @@ blobcache_put(const char *key, const char *stash, buf_t *b,
   uint64_t dk = digest_key(key, stash);
   uint64_t dc = digest_content(b->b_ptr, b->b_size);
   uint32_t now = time(NULL);
+  int64_t expiry = (int64_t)maxage + now;
+  blobcache_stash_t *bst = stash_get(stash);
+  blobcache_shard_t *bs;
   blobcache_item_t *p;
+  uint64_t old_content_hash = 0;
+  uint32_t slot;
+  int idx, r, segment;
 
-  if(etag != NULL && strlen(etag) > 255)
+  if(etag != NULL && strlen(etag) > BC_ETAG_MAX)
     etag = NULL;
 
-  hts_mutex_lock(&cache_lock);
+  bs = bs_lock(dk);
   if(!bcrun) {
-    hts_mutex_unlock(&cache_lock);
+    hts_mutex_unlock(&bs->bs_lock);
     return 0;
   }
 
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      break;
-
-  hts_cond_signal(&cache_cond);
-  index_dirty = 1;
+  idx = bs_find(bs, dk);
+  p = idx == -1 ? NULL : bs->bs_items[idx];
 
   if(p != NULL && p->bi_content_hash == dc && p->bi_size == b->b_size) {
-    p->bi_modtime = mtime;
-    p->bi_expiry = now + maxage;
-    p->bi_lastaccess = now;
-    p->bi_flags = flags;
-    mystrset(&p->bi_etag, etag);
-    hts_mutex_unlock(&cache_lock);
-    return 1;
-  }
+    bs_lru_touch(bs, p);
+    r = 1;
+  } else {
 
-  blobcache_flush_t *bf = pool_get(item_pool);
-  bf->bf_key_hash = dk;
-  bf->bf_buf = buf_retain(b);
-  TAILQ_INSERT_TAIL(&flush_queue, bf, bf_link);
-  hts_cond_signal(&cache_cond);
+    if(p != NULL) {
+      bs_lru_remove(bs, p);
+      old_content_hash = p->bi_content_hash;
+      segment = BC_SEG_PROTECTED;
+    } else {
+      if(bs_slot_alloc(bs, &slot)) {
+        hts_mutex_unlock(&bs->bs_lock);
+        return 0;
+      }
+      p = pool_get(bs->bs_pool);
+      p->bi_key_hash = dk;
+      p->bi_size = 0;
+      p->bi_etag = NULL;
+      p->bi_pending = NULL;
+      p->bi_slot = slot;
+      bs_insert(bs, p);
+      segment = BC_SEG_PROBATION;
+    }
 
-  if(p == NULL) {
-    p = pool_get(item_pool);
-    p->bi_key_hash = dk;
-    p->bi_size = 0;
-    p->bi_content_type_len = 0;
-    p->bi_link = hashvector[dk & ITEM_HASH_MASK];
-    p->bi_etag = NULL;
-    hashvector[dk & ITEM_HASH_MASK] = p;
+    p->bi_content_hash = dc;
+    p->bi_compressed = 0;
+    bs->bs_size -= p->bi_size;
+    p->bi_size = b->b_size;
+    bs->bs_size += p->bi_size;
+    p->bi_content_type_len = b->b_content_type ?
+      strlen(rstr_get(b->b_content_type)) : 0;
+
+    if(p->bi_pending != NULL)
+      buf_release(p->bi_pending);
+    p->bi_pending = buf_retain(b);
+
+    if(flags & BLOBCACHE_IMPORTANT_ITEM)
+      segment = BC_SEG_PROTECTED;
+    bs_lru_insert(bs, p, segment);
+    bs_lru_balance(bs);
+    r = 0;
   }
 
-  int64_t expiry = (int64_t)maxage + now;
-
   p->bi_modtime = mtime;
   mystrset(&p->bi_etag, etag);
   p->bi_expiry = MIN(INT32_MAX, expiry);
   p->bi_lastaccess = now;
-  p->bi_content_hash = dc;
-  current_cache_size -= p->bi_size;
-  p->bi_size = b->b_size;
-  current_cache_size += p->bi_size;
-  p->bi_content_type_len = b->b_content_type ?
-    strlen(rstr_get(b->b_content_type)) : 0;
   p->bi_flags = flags;
+  p->bi_stash = bst - stashes;
+  bs_item_store(bs, p);
+  hts_mutex_unlock(&bs->bs_lock);
+
+  hts_mutex_lock(&cache_lock);
+  if(r == 0 && bcrun) {
+    blobcache_flush_t *bf = pool_get(flush_pool);
+    bf->bf_key_hash = dk;
+    bf->bf_content_hash = dc;
+    bf->bf_old_content_hash = old_content_hash;
+    bf->bf_stash = bst - stashes;
+    bf->bf_buf = buf_retain(b);
+    TAILQ_INSERT_TAIL(&flush_queue, bf, bf_link);
+  }
+  index_dirty = 1;
+  hts_cond_signal(&cache_cond);
   hts_mutex_unlock(&cache_lock);
-  return 0;
+  return r;
 }
 
 
@@ -497,26 +1444,21 @@ blobcache_get(const char *key, const char *stash, int pad,
 	      int *ignore_expiry, char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
-  blobcache_item_t *p, **q;
+  blobcache_stash_t *bst = stash_get(stash);
+  blobcache_shard_t *bs = bs_lock(dk);
+  blobcache_item_t *p;
   char filename[PATH_MAX];
   struct stat st;
   uint32_t now;
+  int idx;
 
-  hts_mutex_lock(&cache_lock);
-
-  if(!bcrun) {
-    p = NULL;
-  } else {
-    for(q = &hashvector[dk & ITEM_HASH_MASK]; (p = *q); q = &p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
-  }
-
-  if(p == NULL) {
-    hts_mutex_unlock(&cache_lock);
+  if(!bcrun || (idx = bs_find(bs, dk)) == -1) {
+    hts_mutex_unlock(&bs->bs_lock);
+    atomic_inc(&bst->bst_misses);
     return NULL;
   }
 
+  p = bs->bs_items[idx];
   now = time(NULL);
 
   int expired = now > p->bi_expiry;
@@ -524,33 +1466,22 @@ blobcache_get(const char *key, const char *stash, int pad,
   if(expired && ignore_expiry == NULL)
     goto bad;
 
-  blobcache_flush_t *bf;
   buf_t *b = NULL;
   int fd = -1;
-  TAILQ_FOREACH_REVERSE(bf, &flush_queue, blobcache_flush_queue, bf_link) {
-    if(bf->bf_key_hash == p->bi_key_hash) {
-      // Item is not yet written to disk
-      b = buf_retain(bf->bf_buf);
-      break;
-    }
-  }
 
-  if(b == NULL) {
+  if(p->bi_pending != NULL) {
+    // Item is not yet written to disk
+    b = buf_retain(p->bi_pending);
+  } else {
     make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
     fd = open(filename, O_RDONLY, 0);
-    if(fd == -1) {
-    bad:
-      *q = p->bi_link;
-      pool_put(item_pool, p);
-      hts_mutex_unlock(&cache_lock);
-      return NULL;
-    }
-
-    if(fstat(fd, &st))
+    if(fd == -1)
       goto bad;
 
-    if(st.st_size != p->bi_size + p->bi_content_type_len) {
-      unlink(filename);
+    if(fstat(fd, &st) ||
+       (p->bi_compressed ? st.st_size <= p->bi_content_type_len :
+        st.st_size != p->bi_size + p->bi_content_type_len)) {
+      close(fd);
       goto bad;
     }
   }
@@ -562,40 +1493,67 @@ blobcache_get(const char *key, const char *stash, int pad,
     *etagp = p->bi_etag ? strdup(p->bi_etag) : NULL;
 
   p->bi_lastaccess = now;
-  index_dirty = 1; // We don't deem it important enough to wakeup on get
+  bs_lru_touch(bs, p);
+  bs_item_store(bs, p);
+  atomic_inc(&bst->bst_hits);
 
   if(ignore_expiry != NULL)
     *ignore_expiry = expired;
 
-  hts_mutex_unlock(&cache_lock);
+  const uint32_t size = p->bi_size;
+  const int content_type_len = p->bi_content_type_len;
+  const int compressed = p->bi_compressed;
+
+  hts_mutex_unlock(&bs->bs_lock);
 
   if(b == NULL) {
 
-    b = buf_create(p->bi_size + pad);
+    b = buf_create(size + pad);
     if(b == NULL) {
       close(fd);
       return NULL;
     }
 
-    if(p->bi_content_type_len) {
-      b->b_content_type = rstr_allocl(NULL, p->bi_content_type_len);
-      if(read(fd, rstr_data(b->b_content_type), p->bi_content_type_len) !=
-	 p->bi_content_type_len) {
+    if(content_type_len) {
+      b->b_content_type = rstr_allocl(NULL, content_type_len);
+      if(read(fd, rstr_data(b->b_content_type), content_type_len) !=
+	 content_type_len) {
 	buf_release(b);
 	close(fd);
 	return NULL;
       }
     }
 
-    if(read(fd, b->b_ptr, p->bi_size) != p->bi_size) {
+    if(compressed) {
+      const size_t zlen = st.st_size - content_type_len;
+      uLongf outlen = size;
+      void *zdata = mymalloc(zlen);
+
+      if(zdata == NULL || read(fd, zdata, zlen) != zlen ||
+         uncompress((void *)b->b_ptr, &outlen, zdata, zlen) != Z_OK ||
+         outlen != size) {
+        free(zdata);
+        buf_release(b);
+        close(fd);
+        return NULL;
+      }
+      free(zdata);
+
+    } else if(read(fd, b->b_ptr, size) != size) {
       buf_release(b);
       close(fd);
       return NULL;
     }
-    memset(b->b_ptr + p->bi_size, 0, pad);
+    memset(b->b_ptr + size, 0, pad);
     close(fd);
   }
   return b;
+
+ bad:
+  bs_item_destroy(bs, idx);
+  hts_mutex_unlock(&bs->bs_lock);
+  atomic_inc(&bst->bst_misses);
+  return NULL;
 }
 
 
@@ -606,22 +1564,16 @@ blobcache_get(const char *key, const char *stash, int pad,
  *
  */
 int
-blobcache_get_meta(const char *key, const char *stash, 
+blobcache_get_meta(const char *key, const char *stash,
 		   char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
+  blobcache_shard_t *bs = bs_lock(dk);
   blobcache_item_t *p;
-  int r;
-  hts_mutex_lock(&cache_lock);
-  if(!bcrun) {
-    p = NULL;
-  } else {
-    for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
-  }
+  int idx, r;
 
-  if(p != NULL) {
+  if(bcrun && (idx = bs_find(bs, dk)) != -1) {
+    p = bs->bs_items[idx];
     r = 0;
 
     if(mtimep != NULL)
@@ -634,26 +1586,28 @@ blobcache_get_meta(const char *key, const char *stash,
     r = -1;
   }
 
-  hts_mutex_unlock(&cache_lock);
+  hts_mutex_unlock(&bs->bs_lock);
   return r;
 }
 
 
 /**
- * Assume we're locked
+ *
  */
-static blobcache_item_t *
-lookup_item(uint64_t dk)
+static int
+item_exists(uint64_t dk)
 {
-  blobcache_item_t *p;
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      return p;
-  return NULL;
+  blobcache_shard_t *bs = bs_lock(dk);
+  int r = bs_find(bs, dk) != -1;
+  hts_mutex_unlock(&bs->bs_lock);
+  return r;
 }
 
+
 /**
- *
+ * Remove files not referenced by the index. Only needed when index
+ * records have been lost, otherwise files are removed together with
+ * their records
  */
 static void
 prune_stale(void)
@@ -683,53 +1637,56 @@ prune_stale(void)
 		     gconf.cache_path, de1->d_name,
 		     de2->d_name);
 
+            if(strlen(de2->d_name) == 17 &&
+               (de2->d_name[0] == 'c' || de2->d_name[0] == 'z')) {
+              // Blob, garbage if no key links to it
+              struct stat st;
+              if(!stat(path3, &st) && st.st_nlink == 1)
+                unlink(path3);
+              continue;
+            }
+
 	    if(sscanf(de2->d_name, "%016"PRIx64, &k) != 1 ||
-	       lookup_item(k) == NULL) {
+	       !item_exists(k)) {
 	      TRACE(TRACE_DEBUG, "Blobcache", "Removed stale file %s", path3);
 	      unlink(path3);
 	    }
 	  }
 	}
 	closedir(d2);
+        rmdir(path2);
       }
-      rmdir(path2);
     }
   }
   closedir(d1);
-}  
-
-
+}
 
 
 /**
- *
+ * Lower rank is evicted first
  */
-static void
-prune_item(blobcache_item_t *p)
+static uint64_t
+victim_rank(const blobcache_item_t *p)
 {
-  char filename[PATH_MAX];
-  make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
-  unlink(filename);
-  pool_put(item_pool, p);
+  return
+    (uint64_t)!!(p->bi_flags & BLOBCACHE_IMPORTANT_ITEM) << 33 |
+    (uint64_t)p->bi_segment << 32 |
+    p->bi_lastaccess;
 }
 
 
 /**
- *
+ * LRU tail of the shard, probation is drained before protected
  */
-static int
-accesstimecmp(const void *A, const void *B)
+static blobcache_item_t *
+bs_lru_victim(const blobcache_shard_t *bs)
 {
-  const blobcache_item_t *a = *(const blobcache_item_t **)A;
-  const blobcache_item_t *b = *(const blobcache_item_t **)B;
-
-  const int a_imp = !!(a->bi_flags & BLOBCACHE_IMPORTANT_ITEM);
-  const int b_imp = !!(b->bi_flags & BLOBCACHE_IMPORTANT_ITEM);
-
-  if(a_imp != b_imp)
-    return a_imp - b_imp;
+  blobcache_item_t *p;
 
-  return a->bi_lastaccess - b->bi_lastaccess;
+  p = TAILQ_LAST(&bs->bs_lru[BC_SEG_PROBATION], blobcache_item_queue);
+  if(p == NULL)
+    p = TAILQ_LAST(&bs->bs_lru[BC_SEG_PROTECTED], blobcache_item_queue);
+  return p;
 }
 
 
@@ -737,45 +1694,69 @@ accesstimecmp(const void *A, const void *B)
  *
  */
 static void
-prune_to_size(uint64_t maxsize)
+blobcache_set_maxsize(uint64_t maxsize)
 {
-  int i, tot = 0, j = 0;
-  blobcache_item_t *p, **sv;
+  int i;
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++)
-    for(p = hashvector[i]; p != NULL; p = p->bi_link)
-      tot++;
+  blobcache_maxsize = maxsize;
 
-  sv = malloc(sizeof(blobcache_item_t *) * tot);
-  current_cache_size = 0;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      sv[j++] = p;
-      current_cache_size += p->bi_size;
-    }
-    hashvector[i] = NULL;
+  for(i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_lock(&bs->bs_lock);
+    bs->bs_protected_max = maxsize * 2 / 3 / BC_SHARDS;
+    if(bs->bs_loaded)
+      bs_lru_balance(bs);
+    hts_mutex_unlock(&bs->bs_lock);
   }
+}
 
-  assert(j == tot);
 
-  qsort(sv, j, sizeof(blobcache_item_t *), accesstimecmp);
-  for(i = 0; i < j; i++) {
-    p = sv[i];
-    if(current_cache_size < maxsize)
+/**
+ * Evict until the cache fits. The shard with the lowest ranked tail is
+ * drained until its tail ranks above the runner up
+ */
+static void
+blobcache_evict(uint64_t maxsize)
+{
+  uint64_t size = blobcache_size(NULL);
+  uint64_t rank, best_rank, next_rank;
+  blobcache_shard_t *bs;
+  blobcache_item_t *p;
+  int i, best;
+
+  while(size > maxsize) {
+    best = -1;
+    best_rank = next_rank = UINT64_MAX;
+
+    for(i = 0; i < BC_SHARDS; i++) {
+      bs = &shards[i];
+      bs_enter(bs);
+      if((p = bs_lru_victim(bs)) != NULL) {
+        rank = victim_rank(p);
+        if(rank < best_rank) {
+          next_rank = best_rank;
+          best_rank = rank;
+          best = i;
+        } else if(rank < next_rank) {
+          next_rank = rank;
+        }
+      }
+      hts_mutex_unlock(&bs->bs_lock);
+    }
+
+    if(best == -1)
       break;
-    current_cache_size -= p->bi_size;
-    prune_item(p);
-    index_dirty = 1;
-  }
 
-  for(; i < j; i++) {
-    p = sv[i];
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
+    bs = &shards[best];
+    bs_enter(bs);
+    while(size > maxsize && (p = bs_lru_victim(bs)) != NULL &&
+          victim_rank(p) <= next_rank) {
+      size -= p->bi_size;
+      atomic_inc(&stashes[p->bi_stash].bst_evictions);
+      bs_item_destroy(bs, bs_find(bs, p->bi_key_hash));
+    }
+    hts_mutex_unlock(&bs->bs_lock);
   }
-
-  free(sv);
-  save_index();
 }
 
 
@@ -826,26 +1807,29 @@ blobcache_prune_old(void)
   unlink(path);
   snprintf(path, sizeof(path), "%s/cachedb/cache.db-wal", gconf.cache_path);
   unlink(path);
-}  
+}
 
 static void
 cache_clear(void *opaque, prop_event_t event, ...)
 {
   int i;
-  blobcache_item_t *p, *n;
+  unsigned int k;
 
   hts_mutex_lock(&cache_lock);
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = n) {
-      n = p->bi_link;
-      prune_item(p);
-      index_dirty = 1;
+  for(i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    bs_enter(bs);
+    // Removal may shift another item into slot k so only advance when empty
+    for(k = 0; k <= bs->bs_mask;) {
+      if(bs->bs_items[k] != NULL)
+        bs_item_destroy(bs, k);
+      else
+        k++;
     }
-    hashvector[i] = NULL;
+    hts_mutex_unlock(&bs->bs_lock);
   }
-  current_cache_size = 0;
-  save_index();
+  blobcache_sync(0);
   hts_mutex_unlock(&cache_lock);
   notify_add(NULL, NOTIFY_INFO, NULL, 3, _("Cache cleared"));
 }
@@ -859,8 +1843,18 @@ static void *
 flushthread(void *aux)
 {
   blobcache_flush_t *bf;
+  blobcache_shard_t *bs;
+  blobcache_item_t *p;
+  uint64_t maxsize;
+  int idx;
+
+  if(need_prune_stale)
+    prune_stale();
+
+  blobcache_evict(blobcache_maxsize);
 
   hts_mutex_lock(&cache_lock);
+  index_dirty = 1;
 
   while(bcrun) {
 
@@ -868,7 +1862,7 @@ flushthread(void *aux)
 
       if(index_dirty) {
         if(hts_cond_wait_timeout(&cache_cond, &cache_lock, 5000))
-          save_index();
+          blobcache_sync(0);
       } else {
         hts_cond_wait(&cache_cond, &cache_lock);
       }
@@ -876,45 +1870,88 @@ flushthread(void *aux)
     }
 
     hts_mutex_unlock(&cache_lock);
-    char filename[PATH_MAX];
-    make_filename(filename, sizeof(filename), bf->bf_key_hash, 1);
     buf_t *b = bf->bf_buf;
-
-    int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-    if(fd != -1) {
-
-      if(b->b_content_type != NULL) {
-	const char *str = rstr_get(b->b_content_type);
-	size_t len = strlen(str);
-	if(write(fd, str, len) != len)
-	  unlink(filename);
-      }
-
-      if(write(fd, b->b_ptr, b->b_size) != b->b_size)
-        unlink(filename);
-
-      if(close(fd))
-        unlink(filename);
+    int compressed = bc_write_item(bf);
+
+    bs = bs_lock(bf->bf_key_hash);
+    idx = bs_find(bs, bf->bf_key_hash);
+    if(idx == -1) {
+      // Item was removed while we were writing
+      char filename[PATH_MAX];
+      make_filename(filename, sizeof(filename), bf->bf_key_hash, 0);
+      unlink(filename);
+      bc_blob_release(bf->bf_content_hash);
+    } else if((p = bs->bs_items[idx])->bi_pending == b) {
+      p->bi_pending = NULL;
+      p->bi_compressed = compressed == 1;
+      bs_item_store(bs, p);
+      buf_release(b);
     }
+    hts_mutex_unlock(&bs->bs_lock);
+
     hts_mutex_lock(&cache_lock);
 
     assert(TAILQ_FIRST(&flush_queue) == bf);
     TAILQ_REMOVE(&flush_queue, bf, bf_link);
     buf_release(bf->bf_buf);
-    pool_put(item_pool, bf);
+    pool_put(flush_pool, bf);
 
-    uint64_t maxsize = blobcache_compute_maxsize();
+    uint64_t current_cache_size = blobcache_size(NULL);
+    maxsize = blobcache_compute_maxsize(current_cache_size);
+    if(maxsize != blobcache_maxsize)
+      blobcache_set_maxsize(maxsize);
 
-    if(maxsize < current_cache_size)
-      prune_to_size(maxsize);
+    if(maxsize < current_cache_size) {
+      hts_mutex_unlock(&cache_lock);
+      blobcache_evict(maxsize);
+      hts_mutex_lock(&cache_lock);
+      index_dirty = 1;
+    }
   }
-  save_index();
+  blobcache_sync(1);
   hts_mutex_unlock(&cache_lock);
   return NULL;
 }
 
-static_assert(sizeof(blobcache_flush_t) <= sizeof(blobcache_item_t),
-              "blobcache_flush too big");
+
+/**
+ * Sizes are in kB
+ */
+static void
+blobcache_stats_update(callout_t *c, void *aux)
+{
+  blobcache_stash_t *bst;
+  int i, items;
+  uint64_t size = blobcache_size(&items);
+
+  callout_arm(&blobcache_stats_timer, blobcache_stats_update, NULL, 5);
+
+  prop_set_int(blobcache_prop_items, items);
+  prop_set_int(blobcache_prop_size, size / 1000);
+  prop_set_int(blobcache_prop_maxsize, blobcache_maxsize / 1000);
+
+  for(i = 0; i < 256; i++) {
+    bst = &stashes[i];
+    if(bst->bst_name == NULL)
+      continue;
+
+    if(bst->bst_prop_hits == NULL) {
+      prop_t *r = prop_create(blobcache_prop_stashes, bst->bst_name);
+      bst->bst_prop_hits      = prop_create(r, "hits");
+      bst->bst_prop_misses    = prop_create(r, "misses");
+      bst->bst_prop_evictions = prop_create(r, "evictions");
+      bst->bst_prop_dedup_saved    = prop_create(r, "dedupSaved");
+      bst->bst_prop_compress_saved = prop_create(r, "compressionSaved");
+    }
+    prop_set_int(bst->bst_prop_hits,      atomic_get(&bst->bst_hits));
+    prop_set_int(bst->bst_prop_misses,    atomic_get(&bst->bst_misses));
+    prop_set_int(bst->bst_prop_evictions, atomic_get(&bst->bst_evictions));
+    prop_set_int(bst->bst_prop_dedup_saved, bst->bst_dedup_saved / 1000);
+    prop_set_int(bst->bst_prop_compress_saved,
+                 bst->bst_compress_saved / 1000);
+  }
+}
+
 
 /**
  *
@@ -923,6 +1960,7 @@ void
 blobcache_init(void)
 {
   char buf[256];
+  int i, items;
 
   TAILQ_INIT(&flush_queue);
 
@@ -934,24 +1972,40 @@ blobcache_init(void)
 
   hts_mutex_init(&cache_lock);
   hts_cond_init(&cache_cond, &cache_lock);
-  item_pool = pool_create("blobcacheitems", sizeof(blobcache_item_t), 0);
-
+  flush_pool = pool_create("blobcacheflush", sizeof(blobcache_flush_t), 0);
+
+  for(i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    bs->bs_index = i;
+    hts_mutex_init(&bs->bs_lock);
+    TAILQ_INIT(&bs->bs_lru[BC_SEG_PROBATION]);
+    TAILQ_INIT(&bs->bs_lru[BC_SEG_PROTECTED]);
+    bs->bs_pool = pool_create("blobcacheitems", sizeof(blobcache_item_t), 0);
+    bs_open(bs);
+  }
 
-  load_index();
-  prune_stale();
+  import_legacy_index();
 
-  uint64_t maxsize = blobcache_compute_maxsize();
-  prune_to_size(maxsize);
+  uint64_t current_cache_size = blobcache_size(&items);
+  uint64_t maxsize = blobcache_compute_maxsize(current_cache_size);
+  blobcache_set_maxsize(maxsize);
 
   TRACE(TRACE_INFO, "blobcache",
 	"Initialized: %d items consuming %.2f MB "
         "(out of maximum %.2f MB) on disk in %s",
-	pool_num(item_pool), current_cache_size / 1000000.0,
+	items, current_cache_size / 1000000.0,
         maxsize / 1000000.0, buf);
 
   settings_create_action(gconf.settings_general, _p("Clear cached files"),
 			 cache_clear, NULL, 0, NULL);
 
+  blobcache_prop_root    = prop_create(prop_get_global(), "blobcache");
+  blobcache_prop_items   = prop_create(blobcache_prop_root, "items");
+  blobcache_prop_size    = prop_create(blobcache_prop_root, "size");
+  blobcache_prop_maxsize = prop_create(blobcache_prop_root, "maxSize");
+  blobcache_prop_stashes = prop_create(blobcache_prop_root, "stashes");
+  blobcache_stats_update(NULL, NULL);
+
   hts_thread_create_joinable("blobcache", &bcthread, flushthread, NULL,
                              THREAD_PRIO_BGTASK);
 }
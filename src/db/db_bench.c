@@ -0,0 +1,287 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+/**
+ * Database contention benchmark
+ *
+ * Replays the load of a library scan while the user is browsing. A
+ * scratch database with an item table similar to the one in metadb is
+ * created in the cache directory.
+ *
+ * DB_BENCH_WRITERS threads each rewrite a directory worth of items
+ * per transaction (like the scanner and indexer storing probe results).
+ * DB_BENCH_BROWSERS threads list random directories in read
+ * transactions and measure how long each listing takes.
+ *
+ * Enabled with --enable-dbbench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "showtime.h"
+#include "misc/callout.h"
+#include "db_support.h"
+
+#ifndef DB_BENCH_WRITERS
+#define DB_BENCH_WRITERS 3
+#endif
+
+#ifndef DB_BENCH_BROWSERS
+#define DB_BENCH_BROWSERS 4
+#endif
+
+#define DB_BENCH_DIRS     256
+#define DB_BENCH_DIRSIZE  100
+#define DB_BENCH_INTERVAL 5
+
+static db_pool_t *bench_pool;
+
+/**
+ * Per-thread counters, only written by the owning thread
+ */
+typedef struct bench_counter {
+  volatile unsigned int bc_ops;
+  volatile unsigned int bc_errors;
+  volatile int64_t bc_latency_sum;
+  volatile int64_t bc_latency_max;
+  char bc_pad[40];
+} bench_counter_t;
+
+static bench_counter_t bench_writers[DB_BENCH_WRITERS];
+static bench_counter_t bench_browsers[DB_BENCH_BROWSERS];
+
+static callout_t bench_timer;
+static int64_t bench_last_report;
+
+
+/**
+ * Rewrite all items in a directory, returns 0 on success
+ */
+static int
+bench_write_dir(sqlite3 *db, int dir, int mtime)
+{
+  sqlite3_stmt *stmt;
+  char url[64];
+  int i, rc;
+
+  rc = db_prepare(db, &stmt,
+                  "INSERT OR REPLACE INTO item(url, parent, mtime) "
+                  "VALUES (?1, ?2, ?3)");
+  if(rc != SQLITE_OK)
+    return -1;
+
+  for(i = 0; i < DB_BENCH_DIRSIZE; i++) {
+    snprintf(url, sizeof(url), "bench://dir%d/file%d", dir, i);
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, dir);
+    sqlite3_bind_int(stmt, 3, mtime);
+    rc = db_step(stmt);
+    sqlite3_reset(stmt);
+    if(rc != SQLITE_DONE)
+      break;
+  }
+  db_finalize(stmt);
+  return rc == SQLITE_DONE ? 0 : -1;
+}
+
+
+/**
+ *
+ */
+static void *
+bench_writer(void *aux)
+{
+  int id = (intptr_t)aux;
+  unsigned int seed = id + 1000;
+  int mtime = 0;
+
+  while(1) {
+    sqlite3 *db = db_pool_get(bench_pool);
+    if(db == NULL)
+      break;
+
+    if(db_begin(db)) {
+      bench_writers[id].bc_errors++;
+    } else if(bench_write_dir(db, rand_r(&seed) % DB_BENCH_DIRS, mtime++)) {
+      db_rollback(db);
+      bench_writers[id].bc_errors++;
+    } else {
+      db_commit(db);
+      bench_writers[id].bc_ops++;
+    }
+    db_pool_put(bench_pool, db);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void *
+bench_browser(void *aux)
+{
+  int id = (intptr_t)aux;
+  bench_counter_t *bc = &bench_browsers[id];
+  unsigned int seed = id + 2000;
+  sqlite3_stmt *stmt;
+
+  while(1) {
+    sqlite3 *db = db_pool_get(bench_pool);
+    if(db == NULL)
+      break;
+
+    int64_t ts = showtime_get_ts();
+    int rc = -1;
+
+    if(!db_begin_read(db)) {
+      rc = db_prepare(db, &stmt,
+                      "SELECT id, url, mtime FROM item WHERE parent = ?1");
+      if(rc == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, rand_r(&seed) % DB_BENCH_DIRS);
+        while((rc = db_step(stmt)) == SQLITE_ROW) {}
+        db_finalize(stmt);
+      }
+      db_rollback(db);
+    }
+    db_pool_put(bench_pool, db);
+
+    if(rc != SQLITE_DONE) {
+      bc->bc_errors++;
+      continue;
+    }
+
+    int64_t d = showtime_get_ts() - ts;
+    bc->bc_latency_sum += d;
+    if(d > bc->bc_latency_max)
+      bc->bc_latency_max = d;
+    bc->bc_ops++;
+  }
+  return NULL;
+}
+
+
+/**
+ * Sum counters and reset the max latency
+ */
+static void
+bench_collect(bench_counter_t *bc, int num, unsigned int *ops,
+              unsigned int *errors, int64_t *latency_sum, int64_t *latency_max)
+{
+  *ops = *errors = 0;
+  *latency_sum = *latency_max = 0;
+
+  for(int i = 0; i < num; i++) {
+    *ops         += bc[i].bc_ops;
+    *errors      += bc[i].bc_errors;
+    *latency_sum += bc[i].bc_latency_sum;
+    if(bc[i].bc_latency_max > *latency_max)
+      *latency_max = bc[i].bc_latency_max;
+    bc[i].bc_latency_max = 0;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+bench_report(callout_t *c, void *aux)
+{
+  static unsigned int last_writes, last_browses;
+  static int64_t last_latency_sum;
+  unsigned int writes, browses, errors, e;
+  int64_t lsum, lmax, now = showtime_get_ts();
+  int64_t delta = (now - bench_last_report) ?: 1;
+
+  bench_collect(bench_writers, DB_BENCH_WRITERS, &writes, &errors,
+                &lsum, &lmax);
+  bench_collect(bench_browsers, DB_BENCH_BROWSERS, &browses, &e,
+                &lsum, &lmax);
+  errors += e;
+
+  unsigned int nbrowse = browses - last_browses;
+
+#define RATE(x) (int)((x) * 1000000LL / delta)
+
+  TRACE(TRACE_INFO, "DBBENCH",
+        "dirs/s: %d, listings/s: %d, "
+        "listing latency avg: %d us max: %d us, errors: %u",
+        RATE(writes - last_writes),
+        RATE(nbrowse),
+        nbrowse ? (int)((lsum - last_latency_sum) / nbrowse) : 0,
+        (int)lmax,
+        errors);
+
+#undef RATE
+
+  last_writes = writes;
+  last_browses = browses;
+  last_latency_sum = lsum;
+  bench_last_report = now;
+  callout_arm(&bench_timer, bench_report, NULL, DB_BENCH_INTERVAL);
+}
+
+
+/**
+ *
+ */
+static void
+db_bench_init(void)
+{
+  char path[1024];
+  sqlite3 *db;
+  int i;
+
+  if(gconf.cache_path == NULL)
+    return;
+
+  snprintf(path, sizeof(path), "%s/dbbench.db", gconf.cache_path);
+  bench_pool = db_pool_create(path, DB_BENCH_BROWSERS + DB_BENCH_WRITERS);
+
+  if((db = db_pool_get(bench_pool)) == NULL)
+    return;
+
+  db_one_statement(db,
+                   "CREATE TABLE IF NOT EXISTS item ("
+                   "id INTEGER PRIMARY KEY, "
+                   "url TEXT UNIQUE, "
+                   "parent INTEGER, "
+                   "mtime INTEGER)", NULL);
+  db_one_statement(db,
+                   "CREATE INDEX IF NOT EXISTS item_parent_idx "
+                   "ON item(parent)", NULL);
+  db_pool_put(bench_pool, db);
+
+  for(i = 0; i < DB_BENCH_WRITERS; i++)
+    hts_thread_create_detached("dbbench writer", bench_writer,
+                               (void *)(intptr_t)i, THREAD_PRIO_BGTASK);
+
+  for(i = 0; i < DB_BENCH_BROWSERS; i++)
+    hts_thread_create_detached("dbbench browser", bench_browser,
+                               (void *)(intptr_t)i, THREAD_PRIO_BGTASK);
+
+  bench_last_report = showtime_get_ts();
+  callout_arm(&bench_timer, bench_report, NULL, DB_BENCH_INTERVAL);
+}
+
+INITME(INIT_GROUP_API, db_bench_init);
@@ -24,8 +24,12 @@
 #include <unistd.h>
 
 #include "showtime.h"
+#include "arch/atomic.h"
 #include "fileaccess/fileaccess.h"
 #include "misc/minmax.h"
+#include "misc/callout.h"
+#include "misc/queue.h"
+#include "prop/prop.h"
 
 #include "db_support.h"
 
@@ -88,12 +92,266 @@ db_step(sqlite3_stmt *pStmt)
   return rc;
 }
 
+
+/**
+ * Prepared statement cache
+ *
+ * Each handle opened with db_open() gets a cache of idle statements.
+ * db_finalize() resets a statement and parks it in the cache instead of
+ * finalizing it and db_prepare() picks it up again if the SQL text
+ * matches. A handle is only used by one thread at a time so a statement
+ * can not be in use by someone else while it sits in the cache, and the
+ * cache itself needs no locking.
+ *
+ * The cache is attached to the connection as the argument of its
+ * rollback hook. sqlite3_rollback_hook() returns the previous argument,
+ * so it can be found from the sqlite3 pointer without any global lookup.
+ * (The bundled sqlite predates sqlite3_set_clientdata())
+ *
+ * The cache must be flushed before the handle is closed since sqlite
+ * refuses to close a handle with unfinalized statements, so all handles
+ * from db_open() must be closed with db_close()
+ */
+#define DB_STMT_CACHE_SIZE 32
+
+#define DB_BUSY_TIMEOUT 10000 // ms
+
+/**
+ * Connection pool
+ *
+ * All connections run in WAL mode without shared cache, so readers work
+ * on their own snapshot and never wait for a writer. Write transactions
+ * are started with BEGIN IMMEDIATE which takes the database write lock
+ * up front, so there is only ever one writer per database. Other writers
+ * wait for it in the busy handler instead of failing halfway through
+ * their transaction.
+ */
+struct db_pool {
+  int dp_size;
+  int dp_closed;
+  char *dp_path;
+  hts_mutex_t dp_mutex;
+  sqlite3 *dp_pool[0];
+};
+
+
+typedef struct db_handle {
+  int dh_count;
+
+  unsigned int dh_hits;
+  unsigned int dh_misses;
+  unsigned int dh_evictions;
+
+  // Most recently used first
+  struct {
+    sqlite3_stmt *stmt;
+    unsigned int hash;
+  } dh_idle[DB_STMT_CACHE_SIZE];
+
+} db_handle_t;
+
+static atomic_t stmt_cache_hits;
+static atomic_t stmt_cache_misses;
+static atomic_t stmt_cache_evictions;
+
+static callout_t stmt_cache_stats_timer;
+static prop_t *stmt_cache_prop_hits;
+static prop_t *stmt_cache_prop_misses;
+static prop_t *stmt_cache_prop_evictions;
+static prop_t *stmt_cache_prop_hitrate;
+
+
+/**
+ *
+ */
+static unsigned int
+stmt_hash(const char *sql)
+{
+  unsigned int h = 5381;
+  while(*sql)
+    h = h * 33 + *sql++;
+  return h;
+}
+
+
+/**
+ *
+ */
+static void
+db_handle_rollback(void *opaque)
+{
+}
+
+
+/**
+ * Returns the handle state of 'db' or NULL if it was not opened with
+ * db_open()
+ */
+static db_handle_t *
+db_handle_get(sqlite3 *db)
+{
+  db_handle_t *dh = sqlite3_rollback_hook(db, db_handle_rollback, NULL);
+  sqlite3_rollback_hook(db, dh ? db_handle_rollback : NULL, dh);
+  return dh;
+}
+
+
+/**
+ * Returns an idle statement for 'sql' or NULL if there is none
+ */
+static sqlite3_stmt *
+stmt_cache_get(sqlite3 *db, const char *sql)
+{
+  db_handle_t *dh;
+  sqlite3_stmt *stmt = NULL;
+  unsigned int hash;
+  int i;
+
+  if((dh = db_handle_get(db)) == NULL)
+    return NULL;
+
+  hash = stmt_hash(sql);
+
+  for(i = 0; i < dh->dh_count; i++) {
+    if(dh->dh_idle[i].hash == hash &&
+       !strcmp(sqlite3_sql(dh->dh_idle[i].stmt), sql)) {
+      stmt = dh->dh_idle[i].stmt;
+      dh->dh_count--;
+      memmove(&dh->dh_idle[i], &dh->dh_idle[i + 1],
+              (dh->dh_count - i) * sizeof(dh->dh_idle[0]));
+      break;
+    }
+  }
+
+  if(stmt != NULL) {
+    dh->dh_hits++;
+    atomic_inc(&stmt_cache_hits);
+  } else {
+    dh->dh_misses++;
+    atomic_inc(&stmt_cache_misses);
+  }
+  return stmt;
+}
+
+
+/**
+ * Reset a statement and return it to the cache of its handle. If the
+ * handle does not have a cache the statement is finalized
+ */
+int
+db_finalize(sqlite3_stmt *stmt)
+{
+  db_handle_t *dh;
+  int rc;
+
+  if(stmt == NULL)
+    return SQLITE_OK;
+
+  rc = sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  if((dh = db_handle_get(sqlite3_db_handle(stmt))) == NULL) {
+    sqlite3_finalize(stmt);
+    return rc;
+  }
+
+  if(dh->dh_count == DB_STMT_CACHE_SIZE) {
+    sqlite3_finalize(dh->dh_idle[DB_STMT_CACHE_SIZE - 1].stmt);
+    dh->dh_count--;
+    dh->dh_evictions++;
+    atomic_inc(&stmt_cache_evictions);
+  }
+
+  memmove(&dh->dh_idle[1], &dh->dh_idle[0],
+          dh->dh_count * sizeof(dh->dh_idle[0]));
+  dh->dh_idle[0].stmt = stmt;
+  dh->dh_idle[0].hash = stmt_hash(sqlite3_sql(stmt));
+  dh->dh_count++;
+  return rc;
+}
+
+
+/**
+ *
+ */
+static void
+db_handle_create(sqlite3 *db)
+{
+  db_handle_t *dh = calloc(1, sizeof(db_handle_t));
+  sqlite3_rollback_hook(db, db_handle_rollback, dh);
+}
+
+
+/**
+ * Finalize all cached statements and close the handle
+ */
+void
+db_close(sqlite3 *db)
+{
+  db_handle_t *dh;
+  int i;
+
+  if(db == NULL)
+    return;
+
+  if((dh = db_handle_get(db)) != NULL) {
+    sqlite3_rollback_hook(db, NULL, NULL);
+
+    for(i = 0; i < dh->dh_count; i++)
+      sqlite3_finalize(dh->dh_idle[i].stmt);
+
+    TRACE(TRACE_DEBUG, "DB",
+          "Closing handle, statement cache hits:%u misses:%u evictions:%u",
+          dh->dh_hits, dh->dh_misses, dh->dh_evictions);
+    free(dh);
+  }
+
+  if(sqlite3_close(db) != SQLITE_OK)
+    TRACE(TRACE_ERROR, "DB", "Unable to close handle -- %s",
+          sqlite3_errmsg(db));
+}
+
+
+/**
+ *
+ */
+static void
+stmt_cache_stats_update(callout_t *c, void *aux)
+{
+  static unsigned int last_hits, last_misses;
+
+  unsigned int hits      = atomic_get(&stmt_cache_hits);
+  unsigned int misses    = atomic_get(&stmt_cache_misses);
+  unsigned int evictions = atomic_get(&stmt_cache_evictions);
+
+  if(hits != last_hits || misses != last_misses) {
+    prop_set_int(stmt_cache_prop_hits, hits);
+    prop_set_int(stmt_cache_prop_misses, misses);
+    prop_set_int(stmt_cache_prop_evictions, evictions);
+    prop_set_float(stmt_cache_prop_hitrate,
+                   hits + misses ? (float)hits / (hits + misses) : 0);
+    last_hits = hits;
+    last_misses = misses;
+  }
+
+  callout_arm(&stmt_cache_stats_timer, stmt_cache_stats_update, NULL, 5);
+}
+
+
+/**
+ * If a matching statement is idle in the handle's cache it is handed
+ * out, otherwise a new one is prepared. Statements should be returned
+ * with db_finalize()
+ */
 int
 db_preparex(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql, 
 	    const char *file, int line)
 {
   int rc;
 
+  if((*ppStmt = stmt_cache_get(db, zSql)) != NULL)
+    return SQLITE_OK;
+
   while(SQLITE_LOCKED==(rc = sqlite3_prepare_v2(db, zSql, -1, ppStmt, NULL))) {
     rc = wait_for_unlock_notify(db);
     if( rc!=SQLITE_OK ) break;
@@ -145,7 +403,7 @@ db_get_int64_from_query(sqlite3 *db, const char *query, int64_t *v)
 
   rc = sqlite3_step(stmt);
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     goto restart;
   }
 
@@ -156,7 +414,7 @@ db_get_int64_from_query(sqlite3 *db, const char *query, int64_t *v)
     rval = -1;
   }
 
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   return rval;
 }
 
@@ -176,8 +434,22 @@ db_get_int_from_query(sqlite3 *db, const char *query, int *v)
 
 
 
+/**
+ * Start a write transaction. Waits (up to DB_BUSY_TIMEOUT) for any other
+ * writer on the same database to finish first
+ */
 int
 db_begin0(sqlite3 *db, const char *src)
+{
+  return db == NULL || db_one_statement(db, "BEGIN IMMEDIATE;", src);
+}
+
+
+/**
+ * Start a transaction that will only read. Never waits for writers
+ */
+int
+db_begin_read0(sqlite3 *db, const char *src)
 {
   return db == NULL || db_one_statement(db, "BEGIN;", src);
 }
@@ -186,20 +458,26 @@ db_begin0(sqlite3 *db, const char *src)
 int
 db_commit0(sqlite3 *db, const char *src)
 {
-  return  db == NULL || db_one_statement(db, "COMMIT;", src);
+  if(db == NULL)
+    return 1;
+
+  return db_one_statement(db, "COMMIT;", src);
 }
 
 
 int
 db_rollback0(sqlite3 *db, const char *src)
 {
-  return  db == NULL || db_one_statement(db, "ROLLBACK;", src);
+  if(db == NULL)
+    return 1;
+
+  return db_one_statement(db, "ROLLBACK;", src);
 }
 
 int
 db_rollback_deadlock0(sqlite3 *db, const char *src)
 {
-  int r = db == NULL || db_one_statement(db, "ROLLBACK;", src);
+  int r = db_rollback0(db, src);
   TRACE(TRACE_DEBUG, "DB", "Rollback due to deadlock, and retrying");
   usleep(100000);
   return r;
@@ -232,8 +510,6 @@ db_upgrade_schema(sqlite3 *db, const char *schemadir, const char *dbname,
     detach[0] = 0;
   }
 
-  db_one_statement(db, "pragma journal_mode=wal;", NULL);
-
   if(db_get_int_from_query(db, "pragma user_version", &ver)) {
     TRACE(TRACE_ERROR, "DB", "%s: Unable to query db version", dbname);
     if(detach[0]) db_one_statement(db, detach, NULL);
@@ -344,17 +620,6 @@ db_upgrade_schema(sqlite3 *db, const char *schemadir, const char *dbname,
 }
 
 
-/**
- *
- */
-struct db_pool {
-  int dp_size;
-  int dp_closed;
-  char *dp_path;
-  hts_mutex_t dp_mutex;
-  sqlite3 *dp_pool[0];
-};
-
 /**
  *
  */
@@ -382,7 +647,7 @@ db_open(const char *path, int flags)
 
   rc = sqlite3_open_v2(path, &db,
 		       SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
-		       SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_SHAREDCACHE,
+		       SQLITE_OPEN_NOMUTEX,
 		       NULL);
 
   if(rc) {
@@ -392,6 +657,13 @@ db_open(const char *path, int flags)
     return NULL;
   }
 
+  db_handle_create(db);
+
+  // Writers wait here for the write lock held by another connection
+  sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+  db_one_statement(db, "PRAGMA journal_mode=wal", path);
+
   db_one_statement(db, "PRAGMA synchronous = normal", path);
   if(flags & DB_OPEN_CASE_SENSITIVE_LIKE)
     db_one_statement(db, "PRAGMA case_sensitive_like=1", path);
@@ -457,7 +729,7 @@ db_pool_put(db_pool_t *dp, sqlite3 *db)
     TRACE(TRACE_ERROR, "DB",
 	  "%s: db handle returned to pool while in transaction, closing handle",
 	  dp->dp_path);
-    sqlite3_close(db);
+    db_close(db);
     return;
   }
 
@@ -471,7 +743,7 @@ db_pool_put(db_pool_t *dp, sqlite3 *db)
   }
 
   hts_mutex_unlock(&dp->dp_mutex);
-  sqlite3_close(db);
+  db_close(db);
 }
 
 
@@ -487,9 +759,12 @@ db_pool_close(db_pool_t *dp)
 
   hts_mutex_lock(&dp->dp_mutex);
   dp->dp_closed = 1;
-  for(i = 0; i < dp->dp_size; i++)
-    if(dp->dp_pool[i] != NULL)
-      sqlite3_close(dp->dp_pool[i]);
+  for(i = 0; i < dp->dp_size; i++) {
+    if(dp->dp_pool[i] != NULL) {
+      db_close(dp->dp_pool[i]);
+      dp->dp_pool[i] = NULL;
+    }
+  }
   hts_mutex_unlock(&dp->dp_mutex);
 }
 
@@ -681,6 +956,15 @@ db_init(void)
   sqlite3_config(SQLITE_CONFIG_LOG, &db_log, NULL);
 
   sqlite3_initialize();
+
+  prop_t *p = prop_create(prop_create(prop_get_global(), "db"),
+                          "statementCache");
+  stmt_cache_prop_hits      = prop_create(p, "hits");
+  stmt_cache_prop_misses    = prop_create(p, "misses");
+  stmt_cache_prop_evictions = prop_create(p, "evictions");
+  stmt_cache_prop_hitrate   = prop_create(p, "hitrate");
+  callout_arm(&stmt_cache_stats_timer, stmt_cache_stats_update, NULL, 5);
+
 #ifdef PS3
   sqlite3_soft_heap_limit(10000000);
 #endif
@@ -32,6 +32,8 @@ int db_get_int64_from_query(sqlite3 *db, const char *query, int64_t *v);
 
 int db_begin0(sqlite3 *db, const char *src);
 
+int db_begin_read0(sqlite3 *db, const char *src);
+
 int db_commit0(sqlite3 *db, const char *src);
 
 int db_rollback0(sqlite3 *db, const char *src);
@@ -46,7 +48,10 @@ int db_preparex(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
 
 #define db_prepare(db, stmt, sql) db_preparex(db, stmt, sql, __FILE__, __LINE__)
 
+int db_finalize(sqlite3_stmt *stmt);
+
 #define db_begin(db)    db_begin0(db, __FUNCTION__)
+#define db_begin_read(db) db_begin_read0(db, __FUNCTION__)
 #define db_commit(db)   db_commit0(db, __FUNCTION__)
 #define db_rollback(db) db_rollback0(db, __FUNCTION__)
 #define db_rollback_deadlock(db) db_rollback_deadlock0(db, __FUNCTION__)
@@ -56,6 +61,8 @@ int db_preparex(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
 
 sqlite3 *db_open(const char *path, int flags);
 
+void db_close(sqlite3 *db);
+
 int db_upgrade_schema(sqlite3 *db, const char *schemadir, const char *dbname,
                       const char *extra_db, const char *extra_db_path);
 
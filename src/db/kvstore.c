@@ -42,10 +42,32 @@
 #include "fileaccess/fileaccess.h"
 
 LIST_HEAD(kvstore_write_list, kvstore_write);
+TAILQ_HEAD(kvstore_write_queue, kvstore_write);
 
+/**
+ * Write-behind queue
+ *
+ * Writes are held in memory and coalesced per (url, domain, key) until
+ * they are flushed to the database in one transaction, either when
+ * KVSTORE_FLUSH_COUNT writes are pending or KVSTORE_FLUSH_DELAY seconds
+ * after the first pending write. Pending writes are also in a hash
+ * table so reads can be served from the queue.
+ *
+ * Entries that are being flushed are immutable, a write to the same key
+ * during a flush creates a new entry that shadows the old one in the
+ * hash table.
+ */
+#define KVSTORE_FLUSH_COUNT  64
+#define KVSTORE_FLUSH_DELAY  3
+#define KVSTORE_HASH_SIZE    64
 
 typedef struct kvstore_write {
-  LIST_ENTRY(kvstore_write) kw_link;
+  LIST_ENTRY(kvstore_write) kw_hash_link;
+  TAILQ_ENTRY(kvstore_write) kw_link;
+  unsigned int kw_hash;
+  char kw_flushing;
+  char kw_xattr;         // Try to store as xattr when flushing
+
   char *kw_url;
   int kw_domain;
   char *kw_key;
@@ -63,9 +85,12 @@ typedef struct kvstore_write {
 
 
 static db_pool_t *kvstore_pool;
-static struct kvstore_write_list deferred_writes;
+static struct kvstore_write_list pending_hash[KVSTORE_HASH_SIZE];
+static struct kvstore_write_queue pending_writes;
+static int pending_count;
 static callout_t deferred_callout;
 static hts_mutex_t deferred_mutex;
+static hts_mutex_t flush_mutex;
 
 
 static const char *domain_to_name[] = {
@@ -81,6 +106,7 @@ static const char *domain_to_name[] = {
 void
 kvstore_fini(void)
 {
+  kvstore_deferred_flush();
   db_pool_close(kvstore_pool);
 }
 
@@ -115,6 +141,8 @@ kvstore_init(void)
   char buf[256];
 
   hts_mutex_init(&deferred_mutex);
+  hts_mutex_init(&flush_mutex);
+  TAILQ_INIT(&pending_writes);
 
   snprintf(buf, sizeof(buf), "%s/kvstore", gconf.persistent_path);
   mkdir(buf, 0770);
@@ -166,16 +194,16 @@ get_url(void *db, const char *url, uint64_t *id)
 
   rc = sqlite3_step(stmt);
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     return SQLITE_LOCKED;
   }
   if(rc == SQLITE_ROW) {
     *id = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     return SQLITE_OK;
 
   } else if(rc == SQLITE_DONE) {
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
 
     rc = db_prepare(db, &stmt,
 		    "INSERT INTO url ('url') VALUES (?1)");
@@ -196,7 +224,7 @@ get_url(void *db, const char *url, uint64_t *id)
 
     }
   }
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   return rc;
 }
 
@@ -302,7 +330,7 @@ kv_value_cb(void *opaque, prop_event_t event, ...)
     db_bind_rstr(stmt, 2, key);
 
     rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     rstr_release(key);
 
     if(rc == SQLITE_LOCKED) {
@@ -440,7 +468,7 @@ kv_prop_bind_create(prop_t *p, const char *url)
     }
   }
 
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   kvstore_close(db);
 
   kv_prop_bind_t *kpb = calloc(1, sizeof(kv_prop_bind_t));
@@ -457,6 +485,76 @@ kv_prop_bind_create(prop_t *p, const char *url)
 
 
 
+/**
+ *
+ */
+static unsigned int
+kw_hash(const char *url, int domain, const char *key)
+{
+  unsigned int h = domain;
+  while(*url)
+    h = h * 33 + *url++;
+  while(*key)
+    h = h * 33 + *key++;
+  return h;
+}
+
+
+/**
+ * Find the most recent pending write for a key.
+ * Must be called with deferred_mutex held
+ */
+static kvstore_write_t *
+kw_find(const char *url, int domain, const char *key, unsigned int hash)
+{
+  kvstore_write_t *kw;
+
+  LIST_FOREACH(kw, &pending_hash[hash % KVSTORE_HASH_SIZE], kw_hash_link)
+    if(kw->kw_hash == hash && kw->kw_domain == domain &&
+       !strcmp(kw->kw_url, url) && !strcmp(kw->kw_key, key))
+      return kw;
+  return NULL;
+}
+
+
+/**
+ * Look for a value in the write-behind queue. Returns 0 if there is no
+ * pending write for the key. Otherwise returns 1 and sets *typep to the
+ * kind of value written (KVSTORE_SET_VOID if deleted)
+ */
+static int
+kv_pending_get(const char *url, int domain, const char *key, int *typep,
+               int64_t *i64p, rstr_t **strp)
+{
+  kvstore_write_t *kw;
+
+  hts_mutex_lock(&deferred_mutex);
+  kw = kw_find(url, domain, key, kw_hash(url, domain, key));
+
+  if(kw != NULL) {
+    *typep = kw->kw_type;
+    switch(kw->kw_type) {
+    case KVSTORE_SET_INT:
+      *i64p = kw->kw_int;
+      break;
+    case KVSTORE_SET_INT64:
+      *i64p = kw->kw_int64;
+      break;
+    case KVSTORE_SET_STRING:
+      *strp = rstr_alloc(kw->kw_string);
+      *i64p = strtoll(kw->kw_string, NULL, 0);
+      break;
+    }
+  }
+  hts_mutex_unlock(&deferred_mutex);
+
+  if(kw != NULL && gconf.enable_kvstore_debug)
+    TRACE(TRACE_DEBUG, "kvstore",
+          "GET PENDING url=%s key=%s domain=%d", url, key, domain);
+  return kw != NULL;
+}
+
+
 /**
  *
  */
@@ -487,7 +585,7 @@ kv_url_opt_get(void *db, const char *url, int domain, const char *key)
 
   if(db_step(stmt) == SQLITE_ROW)
     return stmt;
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   return NULL;
 }
 
@@ -518,6 +616,19 @@ kv_url_opt_get_rstr(const char *url, int domain, const char *key)
   if(url == NULL)
     return NULL;
 
+  int type;
+  int64_t i64;
+  rstr_t *str = NULL;
+  char tmp[32];
+
+  if(kv_pending_get(url, domain, key, &type, &i64, &str)) {
+    if(type == KVSTORE_SET_INT || type == KVSTORE_SET_INT64) {
+      snprintf(tmp, sizeof(tmp), "%"PRId64, i64);
+      str = rstr_alloc(tmp);
+    }
+    return str;
+  }
+
   void *data;
   size_t size;
   fa_err_code_t err = opt_get_ea(url, domain, key, &data, &size);
@@ -538,7 +649,7 @@ kv_url_opt_get_rstr(const char *url, int domain, const char *key)
   rstr_t *r = NULL;
   if(stmt) {
     r = db_rstr(stmt, 0);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
   }
   kvstore_close(db);
   return r;
@@ -554,6 +665,15 @@ kv_url_opt_get_int(const char *url, int domain, const char *key, int def)
   if(url == NULL)
     return def;
 
+  int type;
+  int64_t i64;
+  rstr_t *str = NULL;
+
+  if(kv_pending_get(url, domain, key, &type, &i64, &str)) {
+    rstr_release(str);
+    return type == KVSTORE_SET_VOID ? def : i64;
+  }
+
   void *data;
   size_t size;
   fa_err_code_t err = opt_get_ea(url, domain, key, &data, &size);
@@ -574,7 +694,7 @@ kv_url_opt_get_int(const char *url, int domain, const char *key, int def)
   int v = def;
   if(stmt) {
     v = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     if(gconf.enable_kvstore_debug)
       TRACE(TRACE_DEBUG, "kvstore","GET DB url=%s key=%s domain=%d value=%d",
             url, key, domain, v);
@@ -597,6 +717,15 @@ kv_url_opt_get_int64(const char *url, int domain, const char *key, int64_t def)
   if(url == NULL)
     return def;
 
+  int type;
+  int64_t i64;
+  rstr_t *str = NULL;
+
+  if(kv_pending_get(url, domain, key, &type, &i64, &str)) {
+    rstr_release(str);
+    return type == KVSTORE_SET_VOID ? def : i64;
+  }
+
   void *data;
   size_t size;
   fa_err_code_t err = opt_get_ea(url, domain, key, &data, &size);
@@ -621,7 +750,7 @@ kv_url_opt_get_int64(const char *url, int domain, const char *key, int64_t def)
   int64_t v = def;
   if(stmt) {
     v = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     if(gconf.enable_kvstore_debug)
       TRACE(TRACE_DEBUG, "kvstore",
             "GET DB url=%s key=%s domain=%d value=%"PRId64,
@@ -678,7 +807,7 @@ kv_write_db(void *db, const kvstore_write_t *kw, int64_t id)
       break;
 
     case KVSTORE_SET_INT64:
-      sqlite3_bind_int(stmt, 4, kw->kw_int64);
+      sqlite3_bind_int64(stmt, 4, kw->kw_int64);
       snprintf(vtmp, sizeof(vtmp), "%"PRId64, kw->kw_int64);
       break;
 
@@ -697,7 +826,7 @@ kv_write_db(void *db, const kvstore_write_t *kw, int64_t id)
   sqlite3_bind_int(stmt, 3, kw->kw_domain);
 
   rc = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 
 
   if(rc == SQLITE_DONE)
@@ -777,113 +906,218 @@ kv_write_xattr(const kvstore_write_t *kw)
 /**
  *
  */
-void
-kv_url_opt_set(const char *url, int domain, const char *key,
-	       int type, ...)
+static void
+kw_free(kvstore_write_t *kw)
 {
-  void *db;
-  int rc;
-  uint64_t id;
-  va_list ap;
+  free(kw->kw_url);
+  free(kw->kw_key);
+  if(kw->kw_type == KVSTORE_SET_STRING)
+    free(kw->kw_string);
+  free(kw);
+}
 
-  kvstore_write_t kw;
-  kw.kw_url    = (char *)url;
-  kw.kw_domain = domain;
-  kw.kw_key    = (char *)key;
-  kw.kw_type   = type & 0xff;
-  kw.kw_unimportant = type & KVSTORE_UNIMPORTANT;
 
-  va_start(ap, type);
+/**
+ *
+ */
+static void
+deferred_callout_fire(struct callout *c, void *opaque)
+{
+  kvstore_deferred_flush();
+}
+
+
+/**
+ * Add a write to the write-behind queue, replacing any pending write
+ * to the same key that is not already being flushed
+ */
+static void
+kw_enqueue(const char *url, int domain, const char *key, int type,
+           int xattr, va_list ap)
+{
+  kvstore_write_t *kw;
+  const char *str;
+  unsigned int hash = kw_hash(url, domain, key);
+
+  hts_mutex_lock(&deferred_mutex);
+
+  kw = kw_find(url, domain, key, hash);
+
+  if(kw == NULL || kw->kw_flushing) {
+    kw = malloc(sizeof(kvstore_write_t));
+    kw->kw_url      = strdup(url);
+    kw->kw_key      = strdup(key);
+    kw->kw_domain   = domain;
+    kw->kw_hash     = hash;
+    kw->kw_flushing = 0;
+    LIST_INSERT_HEAD(&pending_hash[hash % KVSTORE_HASH_SIZE], kw,
+                     kw_hash_link);
+    TAILQ_INSERT_TAIL(&pending_writes, kw, kw_link);
+    pending_count++;
+  } else {
+    if(kw->kw_type == KVSTORE_SET_STRING)
+      free(kw->kw_string);
+  }
+
+  kw->kw_xattr = xattr;
+  kw->kw_type = type & 0xff;
+  kw->kw_unimportant = type & KVSTORE_UNIMPORTANT;
 
-  switch(kw.kw_type) {
+  switch(kw->kw_type) {
   case KVSTORE_SET_INT:
-    kw.kw_int = va_arg(ap, int);
+    kw->kw_int = va_arg(ap, int);
     break;
 
   case KVSTORE_SET_INT64:
-    kw.kw_int64 = va_arg(ap, int64_t);
+    kw->kw_int64 = va_arg(ap, int64_t);
     break;
 
   case KVSTORE_SET_STRING:
-    kw.kw_string = va_arg(ap, char *);
-    if(kw.kw_string == NULL)
-      kw.kw_type = KVSTORE_SET_VOID;
+    str = va_arg(ap, const char *);
+    if(str != NULL) {
+      kw->kw_string = strdup(str);
+    } else {
+      kw->kw_type = KVSTORE_SET_VOID;
+    }
     break;
 
   default:
     break;
   }
-  va_end(ap);
+
+  if(pending_count >= KVSTORE_FLUSH_COUNT) {
+    callout_arm(&deferred_callout, deferred_callout_fire, NULL, 0);
+  } else if(!callout_isarmed(&deferred_callout)) {
+    callout_arm(&deferred_callout, deferred_callout_fire, NULL,
+                KVSTORE_FLUSH_DELAY);
+  }
+
+  hts_mutex_unlock(&deferred_mutex);
+}
+
+
+/**
+ *
+ */
+void
+kv_url_opt_set(const char *url, int domain, const char *key,
+	       int type, ...)
+{
+  va_list ap;
 
   if(gconf.fa_kvstore_as_xattr) {
-    if(!kv_write_xattr(&kw))
+    kvstore_write_t kw;
+    kw.kw_url    = (char *)url;
+    kw.kw_domain = domain;
+    kw.kw_key    = (char *)key;
+    kw.kw_type   = type & 0xff;
+
+    va_start(ap, type);
+    switch(kw.kw_type) {
+    case KVSTORE_SET_INT:
+      kw.kw_int = va_arg(ap, int);
+      break;
+
+    case KVSTORE_SET_INT64:
+      kw.kw_int64 = va_arg(ap, int64_t);
+      break;
+
+    case KVSTORE_SET_STRING:
+      kw.kw_string = va_arg(ap, char *);
+      if(kw.kw_string == NULL)
+        kw.kw_type = KVSTORE_SET_VOID;
+      break;
+
+    default:
+      break;
+    }
+    va_end(ap);
+
+    if(!kv_write_xattr(&kw)) {
+      /*
+       * An older deferred write for this key would still be served by
+       * kv_pending_get() and would overwrite the xattr when flushed.
+       * Replace its value with ours
+       */
+      hts_mutex_lock(&deferred_mutex);
+      int pending = kw_find(url, domain, key,
+                            kw_hash(url, domain, key)) != NULL;
+      hts_mutex_unlock(&deferred_mutex);
+
+      if(pending) {
+        va_start(ap, type);
+        kw_enqueue(url, domain, key, type, 1, ap);
+        va_end(ap);
+      }
       return;
+    }
   }
 
 #ifdef STOS
-  if(kw.kw_unimportant)
+  if(type & KVSTORE_UNIMPORTANT)
     return;
 #endif
 
-  db = kvstore_get();
-  if(db == NULL)
-    return;
-  
- again:
-  if(db_begin(db)) {
-    kvstore_close(db);
+  if(kvstore_pool == NULL)
     return;
-  }
 
-  rc = get_url(db, url, &id);
-  if(rc == SQLITE_LOCKED) {
-    db_rollback_deadlock(db);
-    goto again;
-  }
+  va_start(ap, type);
+  kw_enqueue(url, domain, key, type, 0, ap);
+  va_end(ap);
+}
 
-  if(rc != SQLITE_OK) {
-    db_rollback(db);
-    kvstore_close(db);
-    return;
-  }
 
-  rc = kv_write_db(db, &kw, id);
-  if(rc == SQLITE_LOCKED) {
-    db_rollback_deadlock(db);
-    goto again;
-  }
-  db_commit(db);
-  kvstore_close(db);
+/**
+ *
+ */
+static int
+kw_url_cmp(const void *A, const void *B)
+{
+  const kvstore_write_t *a = *(const kvstore_write_t **)A;
+  const kvstore_write_t *b = *(const kvstore_write_t **)B;
+  return strcmp(a->kw_url, b->kw_url);
 }
 
 
 /**
+ * Write all pending writes to the database in one transaction. A write
+ * that fails is logged and dropped, the others are still committed.
  *
+ * Flushes are serialized by flush_mutex so a newer write to a key can
+ * never be committed before an older one
  */
 void
 kvstore_deferred_flush(void)
 {
-  kvstore_write_t *kw;
+  struct kvstore_write_queue q;
+  kvstore_write_t *kw, **vec;
   void *db;
-  int rc;
+  int rc, i, n = 0;
   uint64_t id = 0;
   const char *current_url;
 
-  db = kvstore_get();
-  if(db == NULL)
-    return;
+  hts_mutex_lock(&flush_mutex);
 
   hts_mutex_lock(&deferred_mutex);
+  TAILQ_INIT(&q);
+  TAILQ_MERGE(&q, &pending_writes, kw_link);
+  TAILQ_FOREACH(kw, &q, kw_link)
+    kw->kw_flushing = 1;
+  n = pending_count;
+  pending_count = 0;
+  hts_mutex_unlock(&deferred_mutex);
 
- again:
-  if(db_begin(db))
-    goto err;
-
-  current_url = NULL;
+  if(n == 0) {
+    hts_mutex_unlock(&flush_mutex);
+    return;
+  }
 
-  LIST_FOREACH(kw, &deferred_writes, kw_link) {
+  // Sort on URL so each URL is only looked up once
+  vec = malloc(n * sizeof(kvstore_write_t *));
+  n = 0;
+  TAILQ_FOREACH(kw, &q, kw_link) {
 
-    if(gconf.fa_kvstore_as_xattr) {
+    if(kw->kw_xattr && gconf.fa_kvstore_as_xattr) {
       if(!kv_write_xattr(kw))
         continue;
     }
@@ -892,60 +1126,72 @@ kvstore_deferred_flush(void)
     if(kw->kw_unimportant)
       continue;
 #endif
+    vec[n++] = kw;
+  }
 
-    if(current_url == NULL || strcmp(kw->kw_url, current_url)) {
+  qsort(vec, n, sizeof(kvstore_write_t *), kw_url_cmp);
+
+  if(n > 0 && (db = kvstore_get()) != NULL) {
+
+  again:
+    if(db_begin(db))
+      goto err;
+
+    current_url = NULL;
+
+    for(i = 0; i < n; i++) {
+      kw = vec[i];
+
+      // Each write gets a savepoint of its own so a failing write is
+      // dropped without taking the rest of the batch with it
+      if(db_one_statement(db, "SAVEPOINT kvw;", __FUNCTION__)) {
+        db_rollback(db);
+        goto err;
+      }
+
+      rc = SQLITE_OK;
+      if(current_url == NULL || strcmp(kw->kw_url, current_url)) {
+        rc = get_url(db, kw->kw_url, &id);
+        current_url = rc == SQLITE_OK ? kw->kw_url : NULL;
+      }
+
+      if(rc == SQLITE_OK)
+        rc = kv_write_db(db, kw, id);
 
-      rc = get_url(db, kw->kw_url, &id);
       if(rc == SQLITE_LOCKED) {
         db_rollback_deadlock(db);
         goto again;
       }
 
       if(rc != SQLITE_OK) {
-        db_rollback(db);
-        goto err;
+        TRACE(TRACE_ERROR, "kvstore", "Unable to write url=%s key=%s -- %s",
+              kw->kw_url, kw->kw_key, sqlite3_errmsg(db));
+        db_one_statement(db, "ROLLBACK TO kvw;", __FUNCTION__);
+        current_url = NULL; // URL row may have been rolled back as well
       }
-      current_url = kw->kw_url;
-    }
-
-    rc = kv_write_db(db, kw, id);
-    if(rc == SQLITE_LOCKED) {
-      db_rollback_deadlock(db);
-      goto again;
-    }
-    if(rc != SQLITE_OK) {
-      db_rollback(db);
-      goto err;
+      db_one_statement(db, "RELEASE kvw;", __FUNCTION__);
     }
-  }
 
-  db_commit(db);
-
- err:
+    db_commit(db);
 
-  while((kw = LIST_FIRST(&deferred_writes)) != NULL) {
-    LIST_REMOVE(kw, kw_link);
-    free(kw->kw_url);
-    free(kw->kw_key);
-    if(kw->kw_type == KVSTORE_SET_STRING)
-      free(kw->kw_string);
-    free(kw);
+  err:
+    kvstore_close(db);
   }
 
+  free(vec);
 
+  // Committed (or given up), stop serving these from the queue
+  hts_mutex_lock(&deferred_mutex);
+  TAILQ_FOREACH(kw, &q, kw_link)
+    LIST_REMOVE(kw, kw_hash_link);
   hts_mutex_unlock(&deferred_mutex);
-  kvstore_close(db);
-
-}
 
+  while((kw = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, kw, kw_link);
+    kw_free(kw);
+  }
 
-/**
- *
- */
-static void
-deferred_callout_fire(struct callout *c, void *opaque)
-{
-  kvstore_deferred_flush();
+  hts_mutex_unlock(&flush_mutex);
 }
 
 
@@ -956,59 +1202,9 @@ void
 kv_url_opt_set_deferred(const char *url, int domain, const char *key,
                         int type, ...)
 {
-  kvstore_write_t *kw;
   va_list ap;
-  const char *str;
-  va_start(ap, type);
 
-  hts_mutex_lock(&deferred_mutex);
-
-  LIST_FOREACH(kw, &deferred_writes, kw_link) {
-    if(!strcmp(kw->kw_url, url) &&
-       !strcmp(kw->kw_key, key) &&
-       kw->kw_domain == domain)
-      break;
-  }
-
-  if(kw == NULL) {
-    kw = malloc(sizeof(kvstore_write_t));
-    kw->kw_url    = strdup(url);
-    kw->kw_key    = strdup(key);
-    kw->kw_domain = domain;
-    LIST_INSERT_HEAD(&deferred_writes, kw, kw_link);
-  } else {
-    if(kw->kw_type == KVSTORE_SET_STRING)
-      free(kw->kw_string);
-  }
-
-  
-  kw->kw_type = type & 0xff;
-  kw->kw_unimportant = type & KVSTORE_UNIMPORTANT;
-
-  switch(kw->kw_type) {
-  case KVSTORE_SET_INT:
-    kw->kw_int = va_arg(ap, int);
-    break;
-
-  case KVSTORE_SET_INT64:
-    kw->kw_int64 = va_arg(ap, int64_t);
-    break;
-
-  case KVSTORE_SET_STRING:
-    str = va_arg(ap, const char *);
-    if(str != NULL) {
-      kw->kw_string = strdup(str);
-    } else {
-      kw->kw_type = KVSTORE_SET_VOID;
-    }
-    break;
-
-  default:
-    break;
-  }
-
-  hts_mutex_unlock(&deferred_mutex);
-
-  callout_arm(&deferred_callout, deferred_callout_fire, NULL, 5);
+  va_start(ap, type);
+  kw_enqueue(url, domain, key, type, 1, ap);
   va_end(ap);
 }
@@ -34,14 +34,14 @@ es_prop_release_duk(duk_context *ctx)
 {
   prop_t *p = duk_require_pointer(ctx, 0);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_parent == NULL)
     prop_destroy0(p);
 
   prop_ref_dec_locked(p);
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return 0;
 }
 
@@ -79,10 +79,10 @@ es_prop_get_value_duk(duk_context *ctx)
   prop_t *p = es_stprop_get(ctx, 0);
   const char *str = duk_require_string(ctx, 1);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return 0;
   }
 
@@ -108,7 +108,7 @@ es_prop_get_value_duk(duk_context *ctx)
     duk_push_pointer(ctx, prop_ref_inc(p));
     break;
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return 1;
 }
 
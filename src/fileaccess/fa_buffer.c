@@ -39,6 +39,26 @@
 #define BF_ZONES 8
 #define BF_MASK (BF_ZONES - 1)
 
+/**
+ * Once the access pattern is sequential or strided a prefetch thread
+ * reads ahead of the reader in chunks of up to BF_PREFETCH_CHUNK. The
+ * readahead window starts at two minimum requests and doubles every
+ * time the reader catches up with it, up to half the ring
+ */
+#define BF_PREFETCH_CHUNK (256 * 1024)
+
+/**
+ * Data read synchronously from the first BF_PIN_HEAD or last
+ * BF_PIN_TAIL bytes of a file is where containers keep their indexes
+ * (moov atoms, cues, etc). Copies of up to BF_PIN_SIZE are kept in
+ * BF_PINS slots on the side so streaming through the ring does not
+ * evict them
+ */
+#define BF_PINS     4
+#define BF_PIN_SIZE (64 * 1024)
+#define BF_PIN_HEAD (256 * 1024)
+#define BF_PIN_TAIL (1024 * 1024)
+
 static HTS_MUTEX_DECL(buffered_global_mutex);
 
 typedef struct buffered_zone {
@@ -47,6 +67,19 @@ typedef struct buffered_zone {
   int bz_size;
 } buffered_zone_t;
 
+typedef struct buffered_pin {
+  int64_t bp_fpos;
+  int bp_size;
+  int bp_used;
+  void *bp_mem;
+} buffered_pin_t;
+
+typedef enum {
+  BF_ACCESS_RANDOM,
+  BF_ACCESS_SEQUENTIAL,
+  BF_ACCESS_STRIDED,
+} bf_access_t;
+
 /**
  *
  */
@@ -77,6 +110,41 @@ typedef struct buffered_file {
 
   buffered_zone_t bf_zones[BF_ZONES];
 
+  /**
+   * bf_mutex protects everything below as well as the ring, zones and
+   * bf_size as they are shared with the prefetch thread.
+   * bf_io_mutex serializes access to bf_src
+   */
+  hts_mutex_t bf_mutex;
+  hts_cond_t bf_cond;
+  hts_mutex_t bf_io_mutex;
+
+  void *bf_scratch; // bf_min_request bytes for synchronous fills
+
+  bf_access_t bf_access;
+  int64_t bf_last_fpos;
+  int64_t bf_last_end;
+  int64_t bf_stride;
+  int bf_last_size;
+  int bf_seq_count;
+  int bf_window;
+
+  hts_thread_t bf_pf_tid;
+  int bf_pf_running;
+  int bf_pf_stop;
+  int64_t bf_pf_fpos;  // Request in flight, if bf_pf_size != 0
+  int bf_pf_size;
+  void *bf_pf_mem;
+
+  buffered_pin_t bf_pins[BF_PINS];
+  int bf_pin_clock;
+
+  int bf_stat_reads;
+  int bf_stat_misses;
+  int bf_stat_waits;
+  int bf_stat_pin_hits;
+  int64_t bf_stat_prefetched;
+
 } buffered_file_t;
 
 
@@ -234,16 +302,134 @@ need_to_fill(const buffered_file_t *bf, int64_t fpos, size_t rd)
 }
 
 
+/**
+ * Returns end of contiguously cached data starting at fpos
+ */
+static int64_t
+cached_until(const buffered_file_t *bf, int64_t fpos)
+{
+  int mpos, cs;
+  while((cs = resolve_zone(bf, fpos, INT32_MAX, &mpos)) > 0)
+    fpos += cs;
+  return fpos;
+}
+
+
+/**
+ *
+ */
+static int
+resolve_pin(buffered_file_t *bf, int64_t fpos, void *buf, int size)
+{
+  int i;
+
+  for(i = 0; i < BF_PINS; i++) {
+    buffered_pin_t *bp = &bf->bf_pins[i];
+    if(bp->bp_size == 0)
+      continue;
+
+    if(fpos >= bp->bp_fpos && fpos < bp->bp_fpos + bp->bp_size) {
+      int d = fpos - bp->bp_fpos;
+      size = MIN(size, bp->bp_size - d);
+      memcpy(buf, bp->bp_mem + d, size);
+      bp->bp_used = ++bf->bf_pin_clock;
+      return size;
+    }
+  }
+  return -1;
+}
+
+
+/**
+ * Keep a copy of data from the head or tail of the file
+ */
+static void
+pin_data(buffered_file_t *bf, const void *buf, int size, int64_t fpos)
+{
+  buffered_pin_t *bp, *victim = NULL;
+  int i;
+
+  if(fpos >= BF_PIN_HEAD &&
+     (bf->bf_size == -1 || fpos + size <= bf->bf_size - BF_PIN_TAIL))
+    return;
+
+  size = MIN(size, BF_PIN_SIZE);
+
+  for(i = 0; i < BF_PINS; i++) {
+    bp = &bf->bf_pins[i];
+    if(bp->bp_size &&
+       fpos >= bp->bp_fpos && fpos + size <= bp->bp_fpos + bp->bp_size)
+      return; // Already got it
+
+    if(victim == NULL || bp->bp_used < victim->bp_used)
+      victim = bp;
+  }
+
+  if(victim->bp_mem == NULL && (victim->bp_mem = malloc(BF_PIN_SIZE)) == NULL)
+    return;
+
+  memcpy(victim->bp_mem, buf, size);
+  victim->bp_fpos = fpos;
+  victim->bp_size = size;
+  victim->bp_used = ++bf->bf_pin_clock;
+}
+
+
+/**
+ * Read from source. Must be called without bf_mutex held
+ */
+static int
+source_read(buffered_file_t *bf, int64_t fpos, void *buf, int size)
+{
+  fa_handle_t *src = bf->bf_src;
+  int r;
+
+  hts_mutex_lock(&bf->bf_io_mutex);
+  if(src->fh_proto->fap_seek(src, fpos, SEEK_SET) != fpos)
+    r = -1;
+  else
+    r = src->fh_proto->fap_read(src, buf, size);
+  hts_mutex_unlock(&bf->bf_io_mutex);
+  return r;
+}
+
+
 /**
  *
  */
 static void
 fab_destroy(buffered_file_t *bf)
 {
+  int i;
+
+  if(bf->bf_pf_running) {
+    hts_mutex_lock(&bf->bf_mutex);
+    bf->bf_pf_stop = 1;
+    hts_cond_broadcast(&bf->bf_cond);
+    hts_mutex_unlock(&bf->bf_mutex);
+    hts_thread_join(&bf->bf_pf_tid);
+  }
+
+  if(bf->bf_stat_reads)
+    TRACE(TRACE_DEBUG, "FA",
+          "Buffer stats for %s: %d reads, %d%% hit, %d pinned hits, "
+          "%d waits for prefetch, %"PRId64" kB prefetched",
+          bf->bf_url, bf->bf_stat_reads,
+          100 - 100 * bf->bf_stat_misses / bf->bf_stat_reads,
+          bf->bf_stat_pin_hits, bf->bf_stat_waits,
+          bf->bf_stat_prefetched / 1024);
+
   bf->bf_src->fh_proto->fap_close(bf->bf_src);
 
   if(bf->bf_mem != NULL)
     hfree(bf->bf_mem, bf->bf_mem_size);
+  for(i = 0; i < BF_PINS; i++)
+    free(bf->bf_pins[i].bp_mem);
+  free(bf->bf_scratch);
+  free(bf->bf_pf_mem);
+  hts_cond_destroy(&bf->bf_cond);
+  hts_mutex_destroy(&bf->bf_mutex);
+  hts_mutex_destroy(&bf->bf_io_mutex);
   free(bf->bf_url);
   free(bf);
 }
@@ -265,6 +451,11 @@ fab_close(fa_handle_t *handle)
     return;
   }
 
+  // Stop prefetching
+  hts_mutex_lock(&bf->bf_mutex);
+  bf->bf_access = BF_ACCESS_RANDOM;
+  hts_mutex_unlock(&bf->bf_mutex);
+
   hts_mutex_lock(&buffered_global_mutex);
   if(parked)
     closeme = parked;
@@ -285,10 +476,37 @@ fab_close(fa_handle_t *handle)
  *
  */
 static int64_t
-fab_seek(fa_handle_t *handle, int64_t pos, int whence)
+fab_fsize(fa_handle_t *handle)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
   fa_handle_t *src = bf->bf_src;
+  int64_t size;
+
+  hts_mutex_lock(&bf->bf_mutex);
+  size = bf->bf_size;
+  hts_mutex_unlock(&bf->bf_mutex);
+
+  if(size != -1)
+    return size;
+
+  hts_mutex_lock(&bf->bf_io_mutex);
+  size = src->fh_proto->fap_fsize(src);
+  hts_mutex_unlock(&bf->bf_io_mutex);
+
+  hts_mutex_lock(&bf->bf_mutex);
+  bf->bf_size = size;
+  hts_mutex_unlock(&bf->bf_mutex);
+  return size;
+}
+
+
+/**
+ *
+ */
+static int64_t
+fab_seek(fa_handle_t *handle, int64_t pos, int whence)
+{
+  buffered_file_t *bf = (buffered_file_t *)handle;
   int64_t np;
 
   switch(whence) {
@@ -301,12 +519,10 @@ fab_seek(fa_handle_t *handle, int64_t pos, int whence)
     break;
 
   case SEEK_END:
-    if(bf->bf_size == -1) {
-      bf->bf_size = src->fh_proto->fap_fsize(src);
-      if(bf->bf_size == -1)
-	return -1;
-    }
-    np = bf->bf_size + pos;
+    np = fab_fsize(handle);
+    if(np == -1)
+      return -1;
+    np += pos;
     break;
 
   default:
@@ -322,27 +538,13 @@ fab_seek(fa_handle_t *handle, int64_t pos, int whence)
 }
 
 
-/**
- *
- */
-static int64_t
-fab_fsize(fa_handle_t *handle)
-{
-  buffered_file_t *bf = (buffered_file_t *)handle;
-  if(bf->bf_size != -1)
-    return bf->bf_size;
-
-  fa_handle_t *src = bf->bf_src;
-  bf->bf_size = src->fh_proto->fap_fsize(src);
-  return bf->bf_size;
-}
 
 
 /**
  *
  */
 static void
-store_in_cache(buffered_file_t *bf, const void *buf, size_t size)
+store_in_cache(buffered_file_t *bf, const void *buf, size_t size, int64_t fpos)
 {
   if(size > bf->bf_mem_size)
     return;
@@ -358,7 +560,7 @@ store_in_cache(buffered_file_t *bf, const void *buf, size_t size)
 
   erase_zone(bf, bf->bf_mem_ptr, s1);
 
-  map_zone(bf, bf->bf_mem_ptr, s1, bf->bf_fpos);
+  map_zone(bf, bf->bf_mem_ptr, s1, fpos);
   memcpy(bf->bf_mem + bf->bf_mem_ptr, buf, s1);
 
   bf->bf_mem_ptr += s1;
@@ -370,7 +572,7 @@ store_in_cache(buffered_file_t *bf, const void *buf, size_t size)
   if(s2 > 0) {
     erase_zone(bf, bf->bf_mem_ptr, s2);
 
-    map_zone(bf, bf->bf_mem_ptr, s2, bf->bf_fpos + s1);
+    map_zone(bf, bf->bf_mem_ptr, s2, fpos + s1);
     memcpy(bf->bf_mem + bf->bf_mem_ptr, buf + s1, s2);
 
     bf->bf_mem_ptr += s2;
@@ -379,6 +581,135 @@ store_in_cache(buffered_file_t *bf, const void *buf, size_t size)
 
 
 
+/**
+ * Figure out what to prefetch next. Returns 0 if nothing
+ */
+static int
+prefetch_next(buffered_file_t *bf, int64_t *fposp, int *sizep)
+{
+  int64_t fpos, end;
+
+  switch(bf->bf_access) {
+  case BF_ACCESS_SEQUENTIAL:
+    end = bf->bf_last_end + bf->bf_window;
+    break;
+
+  case BF_ACCESS_STRIDED:
+    fpos = bf->bf_last_fpos + bf->bf_stride;
+    end = fpos + bf->bf_last_size;
+    if(cached_until(bf, fpos) >= end)
+      return 0;
+    *fposp = cached_until(bf, fpos);
+    *sizep = MIN(end - *fposp, BF_PREFETCH_CHUNK);
+    goto clip;
+
+  default:
+    return 0;
+  }
+
+  fpos = cached_until(bf, bf->bf_last_end);
+  if(fpos >= end)
+    return 0;
+
+  *fposp = fpos;
+  *sizep = MIN(end - fpos, BF_PREFETCH_CHUNK);
+
+ clip:
+  if(bf->bf_size != -1) {
+    if(*fposp >= bf->bf_size)
+      return 0;
+    *sizep = MIN(*sizep, bf->bf_size - *fposp);
+  }
+  return *sizep > 0;
+}
+
+
+/**
+ *
+ */
+static void *
+prefetch_thread(void *aux)
+{
+  buffered_file_t *bf = aux;
+  int64_t fpos;
+  int size, r;
+
+  hts_mutex_lock(&bf->bf_mutex);
+
+  while(!bf->bf_pf_stop) {
+
+    if(!prefetch_next(bf, &fpos, &size)) {
+      hts_cond_wait(&bf->bf_cond, &bf->bf_mutex);
+      continue;
+    }
+
+    bf->bf_pf_fpos = fpos;
+    bf->bf_pf_size = size;
+    hts_mutex_unlock(&bf->bf_mutex);
+
+    r = source_read(bf, fpos, bf->bf_pf_mem, size);
+
+    hts_mutex_lock(&bf->bf_mutex);
+
+    if(r > 0) {
+      store_in_cache(bf, bf->bf_pf_mem, r, fpos);
+      bf->bf_stat_prefetched += r;
+    }
+
+    if(r < 0)
+      bf->bf_access = BF_ACCESS_RANDOM; // Leave it to the reader
+    else if(r < size)
+      bf->bf_size = fpos + r;
+
+    bf->bf_pf_size = 0;
+    hts_cond_broadcast(&bf->bf_cond);
+  }
+  hts_mutex_unlock(&bf->bf_mutex);
+  return NULL;
+}
+
+
+/**
+ * Classify the access pattern and kick the prefetcher
+ */
+static void
+track_access(buffered_file_t *bf, int64_t fpos, int size)
+{
+  if(fpos == bf->bf_last_end) {
+    // Short sequential runs (probing headers) are not worth a thread
+    if(++bf->bf_seq_count >= 4)
+      bf->bf_access = BF_ACCESS_SEQUENTIAL;
+  } else {
+    int64_t stride = fpos - bf->bf_last_fpos;
+
+    if(stride > 0 && stride == bf->bf_stride) {
+      bf->bf_access = BF_ACCESS_STRIDED;
+    } else {
+      bf->bf_access = BF_ACCESS_RANDOM;
+      bf->bf_window = bf->bf_min_request * 2;
+    }
+    bf->bf_stride = stride;
+    bf->bf_seq_count = 0;
+  }
+
+  bf->bf_last_fpos = fpos;
+  bf->bf_last_size = size;
+  bf->bf_last_end = fpos + size;
+
+  if(bf->bf_access == BF_ACCESS_RANDOM || bf->bf_min_request == 0)
+    return;
+
+  if(!bf->bf_pf_running) {
+    if((bf->bf_pf_mem = malloc(BF_PREFETCH_CHUNK)) == NULL)
+      return;
+    bf->bf_pf_running = 1;
+    hts_thread_create_joinable("fa prefetch", &bf->bf_pf_tid,
+                               prefetch_thread, bf, THREAD_PRIO_DEMUXER);
+  }
+  hts_cond_broadcast(&bf->bf_cond);
+}
+
+
 /**
  *
  */
@@ -386,16 +717,28 @@ static int
 fab_read(fa_handle_t *handle, void *buf, size_t size)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
-  fa_handle_t *src = bf->bf_src;
+  int missed = 0;
 
   if(bf->bf_mem == NULL) {
     bf->bf_mem = halloc(bf->bf_mem_size);
     if(bf->bf_mem == NULL)
       return -1;
+
+    if(bf->bf_min_request &&
+       (bf->bf_scratch = malloc(bf->bf_min_request)) == NULL) {
+      hfree(bf->bf_mem, bf->bf_mem_size);
+      bf->bf_mem = NULL;
+      return -1;
+    }
   }
 
+  hts_mutex_lock(&bf->bf_mutex);
+
   if(bf->bf_size != -1 && bf->bf_fpos + size > bf->bf_size)
-    size = bf->bf_size - bf->bf_fpos;
+    size = MAX(bf->bf_size - bf->bf_fpos, 0);
+
+  track_access(bf, bf->bf_fpos, size);
+  bf->bf_stat_reads++;
 
   size_t rval = 0;
   while(size > 0) {
@@ -411,61 +754,75 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
       continue;
     }
 
-    int rreq = need_to_fill(bf, bf->bf_fpos, size);
-    if(rreq >= bf->bf_min_request) {
-
-      if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET) != bf->bf_fpos)
-	return -1;
-
-      int r = src->fh_proto->fap_read(src, buf, rreq);
-      if(r > 0) {
-	store_in_cache(bf, buf, r);
-	rval += r;
-	buf += r;
-	bf->bf_fpos += r;
-	size -= r;
-      }
-      if(r != rreq) {
-	bf->bf_size = bf->bf_fpos;
-	return r < 0 ? r : rval;
-      }
+    cs = resolve_pin(bf, bf->bf_fpos, buf, size);
+    if(cs > 0) {
+      bf->bf_stat_pin_hits++;
+      rval += cs;
+      buf += cs;
+      bf->bf_fpos += cs;
+      size -= cs;
       continue;
     }
 
-    if(bf->bf_mem_ptr + bf->bf_min_request > bf->bf_mem_size)
-      bf->bf_mem_ptr = 0;
-    
-    erase_zone(bf, bf->bf_mem_ptr, bf->bf_min_request);
-
-    if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET) != bf->bf_fpos)
-      return -1;
+    if(bf->bf_pf_size && bf->bf_fpos >= bf->bf_pf_fpos &&
+       bf->bf_fpos < bf->bf_pf_fpos + bf->bf_pf_size) {
+      // On its way
+      bf->bf_stat_waits++;
+      hts_cond_wait(&bf->bf_cond, &bf->bf_mutex);
+      continue;
+    }
 
-    int r = src->fh_proto->fap_read(src, bf->bf_mem + bf->bf_mem_ptr,
-				    bf->bf_min_request);
-    if(r < 1) {
-      bf->bf_size = bf->bf_fpos;
-      return r < 0 ? r : rval;
+    if(!missed) {
+      missed = 1;
+      bf->bf_stat_misses++;
+      // The prefetcher did not keep up
+      if(bf->bf_access == BF_ACCESS_SEQUENTIAL)
+        bf->bf_window = MIN(bf->bf_window * 2, bf->bf_mem_size / 2);
     }
 
-    map_zone(bf, bf->bf_mem_ptr, r, bf->bf_fpos);
+    int rreq = need_to_fill(bf, bf->bf_fpos, size);
+    int direct = rreq >= bf->bf_min_request;
+    int64_t fpos = bf->bf_fpos;
+    void *dst = direct ? buf : bf->bf_scratch;
 
-    if(r != bf->bf_min_request) {
-      // EOF
-      bf->bf_size = bf->bf_fpos + r;
+    if(!direct)
+      rreq = bf->bf_min_request;
 
-      int r2 = MIN(size, r);
-      memcpy(buf, bf->bf_mem + bf->bf_mem_ptr, r2);
-      bf->bf_mem_ptr += r;
-      rval += r2;
+    hts_mutex_unlock(&bf->bf_mutex);
+    int r = source_read(bf, fpos, dst, rreq);
+    hts_mutex_lock(&bf->bf_mutex);
 
-      bf->bf_fpos += r2;
+    if(r < 0) {
+      hts_mutex_unlock(&bf->bf_mutex);
+      return r;
+    }
 
-      return rval;
-    } else {
-      bf->bf_mem_ptr += r;
+    if(r > 0) {
+      store_in_cache(bf, dst, r, fpos);
+      pin_data(bf, dst, r, fpos);
+    }
+
+    if(direct) {
+      rval += r;
+      buf += r;
+      bf->bf_fpos += r;
+      size -= r;
     }
 
+    if(r != rreq) {
+      // EOF
+      bf->bf_size = fpos + r;
+
+      if(!direct) {
+        int r2 = MIN(size, r);
+        memcpy(buf, dst, r2);
+        rval += r2;
+        bf->bf_fpos += r2;
+      }
+      break;
+    }
   }
+  hts_mutex_unlock(&bf->bf_mutex);
   return rval;
 }
 
@@ -532,8 +889,11 @@ fab_set_read_timeout(fa_handle_t *handle, int ms)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
   fa_handle_t *fh = bf->bf_src;
-  if(fh->fh_proto->fap_set_read_timeout != NULL)
+  if(fh->fh_proto->fap_set_read_timeout != NULL) {
+    hts_mutex_lock(&bf->bf_io_mutex);
     fh->fh_proto->fap_set_read_timeout(fh, ms);
+    hts_mutex_unlock(&bf->bf_io_mutex);
+  }
 }
 
 
@@ -607,6 +967,10 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
 
   bf->bf_src = fh;
   bf->bf_size = -1;
+  bf->bf_window = bf->bf_min_request * 2;
+  hts_mutex_init(&bf->bf_mutex);
+  hts_cond_init(&bf->bf_cond, &bf->bf_mutex);
+  hts_mutex_init(&bf->bf_io_mutex);
   bf->h.fh_proto = &fa_protocol_buffered;
 #if BF_CHK
   bf->bf_chk = fa_open_ex(url, NULL, 0, 0, NULL);
@@ -19,43 +19,99 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 
+/**
+ * Persistent read-ahead cache
+ *
+ * Every cached file is stored in <cache>/facache as two files named
+ * after a hash of the URL and a validator (ETag or modification time):
+ *
+ *   <hash>.data  Sparse file with each page stored at its natural offset
+ *   <hash>.meta  fc_header_t, the URL, the validator and a page bitmap
+ *
+ * As the validator is part of the hash a changed file simply ends up
+ * in a new entry and the stale one ages out. Entries are kept on a
+ * global LRU and whole files are evicted when the total exceeds the
+ * cache budget. Entries with open handles are never evicted.
+ *
+ * Concurrent handles for the same file (player and thumbnailer, etc)
+ * share the entry. Each handle has its own source handle and a thread
+ * that fetches pages ahead of the read position. A page being fetched
+ * by one handle is waited for by the others instead of fetched twice.
+ *
+ * Files without a validator are cached for as long as they are open.
+ */
+
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <dirent.h>
+#include <errno.h>
 
-#include <arch/threads.h>
+#include "arch/threads.h"
 #include "showtime.h"
 #include "fileaccess.h"
 #include "fa_proto.h"
-#include "misc/redblack.h"
+#include "misc/sha.h"
+#include "misc/minmax.h"
+
+#define PAGE_SHIFT 19
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
 
+#define FC_READAHEAD 16   // Pages fetched ahead of read position
 
-TAILQ_HEAD(cached_segment_queue, cached_segment);
-RB_HEAD(cached_segment_tree, cached_segment);
-TAILQ_HEAD(cache_request_queue, cache_request);
-TAILQ_HEAD(cached_file_queue, cached_file);
+#define FC_MINSIZE (256LL * 1024 * 1024)
+#define FC_MAXSIZE (4096LL * 1024 * 1024)
 
-LIST_HEAD(cached_file_handle_list, cached_file_handle);
+#define FC_MAGIC 0x66636831 // 'fch1'
 
-static char *cachefile;
+TAILQ_HEAD(cache_entry_queue, cache_entry);
+LIST_HEAD(cache_entry_list, cache_entry);
 
 static hts_mutex_t cache_mutex;
+static struct cache_entry_list cache_entries;
+static struct cache_entry_queue cache_lru;
+static int64_t cache_size;
+static int64_t cache_maxsize;
+static char *cache_dir;
 
-static struct cached_file_queue cached_files;
 
-#define PAGE_SHIFT 19
-#define PAGE_SIZE (1 << PAGE_SHIFT)
-#define PAGE_MASK (PAGE_SIZE - 1)
+/**
+ * On disk header of the .meta file
+ */
+typedef struct fc_header {
+  uint32_t fch_magic;
+  uint32_t fch_urllen;
+  uint32_t fch_validatorlen;
+  uint32_t fch_num_pages;
+  int64_t fch_size;
+  int64_t fch_last_access;
+} fc_header_t;
+
 
 /**
- *
+ * A cached file, protected by cache_mutex
  */
-typedef struct cached_page {
-  int cp_file_offset;
-} cached_page_t;
+typedef struct cache_entry {
+  LIST_ENTRY(cache_entry) ce_link;
+  TAILQ_ENTRY(cache_entry) ce_lru_link;
+  uint64_t ce_hash;
+  char *ce_url;
+  char *ce_validator;
+  int64_t ce_size;
+  int64_t ce_bytes;        // Bytes cached
+  time_t ce_last_access;
+  int ce_num_pages;
+  uint8_t *ce_present;     // Page bitmap
+  uint8_t *ce_busy;        // Pages being fetched by some handle
+  int ce_refcount;         // Open handles
+  char ce_dirty;           // Bitmap changed since .meta was written
+  char ce_persistent;
+  hts_cond_t ce_cond;      // Broadcast when a fetch completes
+} cache_entry_t;
 
 
 /**
@@ -64,256 +120,299 @@ typedef struct cached_page {
 typedef struct cached_file {
   fa_handle_t h;
 
-  int cf_ref_count;
-
-  uint64_t cf_pos;
-  hts_cond_t cf_cond_req;
-  hts_cond_t cf_cond_resp;
-  int cf_pending;
-
+  cache_entry_t *cf_ce;
   fa_handle_t *cf_src;
-  uint64_t cf_src_pos;
-
-  uint64_t cf_size;
-  int cf_fd[2];
-  struct cached_segment_tree cf_segments;
-
-  struct cached_segment_queue cf_active_segments;
-  struct cached_segment_queue cf_idle_segments;
-
-  hts_mutex_t cf_mutex;
-
-  int cf_thread_running;
-
-  struct cached_file_handle_list cf_fhs;
+  int cf_fd[2];            // [0] written by fetch thread, [1] read by reader
 
-  cached_page_t *cf_pages;
+  int64_t cf_pos;
 
-  int cf_page_mask;
-  int cf_num_pages;
+  hts_thread_t cf_thread;
+  hts_cond_t cf_cond_req;
+  int cf_running;
+  int cf_error;
 
   prop_t *cf_stats_cachesize;
-  prop_t *cf_stats_cachemax;
 
 } cached_file_t;
 
 
+#define BIT_GET(v, b) ((v)[(b) >> 3] & (1 << ((b) & 7)))
+#define BIT_SET(v, b) ((v)[(b) >> 3] |= (1 << ((b) & 7)))
+#define BIT_CLR(v, b) ((v)[(b) >> 3] &= ~(1 << ((b) & 7)))
+
 
-#if 0
 /**
  *
  */
-static void
-clear_segments(struct cached_segment_queue *q)
+static uint64_t
+ce_digest(const char *url, const char *validator)
 {
-  cached_segment_t *cs;
-  while((cs = TAILQ_FIRST(q)) != NULL) {
-    TAILQ_REMOVE(q, cs, cs_link);
-    free(cs);
-  }
+  union {
+    uint8_t d[20];
+    uint64_t u64;
+  } u;
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, (const uint8_t *)url, strlen(url) + 1);
+  sha1_update(shactx, (const uint8_t *)validator, strlen(validator));
+  sha1_final(shactx, u.d);
+  return u.u64;
 }
-#endif
 
 
 /**
  *
  */
 static void
-cf_setup_segment_vector(cached_file_t *cf)
+ce_path(char *buf, size_t len, uint64_t hash, const char *suffix)
 {
-  int cache_size = 256 * 1024 * 1024;
-  int num_pages = cache_size / PAGE_SIZE;
-  cf->cf_pages = malloc(sizeof(cached_page_t) * num_pages);
-  memset(cf->cf_pages, 0xff, sizeof(cached_page_t) * num_pages);
-  cf->cf_page_mask = num_pages - 1;
-  cf->cf_num_pages = num_pages;
+  snprintf(buf, len, "%s/%016"PRIx64".%s", cache_dir, hash, suffix);
 }
 
+
 /**
  *
  */
 static int
-get_anon_file(int fd[2])
+ce_page_bytes(const cache_entry_t *ce, int page)
 {
-  int rval = 0;
-  hts_mutex_lock(&cache_mutex);
-
-  fd[0] = open(cachefile, O_CREAT | O_TRUNC | O_WRONLY, 0666);
-  fd[1] = open(cachefile, O_RDONLY);
-  
-  if(fd[0] == -1 || fd[1] == -1 || unlink(cachefile)) {
-    
-    if(fd[0] != -1)
-      close(fd[0]);
-    if(fd[1] != -1)
-      close(fd[1]);
-    rval = 1;
-  }
-  hts_mutex_unlock(&cache_mutex);
-  return rval;
+  return MIN(PAGE_SIZE, ce->ce_size - ((int64_t)page << PAGE_SHIFT));
 }
 
 
 /**
- *
+ * Forget a page that turned out not to be in the .data file,
+ * called with cache_mutex held
  */
 static void
-cf_release(cached_file_t *cf)
+ce_page_lost(cache_entry_t *ce, int page)
 {
-  if(atomic_add(&cf->cf_ref_count, -1) > 1)
-    return;
-  
-  close(cf->cf_fd[0]);
-  close(cf->cf_fd[1]);
-  fa_close(cf->cf_src);
-  hts_mutex_destroy(&cf->cf_mutex);
-  hts_cond_destroy(&cf->cf_cond_req);
-  hts_cond_destroy(&cf->cf_cond_resp);
-  prop_ref_dec(cf->cf_stats_cachesize);
-  free(cf);
+  int size = ce_page_bytes(ce, page);
+
+  BIT_CLR(ce->ce_present, page);
+  ce->ce_bytes -= size;
+  cache_size -= size;
+  ce->ce_dirty = 1;
 }
 
 
 /**
  *
  */
-static void
-fac_close(fa_handle_t *handle)
+static cache_entry_t *
+ce_create(uint64_t hash, const char *url, const char *validator, int64_t size)
 {
-  cached_file_t *cf = (cached_file_t *)handle;
-
-  hts_mutex_lock(&cf->cf_mutex);
-  cf->cf_thread_running = 0;
-  hts_cond_signal(&cf->cf_cond_req);
-  hts_mutex_unlock(&cf->cf_mutex);
-  cf_release(cf);
+  cache_entry_t *ce = calloc(1, sizeof(cache_entry_t));
+  int bitmapsize;
+
+  ce->ce_hash = hash;
+  ce->ce_url = strdup(url);
+  ce->ce_validator = strdup(validator);
+  ce->ce_size = size;
+  ce->ce_num_pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  bitmapsize = (ce->ce_num_pages + 7) / 8;
+  ce->ce_present = calloc(1, bitmapsize);
+  ce->ce_busy = calloc(1, bitmapsize);
+  hts_cond_init(&ce->ce_cond, &cache_mutex);
+  LIST_INSERT_HEAD(&cache_entries, ce, ce_link);
+  return ce;
 }
 
 
 /**
- *
+ * Remove entry and its files
  */
-static int64_t
-fac_seek(fa_handle_t *handle, int64_t pos, int whence)
+static void
+ce_destroy(cache_entry_t *ce)
 {
-  cached_file_t *cf = (cached_file_t *)handle;
-  uint64_t np;
+  char path[PATH_MAX];
+
+  assert(ce->ce_refcount == 0);
+
+  ce_path(path, sizeof(path), ce->ce_hash, "meta");
+  unlink(path);
+  ce_path(path, sizeof(path), ce->ce_hash, "data");
+  unlink(path);
+
+  cache_size -= ce->ce_bytes;
+  LIST_REMOVE(ce, ce_link);
+  TAILQ_REMOVE(&cache_lru, ce, ce_lru_link);
+  hts_cond_destroy(&ce->ce_cond);
+  free(ce->ce_url);
+  free(ce->ce_validator);
+  free(ce->ce_present);
+  free(ce->ce_busy);
+  free(ce);
+}
 
-  hts_mutex_lock(&cf->cf_mutex);
 
-  switch(whence) {
-  case SEEK_SET:
-    np = pos;
-    break;
+/**
+ * Write .meta file, called with cache_mutex held
+ */
+static void
+ce_save(cache_entry_t *ce)
+{
+  char path[PATH_MAX], tmp[PATH_MAX + 8];
+  fc_header_t fch;
+  int fd, r;
 
-  case SEEK_CUR:
-    np = cf->cf_pos + pos;
-    break;
+  fch.fch_magic = FC_MAGIC;
+  fch.fch_urllen = strlen(ce->ce_url);
+  fch.fch_validatorlen = strlen(ce->ce_validator);
+  fch.fch_num_pages = ce->ce_num_pages;
+  fch.fch_size = ce->ce_size;
+  fch.fch_last_access = ce->ce_last_access;
 
-  case SEEK_END:
-    np = cf->cf_size + pos;
-    break;
+  ce_path(path, sizeof(path), ce->ce_hash, "meta");
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
 
-  default:
-    hts_mutex_unlock(&cf->cf_mutex);
-    return -1;
-  }
+  if((fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666)) == -1)
+    return;
 
-  if(np < 0) {
-    hts_mutex_unlock(&cf->cf_mutex);
-    return -1;
-  }
+  r = write(fd, &fch, sizeof(fch)) != sizeof(fch) ||
+    write(fd, ce->ce_url, fch.fch_urllen) != fch.fch_urllen ||
+    write(fd, ce->ce_validator, fch.fch_validatorlen) !=
+    fch.fch_validatorlen ||
+    write(fd, ce->ce_present, (ce->ce_num_pages + 7) / 8) !=
+    (ce->ce_num_pages + 7) / 8;
 
-  if(cf->cf_pos != np) {
-    cf->cf_pos = np;
-    hts_cond_signal(&cf->cf_cond_req);
+  close(fd);
+
+  if(r || rename(tmp, path)) {
+    unlink(tmp);
+    return;
   }
-  hts_mutex_unlock(&cf->cf_mutex);
-  return np;
+  ce->ce_dirty = 0;
 }
 
 
 /**
- *
+ * Load a .meta file, returns NULL if it is corrupt
  */
-static int64_t
-fac_fsize(fa_handle_t *handle)
+static cache_entry_t *
+ce_load(uint64_t hash)
 {
-  cached_file_t *cf = (cached_file_t *)handle;
-  return cf->cf_size;
-}
-
+  char path[PATH_MAX];
+  fc_header_t fch;
+  cache_entry_t *ce = NULL;
+  char *url = NULL, *validator = NULL;
+  uint8_t *bitmap = NULL;
+  int fd, bitmapsize;
+
+  ce_path(path, sizeof(path), hash, "meta");
+  if((fd = open(path, O_RDONLY)) == -1)
+    return NULL;
 
-/**
- *
- */
-static int
-cache_page(cached_file_t *cf, int vpage, void *buf)
-{
-  int dpage = vpage & cf->cf_page_mask;
-  cached_page_t *cp = cf->cf_pages + dpage;
-  
-  if(cp->cp_file_offset == vpage)
-    return 0;
+  if(read(fd, &fch, sizeof(fch)) != sizeof(fch) ||
+     fch.fch_magic != FC_MAGIC || fch.fch_urllen > 65536 ||
+     fch.fch_validatorlen > 1024 || fch.fch_size <= 0 ||
+     fch.fch_num_pages != (fch.fch_size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+    goto bad;
 
-  int64_t srcoffset = (int64_t) vpage << PAGE_SHIFT;
-  
-  if(srcoffset >= cf->cf_size)
-    return 0;
+  url = malloc(fch.fch_urllen + 1);
+  validator = malloc(fch.fch_validatorlen + 1);
+  bitmapsize = (fch.fch_num_pages + 7) / 8;
+  bitmap = malloc(bitmapsize);
 
-  cp->cp_file_offset = -1;
-  hts_mutex_unlock(&cf->cf_mutex);
+  if(read(fd, url, fch.fch_urllen) != fch.fch_urllen ||
+     read(fd, validator, fch.fch_validatorlen) != fch.fch_validatorlen ||
+     read(fd, bitmap, bitmapsize) != bitmapsize)
+    goto bad;
 
-  int r;
+  url[fch.fch_urllen] = 0;
+  validator[fch.fch_validatorlen] = 0;
 
-  if(fa_seek(cf->cf_src, srcoffset, SEEK_SET) == srcoffset) {
-    r = fa_read(cf->cf_src, buf, PAGE_SIZE);
-  } else {
-    r = -1;
-  }
+  if(ce_digest(url, validator) != hash)
+    goto bad;
 
-  if(r <= 0) {
-    hts_mutex_lock(&cf->cf_mutex);
-    return -1;
-  }
+  ce = ce_create(hash, url, validator, fch.fch_size);
+  ce->ce_persistent = 1;
+  ce->ce_last_access = fch.fch_last_access;
+  memcpy(ce->ce_present, bitmap, bitmapsize);
 
-  int64_t voff = dpage << PAGE_SHIFT;
+  // Only trust pages that the .data file is large enough to hold
+  struct stat st;
+  ce_path(path, sizeof(path), hash, "data");
+  int64_t datasize = stat(path, &st) ? 0 : st.st_size;
 
-  r = lseek(cf->cf_fd[0], voff, SEEK_SET) != voff ||
-    write(cf->cf_fd[0], buf, r) <= 0;
-  
-  hts_mutex_lock(&cf->cf_mutex);
-  if(r)
-    return -1;
+  for(int i = 0; i < ce->ce_num_pages; i++) {
+    if(!BIT_GET(ce->ce_present, i))
+      continue;
+    if(((int64_t)i << PAGE_SHIFT) + ce_page_bytes(ce, i) > datasize) {
+      BIT_CLR(ce->ce_present, i);
+      ce->ce_dirty = 1;
+    } else {
+      ce->ce_bytes += ce_page_bytes(ce, i);
+    }
+  }
 
-  cp->cp_file_offset = vpage;
-  return 1;
+ bad:
+  close(fd);
+  free(url);
+  free(validator);
+  free(bitmap);
+  return ce;
 }
 
 
 /**
- *
+ * Evict least recently used files until we're within budget,
+ * called with cache_mutex held
  */
 static void
-cache_pages(cached_file_t *cf, void *buf)
+cache_trim(void)
 {
-  int i;
-  int basepage = cf->cf_pos >> PAGE_SHIFT;
-  int ra = 0;
+  cache_entry_t *ce, *prev;
 
-  for(i = 0; i < cf->cf_num_pages - 10; i++) {
-    if(cf->cf_pending == 1 || cf->cf_thread_running == 0)
-      break;
-    int r = cache_page(cf, basepage + i, buf);
-    if(r == -1)
-      break;
-    if(r == 1)
-      prop_set_int(cf->cf_stats_cachesize, ra * PAGE_SIZE);
-    ra++;
+  for(ce = TAILQ_LAST(&cache_lru, cache_entry_queue);
+      ce != NULL && cache_size > cache_maxsize; ce = prev) {
+    prev = TAILQ_PREV(ce, cache_entry_queue, ce_lru_link);
+    if(ce->ce_refcount)
+      continue;
+    TRACE(TRACE_DEBUG, "FACache", "Evicting %s (%"PRId64" bytes)",
+          ce->ce_url, ce->ce_bytes);
+    ce_destroy(ce);
   }
 }
 
 
+/**
+ * Find the next page to fetch at or after the read position,
+ * called with cache_mutex held
+ */
+static int
+cf_next_page(cached_file_t *cf)
+{
+  cache_entry_t *ce = cf->cf_ce;
+  int page = cf->cf_pos >> PAGE_SHIFT;
+  int end = MIN(page + FC_READAHEAD, ce->ce_num_pages);
+
+  for(; page < end; page++)
+    if(!BIT_GET(ce->ce_present, page) && !BIT_GET(ce->ce_busy, page))
+      return page;
+  return -1;
+}
+
+
+/**
+ * Fetch a page from the source into the data file
+ */
+static int
+cf_fetch(cached_file_t *cf, int page, void *buf, int size)
+{
+  int64_t off = (int64_t)page << PAGE_SHIFT;
+
+  if(fa_seek(cf->cf_src, off, SEEK_SET) != off ||
+     fa_read(cf->cf_src, buf, size) != size)
+    return -1;
+
+  if(lseek(cf->cf_fd[0], off, SEEK_SET) != off ||
+     write(cf->cf_fd[0], buf, size) != size)
+    return -1;
+  return 0;
+}
+
+
 /**
  *
  */
@@ -321,73 +420,142 @@ static void *
 fac_thread(void *aux)
 {
   cached_file_t *cf = aux;
+  cache_entry_t *ce = cf->cf_ce;
   void *buf = malloc(PAGE_SIZE);
+  int page, size, r;
 
-  hts_mutex_lock(&cf->cf_mutex);
-
-  while(cf->cf_thread_running == 1) {
+  hts_mutex_lock(&cache_mutex);
 
-    if(cf->cf_pending == 1) {
-      TRACE(TRACE_DEBUG, "Read-ahead", "Cache miss at position %"PRId64,
-	    cf->cf_pos);
+  while(cf->cf_running) {
 
-      if(cache_page(cf, cf->cf_pos >> PAGE_SHIFT, buf) == -1) {
-	cf->cf_pending = 2;
-      } else {
-	cf->cf_pending = 0;
-      }
-      hts_cond_signal(&cf->cf_cond_resp);
+    if(cf->cf_error || (page = cf_next_page(cf)) == -1) {
+      hts_cond_wait(&cf->cf_cond_req, &cache_mutex);
       continue;
     }
 
-    cache_pages(cf, buf);
+    BIT_SET(ce->ce_busy, page);
+    size = ce_page_bytes(ce, page);
+    hts_mutex_unlock(&cache_mutex);
+
+    r = cf_fetch(cf, page, buf, size);
+
+    hts_mutex_lock(&cache_mutex);
+    BIT_CLR(ce->ce_busy, page);
+
+    if(r) {
+      TRACE(TRACE_DEBUG, "FACache", "Unable to fetch page %d of %s",
+            page, ce->ce_url);
+      cf->cf_error = 1;
+    } else {
+      BIT_SET(ce->ce_present, page);
+      ce->ce_bytes += size;
+      ce->ce_dirty = 1;
+      cache_size += size;
+      prop_set_int(cf->cf_stats_cachesize, ce->ce_bytes);
+      cache_trim();
+    }
+    hts_cond_broadcast(&ce->ce_cond);
+  }
+  hts_mutex_unlock(&cache_mutex);
+  free(buf);
+  return NULL;
+}
 
-    if(cf->cf_pending)
-      continue;
 
-    if(cf->cf_thread_running == 0)
-      break;
+/**
+ *
+ */
+static void
+fac_close(fa_handle_t *handle)
+{
+  cached_file_t *cf = (cached_file_t *)handle;
+  cache_entry_t *ce = cf->cf_ce;
+
+  hts_mutex_lock(&cache_mutex);
+  cf->cf_running = 0;
+  hts_cond_signal(&cf->cf_cond_req);
+  hts_mutex_unlock(&cache_mutex);
 
-    hts_cond_wait(&cf->cf_cond_req, &cf->cf_mutex);
+  hts_thread_join(&cf->cf_thread);
+
+  hts_mutex_lock(&cache_mutex);
+  ce->ce_refcount--;
+  if(ce->ce_refcount == 0) {
+    if(!ce->ce_persistent)
+      ce_destroy(ce);
+    else if(ce->ce_dirty)
+      ce_save(ce);
   }
-  hts_mutex_unlock(&cf->cf_mutex);
-  free(buf);
-  cf_release(cf);
-  return NULL; 
+  cache_trim();
+  hts_mutex_unlock(&cache_mutex);
+
+  close(cf->cf_fd[0]);
+  close(cf->cf_fd[1]);
+  fa_close(cf->cf_src);
+  hts_cond_destroy(&cf->cf_cond_req);
+  prop_ref_dec(cf->cf_stats_cachesize);
+  free(cf);
 }
 
 
 /**
  *
  */
-static int
-fac_load(cached_file_t *cf, void *buf, int64_t offset, int size)
+static int64_t
+fac_seek(fa_handle_t *handle, int64_t pos, int whence)
 {
-  int poffset = offset & PAGE_MASK;
-  int vpage = offset >> PAGE_SHIFT;
-  int dpage = vpage & cf->cf_page_mask;
-  
-  cached_page_t *cp = cf->cf_pages + dpage;
+  cached_file_t *cf = (cached_file_t *)handle;
+  int64_t np;
 
-  if(cp->cp_file_offset != vpage)
-    return 0;
+  switch(whence) {
+  case SEEK_SET:
+    np = pos;
+    break;
+
+  case SEEK_CUR:
+    np = cf->cf_pos + pos;
+    break;
 
-  int count = MIN(size, PAGE_SIZE - poffset);
-  int64_t voff = (dpage << PAGE_SHIFT) + poffset;
+  case SEEK_END:
+    np = cf->cf_ce->ce_size + pos;
+    break;
 
-  hts_mutex_unlock(&cf->cf_mutex);
+  default:
+    return -1;
+  }
 
-  int r;
+  if(np < 0)
+    return -1;
 
-  if(lseek(cf->cf_fd[1], voff, SEEK_SET) != voff) {
-    r = 1;
-  } else {
-    r = read(cf->cf_fd[1], buf, count) != count;
+  if(cf->cf_pos != np) {
+    hts_mutex_lock(&cache_mutex);
+    cf->cf_pos = np;
+    cf->cf_error = 0;
+    hts_cond_signal(&cf->cf_cond_req);
+    hts_mutex_unlock(&cache_mutex);
   }
+  return np;
+}
+
+
+/**
+ *
+ */
+static int64_t
+fac_fsize(fa_handle_t *handle)
+{
+  cached_file_t *cf = (cached_file_t *)handle;
+  return cf->cf_ce->ce_size;
+}
+
 
-  hts_mutex_lock(&cf->cf_mutex);
-  
-  return r ? -1 : count;
+/**
+ *
+ */
+static int
+fac_seek_is_fast(fa_handle_t *handle)
+{
+  return 1;
 }
 
 
@@ -398,48 +566,63 @@ static int
 fac_read(fa_handle_t *handle, void *buf, size_t size)
 {
   cached_file_t *cf = (cached_file_t *)handle;
-  uint64_t off = cf->cf_pos;
+  cache_entry_t *ce = cf->cf_ce;
+  int64_t off = cf->cf_pos;
+  int total = 0;
+  int refetched = -1;
 
-  if(off > cf->cf_size) 
+  if(off >= ce->ce_size)
     return 0;
 
-  if(off + size > cf->cf_size)
-    size = cf->cf_size - off;
-
-  int total = size;
+  if(off + size > ce->ce_size)
+    size = ce->ce_size - off;
 
-  hts_mutex_lock(&cf->cf_mutex);
+  hts_mutex_lock(&cache_mutex);
+  cf->cf_error = 0;
 
   while(size > 0) {
-    int r = fac_load(cf, buf, off, size);
+    int page = off >> PAGE_SHIFT;
 
-    if(r == -1) {
-      hts_mutex_unlock(&cf->cf_mutex);
-      return -1;
+    if(!BIT_GET(ce->ce_present, page)) {
+      if(cf->cf_error)
+        break;
+      hts_cond_signal(&cf->cf_cond_req);
+      hts_cond_wait(&ce->ce_cond, &cache_mutex);
+      continue;
     }
 
-    if(r > 0) {
-      size -= r;
-      buf += r;
-      off += r;
-      cf->cf_pos += r;
+    hts_mutex_unlock(&cache_mutex);
+
+    int count = MIN(size, PAGE_SIZE - (off & PAGE_MASK));
+    int r = lseek(cf->cf_fd[1], off, SEEK_SET) != off ||
+      read(cf->cf_fd[1], buf, count) != count;
+
+    hts_mutex_lock(&cache_mutex);
+
+    if(r) {
+      // Page is not really on disk, fetch it again (but only once)
+      if(page == refetched)
+        break;
+      if(BIT_GET(ce->ce_present, page)) {
+        TRACE(TRACE_DEBUG, "FACache", "Page %d of %s missing on disk",
+              page, ce->ce_url);
+        ce_page_lost(ce, page);
+      }
+      refetched = page;
       continue;
     }
 
-    cf->cf_pending = 1;
-    hts_cond_signal(&cf->cf_cond_req);
-    while(cf->cf_pending == 1)
-      hts_cond_wait(&cf->cf_cond_resp, &cf->cf_mutex);
-  
-    if(cf->cf_pending == 2) {
-      hts_mutex_unlock(&cf->cf_mutex);
-      return -1;
-    }
+    size  -= count;
+    buf   += count;
+    off   += count;
+    total += count;
+    cf->cf_pos = off;
   }
 
+  // Let the fetch thread continue ahead of the new position
   hts_cond_signal(&cf->cf_cond_req);
-  hts_mutex_unlock(&cf->cf_mutex);
-  return total;
+  hts_mutex_unlock(&cache_mutex);
+  return total ?: (size ? -1 : 0);
 }
 
 
@@ -452,59 +635,235 @@ static fa_protocol_t fa_protocol_cache = {
   .fap_read  = fac_read,
   .fap_seek  = fac_seek,
   .fap_fsize = fac_fsize,
+  .fap_seek_is_fast = fac_seek_is_fast,
 };
 
 
+/**
+ * Get a validator for the content of the file. Returns -1 if we
+ * can't tell when the file changes
+ */
+static int
+get_validator(const char *url, fa_handle_t *fh, char *buf, size_t len)
+{
+  struct fa_stat fs;
+
+  if(fh->fh_proto->fap_get_validator != NULL)
+    return fh->fh_proto->fap_get_validator(fh, buf, len);
+
+  if(fa_stat(url, &fs, NULL, 0) || fs.fs_mtime == 0)
+    return -1;
+  snprintf(buf, len, "mtime:%"PRId64, (int64_t)fs.fs_mtime);
+  return 0;
+}
+
+
 /**
  *
  */
 fa_handle_t *
 fa_cache_open(const char *url, char *errbuf, size_t errsize, int flags,
-	      struct prop *stats)
+	      struct fa_open_extra *foe)
 {
-  fa_handle_t *fh = fa_open_ex(url, errbuf, errsize, flags | FA_HUGE_BUFFER,
-			       stats);
+  char validator[256];
+  char path[PATH_MAX];
+  cache_entry_t *ce;
+  uint64_t hash;
+  int64_t size;
+  int persistent = 1;
+  int srcflags =
+    flags & ~(FA_BUFFERED_SMALL | FA_BUFFERED_BIG | FA_BUFFERED_NO_PREFETCH);
+
+  if(cache_dir == NULL)
+    return fa_open_ex(url, errbuf, errsize, flags, foe);
+
+  fa_handle_t *fh = fa_open_ex(url, errbuf, errsize, srcflags, foe);
   if(fh == NULL)
     return NULL;
 
-  if(!(fh->fh_proto->fap_flags & FAP_ALLOW_CACHE))
-    return fh;
+  if(!(fh->fh_proto->fap_flags & FAP_ALLOW_CACHE) ||
+     (size = fa_fsize(fh)) <= 0) {
+    // Not cacheable, fall back to regular buffering
+    fa_close(fh);
+    return fa_open_ex(url, errbuf, errsize, flags, foe);
+  }
 
-  TRACE(TRACE_INFO, "RA", "Enabling read-ahead cache for %s", url);
+  if(get_validator(url, fh, validator, sizeof(validator))) {
+    validator[0] = 0;
+    persistent = 0;
+  }
 
   cached_file_t *cf = calloc(1, sizeof(cached_file_t));
-  if(get_anon_file(cf->cf_fd)) {
-    TRACE(TRACE_ERROR, "RA", "Unable to create page file for %s", url);
+
+  hts_mutex_lock(&cache_mutex);
+
+  hash = ce_digest(url, validator);
+
+  LIST_FOREACH(ce, &cache_entries, ce_link)
+    if(ce->ce_hash == hash)
+      break;
+
+  if(ce != NULL && (ce->ce_size != size || strcmp(ce->ce_url, url) ||
+                    strcmp(ce->ce_validator, validator))) {
+    if(ce->ce_refcount) {
+      // Hash collision with an entry in use, don't cache this one
+      hts_mutex_unlock(&cache_mutex);
+      free(cf);
+      fa_close(fh);
+      return fa_open_ex(url, errbuf, errsize, flags, foe);
+    }
+    ce_destroy(ce);
+    ce = NULL;
+  }
+
+  ce_path(path, sizeof(path), hash, "data");
+
+  if(ce == NULL) {
+    ce = ce_create(hash, url, validator, size);
+    ce->ce_persistent = persistent;
+    TAILQ_INSERT_HEAD(&cache_lru, ce, ce_lru_link);
+    cf->cf_fd[0] = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  } else {
+    TAILQ_REMOVE(&cache_lru, ce, ce_lru_link);
+    TAILQ_INSERT_HEAD(&cache_lru, ce, ce_lru_link);
+    cf->cf_fd[0] = open(path, O_CREAT | O_WRONLY, 0666);
+  }
+  cf->cf_fd[1] = open(path, O_RDONLY);
+
+  if(cf->cf_fd[0] == -1 || cf->cf_fd[1] == -1) {
+    TRACE(TRACE_ERROR, "FACache", "Unable to open %s -- %s",
+          path, strerror(errno));
+    if(cf->cf_fd[0] != -1)
+      close(cf->cf_fd[0]);
+    if(cf->cf_fd[1] != -1)
+      close(cf->cf_fd[1]);
+    if(ce->ce_refcount == 0 && ce->ce_bytes == 0)
+      ce_destroy(ce);
+    hts_mutex_unlock(&cache_mutex);
     free(cf);
-    return fh;
+    fa_close(fh);
+    return fa_open_ex(url, errbuf, errsize, flags, foe);
   }
 
-  hts_mutex_init(&cf->cf_mutex);
-  hts_cond_init(&cf->cf_cond_req, &cf->cf_mutex);
-  hts_cond_init(&cf->cf_cond_resp, &cf->cf_mutex);
+  ce->ce_refcount++;
+  ce->ce_last_access = time(NULL);
+  ce->ce_dirty = 1;
 
-  cf_setup_segment_vector(cf);
+  TRACE(TRACE_DEBUG, "FACache", "Opened %s, %"PRId64" of %"PRId64" bytes "
+        "cached%s", url, ce->ce_bytes, size,
+        persistent ? "" : " (no validator, not persistent)");
 
-  // File we cache 
+  cf->cf_ce = ce;
+  cf->cf_src = fh;
+  cf->h.fh_proto = &fa_protocol_cache;
 
-  if(stats != NULL) {
+  if(foe != NULL && foe->foe_stats != NULL) {
+    prop_t *stats = foe->foe_stats;
     cf->cf_stats_cachesize =
       prop_ref_inc(prop_create(stats, "cacheSizeCurrent"));
     prop_set_int(prop_create(stats, "cacheSizeValid"), 1);
-    prop_set_int(prop_create(stats, "cacheSizeMax"),
-		 cf->cf_num_pages * PAGE_SIZE);
+    prop_set_int(prop_create(stats, "cacheSizeMax"), size);
+    prop_set_int(cf->cf_stats_cachesize, ce->ce_bytes);
   }
 
-  cf->cf_src = fh;
-  cf->cf_size = fa_fsize(fh);
-  // Boot thread
+  hts_cond_init(&cf->cf_cond_req, &cache_mutex);
+  cf->cf_running = 1;
+  hts_thread_create_joinable("facache", &cf->cf_thread, fac_thread, cf,
+                             THREAD_PRIO_FILESYSTEM);
+  hts_mutex_unlock(&cache_mutex);
+  return &cf->h;
+}
 
-  cf->cf_ref_count = 2;
-  cf->cf_thread_running = 1;
-  hts_thread_create_detached("facache", fac_thread, cf, THREAD_PRIO_NORMAL);
 
-  cf->h.fh_proto = &fa_protocol_cache;
-  return &cf->h;
+/**
+ *
+ */
+static int
+ce_lru_cmp(const cache_entry_t *a, const cache_entry_t *b)
+{
+  if(a->ce_last_access > b->ce_last_access)
+    return -1;
+  return a->ce_last_access < b->ce_last_access;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+fa_cache_compute_maxsize(uint64_t current_size)
+{
+  char path[PATH_MAX];
+  fa_fsinfo_t ffi;
+
+  snprintf(path, sizeof(path), "file://%s", cache_dir);
+  if(!fa_fsinfo(path, &ffi)) {
+    uint64_t avail = ffi.ffi_avail + current_size;
+    return MAX(FC_MINSIZE, MIN(avail / 10, FC_MAXSIZE));
+  }
+  return FC_MINSIZE;
+}
+
+
+/**
+ * Load index of cached files and remove leftovers from unclean exits
+ */
+static void
+fa_cache_load(void)
+{
+  struct dirent *d;
+  cache_entry_t *ce;
+  char path[PATH_MAX];
+  uint64_t hash;
+  DIR *dir;
+  int items = 0;
+
+  if((dir = opendir(cache_dir)) == NULL)
+    return;
+
+  while((d = readdir(dir)) != NULL) {
+    char suffix[8];
+    if(sscanf(d->d_name, "%016"SCNx64".%7s", &hash, suffix) != 2 ||
+       strcmp(suffix, "meta"))
+      continue;
+
+    if((ce = ce_load(hash)) == NULL) {
+      ce_path(path, sizeof(path), hash, "meta");
+      unlink(path);
+      continue;
+    }
+    TAILQ_INSERT_SORTED(&cache_lru, ce, ce_lru_link, ce_lru_cmp,
+                        cache_entry_t);
+    cache_size += ce->ce_bytes;
+    items++;
+  }
+
+  rewinddir(dir);
+
+  while((d = readdir(dir)) != NULL) {
+    if(d->d_name[0] == '.')
+      continue;
+
+    if(sscanf(d->d_name, "%016"SCNx64".", &hash) == 1) {
+      LIST_FOREACH(ce, &cache_entries, ce_link)
+        if(ce->ce_hash == hash)
+          break;
+      if(ce != NULL && strstr(d->d_name, ".tmp") == NULL)
+        continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, d->d_name);
+    unlink(path);
+  }
+  closedir(dir);
+
+  cache_maxsize = fa_cache_compute_maxsize(cache_size);
+  cache_trim();
+
+  TRACE(TRACE_INFO, "FACache",
+        "Initialized: %d files consuming %.2f MB "
+        "(out of maximum %.2f MB) in %s",
+        items, cache_size / 1000000.0, cache_maxsize / 1000000.0,
+        cache_dir);
 }
 
 
@@ -514,14 +873,24 @@ fa_cache_open(const char *url, char *errbuf, size_t errsize, int flags,
 void
 fa_cache_init(void)
 {
-  char path[200];
+  char path[PATH_MAX];
 
-  snprintf(path, sizeof(path), "%s/facache", showtime_cache_path);
-  mkdir(path, 0777);
-  snprintf(path, sizeof(path), "%s/facache/tmp", showtime_cache_path);
-
-  cachefile = strdup(path);
-  
   hts_mutex_init(&cache_mutex);
-  TAILQ_INIT(&cached_files);
+  LIST_INIT(&cache_entries);
+  TAILQ_INIT(&cache_lru);
+
+  if(gconf.cache_path == NULL)
+    return;
+
+  snprintf(path, sizeof(path), "%s/facache", gconf.cache_path);
+  if(mkdir(path, 0777) && errno != EEXIST) {
+    TRACE(TRACE_ERROR, "FACache", "Unable to create cache dir %s -- %s",
+	  path, strerror(errno));
+    return;
+  }
+
+  cache_dir = strdup(path);
+  hts_mutex_lock(&cache_mutex);
+  fa_cache_load();
+  hts_mutex_unlock(&cache_mutex);
 }
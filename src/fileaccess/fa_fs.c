@@ -122,6 +122,7 @@ fs_scandir(fa_protocol_t *fap, fa_dir_t *fd, const char *url,
   char buf[URL_MAX];
   struct stat st;
   struct dirent *d;
+  fa_dir_entry_t *fde;
   int type;
   DIR *dir;
   int split_num;
@@ -137,6 +138,8 @@ fs_scandir(fa_protocol_t *fap, fa_dir_t *fd, const char *url,
     if(stat(buf, &st))
       continue;
 
+    split_num = 0;
+
     switch(st.st_mode & S_IFMT) {
     case S_IFDIR:
       type = CONTENT_DIR;
@@ -159,7 +162,15 @@ fs_scandir(fa_protocol_t *fap, fa_dir_t *fd, const char *url,
     }
 
     fs_urlsnprintf(buf, sizeof(buf), "file://", url, d->d_name);
-    fa_dir_add(fd, buf, d->d_name, type);
+    fde = fa_dir_add(fd, buf, d->d_name, type);
+
+    // We already paid for the stat(), keep it unless it's a split file
+    if(fde != NULL && split_num <= 0) {
+      fde->fde_stat.fs_size = st.st_size;
+      fde->fde_stat.fs_mtime = st.st_mtime;
+      fde->fde_stat.fs_type = type;
+      fde->fde_statdone = 1;
+    }
   }
   closedir(dir);
   return 0;
@@ -478,9 +489,8 @@ fs_rename(const fa_protocol_t *fap, const char *old, const char *new,
 }
 
 /**
- * FS change notification 
+ * FS change notification
  */
-#if 0
 #if ENABLE_INOTIFY
 #include <sys/inotify.h>
 #include <poll.h>
@@ -491,105 +501,135 @@ typedef struct notify_created_file {
 
 } notify_created_file_t;
 
+LIST_HEAD(notify_created_file_list, notify_created_file);
+
+typedef struct fs_notify_aux {
+  fa_handle_t h;
+
+  void *opaque;
+  void (*change)(void *opaque,
+		 fa_notify_op_t op,
+		 const char *filename,
+		 const char *url,
+		 int type);
+
+  char *url;
+  int ifd;
+  int pipe[2];
+  hts_thread_t tid;
+} fs_notify_aux_t;
 
 
+/**
+ * Translate one inotify event into calls to the change callback
+ *
+ * Files that are created are not reported until they are closed after
+ * writing so we don't probe half written files
+ */
 static void
-fs_notify(struct fa_protocol *fap, const char *url,
-	  void *opaque,
-	  void (*change)(void *opaque,
-			 fa_notify_op_t op, 
-			 const char *filename,
-			 const char *url,
-			 int type),
-	  int (*breakcheck)(void *opaque))
-{
-  int fd, n;
-  char buf[1024];
-  char buf2[URL_MAX];
-  struct pollfd fds;
-  struct inotify_event *e;
-  LIST_HEAD(, notify_created_file) pending_create;
+fs_notify_event(fs_notify_aux_t *fna, const struct inotify_event *e,
+		struct notify_created_file_list *pending_create)
+{
+  char url[URL_MAX];
   notify_created_file_t *ncf;
+  int type = e->mask & IN_ISDIR ? CONTENT_DIR : CONTENT_FILE;
 
-  if((fd = inotify_init()) == -1)
+  if(e->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) {
+    // We lost track, let the receiver rescan
+    fna->change(fna->opaque, FA_NOTIFY_DIR_CHANGE, NULL, NULL, 0);
     return;
+  }
 
-  fds.fd = fd;
-  fds.events = POLLIN;
-
-  if(inotify_add_watch(fd, url, IN_ONLYDIR | IN_CREATE | IN_CLOSE_WRITE | 
-		       IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) == -1) {
-    TRACE(TRACE_DEBUG, "FS", "Unable to watch %s -- %s",
-	  url, strerror(errno));
+  if(e->len == 0)
     return;
+
+  fs_urlsnprintf(url, sizeof(url), "file://", fna->url, e->name);
+
+  if(e->mask & IN_CREATE) {
+    if(e->mask & IN_ISDIR) {
+      TRACE(TRACE_DEBUG, "FS", "Directory %s created in %s",
+	    e->name, fna->url);
+      fna->change(fna->opaque, FA_NOTIFY_ADD, e->name, url, CONTENT_DIR);
+    } else {
+      ncf = malloc(sizeof(notify_created_file_t));
+      ncf->name = strdup(e->name);
+      LIST_INSERT_HEAD(pending_create, ncf, link);
+    }
   }
 
-  LIST_INIT(&pending_create);
-  
-  while(1) {
-    n = poll(&fds, 1, 1000);
-    
-    if(n < 0)
-      break;
+  if(e->mask & IN_CLOSE_WRITE) {
+
+    LIST_FOREACH(ncf, pending_create, link)
+      if(!strcmp(ncf->name, e->name))
+	break;
+
+    if(ncf != NULL) {
+      TRACE(TRACE_DEBUG, "FS", "File %s created in %s", e->name, fna->url);
+      fna->change(fna->opaque, FA_NOTIFY_ADD, e->name, url, CONTENT_FILE);
+      LIST_REMOVE(ncf, link);
+      free(ncf->name);
+      free(ncf);
+    } else {
+      TRACE(TRACE_DEBUG, "FS", "File %s modified in %s", e->name, fna->url);
+      fna->change(fna->opaque, FA_NOTIFY_CHANGE, e->name, url, CONTENT_FILE);
+    }
+  }
 
-    if(breakcheck(opaque))
-      break;
+  if(e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    TRACE(TRACE_DEBUG, "FS", "File %s removed from %s", e->name, fna->url);
+    fna->change(fna->opaque, FA_NOTIFY_DEL, e->name, url, type);
+  }
 
-    if(n != 1)
-      continue;
-      
-    n = read(fd, buf, sizeof(buf));
-    e = (struct inotify_event *)&buf[0];
+  if(e->mask & IN_MOVED_TO) {
+    TRACE(TRACE_DEBUG, "FS", "File %s moved in to %s", e->name, fna->url);
+    fna->change(fna->opaque, FA_NOTIFY_ADD, e->name, url, type);
+  }
+}
 
-    if(e->len == 0)
-      continue;
 
-    fs_urlsnprintf(buf2, sizeof(buf2), "file://", url, e->name);
-
-    if(e->mask & IN_CREATE) {
-      if(e->mask & IN_ISDIR) {
-	TRACE(TRACE_DEBUG, "FS", "Directory %s created in %s", e->name, url);
-	change(opaque, FA_NOTIFY_ADD, e->name, buf2, CONTENT_DIR);
-      } else {
-	ncf = malloc(sizeof(notify_created_file_t));
-	ncf->name = strdup(e->name);
-	LIST_INSERT_HEAD(&pending_create, ncf, link);
-	TRACE(TRACE_DEBUG, "FS", "File %s created in %s", e->name, url);
-      }
-    }
+/**
+ *
+ */
+static void *
+fs_notify_thread(void *aux)
+{
+  fs_notify_aux_t *fna = aux;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2];
+  struct notify_created_file_list pending_create;
+  notify_created_file_t *ncf;
+  int n;
 
-    if(e->mask & IN_CLOSE_WRITE) {
+  LIST_INIT(&pending_create);
 
-      LIST_FOREACH(ncf, &pending_create, link) 
-	if(!strcmp(ncf->name, e->name))
-	  break;
+  fds[0].fd = fna->ifd;
+  fds[0].events = POLLIN;
+  fds[1].fd = fna->pipe[0];
+  fds[1].events = POLLIN;
 
-      if(ncf != NULL) {
-	TRACE(TRACE_DEBUG, "FS", "File %s created and closed", e->name);
-	change(opaque, FA_NOTIFY_ADD, e->name, buf2, 
-	       e->mask & IN_ISDIR ? CONTENT_DIR : CONTENT_FILE);
-	LIST_REMOVE(ncf, link);
-	free(ncf->name);
-	free(ncf);
-      }
+  while(1) {
+    n = poll(fds, 2, -1);
+    if(n < 0) {
+      if(errno == EINTR)
+	continue;
+      break;
     }
 
-    if(e->mask & IN_DELETE) {
-      TRACE(TRACE_DEBUG, "FS", "File %s deleted", e->name);
-      change(opaque, FA_NOTIFY_DEL, e->name, buf2, 
-	     e->mask & IN_ISDIR ? CONTENT_DIR : CONTENT_FILE);
-    }
+    if(fds[1].revents)
+      break;
 
-    if(e->mask & IN_MOVED_FROM) {
-      TRACE(TRACE_DEBUG, "FS", "File %s moved away from %s", e->name, url);
-      change(opaque, FA_NOTIFY_DEL, e->name, buf2, 
-	     e->mask & IN_ISDIR ? CONTENT_DIR : CONTENT_FILE);
-    }
+    if(!(fds[0].revents & POLLIN))
+      continue;
 
-    if(e->mask & IN_MOVED_TO) {
-      TRACE(TRACE_DEBUG, "FS", "File %s moved in to %s", e->name, url);
-      change(opaque, FA_NOTIFY_ADD, e->name, buf2, 
-	     e->mask & IN_ISDIR ? CONTENT_DIR : CONTENT_FILE);
+    n = read(fna->ifd, buf, sizeof(buf));
+    if(n <= 0)
+      break;
+
+    const char *p = buf;
+    while(p < buf + n) {
+      const struct inotify_event *e = (const struct inotify_event *)p;
+      fs_notify_event(fna, e, &pending_create);
+      p += sizeof(struct inotify_event) + e->len;
     }
   }
 
@@ -598,11 +638,74 @@ fs_notify(struct fa_protocol *fap, const char *url,
     free(ncf->name);
     free(ncf);
   }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static fa_handle_t *
+fs_notify_start(struct fa_protocol *fap, const char *url,
+                void *opaque,
+                void (*change)(void *opaque,
+                               fa_notify_op_t op,
+                               const char *filename,
+                               const char *url,
+                               int type))
+{
+  int fd;
 
-  close(fd);
+  if((fd = inotify_init()) == -1)
+    return NULL;
+
+  if(inotify_add_watch(fd, url, IN_ONLYDIR | IN_CREATE | IN_CLOSE_WRITE |
+		       IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+		       IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+    TRACE(TRACE_DEBUG, "FS", "Unable to watch %s -- %s",
+	  url, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  fs_notify_aux_t *fna = calloc(1, sizeof(fs_notify_aux_t));
+
+  if(pipe(fna->pipe)) {
+    close(fd);
+    free(fna);
+    return NULL;
+  }
+
+  fna->h.fh_proto = fap;
+  fna->opaque = opaque;
+  fna->change = change;
+  fna->url = strdup(url);
+  fna->ifd = fd;
+
+  hts_thread_create_joinable("fs notify", &fna->tid, fs_notify_thread, fna,
+			     THREAD_PRIO_BGTASK);
+  return &fna->h;
+}
+
+
+/**
+ * Returns when the watcher thread has exited, so the change callback
+ * will never be invoked after this
+ */
+static void
+fs_notify_stop(fa_handle_t *fh)
+{
+  fs_notify_aux_t *fna = (fs_notify_aux_t *)fh;
+  if(write(fna->pipe[1], "", 1) != 1)
+    TRACE(TRACE_ERROR, "FS", "Unable to stop watcher for %s", fna->url);
+  hts_thread_join(&fna->tid);
+  close(fna->pipe[0]);
+  close(fna->pipe[1]);
+  close(fna->ifd);
+  free(fna->url);
+  free(fna);
 }
 
-#endif
 #endif
 
 #if ENABLE_FSEVENTS
@@ -650,6 +753,7 @@ fs_notify_start(struct fa_protocol *fap, const char *url,
 {
   FSEventStreamContext ctx = {0};
   struct fs_notify_aux *fna = calloc(1, sizeof(struct fs_notify_aux));
+  fna->h.fh_proto = fap;
   fna->opaque = opaque;
   fna->change = change;
   ctx.info = fna;
@@ -833,10 +937,7 @@ fa_protocol_t fa_protocol_fs = {
   .fap_unlink= fs_unlink,
   .fap_rmdir = fs_rmdir,
   .fap_rename = fs_rename,
-#if ENABLE_INOTIFY
-  //  .fap_notify = fs_notify,
-#endif
-#if ENABLE_FSEVENTS
+#if ENABLE_INOTIFY || ENABLE_FSEVENTS
   .fap_notify_start = fs_notify_start,
   .fap_notify_stop  = fs_notify_stop,
 #endif
@@ -28,12 +28,16 @@
 #endif
 #include <assert.h>
 #include <zlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "showtime.h"
 
 #include "keyring.h"
 #include "fileaccess.h"
 #include "networking/net.h"
+#include "networking/asyncio.h"
 #include "fa_proto.h"
 #include "task.h"
 #include "htsmsg/htsmsg_xml.h"
@@ -94,25 +98,105 @@ static int http_tokenize(char *buf, char **vec, int vecsize, int delimiter);
   } while(0)
 
 /**
- * Connection parking
+ * Connection pool
+ *
+ * Connections are grouped per (hostname, port, ssl) in a small hash
+ * table so checkout does not depend on how many connections other hosts
+ * have parked. Each host has a limit on how many connections may be idle
+ * and how many may be in use at once. Idle connections whose keep-alive
+ * has run out are closed from a callout.
+ *
+ * When a host is at its active limit, GET requests issued with
+ * FA_PIPELINE may be queued behind a request in flight on one of its
+ * connections instead of waiting for a connection to be returned.
  */
-TAILQ_HEAD(http_connection_queue , http_connection);
+#ifndef HTTP_MAX_IDLE_PER_HOST
+#define HTTP_MAX_IDLE_PER_HOST   4
+#endif
+
+#ifndef HTTP_MAX_ACTIVE_PER_HOST
+#define HTTP_MAX_ACTIVE_PER_HOST 6
+#endif
+
+#ifndef HTTP_MAX_IDLE
+#define HTTP_MAX_IDLE            16
+#endif
+
+#ifndef HTTP_PIPELINE_DEPTH
+#define HTTP_PIPELINE_DEPTH      4
+#endif
+
+#define HTTP_HOST_HASH_SIZE      64
+#define HTTP_ACTIVE_WAIT         2000 // ms to wait for a free connection
+#define HTTP_EXPIRE_INTERVAL     5
 
-static struct http_connection_queue http_connections;
+LIST_HEAD(http_host_list, http_host);
+LIST_HEAD(http_connection_list, http_connection);
+TAILQ_HEAD(http_connection_queue, http_connection);
+
+static struct http_host_list http_hosts[HTTP_HOST_HASH_SIZE];
+static struct http_connection_queue http_idle_connections;
 static int http_parked_connections;
 static hts_mutex_t http_connections_mutex;
 static int http_connection_tally;
+static callout_t http_expire_timer;
+
+static int http_stat_checkouts;
+static int http_stat_reused;
+static int http_stat_pipelined;
+static int http_stat_connects;
+static int64_t http_stat_connect_time;
+
+static prop_t *http_prop_checkouts;
+static prop_t *http_prop_reused;
+static prop_t *http_prop_pipelined;
+static prop_t *http_prop_connects;
+static prop_t *http_prop_connect_latency;
+static prop_t *http_prop_idle;
+
+typedef struct http_host {
+  LIST_ENTRY(http_host) hh_link;
+
+  struct http_connection_queue hh_idle;   // Least recently parked first
+  struct http_connection_list hh_active;
+  int hh_num_idle;
+  int hh_num_active;
+  int hh_waiters;        // Waiting for a connection or on a pipeline
+  hts_cond_t hh_cond;
+
+  char hh_hostname[HOSTNAME_MAX];
+  int hh_port;
+  char hh_ssl;
+  char hh_persistent;   // Server has kept a connection alive
+  char hh_no_pipeline;  // A pipelined request failed, don't try again
+
+} http_host_t;
 
 typedef struct http_connection {
   char hc_hostname[HOSTNAME_MAX];
   int hc_port;
   int hc_id;
   tcpcon_t *hc_tc;
+  http_host_t *hc_host;
 
-  TAILQ_ENTRY(http_connection) hc_link;
+  TAILQ_ENTRY(http_connection) hc_link;       // hh_idle
+  TAILQ_ENTRY(http_connection) hc_idle_link;  // http_idle_connections
+  LIST_ENTRY(http_connection) hc_active_link; // hh_active
 
   char hc_ssl;
   char hc_reused;
+  char hc_pipeline;  // Request in flight allows others to queue behind it
+  char hc_broken;    // Queued requests must not use this connection
+  char hc_detached;  // No longer counted as active, last user destroys
+
+  /**
+   * Pipelining. Requests are written in ticket order and responses
+   * are read by whoever holds hc_turn
+   */
+  int hc_queued;
+  int hc_ticket;
+  int hc_turn;
+  hts_mutex_t hc_write_mutex;
 
   time_t hc_reuse_before;
 
@@ -147,6 +231,7 @@ typedef struct http_file {
   int64_t hf_consecutive_read;
 
   char *hf_content_type;
+  char *hf_etag;
 
   /* The negotiated connection mode (ie, what the server replied with) */
   enum {
@@ -178,6 +263,9 @@ typedef struct http_file {
 
   char hf_no_retries;
 
+  char hf_pipeline;   // Request may be queued on a busy connection
+  char hf_pipelined;  // Queued, must go through http_pipeline_send()
+
   char hf_req_compression;
   
   char hf_content_encoding;
@@ -214,54 +302,215 @@ http_connection_destroy(http_connection_t *hc, int dbg, const char *reason)
   HTTP_TRACE(dbg, "Disconnected from %s:%d (id=%d) %s",
 	     hc->hc_hostname, hc->hc_port, hc->hc_id, reason);
   tcp_close(hc->hc_tc);
+  hts_mutex_destroy(&hc->hc_write_mutex);
   free(hc);
 }
 
 
+/**
+ * Must be called with http_connections_mutex held
+ */
+static void
+http_pool_update_stats(void)
+{
+  prop_set_int(http_prop_checkouts, http_stat_checkouts);
+  prop_set_int(http_prop_reused, http_stat_reused);
+  prop_set_int(http_prop_pipelined, http_stat_pipelined);
+  prop_set_int(http_prop_connects, http_stat_connects);
+  prop_set_int(http_prop_idle, http_parked_connections);
+  if(http_stat_connects)
+    prop_set_int(http_prop_connect_latency,
+                 http_stat_connect_time / http_stat_connects / 1000);
+}
+
+
+/**
+ * Must be called with http_connections_mutex held
+ */
+static http_host_t *
+http_host_find(const char *hostname, int port, int ssl)
+{
+  http_host_t *hh;
+  unsigned int h = port + ssl;
+  const char *s;
+
+  for(s = hostname; *s; s++)
+    h = h * 33 + *s;
+  h &= HTTP_HOST_HASH_SIZE - 1;
+
+  LIST_FOREACH(hh, &http_hosts[h], hh_link)
+    if(hh->hh_port == port && hh->hh_ssl == ssl &&
+       !strcmp(hh->hh_hostname, hostname))
+      return hh;
+
+  hh = calloc(1, sizeof(http_host_t));
+  snprintf(hh->hh_hostname, sizeof(hh->hh_hostname), "%s", hostname);
+  hh->hh_port = port;
+  hh->hh_ssl = ssl;
+  TAILQ_INIT(&hh->hh_idle);
+  LIST_INIT(&hh->hh_active);
+  hts_cond_init(&hh->hh_cond, &http_connections_mutex);
+  LIST_INSERT_HEAD(&http_hosts[h], hh, hh_link);
+  return hh;
+}
+
+
+/**
+ * Must be called with http_connections_mutex held
+ */
+static void
+http_connection_unpark(http_connection_t *hc)
+{
+  http_host_t *hh = hc->hc_host;
+
+  TAILQ_REMOVE(&hh->hh_idle, hc, hc_link);
+  TAILQ_REMOVE(&http_idle_connections, hc, hc_idle_link);
+  hh->hh_num_idle--;
+  http_parked_connections--;
+}
+
+
+/**
+ * Stop counting connection as active. Returns 1 if caller should
+ * destroy it, otherwise the last queued request will do that.
+ *
+ * Must be called with http_connections_mutex held
+ */
+static int
+http_connection_detach_locked(http_connection_t *hc)
+{
+  http_host_t *hh = hc->hc_host;
+
+  LIST_REMOVE(hc, hc_active_link);
+  hh->hh_num_active--;
+  hc->hc_detached = 1;
+  hc->hc_broken = 1;
+  hts_cond_broadcast(&hh->hh_cond);
+  return hc->hc_queued == 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_connection_destroy_list(struct http_connection_queue *q, int dbg,
+                             const char *reason)
+{
+  http_connection_t *hc;
+
+  while((hc = TAILQ_FIRST(q)) != NULL) {
+    TAILQ_REMOVE(q, hc, hc_link);
+    http_connection_destroy(hc, dbg, reason);
+  }
+}
+
 
 /**
+ * Get a connection to the given host.
  *
+ * If *pipelined is set on return the connection is in use by another
+ * request. The caller must then go through http_pipeline_send() before
+ * reading the response.
  */
 static http_connection_t *
 http_connection_get(const char *hostname, int port, int ssl,
 		    char *errbuf, int errlen, int dbg, int timeout,
-                    cancellable_t *c)
+                    cancellable_t *c, int pipeline, int *pipelined)
 {
-  http_connection_t *hc, *next;
+  struct http_connection_queue expired;
+  http_connection_t *hc;
+  http_host_t *hh;
   tcpcon_t *tc;
   int id;
   time_t now;
+  int64_t ts = showtime_get_ts();
+  const int64_t deadline = ts + MIN(timeout, HTTP_ACTIVE_WAIT) * 1000LL;
 
-  time(&now);
+  TAILQ_INIT(&expired);
+  *pipelined = 0;
 
   hts_mutex_lock(&http_connections_mutex);
 
-  for(hc = TAILQ_FIRST(&http_connections); hc != NULL; hc = next) {
-    next = TAILQ_NEXT(hc, hc_link);
+  hh = http_host_find(hostname, port, ssl);
+  http_stat_checkouts++;
 
-    if(now >= hc->hc_reuse_before) {
-      TAILQ_REMOVE(&http_connections, hc, hc_link);
-      http_parked_connections--;
-      http_connection_destroy(hc, dbg, "Keep alive expired");
-      continue;
+  while(1) {
+    time(&now);
+
+    /*
+     * Most recently parked first, it's the one least likely to have
+     * been closed by the server
+     */
+    while((hc = TAILQ_LAST(&hh->hh_idle, http_connection_queue)) != NULL) {
+      http_connection_unpark(hc);
+      if(now < hc->hc_reuse_before)
+        break;
+      TAILQ_INSERT_TAIL(&expired, hc, hc_link);
     }
 
-    if(!strcmp(hc->hc_hostname, hostname) && hc->hc_port == port &&
-       hc->hc_ssl == ssl) {
-      TAILQ_REMOVE(&http_connections, hc, hc_link);
-      http_parked_connections--;
+    if(hc != NULL) {
+      hc->hc_reused = 1;
+      hc->hc_pipeline = 0;
+      hc->hc_ticket = 1;
+      hc->hc_turn = 0;
+      LIST_INSERT_HEAD(&hh->hh_active, hc, hc_active_link);
+      hh->hh_num_active++;
+      http_stat_reused++;
+      http_pool_update_stats();
       hts_mutex_unlock(&http_connections_mutex);
+
+      http_connection_destroy_list(&expired, dbg, "Keep alive expired");
       HTTP_TRACE(dbg, "Reusing connection to %s:%d (id=%d)",
 		 hc->hc_hostname, hc->hc_port, hc->hc_id);
-      hc->hc_reused = 1;
       tcp_set_cancellable(hc->hc_tc, c);
       return hc;
     }
+
+    if(hh->hh_num_active < HTTP_MAX_ACTIVE_PER_HOST)
+      break;
+
+    if(pipeline && !ssl && hh->hh_persistent && !hh->hh_no_pipeline) {
+      LIST_FOREACH(hc, &hh->hh_active, hc_active_link)
+        if(hc->hc_pipeline && !hc->hc_broken &&
+           hc->hc_queued < HTTP_PIPELINE_DEPTH)
+          break;
+
+      if(hc != NULL) {
+        hc->hc_queued++;
+        hh->hh_waiters++;
+        http_stat_pipelined++;
+        http_pool_update_stats();
+        hts_mutex_unlock(&http_connections_mutex);
+
+        http_connection_destroy_list(&expired, dbg, "Keep alive expired");
+        HTTP_TRACE(dbg, "Pipelining request to %s:%d (id=%d)",
+                   hc->hc_hostname, hc->hc_port, hc->hc_id);
+        *pipelined = 1;
+        return hc;
+      }
+    }
+
+    /*
+     * Host is busy. Wait a while for a connection to be returned but
+     * don't wait forever, the caller might be holding one of them
+     */
+    int64_t remain = deadline - showtime_get_ts();
+    if(remain <= 0 || cancellable_is_cancelled(c))
+      break;
+
+    hh->hh_waiters++;
+    hts_cond_wait_timeout(&hh->hh_cond, &http_connections_mutex,
+                          MIN(remain / 1000, 250) + 1);
+    hh->hh_waiters--;
   }
 
+  hh->hh_num_active++;
   id = ++http_connection_tally;
   hts_mutex_unlock(&http_connections_mutex);
 
+  http_connection_destroy_list(&expired, dbg, "Keep alive expired");
+
   if(errbuf == NULL || errlen == 0) {
     char xerrbuf[256];
     errbuf = xerrbuf;
@@ -275,67 +524,291 @@ http_connection_get(const char *hostname, int port, int ssl,
   if(ssl)
     tcp_connect_flags |= TCP_SSL;
 
+  ts = showtime_get_ts();
+
   if((tc = tcp_connect(hostname, port, errbuf, errlen,
                         timeout, tcp_connect_flags, c)) == NULL) {
     HTTP_TRACE(dbg, "Connection to %s:%d failed -- %s", hostname, port, errbuf);
+    hts_mutex_lock(&http_connections_mutex);
+    hh->hh_num_active--;
+    hts_cond_broadcast(&hh->hh_cond);
+    hts_mutex_unlock(&http_connections_mutex);
     return NULL;
   }
   HTTP_TRACE(dbg, "Connected to %s:%d (id=%d)", hostname, port, id);
 
-  hc = malloc(sizeof(http_connection_t));
+  hc = calloc(1, sizeof(http_connection_t));
   snprintf(hc->hc_hostname, sizeof(hc->hc_hostname), "%s", hostname);
   hc->hc_port = port;
   hc->hc_ssl = ssl;
   hc->hc_tc = tc;
-  hc->hc_reused = 0;
   hc->hc_id = id;
+  hc->hc_host = hh;
+  hc->hc_ticket = 1;
+  hts_mutex_init(&hc->hc_write_mutex);
+
+  hts_mutex_lock(&http_connections_mutex);
+  LIST_INSERT_HEAD(&hh->hh_active, hc, hc_active_link);
+  http_stat_connects++;
+  http_stat_connect_time += showtime_get_ts() - ts;
+  http_pool_update_stats();
+  hts_mutex_unlock(&http_connections_mutex);
   return hc;
 }
 
 
 /**
- *
+ * Return a connection that still can be used for another request
  */
 static void
 http_connection_park(http_connection_t *hc, int dbg, int max_age)
 {
+  struct http_connection_queue evicted;
+  http_host_t *hh = hc->hc_host;
   time_t now;
-  http_connection_t *next;
 
   time(&now);
+  TAILQ_INIT(&evicted);
 
   tcp_set_cancellable(hc->hc_tc, NULL);
 
+  hts_mutex_lock(&http_connections_mutex);
+
+  hh->hh_persistent = 1;
+
+  if(hc->hc_broken) {
+    int destroy = http_connection_detach_locked(hc);
+    hts_mutex_unlock(&http_connections_mutex);
+    if(destroy)
+      http_connection_destroy(hc, dbg, "Pipeline broken");
+    return;
+  }
+
+  if(hc->hc_queued > 0) {
+    // Next pipelined request may read its response
+    hc->hc_turn++;
+    hts_cond_broadcast(&hh->hh_cond);
+    hts_mutex_unlock(&http_connections_mutex);
+    HTTP_TRACE(dbg, "Passing connection to %s:%d (id=%d) to queued request",
+               hc->hc_hostname, hc->hc_port, hc->hc_id);
+    return;
+  }
+
   HTTP_TRACE(dbg, "Parking connection to %s:%d (id=%d)",
 	     hc->hc_hostname, hc->hc_port, hc->hc_id);
 
+  LIST_REMOVE(hc, hc_active_link);
+  hh->hh_num_active--;
+
+  hc->hc_pipeline = 0;
   hc->hc_reuse_before = now + max_age;
+  TAILQ_INSERT_TAIL(&hh->hh_idle, hc, hc_link);
+  TAILQ_INSERT_TAIL(&http_idle_connections, hc, hc_idle_link);
+  hh->hh_num_idle++;
+  http_parked_connections++;
+
+  if(hh->hh_num_idle > HTTP_MAX_IDLE_PER_HOST) {
+    hc = TAILQ_FIRST(&hh->hh_idle);
+    http_connection_unpark(hc);
+    TAILQ_INSERT_TAIL(&evicted, hc, hc_link);
+  }
+
+  while(http_parked_connections > HTTP_MAX_IDLE) {
+    hc = TAILQ_FIRST(&http_idle_connections);
+    http_connection_unpark(hc);
+    TAILQ_INSERT_TAIL(&evicted, hc, hc_link);
+  }
+
+  hts_cond_broadcast(&hh->hh_cond);
+  http_pool_update_stats();
+  hts_mutex_unlock(&http_connections_mutex);
+
+  http_connection_destroy_list(&evicted, dbg, "Too many idle connections");
+}
+
+
+/**
+ * Return a connection that can not be reused
+ */
+static void
+http_connection_release(http_connection_t *hc, int dbg, const char *reason)
+{
+  hts_mutex_lock(&http_connections_mutex);
+  int destroy = http_connection_detach_locked(hc);
+  hts_mutex_unlock(&http_connections_mutex);
+
+  if(destroy)
+    http_connection_destroy(hc, dbg, reason);
+}
+
+
+/**
+ * Leave a connection we've been queued on without reading our response.
+ * Nothing more can be read from it in order so it's marked as broken and
+ * any other queued requests will have to start over.
+ *
+ * If ticket is -1 we've not yet been given one
+ */
+static void
+http_pipeline_abandon(http_connection_t *hc, int ticket, int dbg)
+{
+  int destroy;
 
   hts_mutex_lock(&http_connections_mutex);
-  TAILQ_INSERT_TAIL(&http_connections, hc, hc_link);
-  http_parked_connections++;
 
-  if(http_parked_connections > 5) {
-    for(hc = TAILQ_FIRST(&http_connections); hc != NULL; hc = next) {
-      next = TAILQ_NEXT(hc, hc_link);
+  if(ticket == -1)
+    ticket = hc->hc_ticket++;
 
-      if(now >= hc->hc_reuse_before) {
-	TAILQ_REMOVE(&http_connections, hc, hc_link);
-	http_parked_connections--;
-	http_connection_destroy(hc, dbg, "Keep alive expired");
-      }
-    }
+  hc->hc_broken = 1;
+  hc->hc_queued--;
+  hc->hc_host->hh_waiters--;
+
+  if(!hc->hc_detached && hc->hc_turn == ticket) {
+    // It's our turn so we're the owner, nobody else will detach it
+    destroy = http_connection_detach_locked(hc);
+  } else {
+    destroy = hc->hc_detached && hc->hc_queued == 0;
+    hts_cond_broadcast(&hc->hc_host->hh_cond);
+  }
+
+  hts_mutex_unlock(&http_connections_mutex);
+
+  if(destroy)
+    http_connection_destroy(hc, dbg, "Pipeline broken");
+}
+
+
+/**
+ * Allow other GET requests to queue behind the one we just sent
+ */
+static void
+http_pipeline_open(http_connection_t *hc)
+{
+  hts_mutex_lock(&http_connections_mutex);
+  hc->hc_pipeline = 1;
+  hts_mutex_unlock(&http_connections_mutex);
+}
+
+
+/**
+ * Send a request on a connection we are queued on and wait until the
+ * responses to all requests before ours have been read.
+ *
+ * Returns -1 if the connection went away, the request should then be
+ * retried on a connection of its own
+ */
+static int
+http_pipeline_send(http_file_t *hf, htsbuf_queue_t *q)
+{
+  http_connection_t *hc = hf->hf_connection;
+  http_host_t *hh = hc->hc_host;
+  int ticket, broken;
+
+  hf->hf_pipelined = 0;
+
+  hts_mutex_lock(&hc->hc_write_mutex);
+
+  hts_mutex_lock(&http_connections_mutex);
+  ticket = hc->hc_ticket++;
+  broken = hc->hc_broken;
+  hts_mutex_unlock(&http_connections_mutex);
+
+  if(broken) {
+    htsbuf_queue_flush(q);
+  } else if(tcp_write_queue(hc->hc_tc, q)) {
+    broken = 1;
+  }
+
+  hts_mutex_unlock(&hc->hc_write_mutex);
+
+  hts_mutex_lock(&http_connections_mutex);
+
+  while(!broken && hc->hc_turn != ticket) {
+    if(cancellable_is_cancelled(hf->hf_c))
+      broken = 1;
+    else
+      hts_cond_wait_timeout(&hh->hh_cond, &http_connections_mutex, 250);
+    broken |= hc->hc_broken;
+  }
+
+  if(broken) {
+    hts_mutex_unlock(&http_connections_mutex);
+    http_pipeline_abandon(hc, ticket, hf->hf_debug);
+    hf->hf_connection = NULL;
+    return -1;
+  }
+
+  // Our turn, we now own the connection
+  hc->hc_queued--;
+  hh->hh_waiters--;
+  hts_mutex_unlock(&http_connections_mutex);
+
+  tcp_set_cancellable(hc->hc_tc, hf->hf_c);
+  HF_TRACE(hf, "Reading pipelined response from %s:%d (id=%d)",
+           hc->hc_hostname, hc->hc_port, hc->hc_id);
+  return 0;
+}
+
+
+/**
+ * A pipelined request didn't get a response, the server (or something
+ * in between) doesn't handle it so stop trying
+ */
+static void
+http_pipeline_failed(http_connection_t *hc)
+{
+  hts_mutex_lock(&http_connections_mutex);
+  hc->hc_host->hh_no_pipeline = 1;
+  hts_mutex_unlock(&http_connections_mutex);
+}
+
+
+/**
+ * Periodically close idle connections that have passed their keep-alive
+ * and forget about hosts we no longer talk to
+ */
+static void
+http_pool_expire(callout_t *c, void *aux)
+{
+  struct http_connection_queue expired;
+  http_connection_t *hc, *next;
+  http_host_t *hh, *nexthh;
+  time_t now;
+  int i;
+
+  time(&now);
+  TAILQ_INIT(&expired);
+
+  hts_mutex_lock(&http_connections_mutex);
+
+  for(hc = TAILQ_FIRST(&http_idle_connections); hc != NULL; hc = next) {
+    next = TAILQ_NEXT(hc, hc_idle_link);
+    if(now < hc->hc_reuse_before)
+      continue;
+    http_connection_unpark(hc);
+    TAILQ_INSERT_TAIL(&expired, hc, hc_link);
   }
 
-  while(http_parked_connections > 5) {
-    hc = TAILQ_FIRST(&http_connections);
-    assert(hc != NULL);
-    TAILQ_REMOVE(&http_connections, hc, hc_link);
-    http_connection_destroy(hc, dbg, "Too many idle connections");
-    http_parked_connections--;
+  for(i = 0; i < HTTP_HOST_HASH_SIZE; i++) {
+    for(hh = LIST_FIRST(&http_hosts[i]); hh != NULL; hh = nexthh) {
+      nexthh = LIST_NEXT(hh, hh_link);
+      if(hh->hh_num_idle || hh->hh_num_active || hh->hh_waiters)
+        continue;
+      LIST_REMOVE(hh, hh_link);
+      hts_cond_destroy(&hh->hh_cond);
+      free(hh);
+    }
   }
 
+  if(!TAILQ_EMPTY(&expired))
+    http_pool_update_stats();
+
   hts_mutex_unlock(&http_connections_mutex);
+
+  http_connection_destroy_list(&expired, 0, "Keep alive expired");
+
+  callout_arm(&http_expire_timer, http_pool_expire, NULL,
+              HTTP_EXPIRE_INTERVAL);
 }
 
 
@@ -1274,15 +1747,9 @@ hf_set_location(http_file_t *hf, const char *str)
 /**
  *
  */
-static int
-http_read_response(http_file_t *hf, struct http_header_list *headers)
+static void
+http_response_begin(http_file_t *hf, struct http_header_list *headers)
 {
-  int li;
-  char *c, *q, *argv[2];
-  int code = -1;
-  int64_t i64;
-  http_connection_t *hc = hf->hf_connection;
-
   http_headers_free(headers);
 
   hf->hf_content_encoding = HTTP_CE_IDENTITY;
@@ -1294,125 +1761,174 @@ http_read_response(http_file_t *hf, struct http_header_list *headers)
   hf->hf_max_age = 30;
 
   HF_TRACE(hf, "%s: Response:", hf->hf_url);
+}
 
-  for(li = 0; ;li++) {
-    if(tcp_read_line(hc->hc_tc, hf->hf_line, sizeof(hf->hf_line)) < 0)
-      return -1;
 
-    HF_TRACE(hf, "< %s", hf->hf_line);
+/**
+ * Parse line 'li' of the response header. Returns 1 when the empty line
+ * terminating the header has been seen
+ */
+static int
+http_response_line(http_file_t *hf, int li, char *line,
+                   struct http_header_list *headers, int *code)
+{
+  char *c, *q, *argv[2];
+  int64_t i64;
 
-    if(hf->hf_line[0] == 0)
-      break;
+  HF_TRACE(hf, "< %s", line);
 
-    if(li == 0) {
-      q = hf->hf_line;
-      while(*q && *q != ' ')
-	q++;
-      while(*q == ' ')
-	q++;
-      code = atoi(q);
-      continue;
-    }
+  if(line[0] == 0)
+    return 1;
 
-    if((c = strchr(hf->hf_line, ':')) == NULL)
-      continue;
+  if(li == 0) {
+    q = line;
+    while(*q && *q != ' ')
+      q++;
+    while(*q == ' ')
+      q++;
+    *code = atoi(q);
+    return 0;
+  }
 
-    if(http_tokenize(hf->hf_line, argv, 2, ':') != 2)
-      continue;
-    *c = 0;
+  if((c = strchr(line, ':')) == NULL)
+    return 0;
+
+  if(http_tokenize(line, argv, 2, ':') != 2)
+    return 0;
+  *c = 0;
 
-    if(headers != NULL)
-      http_header_add(headers, argv[0], argv[1], 1);
+  if(headers != NULL)
+    http_header_add(headers, argv[0], argv[1], 1);
 
-    if(!strcasecmp(argv[0], "Transfer-Encoding")) {
+  if(!strcasecmp(argv[0], "Transfer-Encoding")) {
 
-      if(!strcasecmp(argv[1], "chunked")) {
-	hf->hf_chunked_transfer = 1;
-	hf->hf_chunk_size = 0;
-      }
-      continue;
+    if(!strcasecmp(argv[1], "chunked")) {
+      hf->hf_chunked_transfer = 1;
+      hf->hf_chunk_size = 0;
     }
+    return 0;
+  }
 
-    if(!strcasecmp(argv[0], "WWW-Authenticate")) {
+  if(!strcasecmp(argv[0], "WWW-Authenticate")) {
 
-      if(http_tokenize(argv[1], argv, 2, -1) != 2)
-	continue;
-      
-      if(strcasecmp(argv[0], "Basic"))
-	continue;
+    if(http_tokenize(argv[1], argv, 2, -1) != 2)
+      return 0;
+    
+    if(strcasecmp(argv[0], "Basic"))
+      return 0;
 
-      if(strncasecmp(argv[1], "realm=\"", strlen("realm=\"")))
-	continue;
-      q = c = argv[1] + strlen("realm=\"");
-      
-      if((q = strrchr(c, '"')) == NULL)
-	continue;
-      *q = 0;
-      
-      free(hf->hf_auth_realm);
-      hf->hf_auth_realm = strdup(c);
-      continue;
-    }
+    if(strncasecmp(argv[1], "realm=\"", strlen("realm=\"")))
+      return 0;
+    q = c = argv[1] + strlen("realm=\"");
+    
+    if((q = strrchr(c, '"')) == NULL)
+      return 0;
+    *q = 0;
+    
+    free(hf->hf_auth_realm);
+    hf->hf_auth_realm = strdup(c);
+    return 0;
+  }
 
 
-    if(!strcasecmp(argv[0], "Location")) {
-      hf_set_location(hf, argv[1]);
-      continue;
-    }
+  if(!strcasecmp(argv[0], "Location")) {
+    hf_set_location(hf, argv[1]);
+    return 0;
+  }
 
-    if(!strcasecmp(argv[0], "Keep-Alive")) {
-      const char *x = strstr(argv[1], "timeout=");
-      if(x != NULL)
-	hf->hf_max_age = atoi(x + strlen("timeout="));
-      continue;
-    }
+  if(!strcasecmp(argv[0], "Keep-Alive")) {
+    const char *x = strstr(argv[1], "timeout=");
+    if(x != NULL)
+      hf->hf_max_age = atoi(x + strlen("timeout="));
+    return 0;
+  }
 
-    if(!strcasecmp(argv[0], "Content-Encoding")) {
-      if(!strcasecmp(argv[1], "gzip"))
-	hf->hf_content_encoding = HTTP_CE_GZIP;
-      else
-	hf->hf_content_encoding = HTTP_CE_IDENTITY;
-    }
-    if(!strcasecmp(argv[0], "Content-Length")) {
-      i64 = strtoll(argv[1], NULL, 0);
-      hf->hf_rsize = i64;
+  if(!strcasecmp(argv[0], "Content-Encoding")) {
+    if(!strcasecmp(argv[1], "gzip"))
+      hf->hf_content_encoding = HTTP_CE_GZIP;
+    else
+      hf->hf_content_encoding = HTTP_CE_IDENTITY;
+  }
+  if(!strcasecmp(argv[0], "Content-Length")) {
+    i64 = strtoll(argv[1], NULL, 0);
+    hf->hf_rsize = i64;
 
-      if(code == 200)
-	hf->hf_filesize = i64;
-    }
-    
-    if(!strcasecmp(argv[0], "Content-Type")) {
-      free(hf->hf_content_type);
-      hf->hf_content_type = strdup(argv[1]);
-    }
+    if(*code == 200)
+      hf->hf_filesize = i64;
+  }
+  
+  if(!strcasecmp(argv[0], "Content-Type")) {
+    free(hf->hf_content_type);
+    hf->hf_content_type = strdup(argv[1]);
+  }
 
-    if(code == 206 && !strcasecmp(argv[0], "Content-Range") &&
-       hf->hf_filesize == -1) {
+  if((*code == 200 || *code == 206) && !strcasecmp(argv[0], "ETag")) {
+    free(hf->hf_etag);
+    hf->hf_etag = strdup(argv[1]);
+  }
 
-      if(!strncasecmp(argv[1], "bytes", 5)) {
-	const char *slash = strchr(argv[1], '/');
-	if(slash != NULL) {
-	  slash++;
-	  hf->hf_filesize = strtoll(slash, NULL, 0);
-	}
-      }
-    }
+  if((*code == 200 || *code == 206) &&
+     !strcasecmp(argv[0], "Last-Modified"))
+    http_ctime(&hf->hf_mtime, argv[1]);
 
-    if(!strcasecmp(argv[0], "connection")) {
+  if(*code == 206 && !strcasecmp(argv[0], "Content-Range") &&
+     hf->hf_filesize == -1) {
 
-      if(!strcasecmp(argv[1], "close"))
-	hf->hf_connection_mode = CONNECTION_MODE_CLOSE;
+    if(!strncasecmp(argv[1], "bytes", 5)) {
+      const char *slash = strchr(argv[1], '/');
+      if(slash != NULL) {
+        slash++;
+        hf->hf_filesize = strtoll(slash, NULL, 0);
+      }
     }
+  }
+
+  if(!strcasecmp(argv[0], "connection")) {
 
-    if(!strcasecmp(argv[0], "Set-Cookie"))
-      http_cookie_set(argv[1], hf);
+    if(!strcasecmp(argv[1], "close"))
+      hf->hf_connection_mode = CONNECTION_MODE_CLOSE;
   }
 
+  if(!strcasecmp(argv[0], "Set-Cookie"))
+    http_cookie_set(argv[1], hf);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_response_end(http_file_t *hf, int code)
+{
   if(code >= 200 && code < 400) {
     hf->hf_auth_failed = 0;
     http_auth_cache_set(hf);
   }
+}
+
+
+/**
+ *
+ */
+static int
+http_read_response(http_file_t *hf, struct http_header_list *headers)
+{
+  int li;
+  int code = -1;
+  http_connection_t *hc = hf->hf_connection;
+
+  http_response_begin(hf, headers);
+
+  for(li = 0; ;li++) {
+    if(tcp_read_line(hc->hc_tc, hf->hf_line, sizeof(hf->hf_line)) < 0)
+      return -1;
+
+    if(http_response_line(hf, li, hf->hf_line, headers, &code))
+      break;
+  }
 
+  http_response_end(hf, code);
   return code;
 }
 
@@ -1428,21 +1944,25 @@ http_detach(http_file_t *hf, int reusable, const char *reason)
   if(hf->hf_connection == NULL)
     return;
 
-  if(reusable && !gconf.disable_http_reuse && hf->hf_read_timeout == 0) {
+  if(hf->hf_pipelined) {
+    http_pipeline_abandon(hf->hf_connection, -1, hf->hf_debug);
+    hf->hf_pipelined = 0;
+  } else if(reusable && !gconf.disable_http_reuse &&
+            hf->hf_read_timeout == 0) {
     http_connection_park(hf->hf_connection, hf->hf_debug, hf->hf_max_age);
   } else {
-    http_connection_destroy(hf->hf_connection, hf->hf_debug, reason);
+    http_connection_release(hf->hf_connection, hf->hf_debug, reason);
   }
   hf->hf_connection = NULL;
 }
 
 
 /**
- *
+ * Update the request URL from the Location header of a redirect
  */
 static int
-redirect(http_file_t *hf, int *redircount, char *errbuf, size_t errlen,
-	 int code, int expect_content)
+http_redirect_url(http_file_t *hf, int *redircount, char *errbuf,
+                  size_t errlen, int code)
 {
   (*redircount)++;
   if(*redircount == 10) {
@@ -1474,7 +1994,20 @@ redirect(http_file_t *hf, int *redircount, char *errbuf, size_t errlen,
 
   free(hf->hf_location);
   hf->hf_location = NULL;
-  
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+redirect(http_file_t *hf, int *redircount, char *errbuf, size_t errlen,
+	 int code, int expect_content)
+{
+  if(http_redirect_url(hf, redircount, errbuf, errlen, code))
+    return -1;
+
   if(expect_content && http_drain_content(hf))
     hf->hf_connection_mode = CONNECTION_MODE_CLOSE;
 
@@ -1573,22 +2106,18 @@ http_set_read_timeout(fa_handle_t *fh, int ms)
 
 
 /**
- *
+ * Resolve the request URL (following permanent redirects) into the
+ * host to connect to and the path to request
  */
-static int
-http_connect(http_file_t *hf, char *errbuf, int errlen)
+static void
+http_split_url(http_file_t *hf, char *hostname, size_t hostnamelen,
+               int *portp, int *sslp)
 {
-  char hostname[HOSTNAME_MAX];
   char proto[16];
   int port, ssl;
   http_redirect_t *hr;
   const char *url;
 
-  hf->hf_rsize = 0;
-
-  if(hf->hf_connection != NULL)
-    http_detach(hf, 0, "Reconnect");
-
   url = hf->hf_url;
 
   hts_mutex_lock(&http_redirects_mutex);
@@ -1600,7 +2129,7 @@ http_connect(http_file_t *hf, char *errbuf, int errlen)
     }
   
   url_split(proto, sizeof(proto), hf->hf_authurl, sizeof(hf->hf_authurl), 
-	    hostname, sizeof(hostname), &port,
+	    hostname, hostnamelen, &port,
 	    hf->hf_path, sizeof(hf->hf_path), 
 	    url);
 
@@ -1614,10 +2143,34 @@ http_connect(http_file_t *hf, char *errbuf, int errlen)
   if(!hf->hf_path[0])
     strcpy(hf->hf_path, "/");
 
+  *portp = port;
+  *sslp = ssl;
+}
+
+
+/**
+ *
+ */
+static int
+http_connect(http_file_t *hf, char *errbuf, int errlen)
+{
+  char hostname[HOSTNAME_MAX];
+  int port, ssl;
+
+  hf->hf_rsize = 0;
+
+  if(hf->hf_connection != NULL)
+    http_detach(hf, 0, "Reconnect");
+
+  http_split_url(hf, hostname, sizeof(hostname), &port, &ssl);
+
   const int timeout = hf->hf_connect_timeout ?: 30000;
 
+  int pipelined;
   hf->hf_connection = http_connection_get(hostname, port, ssl, errbuf, errlen,
-					  hf->hf_debug, timeout, hf->hf_c);
+					  hf->hf_debug, timeout, hf->hf_c,
+                                          hf->hf_pipeline, &pipelined);
+  hf->hf_pipelined = pipelined;
 
   if(hf->hf_read_timeout != 0 && hf->hf_connection != NULL)
     tcp_set_read_timeout(hf->hf_connection->hc_tc, hf->hf_read_timeout);
@@ -1755,6 +2308,7 @@ http_destroy(http_file_t *hf)
   free(hf->hf_auth_realm);
   free(hf->hf_location);
   free(hf->hf_content_type);
+  free(hf->hf_etag);
   prop_ref_dec(hf->hf_stats_speed);
   free(hf);
 }
@@ -2128,6 +2682,24 @@ http_fsize(fa_handle_t *handle)
 }
 
 
+/**
+ * Content validator for the read-ahead cache
+ */
+static int
+http_get_validator(fa_handle_t *handle, char *buf, size_t bufsize)
+{
+  http_file_t *hf = (http_file_t *)handle;
+
+  if(hf->hf_etag != NULL)
+    snprintf(buf, bufsize, "etag:%s", hf->hf_etag);
+  else if(hf->hf_mtime)
+    snprintf(buf, bufsize, "mtime:%"PRId64, (int64_t)hf->hf_mtime);
+  else
+    return -1;
+  return 0;
+}
+
+
 /**
  * Standard unix stat
  */
@@ -2149,6 +2721,7 @@ http_stat(fa_protocol_t *fap, const char *url, struct fa_stat *fs,
   
   fs->fs_type = CONTENT_FILE;
   fs->fs_size = hf->hf_filesize;
+  fs->fs_mtime = hf->hf_mtime;
   
   http_destroy(hf);
   return 0;
@@ -2313,12 +2886,25 @@ http_init(void)
   sha1_update(ctx, (void *)&v, sizeof(v));
   sha1_final(ctx, nonce);
 
-  TAILQ_INIT(&http_connections);
+  TAILQ_INIT(&http_idle_connections);
   hts_mutex_init(&http_connections_mutex);
   hts_mutex_init(&http_redirects_mutex);
   hts_mutex_init(&http_cookies_mutex);
   hts_mutex_init(&http_auth_caches_mutex);
   load_cookies();
+
+  prop_t *p = prop_create(prop_create(prop_get_global(), "http"),
+                          "connections");
+
+  http_prop_checkouts       = prop_create(p, "checkouts");
+  http_prop_reused          = prop_create(p, "reused");
+  http_prop_pipelined       = prop_create(p, "pipelined");
+  http_prop_connects        = prop_create(p, "connects");
+  http_prop_connect_latency = prop_create(p, "connectLatency");
+  http_prop_idle            = prop_create(p, "idle");
+
+  callout_arm(&http_expire_timer, http_pool_expire, NULL,
+              HTTP_EXPIRE_INTERVAL);
 }
 
 /**
@@ -2338,6 +2924,7 @@ static fa_protocol_t fa_protocol_http = {
   .fap_get_last_component = http_get_last_component,
   .fap_seek_is_fast = http_seek_is_fast,
   .fap_set_read_timeout = http_set_read_timeout,
+  .fap_get_validator = http_get_validator,
 };
 
 FAP_REGISTER(http);
@@ -2359,6 +2946,7 @@ static fa_protocol_t fa_protocol_https = {
   .fap_get_last_component = http_get_last_component,
   .fap_seek_is_fast = http_seek_is_fast,
   .fap_set_read_timeout = http_set_read_timeout,
+  .fap_get_validator = http_get_validator,
 };
 
 FAP_REGISTER(https);
@@ -2678,6 +3266,7 @@ static fa_protocol_t fa_protocol_webdav = {
   .fap_get_last_component = http_get_last_component,
   .fap_seek_is_fast = http_seek_is_fast,
   .fap_set_read_timeout = http_set_read_timeout,
+  .fap_get_validator = http_get_validator,
 };
 FAP_REGISTER(webdav);
 
@@ -2698,6 +3287,7 @@ static fa_protocol_t fa_protocol_webdavs = {
   .fap_get_last_component = http_get_last_component,
   .fap_seek_is_fast = http_seek_is_fast,
   .fap_set_read_timeout = http_set_read_timeout,
+  .fap_get_validator = http_get_validator,
 };
 FAP_REGISTER(webdavs);
 
@@ -2959,33 +3549,33 @@ http_recv(http_file_t *hf, http_req_aux_t *hra)
 /**
  *
  */
+static const char *
+http_req_method(const http_req_aux_t *hra)
+{
+  return hra->method ?: hra->post ? "POST": (hra->want_result ? "GET" : "HEAD");
+}
+
+
+/**
+ * Build the request header for the connection currently attached to
+ * the request's http_file
+ */
 static int
-http_req_do(http_req_aux_t *hra)
+http_req_build(http_req_aux_t *hra, htsbuf_queue_t *q)
 {
-  htsbuf_queue_t q;
-  int code, r = -1;
-  int redircount = 0;
   struct http_header_list headers;
   struct http_query_arg *hqa;
   struct http_header_list cookies;
   http_file_t *hf = hra->hf;
-
- retry:
-
-
-  http_connect(hf, hra->errbuf, hra->errlen);
-  if(hf->hf_connection == NULL)
-    goto cleanup;
-
   http_connection_t *hc = hf->hf_connection;
 
-  htsbuf_queue_init(&q, 0);
+  htsbuf_queue_init(q, 0);
 
-  const char *m = hra->method ?: hra->post ? "POST": (hra->want_result ? "GET" : "HEAD");
+  const char *m = http_req_method(hra);
 
-  htsbuf_append(&q, m, strlen(m));
-  htsbuf_append(&q, " ", 1);
-  htsbuf_append(&q, hf->hf_path, strlen(hf->hf_path));
+  htsbuf_append(q, m, strlen(m));
+  htsbuf_append(q, " ", 1);
+  htsbuf_append(q, hf->hf_path, strlen(hf->hf_path));
 
   char prefix = '?';
 
@@ -2994,10 +3584,10 @@ http_req_do(http_req_aux_t *hra)
 
     while(args[0] != NULL) {
       if(args[1] != NULL) {
-	htsbuf_append(&q, &prefix, 1);
-	htsbuf_append_and_escape_url(&q, args[0]);
-	htsbuf_append(&q, "=", 1);
-	htsbuf_append_and_escape_url(&q, args[1]);
+	htsbuf_append(q, &prefix, 1);
+	htsbuf_append_and_escape_url(q, args[0]);
+	htsbuf_append(q, "=", 1);
+	htsbuf_append_and_escape_url(q, args[1]);
 	prefix = '&';
       }
       args += 2;
@@ -3005,15 +3595,15 @@ http_req_do(http_req_aux_t *hra)
   }
 
   TAILQ_FOREACH(hqa, &hra->query_args, link) {
-    htsbuf_append(&q, &prefix, 1);
-    htsbuf_append_and_escape_url(&q, hqa->key);
-    htsbuf_append(&q, "=", 1);
-    htsbuf_append_and_escape_url_len(&q, hqa->val, hqa->val_len);
+    htsbuf_append(q, &prefix, 1);
+    htsbuf_append_and_escape_url(q, hqa->key);
+    htsbuf_append(q, "=", 1);
+    htsbuf_append_and_escape_url_len(q, hqa->val, hqa->val_len);
     prefix = '&';
   }
 
 
-  htsbuf_qprintf(&q, " HTTP/1.%d\r\n", hf->hf_version);
+  htsbuf_qprintf(q, " HTTP/1.%d\r\n", hf->hf_version);
 
   http_headers_init(&headers, hf);
 
@@ -3029,21 +3619,62 @@ http_req_do(http_req_aux_t *hra)
     if(http_headers_auth(&headers, &cookies, hf, m,
                          (const char **)hra->arguments,
 			 hra->errbuf, hra->errlen)) {
-      htsbuf_queue_flush(&q);
-      r = -1;
-      goto cleanup;
+      htsbuf_queue_flush(q);
+      return -1;
     }
   }
 
   http_cookie_append(hc->hc_hostname, hf->hf_path, &headers, &cookies);
   http_headers_free(&cookies);
 
-  http_headers_send(&q, &headers, &hra->headers_in);
+  http_headers_send(q, &headers, &hra->headers_in);
 
   if(hf->hf_debug)
-    trace_request(&q);
+    trace_request(q);
+  return 0;
+}
 
-  tcp_write_queue(hf->hf_connection->hc_tc, &q);
+
+/**
+ *
+ */
+static int
+http_req_do(http_req_aux_t *hra)
+{
+  htsbuf_queue_t q;
+  int code, r = -1;
+  int redircount = 0;
+  http_file_t *hf = hra->hf;
+
+  hf->hf_pipeline = !!(hra->flags & FA_PIPELINE) && !hra->post &&
+    hra->want_result && (hra->method == NULL || !strcmp(hra->method, "GET"));
+
+ retry:
+
+
+  http_connect(hf, hra->errbuf, hra->errlen);
+  if(hf->hf_connection == NULL)
+    goto cleanup;
+
+  const char *m = http_req_method(hra);
+
+  if(http_req_build(hra, &q))
+    goto cleanup;
+
+
+  int pipelined = hf->hf_pipelined;
+
+  if(pipelined) {
+    if(http_pipeline_send(hf, &q)) {
+      HF_TRACE(hf, "Pipelined connection lost, retrying");
+      hf->hf_pipeline = 0;
+      goto retry;
+    }
+  } else {
+    tcp_write_queue(hf->hf_connection->hc_tc, &q);
+    if(hf->hf_pipeline)
+      http_pipeline_open(hf->hf_connection);
+  }
 
   if(hra->post) {
     if(hf->hf_debug)
@@ -3053,7 +3684,11 @@ http_req_do(http_req_aux_t *hra)
   }
 
   code = http_read_response(hf, hra->headers_out);
-  if(code == -1 && hf->hf_connection->hc_reused) {
+  if(code == -1 && (hf->hf_connection->hc_reused || pipelined)) {
+    if(pipelined) {
+      http_pipeline_failed(hf->hf_connection);
+      hf->hf_pipeline = 0;
+    }
     http_detach(hf, 0, "Read error on reused connection");
     goto retry;
   }
@@ -3102,6 +3737,9 @@ http_req_do(http_req_aux_t *hra)
     goto retry;
 
   case 206:
+    if(http_header_get(&hra->headers_in, "Range") != NULL)
+      break; // Caller asked for a range
+
     /* We got "Partial Content" without asking for it.  Some servers
        (FlashCom/3.5.7) seem to "remember" Range requests from
        previous queries on same connection if it's not overwritten
@@ -3222,6 +3860,979 @@ http_req_async(void *opaque)
   http_req_release(hra);
 }
 
+
+/**
+ * Asynchronous requests
+ *
+ * Requests with a completion callback are run as a non-blocking state
+ * machine on an asyncio loop instead of on a task thread, so a request
+ * that is waiting for the network does not hold on to a thread.
+ * Requests are handed to the loop of the calling thread if it is an
+ * asyncio thread, otherwise to a loop picked by hashing the URL. Each
+ * loop keeps its own idle keep-alive connections.
+ *
+ * Responses asking for authentication (401) and hosts that don't
+ * resolve to an IPv4 address are passed on to the blocking code on a
+ * task thread.
+ */
+
+#ifndef HTTP_ASYNC_MAX_IDLE
+#define HTTP_ASYNC_MAX_IDLE 8 // Idle connections per loop
+#endif
+
+#define HTTP_ASYNC_TICK 1000000 // Check for timeout/cancel this often (us)
+
+typedef struct http_async_conn {
+  http_connection_t hac_hc; // For the header helpers, hc_tc is not used
+  TAILQ_ENTRY(http_async_conn) hac_link;
+  asyncio_fd_t *hac_af;
+  int hac_fd;
+  int hac_loop;
+  net_ssl_t *hac_ssl;
+  struct http_async *hac_ha; // Request using the connection, NULL if idle
+  int64_t hac_reuse_before;
+} http_async_conn_t;
+
+TAILQ_HEAD(http_async_conn_queue, http_async_conn);
+
+typedef enum {
+  HA_RESOLVE,
+  HA_CONNECT,
+  HA_HANDSHAKE,
+  HA_SEND,
+  HA_HEADER,
+  HA_BODY,
+  HA_CHUNK_HEADER,
+  HA_CHUNK_DATA,
+  HA_CHUNK_END,
+  HA_TRAILER,
+  HA_UNTIL_EOF,
+} http_async_state_t;
+
+typedef struct http_async {
+  TAILQ_ENTRY(http_async) ha_link;
+  http_req_aux_t *ha_hra;
+  http_async_conn_t *ha_hac;
+  http_async_state_t ha_state;
+
+  char ha_hostname[HOSTNAME_MAX];
+  int ha_port;
+  int ha_ssl;
+
+  char ha_got_data;  // Received something on this connection
+  char ha_body_done; // Response fully read, connection can be reused
+  char ha_discard;   // Body is drained, not delivered
+  char ha_redirect;  // Restart when the body has been drained
+  char ha_inflate;   // hra->zstream must be ended
+
+  int ha_code;
+  int ha_line;
+  int ha_redircount;
+  int64_t ha_remain;
+  int64_t ha_deadline;
+
+  htsbuf_queue_t ha_sendq;
+  htsbuf_queue_t ha_recvq;
+} http_async_t;
+
+TAILQ_HEAD(http_async_queue, http_async);
+
+static HTS_MUTEX_DECL(http_async_mutex);
+static struct http_async_queue http_async_pending[ASYNCIO_MAX_LOOPS];
+static int http_async_workers[ASYNCIO_MAX_LOOPS];
+static int http_async_loops; // Zero until the workers are registered
+
+// Only accessed from the owning loop
+static struct http_async_conn_queue http_async_idle[ASYNCIO_MAX_LOOPS];
+static int http_async_num_idle[ASYNCIO_MAX_LOOPS];
+
+static atomic_t http_async_active;
+static prop_t *http_prop_async;
+
+static void http_async_start(http_async_t *ha);
+
+
+/**
+ *
+ */
+static void
+http_async_conn_destroy(http_async_conn_t *hac, int dbg, const char *reason)
+{
+  HTTP_TRACE(dbg, "Disconnected from %s:%d (id=%d) %s",
+             hac->hac_hc.hc_hostname, hac->hac_hc.hc_port, hac->hac_hc.hc_id,
+             reason);
+  if(hac->hac_ssl != NULL)
+    net_ssl_destroy(hac->hac_ssl);
+  asyncio_del_fd(hac->hac_af);
+  free(hac);
+}
+
+
+/**
+ *
+ */
+static void
+http_async_attach(http_async_t *ha, http_async_conn_t *hac)
+{
+  ha->ha_hac = hac;
+  hac->hac_ha = ha;
+  ha->ha_hra->hf->hf_connection = &hac->hac_hc;
+  asyncio_set_timeout(hac->hac_af, showtime_get_ts() + HTTP_ASYNC_TICK);
+}
+
+
+/**
+ * Give up the connection. It's kept for reuse if the response was read
+ * completely and the server wants to keep it open
+ */
+static void
+http_async_detach(http_async_t *ha, const char *reason)
+{
+  http_async_conn_t *hac = ha->ha_hac;
+  http_file_t *hf = ha->ha_hra->hf;
+
+  htsbuf_queue_flush(&ha->ha_sendq);
+
+  if(hac == NULL) {
+    htsbuf_queue_flush(&ha->ha_recvq);
+    return;
+  }
+
+  ha->ha_hac = NULL;
+  hf->hf_connection = NULL;
+
+  if(!ha->ha_body_done || ha->ha_recvq.hq_size != 0 ||
+     hf->hf_connection_mode != CONNECTION_MODE_PERSISTENT ||
+     gconf.disable_http_reuse) {
+    htsbuf_queue_flush(&ha->ha_recvq);
+    http_async_conn_destroy(hac, hf->hf_debug, reason);
+    return;
+  }
+
+  const int loop = hac->hac_loop;
+
+  HF_TRACE(hf, "Parking connection to %s:%d (id=%d)",
+           hac->hac_hc.hc_hostname, hac->hac_hc.hc_port, hac->hac_hc.hc_id);
+
+  hac->hac_ha = NULL;
+  hac->hac_reuse_before = showtime_get_ts() + hf->hf_max_age * 1000000LL;
+  TAILQ_INSERT_HEAD(&http_async_idle[loop], hac, hac_link);
+  http_async_num_idle[loop]++;
+
+  // Wake up when the server closes the connection
+  asyncio_set_events(hac->hac_af, ASYNCIO_READ);
+  asyncio_set_timeout(hac->hac_af, hac->hac_reuse_before);
+
+  if(http_async_num_idle[loop] > HTTP_ASYNC_MAX_IDLE) {
+    hac = TAILQ_LAST(&http_async_idle[loop], http_async_conn_queue);
+    TAILQ_REMOVE(&http_async_idle[loop], hac, hac_link);
+    http_async_num_idle[loop]--;
+    http_async_conn_destroy(hac, hf->hf_debug, "Too many idle connections");
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_async_free(http_async_t *ha)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+
+  if(ha->ha_inflate)
+    inflateEnd(&hra->zstream);
+  free(hra->tmpbuf);
+  hra->tmpbuf = NULL;
+  free(ha);
+  prop_set_int(http_prop_async, atomic_add_and_fetch(&http_async_active, -1));
+}
+
+
+/**
+ * Finish the request, does the same cleanup as http_req_do() and
+ * http_req_async()
+ */
+static void
+http_async_done(http_async_t *ha, int r)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+
+  http_async_detach(ha, "Request done");
+  http_async_free(ha);
+
+  if(r) {
+    if(r != 304)
+      http_headers_free(hra->headers_out);
+    if(hra->decoded_cleanup)
+      hra->decoded_cleanup(hra);
+    hra->result = NULL;
+  }
+
+  http_destroy(hra->hf);
+  hra->async_callback(hra, hra->async_opaque, r);
+  http_req_release(hra);
+}
+
+
+/**
+ * Connection level error. Retry on a new connection if nothing was
+ * received on a reused one (server closed it while it was idle)
+ */
+static void
+http_async_error(http_async_t *ha, const char *reason)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+  http_async_conn_t *hac = ha->ha_hac;
+
+  if(hac != NULL && hac->hac_hc.hc_reused && !ha->ha_got_data) {
+    HF_TRACE(hra->hf, "%s on reused connection, retrying", reason);
+    http_async_detach(ha, reason);
+    http_async_start(ha);
+    return;
+  }
+
+  snprintf(hra->errbuf, hra->errlen, "%s", reason);
+  http_async_done(ha, -1);
+}
+
+
+/**
+ * Let http_req_do() take over on a task thread
+ */
+static void
+http_async_fallback(http_async_t *ha, const char *reason)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+
+  HF_TRACE(hra->hf, "%s, continuing on task thread", reason);
+  http_async_detach(ha, reason);
+  http_async_free(ha);
+  task_run(http_req_async, hra);
+}
+
+
+/**
+ *
+ */
+static void
+http_async_write(http_async_t *ha)
+{
+  http_async_conn_t *hac = ha->ha_hac;
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+  htsbuf_data_t *hd;
+  int r;
+
+  while((hd = TAILQ_FIRST(&ha->ha_sendq.hq_q)) != NULL) {
+    const void *data = hd->hd_data + hd->hd_data_off;
+    const int len = hd->hd_data_len - hd->hd_data_off;
+
+    if(hac->hac_ssl != NULL) {
+      r = net_ssl_write(hac->hac_ssl, data, len);
+      if(r == NET_SSL_WANT_READ || r == NET_SSL_WANT_WRITE) {
+        asyncio_set_events(hac->hac_af, r == NET_SSL_WANT_READ ?
+                           ASYNCIO_READ : ASYNCIO_WRITE);
+        return;
+      }
+    } else {
+      r = write(hac->hac_fd, data, len);
+      if(r == -1 && (errno == EAGAIN || errno == EINTR)) {
+        asyncio_set_events(hac->hac_af, ASYNCIO_WRITE);
+        return;
+      }
+    }
+
+    if(r <= 0) {
+      http_async_error(ha, "Write error");
+      return;
+    }
+    htsbuf_drop(&ha->ha_sendq, r);
+  }
+
+  ha->ha_state = HA_HEADER;
+  ha->ha_line = 0;
+  ha->ha_code = -1;
+  http_response_begin(hf, hra->headers_out);
+  asyncio_set_events(hac->hac_af, ASYNCIO_READ);
+}
+
+
+/**
+ *
+ */
+static void
+http_async_send(http_async_t *ha)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+  htsbuf_data_t *hd;
+
+  ha->ha_state = HA_SEND;
+  ha->ha_deadline =
+    showtime_get_ts() + (hf->hf_read_timeout ?: 30000) * 1000LL;
+
+  if(http_req_build(hra, &ha->ha_sendq)) {
+    http_async_done(ha, -1);
+    return;
+  }
+
+  if(hra->post) {
+    if(hf->hf_debug)
+      htsbuf_hexdump(&hra->postdata, "HTTP-POSTDATA");
+
+    // Keep postdata intact, the request may be sent again
+    TAILQ_FOREACH(hd, &hra->postdata.hq_q, hd_link)
+      htsbuf_append(&ha->ha_sendq, hd->hd_data + hd->hd_data_off,
+                    hd->hd_data_len - hd->hd_data_off);
+  }
+  http_async_write(ha);
+}
+
+
+/**
+ *
+ */
+static void
+http_async_handshake(http_async_t *ha)
+{
+  http_async_conn_t *hac = ha->ha_hac;
+
+  switch(net_ssl_handshake(hac->hac_ssl)) {
+  case 0:
+    http_async_send(ha);
+    break;
+  case NET_SSL_WANT_READ:
+    asyncio_set_events(hac->hac_af, ASYNCIO_READ);
+    break;
+  case NET_SSL_WANT_WRITE:
+    asyncio_set_events(hac->hac_af, ASYNCIO_WRITE);
+    break;
+  default:
+    http_async_error(ha, "SSL handshake failed");
+    break;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_async_connected(http_async_t *ha)
+{
+  http_async_conn_t *hac = ha->ha_hac;
+  http_req_aux_t *hra = ha->ha_hra;
+  int err;
+  socklen_t errlen = sizeof(int);
+
+  getsockopt(hac->hac_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
+  if(err) {
+    http_async_error(ha, strerror(err));
+    return;
+  }
+
+  HF_TRACE(hra->hf, "Connected to %s:%d (id=%d)",
+           hac->hac_hc.hc_hostname, hac->hac_hc.hc_port, hac->hac_hc.hc_id);
+
+  if(!ha->ha_ssl) {
+    http_async_send(ha);
+    return;
+  }
+
+  hac->hac_ssl = net_ssl_create(hac->hac_fd, ha->ha_hostname,
+                                hra->errbuf, hra->errlen);
+  if(hac->hac_ssl == NULL) {
+    http_async_done(ha, -1);
+    return;
+  }
+  ha->ha_state = HA_HANDSHAKE;
+  http_async_handshake(ha);
+}
+
+
+/**
+ * Called when the body has been read. Returns -1 as 'ha' is gone
+ */
+static int
+http_async_body_end(http_async_t *ha)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+
+  ha->ha_body_done = 1;
+  hf->hf_rsize = 0;
+
+  if(!ha->ha_discard) {
+    http_async_done(ha, hra->encoded_data(hf, hra, NULL, 0) ? -1 : 0);
+  } else if(ha->ha_redirect) {
+    // Location changed, connection is reused if it's to the same host
+    http_async_detach(ha, "Location changed");
+    http_async_start(ha);
+  } else if(ha->ha_code == 304) {
+    http_async_done(ha, 304);
+  } else {
+    http_async_done(ha, -1);
+  }
+  return -1;
+}
+
+
+/**
+ * Setup for reading the body. If 'discard' is set the body is drained
+ * rather than delivered
+ */
+static int
+http_async_body_begin(http_async_t *ha, int discard)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+
+  ha->ha_discard = discard;
+
+  if(!strcmp(http_req_method(hra), "HEAD") ||
+     ha->ha_code == 204 || ha->ha_code == 304) {
+    hf->hf_chunked_transfer = 0;
+    hf->hf_rsize = 0;
+  }
+
+  if(!discard) {
+    if(hf->hf_content_encoding == HTTP_CE_GZIP) {
+      inflateInit2(&hra->zstream, 16+MAX_WBITS);
+      ha->ha_inflate = 1;
+      hra->encoded_data = &append_gzip;
+      HF_TRACE(hf, "Inflating content using gzip");
+    } else {
+      hra->encoded_data = hra->decoded_data;
+    }
+  }
+
+  if(hra->tmpbuf == NULL)
+    hra->tmpbuf = malloc(HTTP_TMP_SIZE);
+
+  if(hf->hf_chunked_transfer) {
+    HF_TRACE(hf, "Chunked transfer");
+    ha->ha_state = HA_CHUNK_HEADER;
+  } else if(hf->hf_rsize == -1) {
+    HF_TRACE(hf, "Reading data until EOF");
+    ha->ha_state = HA_UNTIL_EOF;
+  } else {
+    HF_TRACE(hf, "Reading %"PRId64" bytes", hf->hf_rsize);
+    if(!discard)
+      hra->total = hf->hf_rsize;
+    ha->ha_remain = hf->hf_rsize;
+    ha->ha_state = HA_BODY;
+    if(ha->ha_remain == 0)
+      return http_async_body_end(ha);
+  }
+  return 0;
+}
+
+
+/**
+ * Act on the response code, same as the switch in http_req_do().
+ * Returns -1 if 'ha' has moved on
+ */
+static int
+http_async_response(http_async_t *ha)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+  const int code = ha->ha_code;
+
+  http_response_end(hf, code);
+
+  switch(code) {
+  case 200 ... 205:
+    if(!strcmp(http_req_method(hra), "HEAD")) {
+      ha->ha_body_done = 1;
+      hf->hf_rsize = 0;
+      if(hra->decoded_cleanup)
+        hra->decoded_cleanup(hra);
+      http_async_done(ha, 0);
+      return -1;
+    }
+    break;
+
+  case 304:
+    // Not modified
+    return http_async_body_begin(ha, 1);
+
+  case 302:
+  case 303:
+    hra->post = 0;
+    mystrset(&hra->postcontenttype, NULL);
+    mystrset(&hra->method, hra->want_result ? "GET" : "HEAD");
+    // FALLTHRU
+  case 301:
+  case 307:
+    if(hra->flags & FA_NOFOLLOW) {
+      HF_TRACE(hf, "Not following redirect as requested by caller");
+      break;
+    }
+    if(http_redirect_url(hf, &ha->ha_redircount, hra->errbuf, hra->errlen,
+                         code)) {
+      http_async_done(ha, -1);
+      return -1;
+    }
+    ha->ha_redirect = 1;
+    return http_async_body_begin(ha, 1);
+
+  case 401:
+    http_async_fallback(ha, "Authentication requested");
+    return -1;
+
+  case 206:
+    if(http_header_get(&hra->headers_in, "Range") != NULL)
+      break;
+    // See http_req_do()
+    http_async_detach(ha, "Got 206 without asking for it");
+    http_async_start(ha);
+    return -1;
+
+  default:
+    snprintf(hra->errbuf, hra->errlen, "HTTP error: %d", code);
+    return http_async_body_begin(ha, 1);
+  }
+  return http_async_body_begin(ha, 0);
+}
+
+
+/**
+ * Get a line from the receive queue. Returns 1 if a line was read, 0 if
+ * more data is needed and -1 on error ('ha' is gone)
+ */
+static int
+http_async_line(http_async_t *ha, char *buf, size_t len)
+{
+  htsbuf_queue_t *q = &ha->ha_recvq;
+  int l = htsbuf_find(q, 0xa);
+
+  if(l == -1 && q->hq_size < len)
+    return 0;
+
+  if(l == -1 || l >= len) {
+    snprintf(ha->ha_hra->errbuf, ha->ha_hra->errlen, "Line too long");
+    http_async_done(ha, -1);
+    return -1;
+  }
+
+  htsbuf_read(q, buf, l);
+  htsbuf_drop(q, 1);
+  buf[l] = 0;
+  if(l > 0 && buf[l - 1] == '\r')
+    buf[l - 1] = 0;
+  return 1;
+}
+
+
+/**
+ * Consume as much as possible of the receive queue. Returns -1 if the
+ * request has finished or moved on ('ha' may be gone)
+ */
+static int
+http_async_parse(http_async_t *ha)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+  htsbuf_queue_t *q = &ha->ha_recvq;
+  char line[100];
+  int r, len;
+
+  while(1) {
+    switch(ha->ha_state) {
+    case HA_HEADER:
+      if((r = http_async_line(ha, hf->hf_line, sizeof(hf->hf_line))) <= 0)
+        return r;
+
+      if(http_response_line(hf, ha->ha_line++, hf->hf_line, hra->headers_out,
+                            &ha->ha_code) && http_async_response(ha))
+        return -1;
+      break;
+
+    case HA_BODY:
+    case HA_CHUNK_DATA:
+    case HA_UNTIL_EOF:
+      if(q->hq_size == 0)
+        return 0;
+
+      len = MIN(q->hq_size, HTTP_TMP_SIZE);
+      if(ha->ha_state != HA_UNTIL_EOF)
+        len = MIN(len, ha->ha_remain);
+
+      htsbuf_read(q, hra->tmpbuf, len);
+
+      if(!ha->ha_discard) {
+        if(hra->encoded_data(hf, hra, hra->tmpbuf, len)) {
+          http_async_done(ha, -1);
+          return -1;
+        }
+        hra->bytes_completed += len;
+        http_request_partial(hra, 0);
+      }
+
+      if(ha->ha_state == HA_UNTIL_EOF)
+        break;
+
+      ha->ha_remain -= len;
+      if(ha->ha_remain > 0)
+        break;
+
+      if(ha->ha_state == HA_BODY)
+        return http_async_body_end(ha);
+
+      ha->ha_state = HA_CHUNK_END;
+      break;
+
+    case HA_CHUNK_HEADER:
+      if((r = http_async_line(ha, line, sizeof(line))) <= 0)
+        return r;
+
+      ha->ha_remain = strtol(line, NULL, 16);
+      ha->ha_state = ha->ha_remain ? HA_CHUNK_DATA : HA_TRAILER;
+      break;
+
+    case HA_CHUNK_END:
+      if((r = http_async_line(ha, line, sizeof(line))) <= 0)
+        return r;
+      ha->ha_state = HA_CHUNK_HEADER;
+      break;
+
+    case HA_TRAILER:
+      if((r = http_async_line(ha, line, sizeof(line))) <= 0)
+        return r;
+      if(line[0] == 0)
+        return http_async_body_end(ha);
+      break;
+
+    default:
+      return 0;
+    }
+  }
+}
+
+
+/**
+ * Read everything available and feed it to the parser
+ */
+static void
+http_async_read(http_async_t *ha)
+{
+  http_async_conn_t *hac = ha->ha_hac;
+  http_file_t *hf = ha->ha_hra->hf;
+  char buf[4096];
+  int r;
+
+  asyncio_set_events(hac->hac_af, ASYNCIO_READ);
+
+  while(1) {
+    if(hac->hac_ssl != NULL) {
+      r = net_ssl_read(hac->hac_ssl, buf, sizeof(buf));
+      if(r == NET_SSL_WANT_READ)
+        return;
+      if(r == NET_SSL_WANT_WRITE) {
+        asyncio_set_events(hac->hac_af, ASYNCIO_READ | ASYNCIO_WRITE);
+        return;
+      }
+    } else {
+      r = read(hac->hac_fd, buf, sizeof(buf));
+      if(r == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    }
+
+    if(r <= 0)
+      break;
+
+    ha->ha_got_data = 1;
+    ha->ha_deadline =
+      showtime_get_ts() + (hf->hf_read_timeout ?: 30000) * 1000LL;
+
+    htsbuf_append(&ha->ha_recvq, buf, r);
+    if(http_async_parse(ha))
+      return;
+  }
+
+  if(ha->ha_state == HA_UNTIL_EOF) {
+    hf->hf_connection_mode = CONNECTION_MODE_CLOSE;
+    http_async_body_end(ha);
+    return;
+  }
+  http_async_error(ha, "Connection closed");
+}
+
+
+/**
+ *
+ */
+static void
+http_async_io(asyncio_fd_t *af, void *opaque, int events, int error)
+{
+  http_async_conn_t *hac = opaque;
+  http_async_t *ha = hac->hac_ha;
+
+  if(ha == NULL) {
+    // Idle connection was closed by server or has expired
+    TAILQ_REMOVE(&http_async_idle[hac->hac_loop], hac, hac_link);
+    http_async_num_idle[hac->hac_loop]--;
+    http_async_conn_destroy(hac, 0, events & ASYNCIO_TIMEOUT ?
+                            "Keep alive expired" : "Closed by server");
+    return;
+  }
+
+  http_file_t *hf = ha->ha_hra->hf;
+
+  if(events & ASYNCIO_TIMEOUT) {
+    if(cancellable_is_cancelled(hf->hf_c)) {
+      snprintf(ha->ha_hra->errbuf, ha->ha_hra->errlen, "Cancelled");
+      http_async_done(ha, -1);
+    } else if(showtime_get_ts() > ha->ha_deadline) {
+      snprintf(ha->ha_hra->errbuf, ha->ha_hra->errlen, "%s",
+               ha->ha_state < HA_SEND ? "Connection timed out" : "Timeout");
+      http_async_done(ha, -1);
+    } else {
+      asyncio_set_timeout(af, showtime_get_ts() + HTTP_ASYNC_TICK);
+    }
+    return;
+  }
+
+  switch(ha->ha_state) {
+  case HA_CONNECT:
+    if(events & ASYNCIO_ERROR)
+      http_async_error(ha, strerror(error));
+    else
+      http_async_connected(ha);
+    break;
+
+  case HA_HANDSHAKE:
+    if(events & ASYNCIO_ERROR)
+      http_async_error(ha, strerror(error));
+    else
+      http_async_handshake(ha);
+    break;
+
+  case HA_SEND:
+    if(events & ASYNCIO_ERROR)
+      http_async_error(ha, strerror(error));
+    else
+      http_async_write(ha);
+    break;
+
+  default:
+    // Also on errors, there might be data left to read
+    http_async_read(ha);
+    break;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_async_resolved(void *opaque, int status, const void *data)
+{
+  http_async_t *ha = opaque;
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+  const net_addr_t *na = data;
+  struct sockaddr_in si = {0};
+  int fd;
+
+  if(cancellable_is_cancelled(hf->hf_c)) {
+    snprintf(hra->errbuf, hra->errlen, "Cancelled");
+    http_async_done(ha, -1);
+    return;
+  }
+
+  if(status != ASYNCIO_DNS_STATUS_COMPLETED) {
+    snprintf(hra->errbuf, hra->errlen, "%s", (const char *)data);
+    http_async_done(ha, -1);
+    return;
+  }
+
+  if(na->na_family != 4) {
+    http_async_fallback(ha, "Not an IPv4 address");
+    return;
+  }
+
+  if((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+    snprintf(hra->errbuf, hra->errlen, "%s", strerror(errno));
+    http_async_done(ha, -1);
+    return;
+  }
+
+  http_async_conn_t *hac = calloc(1, sizeof(http_async_conn_t));
+  snprintf(hac->hac_hc.hc_hostname, sizeof(hac->hac_hc.hc_hostname), "%s",
+           ha->ha_hostname);
+  hac->hac_hc.hc_port = ha->ha_port;
+  hac->hac_hc.hc_ssl = ha->ha_ssl;
+  hac->hac_fd = fd;
+  hac->hac_loop = asyncio_current_loop();
+
+  hts_mutex_lock(&http_connections_mutex);
+  hac->hac_hc.hc_id = ++http_connection_tally;
+  hts_mutex_unlock(&http_connections_mutex);
+
+  // Makes the socket non-blocking
+  hac->hac_af = asyncio_add_fd(fd, ASYNCIO_WRITE, http_async_io, hac,
+                               "HTTP client");
+  net_change_ndelay(fd, 1);
+
+  ha->ha_state = HA_CONNECT;
+  http_async_attach(ha, hac);
+
+  si.sin_family = AF_INET;
+  si.sin_port = htons(ha->ha_port);
+  memcpy(&si.sin_addr, na->na_addr, 4);
+
+  if(connect(fd, (struct sockaddr *)&si, sizeof(struct sockaddr_in)) == -1 &&
+     errno != EINPROGRESS) {
+    http_async_error(ha, strerror(errno));
+    return;
+  }
+}
+
+
+/**
+ * (Re)start the request, either on an idle connection or a new one
+ */
+static void
+http_async_start(http_async_t *ha)
+{
+  http_req_aux_t *hra = ha->ha_hra;
+  http_file_t *hf = hra->hf;
+  const int loop = asyncio_current_loop();
+  const int64_t now = showtime_get_ts();
+  http_async_conn_t *hac;
+
+  if(cancellable_is_cancelled(hf->hf_c)) {
+    snprintf(hra->errbuf, hra->errlen, "Cancelled");
+    http_async_done(ha, -1);
+    return;
+  }
+
+  ha->ha_state = HA_RESOLVE;
+  ha->ha_got_data = 0;
+  ha->ha_body_done = 0;
+  ha->ha_discard = 0;
+  ha->ha_redirect = 0;
+  hf->hf_rsize = 0;
+
+  http_split_url(hf, ha->ha_hostname, sizeof(ha->ha_hostname),
+                 &ha->ha_port, &ha->ha_ssl);
+
+  // tcp_connect() knows how to talk SOCKS and which hosts are local
+  if(gconf.proxy_host[0] && strcmp(ha->ha_hostname, "localhost")) {
+    http_async_fallback(ha, "Proxy configured");
+    return;
+  }
+
+  TAILQ_FOREACH(hac, &http_async_idle[loop], hac_link) {
+    if(hac->hac_hc.hc_port != ha->ha_port ||
+       hac->hac_hc.hc_ssl != ha->ha_ssl ||
+       hac->hac_reuse_before < now ||
+       strcmp(hac->hac_hc.hc_hostname, ha->ha_hostname))
+      continue;
+
+    TAILQ_REMOVE(&http_async_idle[loop], hac, hac_link);
+    http_async_num_idle[loop]--;
+
+    HF_TRACE(hf, "Reusing connection to %s:%d (id=%d)",
+             hac->hac_hc.hc_hostname, hac->hac_hc.hc_port,
+             hac->hac_hc.hc_id);
+    hac->hac_hc.hc_reused = 1;
+    http_async_attach(ha, hac);
+    http_async_send(ha);
+    return;
+  }
+
+  HF_TRACE(hf, "Connecting to %s:%d", ha->ha_hostname, ha->ha_port);
+  ha->ha_deadline = now + (hf->hf_connect_timeout ?: 30000) * 1000LL;
+  asyncio_dns_lookup_host(ha->ha_hostname, http_async_resolved, ha);
+}
+
+
+/**
+ * Start requests handed over to this loop
+ */
+static void
+http_async_worker(void)
+{
+  const int loop = asyncio_current_loop();
+  http_async_t *ha;
+
+  hts_mutex_lock(&http_async_mutex);
+  while((ha = TAILQ_FIRST(&http_async_pending[loop])) != NULL) {
+    TAILQ_REMOVE(&http_async_pending[loop], ha, ha_link);
+    hts_mutex_unlock(&http_async_mutex);
+    http_async_start(ha);
+    hts_mutex_lock(&http_async_mutex);
+  }
+  hts_mutex_unlock(&http_async_mutex);
+}
+
+
+/**
+ * Hand over a request to an asyncio loop. Returns -1 if the loops are
+ * not running yet
+ */
+static int
+http_async_submit(http_req_aux_t *hra)
+{
+  int loop = asyncio_current_loop();
+  unsigned int h = 0;
+  const char *s;
+
+  hts_mutex_lock(&http_async_mutex);
+
+  if(http_async_loops == 0) {
+    hts_mutex_unlock(&http_async_mutex);
+    return -1;
+  }
+
+  if(loop == -1) {
+    for(s = hra->hf->hf_url; *s; s++)
+      h = h * 33 + *s;
+    loop = asyncio_shard(h);
+  }
+
+  http_async_t *ha = calloc(1, sizeof(http_async_t));
+  ha->ha_hra = hra;
+  htsbuf_queue_init(&ha->ha_sendq, 0);
+  htsbuf_queue_init(&ha->ha_recvq, 0);
+  TAILQ_INSERT_TAIL(&http_async_pending[loop], ha, ha_link);
+  hts_mutex_unlock(&http_async_mutex);
+
+  prop_set_int(http_prop_async, atomic_add_and_fetch(&http_async_active, 1));
+  asyncio_wakeup_worker(http_async_workers[loop]);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_async_init(void)
+{
+  const int loops = asyncio_num_loops();
+
+  http_prop_async = prop_create(prop_create(prop_get_global(), "http"),
+                                "asyncRequests");
+
+  for(int i = 0; i < loops; i++) {
+    TAILQ_INIT(&http_async_pending[i]);
+    TAILQ_INIT(&http_async_idle[i]);
+    http_async_workers[i] = asyncio_add_worker_on(i, http_async_worker);
+  }
+
+  hts_mutex_lock(&http_async_mutex);
+  http_async_loops = loops;
+  hts_mutex_unlock(&http_async_mutex);
+}
+
+INITME(INIT_GROUP_ASYNCIO, http_async_init);
+
 /**
  *
  */
@@ -3416,7 +5027,8 @@ http_reqv(const char *url, va_list ap,
   hra->hf = hf;
 
   if(hra->async_callback != NULL) {
-    task_run(http_req_async, hra);
+    if(http_async_submit(hra))
+      task_run(http_req_async, hra);
     return 0;
   }
 
@@ -43,6 +43,7 @@
 #include "image/jpeg.h"
 #include "backend/backend.h"
 #include "blobcache.h"
+#include "task.h"
 
 static const uint8_t pngsig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
 static const uint8_t gif89sig[6] = {'G', 'I', 'F', '8', '9', 'a'};
@@ -53,6 +54,7 @@ static const uint8_t svgsig2[4] = {'<', 's', 'v', 'g'};
 
 #if ENABLE_LIBAV
 static hts_mutex_t image_from_video_mutex[2];
+static hts_mutex_t thumb_mutex; // Protects thumbctx
 static AVCodecContext *thumbctx;
 static AVCodec *thumbcodec;
 static callout_t thumb_flush_callout;
@@ -71,6 +73,7 @@ fa_imageloader_init(void)
 #if ENABLE_LIBAV
   hts_mutex_init(&image_from_video_mutex[0]);
   hts_mutex_init(&image_from_video_mutex[1]);
+  hts_mutex_init(&thumb_mutex);
   thumbcodec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
 #endif
 }
@@ -95,6 +98,7 @@ fa_imageloader2(const char *url, const char **vpaths,
                  FA_LOAD_ERRBUF(errbuf, errlen),
                  FA_LOAD_CACHE_CONTROL(cache_control),
                  FA_LOAD_CANCELLABLE(c),
+                 FA_LOAD_FLAGS(FA_PIPELINE),
                  NULL);
   if(buf == NULL || buf == NOT_MODIFIED)
     return (image_t *)buf;
@@ -330,12 +334,27 @@ ifv_autoclose(callout_t *c, void *aux)
 /**
  *
  */
+typedef struct thumb_job {
+  AVFrame *tj_frame;
+  char *tj_cacheid;
+  time_t tj_mtime;
+  int tj_width;
+  int tj_height;
+} thumb_job_t;
+
+
+/**
+ * Encode and store a thumbnail. Nobody is waiting for this so it runs
+ * as bulk work on the task pool
+ */
 static void
-write_thumb(const AVCodecContext *src, const AVFrame *sframe, 
-            int width, int height, const char *cacheid, time_t mtime)
+thumb_encode_task(void *aux)
 {
-  if(thumbcodec == NULL)
-    return;
+  thumb_job_t *tj = aux;
+  const int width  = tj->tj_width;
+  const int height = tj->tj_height;
+
+  hts_mutex_lock(&thumb_mutex);
 
   AVCodecContext *ctx = thumbctx;
 
@@ -358,18 +377,56 @@ write_thumb(const AVCodecContext *src, const AVFrame *sframe,
     if(avcodec_open2(ctx, thumbcodec, NULL) < 0) {
       TRACE(TRACE_ERROR, "THUMB", "Unable to open thumb encoder");
       thumbctx = NULL;
-      return;
+      ctx = NULL;
+    } else {
+      thumbctx = ctx;
+    }
+  }
+
+  if(ctx != NULL) {
+    AVPacket out;
+    memset(&out, 0, sizeof(AVPacket));
+    int got_packet;
+    int r = avcodec_encode_video2(ctx, &out, tj->tj_frame, &got_packet);
+    if(r >= 0 && got_packet) {
+      buf_t *b = buf_create_and_adopt(out.size, out.data, &av_free);
+      blobcache_put(tj->tj_cacheid, "videothumb", b, INT32_MAX, NULL,
+                    tj->tj_mtime, 0);
+      buf_release(b);
+    } else {
+      assert(out.data == NULL);
     }
-    thumbctx = ctx;
   }
 
+  hts_mutex_unlock(&thumb_mutex);
+
+  avpicture_free((AVPicture *)tj->tj_frame);
+  av_frame_free(&tj->tj_frame);
+  free(tj->tj_cacheid);
+  free(tj);
+}
+
+
+/**
+ * Scale the frame to thumbnail size, encoding is deferred
+ */
+static void
+write_thumb(const AVCodecContext *src, const AVFrame *sframe, 
+            int width, int height, const char *cacheid, time_t mtime)
+{
+  if(thumbcodec == NULL)
+    return;
+
   AVFrame *oframe = av_frame_alloc();
 
-  avpicture_alloc((AVPicture *)oframe, ctx->pix_fmt, width, height);
-      
+  avpicture_alloc((AVPicture *)oframe, AV_PIX_FMT_YUVJ420P, width, height);
+  oframe->format = AV_PIX_FMT_YUVJ420P;
+  oframe->width  = width;
+  oframe->height = height;
+
   struct SwsContext *sws;
   sws = sws_getContext(src->width, src->height, src->pix_fmt,
-                       width, height, ctx->pix_fmt, SWS_BILINEAR,
+                       width, height, AV_PIX_FMT_YUVJ420P, SWS_BILINEAR,
                        NULL, NULL, NULL);
 
   sws_scale(sws, (const uint8_t **)sframe->data, sframe->linesize,
@@ -377,20 +434,15 @@ write_thumb(const AVCodecContext *src, const AVFrame *sframe,
   sws_freeContext(sws);
 
   oframe->pts = AV_NOPTS_VALUE;
-  AVPacket out;
-  memset(&out, 0, sizeof(AVPacket));
-  int got_packet;
-  int r = avcodec_encode_video2(ctx, &out, oframe, &got_packet);
-  if(r >= 0 && got_packet) {
-    buf_t *b = buf_create_and_adopt(out.size, out.data, &av_free);
-    blobcache_put(cacheid, "videothumb", b, INT32_MAX, NULL, mtime, 0);
-    buf_release(b);
-  } else {
-    assert(out.data == NULL);
-  }
-  av_frame_free(&oframe);
-}
 
+  thumb_job_t *tj = malloc(sizeof(thumb_job_t));
+  tj->tj_frame   = oframe;
+  tj->tj_cacheid = strdup(cacheid);
+  tj->tj_mtime   = mtime;
+  tj->tj_width   = width;
+  tj->tj_height  = height;
+  task_run_prio(thumb_encode_task, tj, TASK_PRIO_BULK);
+}
 
 
 
@@ -19,166 +19,521 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 
+/**
+ * Background indexer
+ *
+ * Directories waiting to be indexed are kept in the indexqueue table in
+ * metadb so indexing resumes where it left off after a restart. Workers
+ * dequeue them in batches, highest priority first. Roots get top
+ * priority and each level down gets one less so the library fills in
+ * breadth first. Indexing pauses while media is playing.
+ *
+ * Progress is exported under global.indexer
+ */
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <string.h>
 
 #include "showtime.h"
+#include "arch/atomic.h"
+#include "misc/callout.h"
+#include "misc/minmax.h"
 #include "metadata/metadata.h"
 #include "db/db_support.h"
 #include "fa_indexer.h"
 #include "fileaccess.h"
 #include "htsmsg/htsmsg_store.h"
 
+#define INDEXER_WORKERS        2
+#define INDEXER_BATCH          16
+#define INDEXER_PRIO_ROOT      1000000
+#define INDEXER_STATS_INTERVAL 5
+
+extern atomic_t media_buffer_hungry;
+
+static hts_mutex_t indexer_mutex;
+static hts_cond_t indexer_cond;
+
+TAILQ_HEAD(indexer_root_queue, indexer_root);
+TAILQ_HEAD(indexer_job_queue, indexer_job);
+
+static struct indexer_root_queue roots;
+
+typedef struct indexer_root {
+  TAILQ_ENTRY(indexer_root) ir_link;
+  char *ir_url;
+  int ir_queued;  // Root and its unindexed directories are in indexqueue
+} indexer_root_t;
+
+/**
+ * A dequeued directory, marked as active in indexqueue
+ */
+typedef struct indexer_job {
+  TAILQ_ENTRY(indexer_job) ij_link;
+  char *ij_url;
+  int ij_priority;
+} indexer_job_t;
+
+static struct indexer_job_queue indexer_jobs;
+
+static int indexer_resumed;   // Stale active entries have been reset
+static int indexer_fetching;  // A worker is dequeuing from db
+static int indexer_work_seq;  // Bumped when new work may be available
+static int indexer_queued;    // Rows in indexqueue
+static int indexer_active;
+static unsigned int indexer_done;
+static volatile int indexer_playing;
+
+static callout_t indexer_stats_timer;
+static prop_t *indexer_prop_pending;
+static prop_t *indexer_prop_active;
+static prop_t *indexer_prop_done;
+static prop_t *indexer_prop_paused;
+static prop_t *indexer_prop_rate;
+static prop_t *indexer_prop_eta;
+
+
+/**
+ * Run a statement with ?1 bound to url and ?2 to an integer.
+ * Returns the sqlite3 result code of the step
+ */
+static int
+indexer_exec(void *db, const char *sql, const char *url, int v)
+{
+  sqlite3_stmt *stmt;
+  int rc = db_prepare(db, &stmt, sql);
+
+  if(rc != SQLITE_OK)
+    return rc;
+
+  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, v);
+  rc = db_step(stmt);
+  db_finalize(stmt);
+  return rc;
+}
+
+
 /**
  *
  */
 static void
-index_path(const char *url)
+indexer_kick(int added)
 {
-  fa_stat_t fs;
-  int err;
-  TRACE(TRACE_DEBUG, "Indexer", "Indexing %s", url);
-  if(!fa_stat(url, &fs, NULL, 0)) {
-    err = fa_scanner_scan(url, fs.fs_mtime);
-  } else {
-    err = 1;
-  }
+  hts_mutex_lock(&indexer_mutex);
+  indexer_queued += added;
+  indexer_work_seq++;
+  hts_cond_broadcast(&indexer_cond);
+  hts_mutex_unlock(&indexer_mutex);
+}
 
-  void *db = metadb_get();
-  sqlite3_stmt *stmt;
-  int rc = db_prepare(db, &stmt,
-                      "UPDATE item "
-                      "SET indexstatus = ?2 "
-                      "WHERE URL = ?1");
-  if(!rc) {
-    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, err ? INDEX_STATUS_ERROR : INDEX_STATUS_STATED);
-    db_step(stmt);
-    sqlite3_finalize(stmt);
+
+/**
+ * Build the prefix that everything below url starts with
+ */
+static void
+indexer_prefix(char *dst, size_t dstlen, const char *url)
+{
+  size_t len = strlen(url);
+  snprintf(dst, dstlen, "%s%s", url, len && url[len - 1] == '/' ? "" : "/");
+}
+
+
+/**
+ * Returns 1 if url is root or anything below it
+ */
+static int
+indexer_below(const char *url, const char *root)
+{
+  size_t len = strlen(root);
+
+  if(strncmp(url, root, len))
+    return 0;
+  return url[len] == 0 || url[len] == '/' || (len && root[len - 1] == '/');
+}
+
+
+/**
+ * Returns 1 if url is still covered by an enabled root
+ */
+static int
+indexer_rooted(const char *url)
+{
+  indexer_root_t *ir;
+  int r = 0;
+
+  hts_mutex_lock(&indexer_mutex);
+  TAILQ_FOREACH(ir, &roots, ir_link) {
+    if(indexer_below(url, ir->ir_url)) {
+      r = 1;
+      break;
+    }
   }
-  metadb_close(db);
-  TRACE(TRACE_DEBUG, "Indexer", "Indexing %s done err=%d", url, err);
+  hts_mutex_unlock(&indexer_mutex);
+  return r;
 }
 
 
+/**
+ * Put a root and all its directories that have not been indexed yet
+ * (ie, left over from a previous session) in the queue
+ */
+static void
+indexer_queue_root(void *db, const char *url)
+{
+  char pfx[PATH_MAX];
+  int rc;
 
-TAILQ_HEAD(item_queue, item);
+  indexer_prefix(pfx, sizeof(pfx), url);
+
+ again:
+  if(db_begin(db))
+    return;
 
-typedef struct item {
-  TAILQ_ENTRY(item) link;
-  char *url;
-  int contenttype;
-  time_t mtime;
-} item_t;
+  rc = indexer_exec(db,
+                    "INSERT OR REPLACE INTO indexqueue (url, priority, status) "
+                    "VALUES (?1, ?2, 0)",
+                    url, INDEXER_PRIO_ROOT);
+
+  if(rc == SQLITE_DONE)
+    rc = indexer_exec(db,
+                      "INSERT OR IGNORE INTO indexqueue (url, priority) "
+                      "SELECT url, ?2 "
+                      "FROM item "
+                      "WHERE substr(url, 1, length(?1)) = ?1 "
+                      "AND contenttype=1 "
+                      "AND indexstatus == 0",
+                      pfx, 0);
+
+  if(rc == SQLITE_LOCKED) {
+    db_rollback_deadlock(db);
+    goto again;
+  }
 
+  if(rc != SQLITE_DONE) {
+    db_rollback(db);
+    return;
+  }
+  db_commit(db);
+}
 
 
 /**
- *
+ * Take care of startup and newly added roots
  */
 static void
-free_items(struct item_queue *q)
+indexer_prepare(void *db)
 {
-  item_t *i;
-  while((i = TAILQ_FIRST(q)) != NULL) {
-    TAILQ_REMOVE(q, i, link);
-    free(i->url);
-    free(i);
+  indexer_root_t *ir;
+  char **urls;
+  int i, num = 0, resume;
+
+  hts_mutex_lock(&indexer_mutex);
+  resume = !indexer_resumed;
+  indexer_resumed = 1;
+
+  TAILQ_FOREACH(ir, &roots, ir_link)
+    num++;
+  urls = alloca(num * sizeof(char *));
+  num = 0;
+  TAILQ_FOREACH(ir, &roots, ir_link) {
+    if(!ir->ir_queued) {
+      ir->ir_queued = 1;
+      urls[num++] = strdup(ir->ir_url);
+    }
+  }
+  hts_mutex_unlock(&indexer_mutex);
+
+  if(resume)
+    db_one_statement(db, "UPDATE indexqueue SET status=0 WHERE status=1",
+                     NULL);
+
+  for(i = 0; i < num; i++) {
+    TRACE(TRACE_DEBUG, "Indexer", "Queueing root %s", urls[i]);
+    indexer_queue_root(db, urls[i]);
+    free(urls[i]);
+  }
+
+  if(resume || num) {
+    int cnt;
+    if(!db_get_int_from_query(db, "SELECT count(*) FROM indexqueue", &cnt)) {
+      hts_mutex_lock(&indexer_mutex);
+      indexer_queued = cnt;
+      hts_mutex_unlock(&indexer_mutex);
+    }
   }
 }
 
 
 /**
- *
+ * Dequeue a batch of directories, returns number of jobs added
  */
 static int
-get_items(void *db, struct item_queue *q, const char *pfx, const char *query)
+indexer_fetch(void)
 {
+  struct indexer_job_queue q;
+  indexer_job_t *ij;
   sqlite3_stmt *stmt;
-  int rc = db_prepare(db, &stmt, query);
+  int rc, num;
+  void *db;
 
-  if(rc != SQLITE_OK)
-    return METADATA_PERMANENT_ERROR;
+  TAILQ_INIT(&q);
+
+  if((db = metadb_get()) == NULL)
+    return 0;
+
+  indexer_prepare(db);
 
-  sqlite3_bind_text(stmt, 1, pfx, -1, SQLITE_STATIC);
+ again:
+  num = 0;
+  if(db_begin(db)) {
+    metadb_close(db);
+    return 0;
+  }
+
+  rc = db_prepare(db, &stmt,
+                  "SELECT url, priority "
+                  "FROM indexqueue "
+                  "WHERE status = 0 "
+                  "ORDER BY priority DESC "
+                  "LIMIT ?1");
+
+  if(rc == SQLITE_OK) {
+    sqlite3_bind_int(stmt, 1, INDEXER_BATCH);
+    while((rc = db_step(stmt)) == SQLITE_ROW) {
+      ij = malloc(sizeof(indexer_job_t));
+      ij->ij_url = strdup((const char *)sqlite3_column_text(stmt, 0));
+      ij->ij_priority = sqlite3_column_int(stmt, 1);
+      TAILQ_INSERT_TAIL(&q, ij, ij_link);
+      num++;
+    }
+    db_finalize(stmt);
+  }
 
-  while((rc = db_step(stmt)) == SQLITE_ROW) {
-    item_t *i = malloc(sizeof(item_t));
-    TAILQ_INSERT_TAIL(q, i, link);
-    const char *url = (const char *)sqlite3_column_text(stmt, 0);
-    i->url         = strdup(url);
-    i->contenttype = sqlite3_column_int(stmt, 1);
-    i->mtime =       sqlite3_column_int(stmt, 2);
+  if(rc == SQLITE_DONE) {
+    TAILQ_FOREACH(ij, &q, ij_link) {
+      rc = indexer_exec(db, "UPDATE indexqueue SET status = ?2 WHERE url = ?1",
+                        ij->ij_url, 1);
+      if(rc != SQLITE_DONE)
+        break;
+    }
   }
-  sqlite3_finalize(stmt);
-  return 0;
+
+  if(rc == SQLITE_DONE) {
+    db_commit(db);
+  } else {
+    if(rc == SQLITE_LOCKED)
+      db_rollback_deadlock(db);
+    else
+      db_rollback(db);
+
+    while((ij = TAILQ_FIRST(&q)) != NULL) {
+      TAILQ_REMOVE(&q, ij, ij_link);
+      free(ij->ij_url);
+      free(ij);
+    }
+    if(rc == SQLITE_LOCKED)
+      goto again;
+    num = 0;
+  }
+
+  metadb_close(db);
+
+  hts_mutex_lock(&indexer_mutex);
+  TAILQ_MERGE(&indexer_jobs, &q, ij_link);
+  hts_mutex_unlock(&indexer_mutex);
+  return num;
 }
 
 
 /**
- *
+ * Scan a directory, queue its subdirectories and retire it.
+ * Returns the number of indexqueue rows removed (0 if the root was
+ * disabled and the row already dropped by indexer_unqueue())
  */
 static int
-do_round(const char *prefix)
+indexer_process(const indexer_job_t *ij)
 {
-  char pfx[PATH_MAX];
-  void *db = metadb_get();
+  const char *url = ij->ij_url;
+  fa_stat_t fs;
+  int err, rc, added = 0, removed = 0;
+  void *db;
 
-  struct item_queue q;
+  TRACE(TRACE_DEBUG, "Indexer", "Indexing %s", url);
+  if(!fa_stat(url, &fs, NULL, 0)) {
+    err = fa_scanner_scan(url, fs.fs_mtime);
+  } else {
+    err = 1;
+  }
 
-  db_escape_path_query(pfx, sizeof(pfx), prefix);
+  if((db = metadb_get()) == NULL)
+    return 0;
 
-  TAILQ_INIT(&q);
+ again:
+  if(db_begin(db)) {
+    metadb_close(db);
+    return 0;
+  }
 
-  int r = get_items(db, &q, pfx,
-                    "SELECT url, contenttype, mtime "
-                    "FROM item "
-                    "WHERE url LIKE ?1 "
-                    "AND contenttype=1 "
-                    "AND indexstatus == 0 "
-                    "LIMIT 1");
+  rc = indexer_exec(db,
+                    "UPDATE item "
+                    "SET indexstatus = ?2 "
+                    "WHERE URL = ?1",
+                    url, err ? INDEX_STATUS_ERROR : INDEX_STATUS_STATED);
+
+  /*
+   * We hold the write lock from here on so indexer_unqueue() has
+   * either already dropped our root from the list and the queue, or
+   * will delete whatever we add once we commit
+   */
+  if(rc == SQLITE_DONE && !err && indexer_rooted(url)) {
+    rc = indexer_exec(db,
+                      "INSERT OR IGNORE INTO indexqueue (url, priority) "
+                      "SELECT url, ?2 "
+                      "FROM item "
+                      "WHERE parent = (SELECT id FROM item WHERE url = ?1) "
+                      "AND contenttype=1 "
+                      "AND indexstatus == 0",
+                      url, ij->ij_priority - 1);
+    added = sqlite3_changes(db);
+  }
 
+  if(rc == SQLITE_DONE) {
+    rc = indexer_exec(db, "DELETE FROM indexqueue WHERE url = ?1", url, 0);
+    removed = sqlite3_changes(db);
+  }
+
+  if(rc == SQLITE_LOCKED) {
+    db_rollback_deadlock(db);
+    goto again;
+  }
+
+  if(rc == SQLITE_DONE) {
+    db_commit(db);
+  } else {
+    db_rollback(db);
+    added = 0;
+    removed = 0;
+  }
   metadb_close(db);
-  if(r)
-    return 0;
-  
-  item_t *i;
-  r = 0;
-  TAILQ_FOREACH(i, &q, link) {
-    index_path(i->url);
-    r = 1;
+
+  indexer_kick(added);
+  TRACE(TRACE_DEBUG, "Indexer", "Indexing %s done err=%d, %d new directories",
+        url, err, added);
+  return removed;
+}
+
+
+/**
+ *
+ */
+static int
+indexer_paused(void)
+{
+  return indexer_playing || atomic_get(&media_buffer_hungry);
+}
+
+
+/**
+ *
+ */
+static void *
+indexer_worker(void *aux)
+{
+  indexer_job_t *ij;
+
+  hts_mutex_lock(&indexer_mutex);
+  while(1) {
+
+    if(indexer_paused()) {
+      hts_cond_wait_timeout(&indexer_cond, &indexer_mutex, 1000);
+      continue;
+    }
+
+    if((ij = TAILQ_FIRST(&indexer_jobs)) == NULL) {
+
+      if(indexer_fetching) {
+        hts_cond_wait(&indexer_cond, &indexer_mutex);
+        continue;
+      }
+
+      int seq = indexer_work_seq;
+      indexer_fetching = 1;
+      hts_mutex_unlock(&indexer_mutex);
+
+      int num = indexer_fetch();
+
+      hts_mutex_lock(&indexer_mutex);
+      indexer_fetching = 0;
+      hts_cond_broadcast(&indexer_cond);
+
+      if(num == 0 && seq == indexer_work_seq)
+        hts_cond_wait(&indexer_cond, &indexer_mutex);
+      continue;
+    }
+
+    TAILQ_REMOVE(&indexer_jobs, ij, ij_link);
+    indexer_active++;
+    hts_mutex_unlock(&indexer_mutex);
+
+    int removed = indexer_process(ij);
+
+    hts_mutex_lock(&indexer_mutex);
+    indexer_active--;
+    indexer_queued -= removed;
+    indexer_done++;
+    free(ij->ij_url);
+    free(ij);
   }
-  free_items(&q);
-  return r;
+  return NULL;
 }
 
 
-static hts_mutex_t indexer_mutex;
-static hts_cond_t indexer_cond;
-TAILQ_HEAD(indexer_root_queue, indexer_root);
+/**
+ *
+ */
+static void
+indexer_stats_update(callout_t *c, void *aux)
+{
+  static unsigned int last_done;
+  static float rate; // Directories per second, smoothed
 
-static struct indexer_root_queue roots;
+  hts_mutex_lock(&indexer_mutex);
+  int pending = MAX(indexer_queued - indexer_active, 0);
+  int active = indexer_active;
+  unsigned int done = indexer_done;
+  hts_mutex_unlock(&indexer_mutex);
 
-typedef struct indexer_root {
-  TAILQ_ENTRY(indexer_root) ir_link;
-  char *ir_url;
-  int ir_refcount;
-  int ir_root_scanned;
-} indexer_root_t;
+  rate = rate * 0.7 + 0.3 * (done - last_done) / INDEXER_STATS_INTERVAL;
+  last_done = done;
+
+  prop_set_int(indexer_prop_pending, pending);
+  prop_set_int(indexer_prop_active, active);
+  prop_set_int(indexer_prop_done, done);
+  prop_set_int(indexer_prop_paused, indexer_paused());
+  prop_set_float(indexer_prop_rate, rate);
+
+  if(pending == 0)
+    prop_set_int(indexer_prop_eta, 0);
+  else if(rate > 0.01)
+    prop_set_int(indexer_prop_eta, pending / rate);
+  else
+    prop_set_void(indexer_prop_eta);
+
+  callout_arm(&indexer_stats_timer, indexer_stats_update, NULL,
+              INDEXER_STATS_INTERVAL);
+}
 
 
 /**
  *
  */
 static void
-ir_release(indexer_root_t *ir)
+indexer_playstatus(void *opaque, const char *str)
 {
-  ir->ir_refcount--;
-  if(ir->ir_refcount > 0)
-    return;
-  free(ir->ir_url);
-  free(ir);
+  indexer_playing = str != NULL && !strcmp(str, "play");
 }
 
 
@@ -191,7 +546,6 @@ addroot(const char *url)
   indexer_root_t *ir;
   ir = calloc(1, sizeof(indexer_root_t));
   ir->ir_url = strdup(url);
-  ir->ir_refcount = 1;
   TAILQ_INSERT_TAIL(&roots, ir, ir_link);
 }
 
@@ -218,6 +572,42 @@ save_state(void)
 }
 
 
+/**
+ * Drop everything below url from the queue
+ */
+static void
+indexer_unqueue(const char *url)
+{
+  char pfx[PATH_MAX];
+  indexer_job_t *ij, *next;
+  void *db;
+  int removed = 0;
+
+  indexer_prefix(pfx, sizeof(pfx), url);
+
+  hts_mutex_lock(&indexer_mutex);
+  for(ij = TAILQ_FIRST(&indexer_jobs); ij != NULL; ij = next) {
+    next = TAILQ_NEXT(ij, ij_link);
+    if(!indexer_below(ij->ij_url, url))
+      continue;
+    TAILQ_REMOVE(&indexer_jobs, ij, ij_link);
+    free(ij->ij_url);
+    free(ij);
+  }
+  hts_mutex_unlock(&indexer_mutex);
+
+  if((db = metadb_get()) == NULL)
+    return;
+
+  if(indexer_exec(db, "DELETE FROM indexqueue "
+                  "WHERE url || '/' = ?1 OR substr(url, 1, length(?1)) = ?1",
+                  pfx, 0) == SQLITE_DONE)
+    removed = sqlite3_changes(db);
+  metadb_close(db);
+
+  indexer_kick(-removed);
+}
+
 
 /**
  *
@@ -226,6 +616,7 @@ void
 fa_indexer_enable(const char *url, int on)
 {
   indexer_root_t *ir;
+  int unqueue = 0;
 
   hts_mutex_lock(&indexer_mutex);
   TAILQ_FOREACH(ir, &roots, ir_link) {
@@ -237,69 +628,24 @@ fa_indexer_enable(const char *url, int on)
     if(ir == NULL) {
       addroot(url);
       TRACE(TRACE_DEBUG, "Indexer", "Creating indexed root at %s", url);
-      hts_cond_signal(&indexer_cond);
+      indexer_work_seq++;
+      hts_cond_broadcast(&indexer_cond);
       save_state();
     }
   } else {
     if(ir != NULL) {
       TAILQ_REMOVE(&roots, ir, ir_link);
-      ir_release(ir);
+      free(ir->ir_url);
+      free(ir);
       TRACE(TRACE_DEBUG, "Indexer", "Removing indexed root at %s", url);
       save_state();
+      unqueue = 1;
     }
   }
   hts_mutex_unlock(&indexer_mutex);
-}
-
-
-/**
- *
- */
-static void *
-indexer_thread(void *aux)
-{
-  indexer_root_t *ir;
-  int did_something;
-
-  hts_mutex_lock(&indexer_mutex);
-  while(1) {
-  restart:
-    did_something = 0;    
-    TAILQ_FOREACH(ir, &roots, ir_link) {
-      
-      ir->ir_refcount++;
-
-      int doroot = 0;
-      if(!ir->ir_root_scanned) {
-        ir->ir_root_scanned = 1;
-        doroot = 1;
-      }
-
-      hts_mutex_unlock(&indexer_mutex);
 
-      if(doroot) {
-        index_path(ir->ir_url);
-        did_something = 1;
-      } else {
-        did_something |= do_round(ir->ir_url);
-      }
-
-      hts_mutex_lock(&indexer_mutex);
-      int rf = ir->ir_refcount;
-      ir_release(ir);
-      if(rf == 1)
-        break;
-    }
-
-    TAILQ_FOREACH(ir, &roots, ir_link) {
-      if(!ir->ir_root_scanned)
-        goto restart;
-    }
-
-    if(!did_something)
-      hts_cond_wait(&indexer_cond, &indexer_mutex);
-  }
-  return NULL;
+  if(unqueue)
+    indexer_unqueue(url);
 }
 
 
@@ -309,7 +655,10 @@ indexer_thread(void *aux)
 void
 fa_indexer_init(void)
 {
+  int i;
+
   TAILQ_INIT(&roots);
+  TAILQ_INIT(&indexer_jobs);
   hts_mutex_init(&indexer_mutex);
   hts_cond_init(&indexer_cond, &indexer_mutex);
 
@@ -330,6 +679,23 @@ fa_indexer_init(void)
     htsmsg_release(m);
   }
 
-  hts_thread_create_detached("indexer", indexer_thread, NULL,
-			     THREAD_PRIO_METADATA_BG);
+  prop_t *p = prop_create(prop_get_global(), "indexer");
+  indexer_prop_pending = prop_create(p, "pending");
+  indexer_prop_active  = prop_create(p, "active");
+  indexer_prop_done    = prop_create(p, "done");
+  indexer_prop_paused  = prop_create(p, "paused");
+  indexer_prop_rate    = prop_create(p, "rate");
+  indexer_prop_eta     = prop_create(p, "eta");
+
+  prop_subscribe(0,
+		 PROP_TAG_NAME("global", "media", "current", "playstatus"),
+		 PROP_TAG_CALLBACK_STRING, indexer_playstatus, NULL,
+		 NULL);
+
+  callout_arm(&indexer_stats_timer, indexer_stats_update, NULL,
+              INDEXER_STATS_INTERVAL);
+
+  for(i = 0; i < INDEXER_WORKERS; i++)
+    hts_thread_create_detached("indexer", indexer_worker, NULL,
+                               THREAD_PRIO_METADATA_BG);
 }
@@ -58,12 +58,48 @@
 LIST_HEAD(cifs_connection_list, cifs_connection);
 LIST_HEAD(nbt_req_list, nbt_req);
 LIST_HEAD(cifs_tree_list, cifs_tree);
+LIST_HEAD(smb_read_list, smb_read);
+TAILQ_HEAD(smb_read_queue, smb_read);
+LIST_HEAD(smb_attr_list, smb_attr);
+TAILQ_HEAD(smb_attr_queue, smb_attr);
+TAILQ_HEAD(smb_dir_queue, smb_dir);
 
 static struct cifs_connection_list cifs_connections;
 static hts_mutex_t smb_global_mutex;
 
 #define NBT_TIMEOUT 30000
 
+/**
+ * File reads are split into READ_ANDX requests of SMB_READ_CHUNK bytes
+ * (SMB_READ_CHUNK_LARGE if the server supports CAP_LARGE_READX). Once a
+ * file is read sequentially we keep SMB_READ_WINDOW bytes in flight
+ * ahead of the read position
+ */
+#define SMB_READ_CHUNK       57344  // 14 * 4096 is max according to spec
+#define SMB_READ_CHUNK_LARGE 126976 // Reply must fit in a 17 bit NBT frame
+
+#ifndef SMB_READ_WINDOW
+#define SMB_READ_WINDOW (2 * 1024 * 1024)
+#endif
+
+#define SMB_MPX_RESERVED 2 // Slots left for requests other than reads
+
+/**
+ * Directory listings and file attributes are cached per tree for
+ * SMB_DIRCACHE_TTL seconds. Entries from a listing also answer stats
+ * for files in that directory
+ */
+#define SMB_DIRCACHE_TTL  30
+#define SMB_DIRCACHE_DIRS 32  // Max cached listings per tree
+#define SMB_ATTR_HASH_SIZE 256
+
+static prop_t *smb_prop_dircache_hits;
+static prop_t *smb_prop_dircache_misses;
+static prop_t *smb_prop_dircache_saved;
+static int smb_dircache_hits;
+static int smb_dircache_misses;
+static int smb_dircache_saved;
+
 /**
  *
  */
@@ -73,15 +109,28 @@ typedef struct nbt_req {
   void *nr_response;
   int nr_response_len;
   int nr_result;
-  LIST_ENTRY(nbt_req) nr_multi_link;
-  int nr_offset;
-  int nr_cnt;
-  int nr_last;
   int nr_is_trans2;
   int nr_data_count;
 } nbt_req_t;
 
 
+/**
+ * An outstanding READ_ANDX request. Protected by cc_mutex
+ */
+typedef struct smb_read {
+  LIST_ENTRY(smb_read) sr_cc_link;
+  TAILQ_ENTRY(smb_read) sr_file_link;
+  uint16_t sr_mid;
+  char sr_abandoned;   // File does not want it anymore, free on arrival
+  int sr_result;       // -1 while in flight
+  int64_t sr_offset;
+  int sr_count;
+  void *sr_response;
+  const uint8_t *sr_data;
+  int sr_datalen;
+} smb_read_t;
+
+
 /**
  *
  */
@@ -134,10 +183,50 @@ typedef struct cifs_connection {
 
   int cc_auto_close;
 
+  /**
+   * Socket writes, the mid generator and the file read pipeline are
+   * protected by cc_mutex so reads don't need smb_global_mutex and
+   * one connection does not stall the others
+   */
+  hts_mutex_t cc_mutex;
+  hts_cond_t cc_read_cond;
+  struct smb_read_list cc_reads;
+  int cc_reads_inflight;
+  int cc_read_chunk;
+  char cc_reads_dead;
+
 } cifs_connection_t;
 
 
 
+/**
+ * Cached attributes of a file or directory
+ */
+typedef struct smb_attr {
+  LIST_ENTRY(smb_attr) sa_hash_link;
+  TAILQ_ENTRY(smb_attr) sa_dir_link;
+  struct smb_dir *sa_dir;  // Listing we came from, NULL if from a stat
+  char *sa_path;
+  const char *sa_name;     // Last component of sa_path
+  int sa_type;
+  int64_t sa_size;
+  time_t sa_mtime;
+  int64_t sa_expire;
+} smb_attr_t;
+
+
+/**
+ * Cached directory listing
+ */
+typedef struct smb_dir {
+  TAILQ_ENTRY(smb_dir) sd_link;
+  char *sd_path;
+  struct smb_attr_queue sd_entries;
+  int64_t sd_expire;
+  int sd_roundtrips;       // FIND_FIRST2/NEXT2 requests needed
+} smb_dir_t;
+
+
 /**
  *
  */
@@ -159,6 +248,11 @@ typedef struct cifs_tree {
 
   char ct_errbuf[256];
 
+  // Directory and attribute cache, protected by smb_global_mutex
+  struct smb_attr_list ct_attr_hash[SMB_ATTR_HASH_SIZE];
+  struct smb_dir_queue ct_dirs;
+  int ct_num_dirs;
+
 } cifs_tree_t;
 
 
@@ -224,6 +318,7 @@ typedef struct {
 
 #define SERVER_CAP_UNICODE 0x00000004
 #define SERVER_CAP_NT_SMBS 0x00000010
+#define SERVER_CAP_LARGE_READX 0x00004000
 
 #define SECURITY_SIGNATURES_REQUIRED	0x08
 #define SECURITY_SIGNATURES_ENABLED	0x04
@@ -926,10 +1021,10 @@ nbt_read(cifs_connection_t *cc, void **bufp, int *lenp)
 }
 
 /**
- *
+ * Must be called with cc_mutex held
  */
-static int
-nbt_write(cifs_connection_t *cc, void *buf, int len)
+static void
+nbt_send(cifs_connection_t *cc, void *buf, int len)
 {
   NBT_t *nbt = buf;
 
@@ -937,6 +1032,18 @@ nbt_write(cifs_connection_t *cc, void *buf, int len)
   nbt->flags = 0;
   nbt->length = htons(len - 4);
   tcp_write_data(cc->cc_tc, buf, len);
+}
+
+
+/**
+ *
+ */
+static int
+nbt_write(cifs_connection_t *cc, void *buf, int len)
+{
+  hts_mutex_lock(&cc->cc_mutex);
+  nbt_send(cc, buf, len);
+  hts_mutex_unlock(&cc->cc_mutex);
   return 0;
 }
 
@@ -985,6 +1092,9 @@ cifs_maybe_destroy(cifs_connection_t *cc)
 
   callout_disarm(&cc->cc_timer);
 
+  assert(LIST_FIRST(&cc->cc_reads) == NULL);
+  hts_cond_destroy(&cc->cc_read_cond);
+  hts_mutex_destroy(&cc->cc_mutex);
   hts_cond_destroy(&cc->cc_cond);
   free(cc->cc_hostname);
   free(cc);
@@ -1072,6 +1182,11 @@ smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
   cc->cc_max_buffer_size = MIN(65000, letoh_32(reply->max_buffer_size));
   cc->cc_max_mpx_count   = letoh_16(reply->max_mpx_count);
 
+  if(letoh_32(reply->capabilities) & SERVER_CAP_LARGE_READX)
+    cc->cc_read_chunk = SMB_READ_CHUNK_LARGE;
+  else
+    cc->cc_read_chunk = SMB_READ_CHUNK;
+
   len -= sizeof(SMB_NEG_PROTOCOL_reply_t);
 
   memcpy(cc->cc_challenge_key, reply->data, 8);
@@ -1280,6 +1395,96 @@ dump_request_list(cifs_connection_t *cc)
 }
 
 
+/**
+ *
+ */
+static int
+smb_read_parse(smb_read_t *sr, const void *buf, int len)
+{
+  const SMB_READ_ANDX_resp_t *resp = buf;
+  int offset, cnt;
+
+  if(len < sizeof(SMB_READ_ANDX_resp_t) || resp->hdr.errorcode)
+    return 1;
+
+  offset = letoh_16(resp->data_offset);
+  cnt = letoh_16(resp->data_length_low) +
+    (letoh_32(resp->data_length_high) << 16);
+
+  if(cnt > sr->sr_count || offset + cnt > len)
+    return 1;
+
+  sr->sr_data = buf + offset;
+  sr->sr_datalen = cnt;
+  return 0;
+}
+
+
+/**
+ * Deliver a READ_ANDX response, returns 1 if the response was for
+ * a read request
+ */
+static int
+smb_read_response(cifs_connection_t *cc, uint16_t mid, void *buf, int len)
+{
+  smb_read_t *sr;
+
+  hts_mutex_lock(&cc->cc_mutex);
+
+  LIST_FOREACH(sr, &cc->cc_reads, sr_cc_link)
+    if(sr->sr_mid == mid && sr->sr_result == -1)
+      break;
+
+  if(sr == NULL) {
+    hts_mutex_unlock(&cc->cc_mutex);
+    return 0;
+  }
+
+  cc->cc_reads_inflight--;
+
+  if(sr->sr_abandoned) {
+    LIST_REMOVE(sr, sr_cc_link);
+    free(sr);
+    free(buf);
+  } else {
+    sr->sr_response = buf;
+    sr->sr_result = smb_read_parse(sr, buf, len);
+    hts_cond_broadcast(&cc->cc_read_cond);
+  }
+  hts_mutex_unlock(&cc->cc_mutex);
+  return 1;
+}
+
+
+/**
+ * Connection is gone, fail all outstanding reads
+ */
+static void
+smb_read_fail_all(cifs_connection_t *cc)
+{
+  smb_read_t *sr, *next;
+
+  hts_mutex_lock(&cc->cc_mutex);
+  cc->cc_reads_dead = 1;
+
+  for(sr = LIST_FIRST(&cc->cc_reads); sr != NULL; sr = next) {
+    next = LIST_NEXT(sr, sr_cc_link);
+    if(sr->sr_result != -1)
+      continue;
+
+    if(sr->sr_abandoned) {
+      LIST_REMOVE(sr, sr_cc_link);
+      free(sr);
+    } else {
+      sr->sr_result = 1;
+    }
+  }
+  cc->cc_reads_inflight = 0;
+  hts_cond_broadcast(&cc->cc_read_cond);
+  hts_mutex_unlock(&cc->cc_mutex);
+}
+
+
 /**
  *
  */
@@ -1322,6 +1527,9 @@ smb_dispatch(void *aux)
       continue;
     }
 
+    if(smb_read_response(cc, mid, buf, len))
+      continue;
+
     hts_mutex_lock(&smb_global_mutex);
 
     LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
@@ -1434,6 +1642,8 @@ smb_dispatch(void *aux)
 
   hts_cond_broadcast(&cc->cc_cond);
   hts_mutex_unlock(&smb_global_mutex);
+
+  smb_read_fail_all(cc);
   return NULL;
 }
 
@@ -1507,6 +1717,8 @@ cifs_get_connection(const char *hostname, int port, char *errbuf, size_t errlen,
     cc->cc_as_guest = as_guest;
 
     hts_cond_init(&cc->cc_cond, &smb_global_mutex);
+    hts_mutex_init(&cc->cc_mutex);
+    hts_cond_init(&cc->cc_read_cond, &cc->cc_mutex);
 
     LIST_INSERT_HEAD(&cifs_connections, cc, cc_link);
     hts_mutex_unlock(&smb_global_mutex);
@@ -1581,11 +1793,14 @@ nbt_async_req(cifs_connection_t *cc, void *request, int request_len,
   SMB_t *h = request + 4;
   nbt_req_t *nr = calloc(1, sizeof(nbt_req_t));
   nr->nr_result = -1;
-  nr->nr_mid = cc->cc_mid_generator++;
   nr->nr_is_trans2 = is_trans2;
   h->pid = htole_16(2);
+
+  hts_mutex_lock(&cc->cc_mutex);
+  nr->nr_mid = cc->cc_mid_generator++;
   h->mid = htole_16(nr->nr_mid);
-  nbt_write(cc, request, request_len);
+  nbt_send(cc, request, request_len);
+  hts_mutex_unlock(&cc->cc_mutex);
 
   LIST_INSERT_HEAD(&cc->cc_pending_nbt_requests, nr, nr_link);
   SMBTRACE("%s:%d %s sent mid=%d on thread %lx", cc->cc_hostname, cc->cc_port,
@@ -1631,6 +1846,240 @@ nbt_async_req_reply_ex(cifs_connection_t *cc,
   nbt_async_req_reply_ex(a, b, c, d, e, f, __FUNCTION__)
 
 
+/**
+ *
+ */
+static unsigned int
+smb_attr_hash(const char *path)
+{
+  unsigned int h = 0;
+  while(*path)
+    h = h * 33 + *path++;
+  return h % SMB_ATTR_HASH_SIZE;
+}
+
+
+/**
+ *
+ */
+static void
+smb_dircache_stats(int hit, int roundtrips)
+{
+  if(hit) {
+    smb_dircache_hits++;
+    smb_dircache_saved += roundtrips;
+    prop_set_int(smb_prop_dircache_hits, smb_dircache_hits);
+    prop_set_int(smb_prop_dircache_saved, smb_dircache_saved);
+  } else {
+    smb_dircache_misses++;
+    prop_set_int(smb_prop_dircache_misses, smb_dircache_misses);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+smb_attr_destroy(smb_attr_t *sa)
+{
+  LIST_REMOVE(sa, sa_hash_link);
+  if(sa->sa_dir != NULL)
+    TAILQ_REMOVE(&sa->sa_dir->sd_entries, sa, sa_dir_link);
+  free(sa->sa_path);
+  free(sa);
+}
+
+
+/**
+ *
+ */
+static void
+smb_dir_destroy(cifs_tree_t *ct, smb_dir_t *sd)
+{
+  smb_attr_t *sa;
+
+  while((sa = TAILQ_FIRST(&sd->sd_entries)) != NULL)
+    smb_attr_destroy(sa);
+
+  TAILQ_REMOVE(&ct->ct_dirs, sd, sd_link);
+  ct->ct_num_dirs--;
+  free(sd->sd_path);
+  free(sd);
+}
+
+
+/**
+ * Find unexpired attributes for path
+ */
+static smb_attr_t *
+smb_attr_find(cifs_tree_t *ct, const char *path)
+{
+  smb_attr_t *sa;
+
+  LIST_FOREACH(sa, &ct->ct_attr_hash[smb_attr_hash(path)], sa_hash_link)
+    if(!strcmp(sa->sa_path, path))
+      break;
+
+  if(sa != NULL && sa->sa_expire < showtime_get_ts()) {
+    if(sa->sa_dir != NULL)
+      smb_dir_destroy(ct, sa->sa_dir);
+    else
+      smb_attr_destroy(sa);
+    return NULL;
+  }
+  return sa;
+}
+
+
+/**
+ *
+ */
+static smb_attr_t *
+smb_attr_add(cifs_tree_t *ct, smb_dir_t *sd, const char *path, int type,
+             int64_t size, time_t mtime)
+{
+  smb_attr_t *sa;
+
+  LIST_FOREACH(sa, &ct->ct_attr_hash[smb_attr_hash(path)], sa_hash_link)
+    if(!strcmp(sa->sa_path, path))
+      break;
+
+  if(sa != NULL)
+    smb_attr_destroy(sa);
+
+  sa = calloc(1, sizeof(smb_attr_t));
+  sa->sa_path = strdup(path);
+  sa->sa_name = strrchr(sa->sa_path, '/');
+  sa->sa_name = sa->sa_name != NULL ? sa->sa_name + 1 : sa->sa_path;
+  sa->sa_type = type;
+  sa->sa_size = size;
+  sa->sa_mtime = mtime;
+  sa->sa_dir = sd;
+
+  if(sd != NULL) {
+    sa->sa_expire = sd->sd_expire;
+    TAILQ_INSERT_TAIL(&sd->sd_entries, sa, sa_dir_link);
+  } else {
+    sa->sa_expire = showtime_get_ts() + SMB_DIRCACHE_TTL * 1000000LL;
+  }
+  LIST_INSERT_HEAD(&ct->ct_attr_hash[smb_attr_hash(path)], sa, sa_hash_link);
+  return sa;
+}
+
+
+/**
+ * Look up a cached listing. Hits are moved to the head of ct_dirs so
+ * eviction from the tail in smb_dir_create() drops the least recently
+ * used one
+ */
+static smb_dir_t *
+smb_dir_find(cifs_tree_t *ct, const char *path)
+{
+  smb_dir_t *sd;
+
+  TAILQ_FOREACH(sd, &ct->ct_dirs, sd_link)
+    if(!strcmp(sd->sd_path, path))
+      break;
+
+  if(sd == NULL)
+    return NULL;
+
+  if(sd->sd_expire < showtime_get_ts()) {
+    smb_dir_destroy(ct, sd);
+    return NULL;
+  }
+
+  if(sd != TAILQ_FIRST(&ct->ct_dirs)) {
+    TAILQ_REMOVE(&ct->ct_dirs, sd, sd_link);
+    TAILQ_INSERT_HEAD(&ct->ct_dirs, sd, sd_link);
+  }
+  return sd;
+}
+
+
+/**
+ * Start a new listing for path, replacing any old one
+ */
+static smb_dir_t *
+smb_dir_create(cifs_tree_t *ct, const char *path)
+{
+  smb_dir_t *sd;
+
+  TAILQ_FOREACH(sd, &ct->ct_dirs, sd_link)
+    if(!strcmp(sd->sd_path, path))
+      break;
+
+  if(sd != NULL)
+    smb_dir_destroy(ct, sd);
+
+  if(ct->ct_num_dirs >= SMB_DIRCACHE_DIRS)
+    smb_dir_destroy(ct, TAILQ_LAST(&ct->ct_dirs, smb_dir_queue));
+
+  sd = calloc(1, sizeof(smb_dir_t));
+  sd->sd_path = strdup(path);
+  sd->sd_expire = showtime_get_ts() + SMB_DIRCACHE_TTL * 1000000LL;
+  TAILQ_INIT(&sd->sd_entries);
+  TAILQ_INSERT_HEAD(&ct->ct_dirs, sd, sd_link);
+  ct->ct_num_dirs++;
+  return sd;
+}
+
+
+/**
+ * Forget about path and the listing of its parent directory
+ */
+static void
+smb_dircache_invalidate(cifs_tree_t *ct, const char *path)
+{
+  smb_attr_t *sa;
+  smb_dir_t *sd;
+  char *parent = mystrdupa(path);
+  char *x = strrchr(parent, '/');
+
+  if(x != NULL)
+    *x = 0;
+  else
+    *parent = 0;
+
+  if((sd = smb_dir_find(ct, parent)) != NULL)
+    smb_dir_destroy(ct, sd);
+
+  if((sd = smb_dir_find(ct, path)) != NULL)
+    smb_dir_destroy(ct, sd);
+
+  if((sa = smb_attr_find(ct, path)) != NULL)
+    smb_attr_destroy(sa);
+}
+
+
+/**
+ * Drop expired entries, or everything if 'all' is set
+ */
+static void
+smb_dircache_prune(cifs_tree_t *ct, int all)
+{
+  int64_t now = showtime_get_ts();
+  smb_attr_t *sa, *next;
+  smb_dir_t *sd, *prev;
+  int i;
+
+  for(sd = TAILQ_LAST(&ct->ct_dirs, smb_dir_queue); sd != NULL; sd = prev) {
+    prev = TAILQ_PREV(sd, smb_dir_queue, sd_link);
+    if(all || sd->sd_expire < now)
+      smb_dir_destroy(ct, sd);
+  }
+
+  for(i = 0; i < SMB_ATTR_HASH_SIZE; i++) {
+    for(sa = LIST_FIRST(&ct->ct_attr_hash[i]); sa != NULL; sa = next) {
+      next = LIST_NEXT(sa, sa_hash_link);
+      if(all || sa->sa_expire < now)
+        smb_attr_destroy(sa);
+    }
+  }
+}
+
+
 /**
  *
  */
@@ -1645,6 +2094,7 @@ cifs_release_tree(cifs_tree_t *ct, int full)
     return;
   }
   LIST_REMOVE(ct, ct_link);
+  smb_dircache_prune(ct, 1);
   cifs_release_connection(ct->ct_cc);
   free(ct->ct_share);
   free(ct);
@@ -1664,6 +2114,7 @@ cifs_disconnect(cifs_connection_t *cc)
       return;
     }
     LIST_REMOVE(ct, ct_link);
+    smb_dircache_prune(ct, 1);
     free(ct->ct_share);
     hts_cond_destroy(&ct->ct_cond);
     free(ct);
@@ -1790,6 +2241,7 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
     ct->ct_cc = cc;
     LIST_INSERT_HEAD(&cc->cc_trees, ct, ct_link);
     ct->ct_share = strdup(share);
+    TAILQ_INIT(&ct->ct_dirs);
     ct->ct_refcount = 1;
     hts_cond_init(&ct->ct_cond, &smb_global_mutex);
     ct->ct_status = CT_CONNECTING;
@@ -1974,9 +2426,17 @@ release_tree_protocol_error(cifs_tree_t *ct, char *errbuf, size_t errlen)
 }
 
 
+#define SMB_REPLY_ERROR 1
+#define SMB_REPLY_RUNT  2
+
+/**
+ * Check a reply without touching the tree. Returns 0 if OK,
+ * SMB_REPLY_ERROR if the server returned an error and SMB_REPLY_RUNT
+ * if the reply is too short
+ */
 static int
-check_smb_error(cifs_tree_t *ct, void *rbuf, size_t rlen, size_t runt_lim,
-		char *errbuf, size_t errlen)
+smb_reply_check(const void *rbuf, size_t rlen, size_t runt_lim,
+                char *errbuf, size_t errlen)
 {
   const SMB_t *smb = rbuf;
   uint32_t errcode = letoh_32(smb->errorcode);
@@ -1984,22 +2444,35 @@ check_smb_error(cifs_tree_t *ct, void *rbuf, size_t rlen, size_t runt_lim,
   if(errcode) {
     snprintf(errbuf, errlen, "SMB Error 0x%08x", errcode);
     SMBTRACE("Error: 0x%08x", errcode);
-    free(rbuf);
-    cifs_release_tree(ct, 0);
-    return -1;
+    return SMB_REPLY_ERROR;
   }
 
   if(rlen < runt_lim) {
     snprintf(errbuf, errlen, "Short packet");
-    free(rbuf);
-    cifs_release_tree(ct, 1);
-    return -1;
+    return SMB_REPLY_RUNT;
   }
-
   return 0;
 }
 
 
+/**
+ * On error 'rbuf' is freed and the tree is released
+ */
+static int
+check_smb_error(cifs_tree_t *ct, void *rbuf, size_t rlen, size_t runt_lim,
+		char *errbuf, size_t errlen)
+{
+  int r = smb_reply_check(rbuf, rlen, runt_lim, errbuf, errlen);
+
+  if(r == 0)
+    return 0;
+
+  free(rbuf);
+  cifs_release_tree(ct, r == SMB_REPLY_RUNT);
+  return -1;
+}
+
+
 /**
  *
  */
@@ -2121,6 +2594,7 @@ cifs_delete(const char *url, char *errbuf, size_t errlen, int dir)
   if(r != CIFS_RESOLVE_TREE)
     return -1;
 
+  smb_dircache_invalidate(ct, filename);
   backslashify(filename);
   cc = ct->ct_cc;
 
@@ -2175,6 +2649,17 @@ static int
 cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
 	  char *errbuf, size_t errlen)
 {
+  smb_attr_t *sa = smb_attr_find(ct, filename);
+
+  if(sa != NULL) {
+    fs->fs_type = sa->sa_type;
+    fs->fs_size = sa->sa_size;
+    fs->fs_mtime = sa->sa_mtime;
+    smb_dircache_stats(1, sa->sa_type == CONTENT_DIR ? 1 : 2);
+    return 0;
+  }
+  smb_dircache_stats(0, 0);
+
   char *fname = mystrdupa(filename);
   backslashify(fname);
   int plen = utf8_to_smb(ct->ct_cc, NULL, fname);
@@ -2220,6 +2705,7 @@ cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
 
     free(rbuf);
   }
+  smb_attr_add(ct, NULL, filename, fs->fs_type, fs->fs_size, fs->fs_mtime);
   return 0;
 }
 
@@ -2243,6 +2729,7 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
   int search_count = 100;
   uint8_t fname[512];
   char url[1024];
+  char relpath[1024];
   char *urlbase;
   size_t urlspace;
 
@@ -2264,6 +2751,26 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
   urlbase = url + strlen(url);
   urlspace = sizeof(url) - strlen(url);
 
+  smb_dir_t *sd = smb_dir_find(ct, path);
+  smb_attr_t *sa;
+
+  if(sd != NULL) {
+    TAILQ_FOREACH(sa, &sd->sd_entries, sa_dir_link) {
+      snprintf(urlbase, urlspace, "%s", sa->sa_name);
+      fde = fa_dir_add(fd, url, sa->sa_name, sa->sa_type);
+      if(fde != NULL) {
+	fde->fde_stat.fs_size = sa->sa_size;
+	fde->fde_stat.fs_mtime = sa->sa_mtime;
+	fde->fde_statdone = 1;
+      }
+    }
+    smb_dircache_stats(1, sd->sd_roundtrips);
+    return 0;
+  }
+  smb_dircache_stats(0, 0);
+
+  sd = smb_dir_create(ct, path);
+
   while(1) {
 
     memset(req, 0, tlen);
@@ -2296,11 +2803,22 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
       tlen = sizeof(SMB_TRANS2_FIND_req_t) + 1;
     }
 
-    if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 1))
+    sd->sd_roundtrips++;
+
+    if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 1)) {
+      smb_dir_destroy(ct, sd);
       return release_tree_io_error(ct, errbuf, errlen);
+    }
 
-    if(check_smb_error(ct, rbuf, rlen, sizeof(TRANS2_reply_t), errbuf, errlen))
+    // Drop the listing before the tree is released (and maybe freed)
+    int err = smb_reply_check(rbuf, rlen, sizeof(TRANS2_reply_t),
+                              errbuf, errlen);
+    if(err) {
+      free(rbuf);
+      smb_dir_destroy(ct, sd);
+      cifs_release_tree(ct, err == SMB_REPLY_RUNT);
       return -1;
+    }
 
     t2resp = (const TRANS2_reply_t *)rbuf;
     int poff = letoh_16(t2resp->param_offset);
@@ -2310,7 +2828,8 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
     } else {
       if(poff < 2) {
 	free(rbuf);
-	return -1;
+	smb_dir_destroy(ct, sd);
+	return release_tree_protocol_error(ct, errbuf, errlen);
       }
       respparam = rbuf + poff-2;
     }
@@ -2329,11 +2848,16 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
 
       int isdir = letoh_32(data->file_attributes) & 0x10;
 
-      fde = fa_dir_add(fd, url, (char *)fname,
-		       isdir ? CONTENT_DIR : CONTENT_FILE);
+      snprintf(relpath, sizeof(relpath), "%s%s%s",
+               path, *path ? "/" : "", fname);
+
+      sa = smb_attr_add(ct, sd, relpath, isdir ? CONTENT_DIR : CONTENT_FILE,
+                        letoh_64(data->file_size), parsetime(data->change));
+
+      fde = fa_dir_add(fd, url, (char *)fname, sa->sa_type);
       if(fde != NULL) {
-	fde->fde_stat.fs_size = letoh_64(data->file_size);
-	fde->fde_stat.fs_mtime = parsetime(data->change);
+	fde->fde_stat.fs_size = sa->sa_size;
+	fde->fde_stat.fs_mtime = sa->sa_mtime;
 	fde->fde_statdone = 1;
       }
 
@@ -2384,12 +2908,50 @@ typedef struct smb_file {
   fa_handle_t h;
   cifs_tree_t *sf_ct;
   uint16_t sf_fid;
-  uint64_t sf_pos;
-  uint64_t sf_file_size;
+  int64_t sf_pos;
+  int64_t sf_file_size;
+
+  struct smb_read_queue sf_reads; // In file order, protected by cc_mutex
+  int64_t sf_issued;              // End of last issued read
+  int sf_seq;                     // Sequential reads in a row
 } smb_file_t;
 
 
 
+/**
+ *
+ */
+static void
+smb_read_free(smb_file_t *sf, smb_read_t *sr)
+{
+  TAILQ_REMOVE(&sf->sf_reads, sr, sr_file_link);
+  LIST_REMOVE(sr, sr_cc_link);
+  free(sr->sr_response);
+  free(sr);
+}
+
+
+/**
+ * Drop all reads issued for the file, called with cc_mutex held
+ */
+static void
+smb_read_flush(smb_file_t *sf)
+{
+  smb_read_t *sr;
+
+  while((sr = TAILQ_FIRST(&sf->sf_reads)) != NULL) {
+    if(sr->sr_result == -1) {
+      // Still in flight, dispatcher will free it
+      TAILQ_REMOVE(&sf->sf_reads, sr, sr_file_link);
+      sr->sr_abandoned = 1;
+    } else {
+      smb_read_free(sf, sr);
+    }
+  }
+  sf->sf_issued = sf->sf_pos;
+}
+
+
 /**
  *
  */
@@ -2455,6 +3017,7 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
   resp = rbuf;
   sf->sf_fid = resp->fid;
   sf->sf_file_size = letoh_64(resp->file_size);
+  TAILQ_INIT(&sf->sf_reads);
   sf->h.fh_proto = fap;
   free(rbuf);
   return &sf->h;
@@ -2471,6 +3034,10 @@ smb_close(fa_handle_t *fh)
   SMB_CLOSE_req_t *req;
   cifs_tree_t *ct = sf->sf_ct;
 
+  hts_mutex_lock(&ct->ct_cc->cc_mutex);
+  smb_read_flush(sf);
+  hts_mutex_unlock(&ct->ct_cc->cc_mutex);
+
   hts_mutex_lock(&smb_global_mutex);
 
   req = alloca(sizeof(SMB_CLOSE_req_t));
@@ -2488,19 +3055,88 @@ smb_close(fa_handle_t *fh)
 
 
 /**
- *
+ * Send one READ_ANDX request, called with cc_mutex held.
+ * If 'first' is set the read is put in front of the already issued ones
+ */
+static void
+smb_read_send(smb_file_t *sf, int64_t pos, int cnt, int first)
+{
+  cifs_tree_t *ct = sf->sf_ct;
+  cifs_connection_t *cc = ct->ct_cc;
+  SMB_READ_ANDX_req_t req;
+  smb_read_t *sr = calloc(1, sizeof(smb_read_t));
+
+  memset(&req, 0, sizeof(req));
+  smb_init_header(cc, &req.hdr, SMB_READ_ANDX,
+                  SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
+
+  sr->sr_mid = cc->cc_mid_generator++;
+  sr->sr_result = -1;
+  sr->sr_offset = pos;
+  sr->sr_count = cnt;
+
+  req.hdr.pid = htole_16(2);
+  req.hdr.mid = htole_16(sr->sr_mid);
+  req.fid = sf->sf_fid;
+  req.offset_low = htole_32((uint32_t)pos);
+  req.offset_high = htole_32((uint32_t)(pos >> 32));
+  req.max_count_low = htole_16(cnt & 0xffff);
+  req.max_count_high = htole_32(cnt >> 16);
+  req.wordcount = 12;
+  req.andx_command = 0xff;
+
+  LIST_INSERT_HEAD(&cc->cc_reads, sr, sr_cc_link);
+  if(first)
+    TAILQ_INSERT_HEAD(&sf->sf_reads, sr, sr_file_link);
+  else
+    TAILQ_INSERT_TAIL(&sf->sf_reads, sr, sr_file_link);
+  cc->cc_reads_inflight++;
+
+  nbt_send(cc, &req, sizeof(req));
+}
+
+
+/**
+ * Issue reads until 'end', called with cc_mutex held
+ */
+static int
+smb_read_issue(smb_file_t *sf, int64_t end)
+{
+  cifs_connection_t *cc = sf->sf_ct->ct_cc;
+  int maxreqs = MAX(1, cc->cc_max_mpx_count - SMB_MPX_RESERVED);
+
+  end = MIN(end, sf->sf_file_size);
+
+  while(sf->sf_issued < end) {
+
+    if(cc->cc_reads_dead)
+      return -1;
+
+    // Always allow one request per file so we can make progress
+    if(cc->cc_reads_inflight >= maxreqs && !TAILQ_EMPTY(&sf->sf_reads))
+      break;
+
+    int cnt = MIN(cc->cc_read_chunk, sf->sf_file_size - sf->sf_issued);
+    smb_read_send(sf, sf->sf_issued, cnt, 0);
+    sf->sf_issued += cnt;
+  }
+  return 0;
+}
+
+
+/**
+ * Reads are pipelined: all READ_ANDX requests needed for the read are
+ * sent at once and when the file is read sequentially we also keep
+ * reading ahead so the next call can be served without a round trip
  */
 static int
 smb_read(fa_handle_t *fh, void *buf, size_t size)
 {
   smb_file_t *sf = (smb_file_t *)fh;
-  SMB_READ_ANDX_req_t *req;
-  const SMB_READ_ANDX_resp_t *resp;
-  size_t cnt, rcnt;
-  size_t total = 0;
-  cifs_tree_t *ct = sf->sf_ct;
-  nbt_req_t *nr = NULL;
-  struct nbt_req_list reqs;
+  cifs_connection_t *cc = sf->sf_ct->ct_cc;
+  smb_read_t *sr;
+  int total = 0;
+  int64_t end;
 
   if(sf->sf_pos >= sf->sf_file_size)
     return 0;
@@ -2511,96 +3147,80 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
   if(size == 0)
     return 0;
 
-  LIST_INIT(&reqs);
+  hts_mutex_lock(&cc->cc_mutex);
 
-  req = alloca(sizeof(SMB_READ_ANDX_req_t));
-  memset(req, 0, sizeof(SMB_READ_ANDX_req_t));
+  sr = TAILQ_FIRST(&sf->sf_reads);
+  if(sr != NULL ? (sf->sf_pos >= sr->sr_offset &&
+                   sf->sf_pos < sr->sr_offset + sr->sr_count) :
+     sf->sf_pos == sf->sf_issued) {
+    sf->sf_seq++;
+  } else {
+    smb_read_flush(sf);
+    sf->sf_seq = 0;
+  }
 
-  hts_mutex_lock(&smb_global_mutex);
+  end = sf->sf_pos + size;
+  if(sf->sf_seq >= 2)
+    end += SMB_READ_WINDOW;
 
   while(size > 0) {
-    cnt = MIN(size, 57344); // 14 * 4096 is max according to spec
-    smb_init_header(ct->ct_cc, &req->hdr, SMB_READ_ANDX,
-		    SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
-    
-    req->fid = sf->sf_fid;
-    int64_t pos = sf->sf_pos + total;
-    req->offset_low = htole_32((uint32_t)pos);
-    req->offset_high = htole_32((uint32_t)(pos >> 32));
-    req->max_count_low = htole_16(cnt & 0xffff);
-    req->max_count_high = htole_32(cnt >> 16);
-    req->wordcount = 12;
-    req->andx_command = 0xff;
 
-    nr = nbt_async_req(ct->ct_cc, req, sizeof(SMB_READ_ANDX_req_t), 0,
-                       "read");
-    LIST_INSERT_HEAD(&reqs, nr, nr_multi_link);
-
-    nr->nr_offset = total;
-    nr->nr_cnt = cnt;
-    total += cnt;
-    size -= cnt;
-    nr->nr_last = 0;
-  }
-  nr->nr_last = 1;
+    if(smb_read_issue(sf, end))
+      goto fail;
 
-  while(1) {
-    LIST_FOREACH(nr, &reqs, nr_multi_link)
-      if(nr->nr_result == -1)
-	break;
+    sr = TAILQ_FIRST(&sf->sf_reads);
 
-    if(nr != NULL) {
-      if(hts_cond_wait_timeout(&ct->ct_cc->cc_cond, &smb_global_mutex,
+    while(sr->sr_result == -1) {
+      if(hts_cond_wait_timeout(&cc->cc_read_cond, &cc->cc_mutex,
                                NBT_TIMEOUT)) {
-	break;
+        TRACE(TRACE_ERROR, "SMB", "%s:%d read timeout (%d) on %p",
+              cc->cc_hostname, cc->cc_port, sr->sr_mid, cc);
+        cc->cc_broken = 1;
+        goto fail;
       }
-    } else {
-      break;
     }
-  }
-  
-  total = 0;
-  while((nr = LIST_FIRST(&reqs)) != NULL) {
-    if(nr->nr_result)
-      goto fail;
 
-    resp = nr->nr_response;
-    uint32_t errcode = letoh_32(resp->hdr.errorcode);
-    if(errcode)
+    if(sr->sr_result)
       goto fail;
 
-    LIST_REMOVE(nr, nr_link);
-    LIST_REMOVE(nr, nr_multi_link);
+    int avail = sr->sr_datalen - (sf->sf_pos - sr->sr_offset);
+    int cnt = avail > 0 ? MIN(avail, size) : 0;
 
-    rcnt = letoh_16(resp->data_length_low);
-    rcnt += letoh_32(resp->data_length_high) << 16;
-    memcpy(buf + nr->nr_offset, 
-	   nr->nr_response + letoh_16(resp->data_offset), rcnt);
-    free(nr->nr_response);
-
-    sf->sf_pos += rcnt;
-    total += rcnt;
+    if(cnt > 0) {
+      memcpy(buf, sr->sr_data + sr->sr_datalen - avail, cnt);
+      buf += cnt;
+      size -= cnt;
+      total += cnt;
+      sf->sf_pos += cnt;
+    }
 
-    if(nr->nr_last && rcnt < nr->nr_cnt) {
-      free(nr);
-      break;
+    if(sf->sf_pos >= sr->sr_offset + sr->sr_datalen) {
+      const int64_t got = sr->sr_offset + sr->sr_datalen;
+      const int missing = sr->sr_count - sr->sr_datalen;
+      const int empty = sr->sr_datalen == 0;
+      smb_read_free(sf, sr);
+
+      if(missing > 0) {
+        if(empty || got >= sf->sf_file_size) {
+          // File is shorter than we thought
+          smb_read_flush(sf);
+          break;
+        }
+        // Short reply, ask for the rest and keep the window behind it
+        if(cc->cc_reads_dead)
+          goto fail;
+        smb_read_send(sf, got, missing, 1);
+      }
     }
-    free(nr);
   }
-  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_unlock(&cc->cc_mutex);
   return total;
 
  fail:
-
-  while((nr = LIST_FIRST(&reqs)) != NULL) {
-    LIST_REMOVE(nr, nr_link);
-    LIST_REMOVE(nr, nr_multi_link);
-    free(nr->nr_response);
-    free(nr);
-  }
-  hts_mutex_unlock(&smb_global_mutex);
-  return -1;
-
+  smb_read_flush(sf);
+  sf->sf_seq = 0;
+  hts_mutex_unlock(&cc->cc_mutex);
+  return total ?: -1;
 }
 
 
@@ -2892,6 +3512,10 @@ cifs_periodic(struct callout *c, void *opaque)
 
   cc->cc_wait_for_ping = 1;
 
+  cifs_tree_t *ct;
+  LIST_FOREACH(ct, &cc->cc_trees, ct_link)
+    smb_dircache_prune(ct, 0);
+
   callout_arm(&cc->cc_timer, cifs_periodic, cc, SMB_ECHO_INTERVAL);
   cc->cc_auto_close++;
   if(cc->cc_auto_close > 5) {
@@ -2909,6 +3533,12 @@ cifs_periodic(struct callout *c, void *opaque)
 static void
 smb_init(void)
 {
+  prop_t *p = prop_create(prop_create(prop_get_global(), "smb"), "dircache");
+
+  smb_prop_dircache_hits   = prop_create(p, "hits");
+  smb_prop_dircache_misses = prop_create(p, "misses");
+  smb_prop_dircache_saved  = prop_create(p, "roundtripsSaved");
+
   hts_mutex_init(&smb_global_mutex);
 }
 
@@ -235,6 +235,13 @@ typedef struct fa_protocol {
   fa_err_code_t (*fap_fsinfo)(struct fa_protocol *fap, const char *url,
                               fa_fsinfo_t *ffi);
 
+  /**
+   * Get a string that changes when the content of the file changes
+   * (ETag, modification time, etc). Used by the read-ahead cache to
+   * detect stale data. Returns 0 on success
+   */
+  int (*fap_get_validator)(fa_handle_t *fh, char *buf, size_t bufsize);
+
 } fa_protocol_t;
 
 
@@ -34,6 +34,7 @@
 #include "fa_probe.h"
 #include "playqueue.h"
 #include "misc/strtab.h"
+#include "misc/minmax.h"
 #include "prop/prop_nodefilter.h"
 #include "plugins.h"
 #include "text/text.h"
@@ -42,6 +43,7 @@
 #include "notifications.h"
 #include "metadata/playinfo.h"
 #include "metadata/metadata_str.h"
+#include "arch/atomic.h"
 
 #define SCAN_TRACE(x, ...) do {                                \
     if(gconf.enable_fa_scanner_debug)                          \
@@ -49,7 +51,32 @@
   } while(0)
 
 
-extern int media_buffer_hungry;
+extern atomic_t media_buffer_hungry;
+
+/**
+ * Directories without change notification are polled. The directory
+ * itself is stat()ed every SCANNER_POLL_INTERVAL seconds and relisted
+ * if its mtime changed. Every SCANNER_POLL_FULL:th poll it's relisted
+ * anyway to pick up files modified in place
+ */
+#define SCANNER_POLL_INTERVAL 30
+#define SCANNER_POLL_FULL     10
+
+#define SCANNER_MAX_PENDING_CHANGES 1000
+
+/**
+ * Change reported by fa_notify_start(), queued on the notifying thread
+ * and applied on the scanner thread
+ */
+typedef struct scanner_change {
+  TAILQ_ENTRY(scanner_change) sc_link;
+  fa_notify_op_t sc_op;
+  int sc_type;
+  char *sc_url;
+  char *sc_filename;
+} scanner_change_t;
+
+TAILQ_HEAD(scanner_change_queue, scanner_change);
 
 typedef enum {
   BROWSER_STOP,
@@ -89,10 +116,19 @@ typedef struct scanner {
 
   prop_courier_t *s_pc;
 
+  uint32_t s_dirsig; // Signature of listing s_fd is in sync with, 0 if unknown
+
+  hts_mutex_t s_change_mutex;
+  struct scanner_change_queue s_changes;
+  int s_num_changes;
+  int s_change_overflow;
+  int s_change_seq;
+  prop_t *s_change_trigger;
+
 } scanner_t;
 
 
-static int rescan(scanner_t *s);
+static int rescan(scanner_t *s, int force);
 static void browse_as_dir(scanner_t *s);
 
 
@@ -147,25 +183,26 @@ set_type(prop_t *proproot, unsigned int type)
 
 
 /**
- *
+ * Build the item prop for 'fde'. All mutations are recorded in 'pb'
+ * and takes effect when the batch is committed
  */
 static void
-make_prop(fa_dir_entry_t *fde)
+make_prop(fa_dir_entry_t *fde, prop_batch_t *pb)
 {
   prop_t *p = prop_create_root(NULL);
   prop_t *metadata;
+  const char *typestr;
 
-  prop_set_rstring(prop_create(p, "url"), fde->fde_url);
-  prop_set_rstring(prop_create(p, "filename"), fde->fde_filename);
-  set_type(p, fde->fde_type);
+  prop_batch_set(pb, p, "url", PROP_SET_RSTRING, fde->fde_url);
+  prop_batch_set(pb, p, "filename", PROP_SET_RSTRING, fde->fde_filename);
+
+  if((typestr = content2type(fde->fde_type)) != NULL)
+    prop_batch_set(pb, p, "type", PROP_SET_STRING, typestr);
 
   if(fde->fde_metadata != NULL) {
 
     metadata = fde->fde_metadata;
-    
-    if(prop_set_parent(metadata, p))
-      abort();
-
+    prop_batch_set_parent(pb, metadata, p);
     fde->fde_metadata = NULL;
   } else {
 
@@ -176,20 +213,20 @@ make_prop(fa_dir_entry_t *fde)
       title = metadata_remove_postfix_rstr(fde->fde_filename);
     }
     
-    metadata = prop_create(p, "metadata");
-    prop_set_rstring(prop_create(metadata, "title"), title);
-    rstr_release(title);
+    metadata = prop_create_root("metadata");
+    prop_batch_set(pb, metadata, "title", PROP_ADOPT_RSTRING, title);
+    prop_batch_set_parent(pb, metadata, p);
   }
 
 
   if(fde->fde_statdone)
-    prop_set(metadata, "timestamp", PROP_SET_INT, fde->fde_stat.fs_mtime);
+    prop_batch_set(pb, metadata, "timestamp", PROP_SET_INT,
+                   fde->fde_stat.fs_mtime);
+
+  prop_batch_set(pb, p, "canDelete", PROP_SET_INT, gconf.fa_allow_delete);
 
   assert(fde->fde_prop == NULL);
   fde->fde_prop = prop_ref_inc(p);
-
-  prop_set(p, "canDelete", PROP_SET_INT, gconf.fa_allow_delete);
-
 }
 
 /**
@@ -264,48 +301,286 @@ type_from_filename(const char *filename)
 
 
 /**
+ * Deep probing
+ *
+ * Probing (metadb cache lookup and, if that fails, opening the file)
+ * is done by a pool of PROBE_WORKERS threads shared by all scanners.
+ * Jobs are queued per host and workers take turns between the hosts
+ * that have work. Remote hosts are probed by at most PROBE_PER_HOST
+ * workers at a time so a single slow share can not occupy all of them.
+ * Hosts are forgotten once they have nothing queued or running.
+ *
+ * While playback is filling its buffers workers leave the queues
+ * alone. Queued jobs of a scanner that goes away are cancelled by the
+ * scanner itself.
  *
+ * The results are applied to the prop tree by the scanner thread in
+ * directory order and the metadb updates are written in batches of
+ * PROBE_WRITE_BATCH items per transaction.
+ */
+#define PROBE_WORKERS     4
+#define PROBE_PER_HOST    2
+#define PROBE_WRITE_BATCH 32
+
+TAILQ_HEAD(probe_job_queue, probe_job);
+TAILQ_HEAD(probe_host_queue, probe_host);
+LIST_HEAD(probe_host_list, probe_host);
+
+typedef struct probe_host {
+  LIST_ENTRY(probe_host) ph_link;
+  TAILQ_ENTRY(probe_host) ph_ready_link;  // In probe_ready if ph_ready
+  struct probe_job_queue ph_jobs;
+  char *ph_name;  // NULL for local files
+  int ph_active;
+  int ph_limit;
+  char ph_ready;
+} probe_host_t;
+
+typedef struct probe_job {
+  TAILQ_ENTRY(probe_job) pj_link;
+  scanner_t *pj_scanner;
+  fa_dir_entry_t *pj_fde;
+  probe_host_t *pj_host;
+  metadata_index_status_t pj_indexstatus;
+  char pj_running;
+  char pj_done;
+  char pj_skipped;
+  char pj_from_cache;
+  int64_t pj_time;
+} probe_job_t;
+
+static struct probe_host_queue probe_ready; // Hosts a job can be taken from
+static struct probe_host_list probe_hosts;
+static probe_host_t probe_local;
+static HTS_MUTEX_DECL(probe_mutex);
+static hts_cond_t probe_cond;       // A host became ready
+static hts_cond_t probe_done_cond;  // A job has completed
+static int probe_workers_started;
+
+
+/**
+ * Returns the host to queue probing of 'url' on. Must be called with
+ * probe_mutex held
+ */
+static probe_host_t *
+probe_host_get(const char *url)
+{
+  probe_host_t *ph;
+  const char *h, *e;
+
+  if((h = strstr(url, "://")) == NULL || !strncmp(url, "file://", 7))
+    return &probe_local;
+
+  h += 3;
+  if((e = strchr(h, '/')) == NULL)
+    e = h + strlen(h);
+
+  LIST_FOREACH(ph, &probe_hosts, ph_link)
+    if(strlen(ph->ph_name) == e - h && !memcmp(ph->ph_name, h, e - h))
+      return ph;
+
+  ph = calloc(1, sizeof(probe_host_t));
+  ph->ph_name = strndup(h, e - h);
+  ph->ph_limit = PROBE_PER_HOST;
+  TAILQ_INIT(&ph->ph_jobs);
+  LIST_INSERT_HEAD(&probe_hosts, ph, ph_link);
+  return ph;
+}
+
+
+/**
+ * Put 'ph' on or take it off the ready queue after its jobs or active
+ * count changed. An idle remote host is freed. Must be called with
+ * probe_mutex held
  */
 static void
-deep_probe(fa_dir_entry_t *fde, scanner_t *s)
+probe_host_update(probe_host_t *ph)
 {
-  fde->fde_probestatus = FDE_PROBED_CONTENTS;
+  const int ready =
+    TAILQ_FIRST(&ph->ph_jobs) != NULL && ph->ph_active < ph->ph_limit;
+
+  if(ready && !ph->ph_ready) {
+    TAILQ_INSERT_TAIL(&probe_ready, ph, ph_ready_link);
+    hts_cond_signal(&probe_cond);
+  } else if(!ready && ph->ph_ready) {
+    TAILQ_REMOVE(&probe_ready, ph, ph_ready_link);
+  }
+  ph->ph_ready = ready;
+
+  if(ph != &probe_local && ph->ph_active == 0 &&
+     TAILQ_FIRST(&ph->ph_jobs) == NULL) {
+    LIST_REMOVE(ph, ph_link);
+    free(ph->ph_name);
+    free(ph);
+  }
+}
+
+
+/**
+ * Take the jobs that are still queued off the queues. Jobs that are
+ * running are left to finish. Must be called with probe_mutex held
+ */
+static void
+probe_cancel(probe_job_t *jobs, int numjobs)
+{
+  int i;
+
+  for(i = 0; i < numjobs; i++) {
+    probe_job_t *pj = &jobs[i];
+    if(pj->pj_done || pj->pj_running)
+      continue;
+    TAILQ_REMOVE(&pj->pj_host->ph_jobs, pj, pj_link);
+    pj->pj_skipped = 1;
+    pj->pj_done = 1;
+    probe_host_update(pj->pj_host);
+  }
+}
+
+
+/**
+ * Figure out metadata for an entry. Runs in a probe worker and must not
+ * touch the prop tree
+ */
+static void
+probe_run(probe_job_t *pj)
+{
+  scanner_t *s = pj->pj_scanner;
+  fa_dir_entry_t *fde = pj->pj_fde;
+
+  if(s->s_mode != BROWSER_DIR) {
+    pj->pj_skipped = 1;
+    return;
+  }
+
+  if(fde->fde_type == CONTENT_UNKNOWN)
+    return;
+
+  int64_t ts = showtime_get_ts();
 
   SCAN_TRACE("Deep probing %s. Content_type:%s",
              rstr_get(fde->fde_url), content2type(fde->fde_type));
 
-  if(fde->fde_type != CONTENT_UNKNOWN) {
+  if(!fde->fde_ignore_cache && !fa_dir_entry_stat(fde) &&
+     (fde->fde_md == NULL || !fde->fde_md->md_cache_status)) {
 
-    prop_t *meta = prop_create_r(fde->fde_prop, "metadata");
+    if(fde->fde_md != NULL)
+      metadata_destroy(fde->fde_md);
+
+    void *db = metadb_get();
+    fde->fde_md = metadb_metadata_get(db, rstr_get(fde->fde_url),
+                                      fde->fde_stat.fs_mtime);
+    metadb_close(db);
+    pj->pj_from_cache = fde->fde_md != NULL;
+    SCAN_TRACE("%s: Metadata %sfound", rstr_get(fde->fde_url),
+               fde->fde_md ? "" : "not ");
+  }
 
-    if(!fde->fde_ignore_cache && !fa_dir_entry_stat(fde) &&
-       (fde->fde_md == NULL || !fde->fde_md->md_cache_status)) {
+  pj->pj_indexstatus = INDEX_STATUS_NIL;
 
-      if(fde->fde_md != NULL)
-	metadata_destroy(fde->fde_md);
+  if(fde->fde_md == NULL) {
 
-      fde->fde_md = metadb_metadata_get(getdb(s), rstr_get(fde->fde_url),
-					fde->fde_stat.fs_mtime);
-      SCAN_TRACE("%s: Metadata %sfound", rstr_get(fde->fde_url),
-                 fde->fde_md ? "" : "not ");
+    if(fde->fde_type == CONTENT_DIR)
+      fde->fde_md = fa_probe_dir(rstr_get(fde->fde_url));
+    else {
+      fde->fde_md = fa_probe_metadata(rstr_get(fde->fde_url), NULL, 0,
+                                      rstr_get(fde->fde_filename), NULL);
+      pj->pj_indexstatus = INDEX_STATUS_FILE_ANALYZED;
     }
+  }
+  pj->pj_time = showtime_get_ts() - ts;
+}
 
-    if(fde->fde_statdone && meta != NULL)
-      prop_set(meta, "timestamp", PROP_SET_INT, fde->fde_stat.fs_mtime);
 
-    metadata_index_status_t is = INDEX_STATUS_NIL;
+/**
+ *
+ */
+static void *
+probe_worker(void *aux)
+{
+  probe_host_t *ph;
+  probe_job_t *pj;
 
-    if(fde->fde_md == NULL) {
+  hts_mutex_lock(&probe_mutex);
 
-      if(fde->fde_type == CONTENT_DIR)
-        fde->fde_md = fa_probe_dir(rstr_get(fde->fde_url));
-      else {
-	fde->fde_md = fa_probe_metadata(rstr_get(fde->fde_url), NULL, 0,
-					rstr_get(fde->fde_filename), NULL);
-        is = INDEX_STATUS_FILE_ANALYZED;
-      }
+  while(1) {
+
+    if(atomic_get(&media_buffer_hungry)) {
+      // Don't compete with playback, check again in a while
+      hts_cond_wait_timeout(&probe_cond, &probe_mutex, 1000);
+      continue;
     }
-    
+
+    if((ph = TAILQ_FIRST(&probe_ready)) == NULL) {
+      hts_cond_wait(&probe_cond, &probe_mutex);
+      continue;
+    }
+
+    pj = TAILQ_FIRST(&ph->ph_jobs);
+    TAILQ_REMOVE(&ph->ph_jobs, pj, pj_link);
+    pj->pj_running = 1;
+    ph->ph_active++;
+
+    // Back of the line so hosts take turns
+    TAILQ_REMOVE(&probe_ready, ph, ph_ready_link);
+    ph->ph_ready = 0;
+    probe_host_update(ph);
+
+    hts_mutex_unlock(&probe_mutex);
+    probe_run(pj);
+    hts_mutex_lock(&probe_mutex);
+
+    ph->ph_active--;
+    probe_host_update(ph);
+    pj->pj_done = 1;
+    hts_cond_broadcast(&probe_done_cond);
+  }
+  return NULL;
+}
+
+
+/**
+ * Must be called with probe_mutex held
+ */
+static void
+probe_workers_start(void)
+{
+  int i;
+
+  if(probe_workers_started)
+    return;
+
+  probe_workers_started = 1;
+  TAILQ_INIT(&probe_ready);
+  TAILQ_INIT(&probe_local.ph_jobs);
+  probe_local.ph_limit = PROBE_WORKERS;
+  hts_cond_init(&probe_cond, &probe_mutex);
+  hts_cond_init(&probe_done_cond, &probe_mutex);
+
+  for(i = 0; i < PROBE_WORKERS; i++)
+    hts_thread_create_detached("fa probe", probe_worker, NULL,
+                               THREAD_PRIO_METADATA_BG);
+}
+
+
+/**
+ * Apply the result of a probe to the prop tree. Any metadb update that
+ * is needed is appended to 'miw'
+ */
+static int
+probe_apply(scanner_t *s, fa_dir_entry_t *fde, const probe_job_t *pj,
+            metadb_item_write_t *miw)
+{
+  int r = 0;
+
+  fde->fde_probestatus = FDE_PROBED_CONTENTS;
+
+  if(fde->fde_type != CONTENT_UNKNOWN) {
+
+    prop_t *meta = prop_create_r(fde->fde_prop, "metadata");
+
+    if(fde->fde_statdone && meta != NULL)
+      prop_set(meta, "timestamp", PROP_SET_INT, fde->fde_stat.fs_mtime);
+
     if(fde->fde_md != NULL) {
       fde->fde_type = fde->fde_md->md_contenttype;
       fde->fde_ignore_cache = 0;
@@ -335,17 +610,21 @@ deep_probe(fa_dir_entry_t *fde, scanner_t *s)
         SCAN_TRACE("Storing item %s in DB parent:%s mtime:%d",
                    rstr_get(fde->fde_url), s->s_url,
                    (int)fde->fde_stat.fs_mtime);
-	metadb_metadata_write(getdb(s), rstr_get(fde->fde_url),
-			      fde->fde_stat.fs_mtime,
-			      fde->fde_md, s->s_url, s->s_mtime,
-                              is);
+        miw->miw_url = rstr_get(fde->fde_url);
+        miw->miw_mtime = fde->fde_stat.fs_mtime;
+        miw->miw_md = fde->fde_md;
+        miw->miw_indexstatus = pj->pj_indexstatus;
+        miw->miw_reparent_only = 0;
+        r = 1;
 	break;
       case METADATA_CACHE_STATUS_FULL:
 	// All set
 	break;
       case METADATA_CACHE_STATUS_UNPARENTED:
 	// Reparent item
-	metadb_parent_item(getdb(s), rstr_get(fde->fde_url), s->s_url);
+        miw->miw_url = rstr_get(fde->fde_url);
+        miw->miw_reparent_only = 1;
+        r = 1;
 	break;
       }
     }
@@ -359,6 +638,7 @@ deep_probe(fa_dir_entry_t *fde, scanner_t *s)
 
   if(fde->fde_prop != NULL)
     set_type(fde->fde_prop, fde->fde_type);
+  return r;
 }
 
 
@@ -387,6 +667,9 @@ static void
 analyzer(scanner_t *s, int probe)
 {
   fa_dir_entry_t *fde;
+  probe_job_t *jobs;
+  metadb_item_write_t writes[PROBE_WRITE_BATCH];
+  int i, numjobs = 0, numwrites = 0;
 
   /* Empty */
   if(s->s_fd->fd_count == 0)
@@ -395,12 +678,11 @@ analyzer(scanner_t *s, int probe)
   if(probe)
     tryplay(s);
 
+  jobs = probe ? calloc(s->s_fd->fd_count, sizeof(probe_job_t)) : NULL;
+
   /* Scan all entries */
   RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link) {
 
-    while(media_buffer_hungry && s->s_mode == BROWSER_DIR) 
-      sleep(1);
-
     if(s->s_mode != BROWSER_DIR)
       break;
 
@@ -411,9 +693,78 @@ analyzer(scanner_t *s, int probe)
       fde->fde_probestatus = FDE_PROBED_FILENAME;
     }
 
-    if(fde->fde_probestatus == FDE_PROBED_FILENAME && probe)
-      deep_probe(fde, s);
+    if(fde->fde_probestatus == FDE_PROBED_FILENAME && probe) {
+      jobs[numjobs].pj_scanner = s;
+      jobs[numjobs].pj_fde = fde;
+      numjobs++;
+    }
+  }
+
+  if(numjobs == 0) {
+    free(jobs);
+    return;
+  }
+
+  int64_t ts = showtime_get_ts();
+  int64_t probetime = 0, writetime = 0;
+  int cached = 0, probed = 0;
+
+  hts_mutex_lock(&probe_mutex);
+  probe_workers_start();
+  for(i = 0; i < numjobs; i++) {
+    probe_host_t *ph = probe_host_get(rstr_get(jobs[i].pj_fde->fde_url));
+    jobs[i].pj_host = ph;
+    TAILQ_INSERT_TAIL(&ph->ph_jobs, &jobs[i], pj_link);
+    probe_host_update(ph);
+  }
+  hts_mutex_unlock(&probe_mutex);
+
+  // Deliver results in directory order
+  for(i = 0; i < numjobs; i++) {
+    probe_job_t *pj = &jobs[i];
+
+    hts_mutex_lock(&probe_mutex);
+    while(!pj->pj_done) {
+      if(s->s_mode != BROWSER_DIR)
+        probe_cancel(pj, numjobs - i);
+      if(!pj->pj_done)
+        hts_cond_wait_timeout(&probe_done_cond, &probe_mutex, 1000);
+    }
+    hts_mutex_unlock(&probe_mutex);
+
+    if(pj->pj_skipped)
+      continue;
+
+    probed++;
+    cached += pj->pj_from_cache;
+    probetime += pj->pj_time;
+
+    numwrites += probe_apply(s, pj->pj_fde, pj, &writes[numwrites]);
+
+    if(numwrites == PROBE_WRITE_BATCH) {
+      int64_t wts = showtime_get_ts();
+      metadb_metadata_write_multi(getdb(s), s->s_url, s->s_mtime,
+                                  writes, numwrites);
+      writetime += showtime_get_ts() - wts;
+      numwrites = 0;
+    }
+  }
+
+  if(numwrites > 0) {
+    int64_t wts = showtime_get_ts();
+    metadb_metadata_write_multi(getdb(s), s->s_url, s->s_mtime,
+                                writes, numwrites);
+    writetime += showtime_get_ts() - wts;
   }
+
+  free(jobs);
+
+  TRACE(TRACE_DEBUG, "FA",
+        "%s: Probed %d items (%d from cache) in %d ms, "
+        "%d ms spent probing, %d ms writing to metadb",
+        s->s_url, probed, cached,
+        (int)((showtime_get_ts() - ts) / 1000),
+        (int)(probetime / 1000), (int)(writetime / 1000));
 }
 
 
@@ -429,6 +780,8 @@ scanner_create(const char *url, time_t mtime)
   s->s_url = strdup(url);
   s->s_mode = BROWSER_DIR;
   s->s_mtime = mtime;
+  hts_mutex_init(&s->s_change_mutex);
+  TAILQ_INIT(&s->s_changes);
   return s;
 }
 
@@ -442,6 +795,7 @@ scanner_destroy(scanner_t *s)
   closedb(s);
   free(s->s_url);
   prop_courier_destroy(s->s_pc);
+  hts_mutex_destroy(&s->s_change_mutex);
   free(s);
 }
 
@@ -475,7 +829,9 @@ scanner_entry_setup(scanner_t *s, fa_dir_entry_t *fde, const char *src)
   if(s->s_nodes == NULL)
     return 0;
 
-  make_prop(fde);
+  prop_batch_t *pb = prop_batch_create();
+  make_prop(fde, pb);
+  prop_batch_commit(pb);
 
   if(!prop_set_parent(fde->fde_prop, s->s_nodes))
     return 1; // OK
@@ -500,58 +856,206 @@ scanner_entry_destroy(scanner_t *s, fa_dir_entry_t *fde, const char *src)
   fa_dir_entry_free(s->s_fd, fde);
 }
 
-#if 0
+
 /**
- *
+ * Signature of a directory listing. Covers the URL and modification
+ * time of every entry (the type is refined by the analyzer so it's not
+ * included). Returns 0 (no signature) unless every entry was stat()ed
+ * while listing, a signature without mtimes would hide files modified
+ * in place
+ */
+static uint32_t
+dir_signature(const fa_dir_t *fd)
+{
+  const fa_dir_entry_t *fde;
+  uint32_t sig = 5381;
+
+  RB_FOREACH(fde, &fd->fd_entries, fde_link) {
+    if(!fde->fde_statdone)
+      return 0;
+    sig = sig * 33 + mystrhash(rstr_get(fde->fde_url));
+    sig = sig * 33 + (uint32_t)fde->fde_stat.fs_mtime;
+  }
+  return sig ?: 1;
+}
+
+
+/**
+ * Store signature of the listing s_fd now reflects
+ */
+static void
+set_dirsig(scanner_t *s, uint32_t sig)
+{
+  if(s->s_dirsig == sig)
+    return;
+  s->s_dirsig = sig;
+  metadb_item_set_dirsig(getdb(s), s->s_url, sig);
+}
+
+
+/**
+ * Called on whatever thread the protocol delivers notifications on.
+ * Queue the change and poke the scanner thread via s_change_trigger
  */
 static void
 scanner_notification(void *opaque, fa_notify_op_t op, const char *filename,
 		     const char *url, int type)
 {
   scanner_t *s = opaque;
-  fa_dir_entry_t *fde;
+  scanner_change_t *sc;
 
   if(filename && filename[0] == '.')
     return; /* Skip all dot-filenames */
 
-  switch(op) {
-  case FA_NOTIFY_DEL:
-    RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link)
-      if(!strcmp(filename, rstr_get(fde->fde_filename)))
-	break;
+  hts_mutex_lock(&s->s_change_mutex);
 
-    if(fde != NULL)
-      scanner_entry_destroy(s, fde, "notification");
-    break;
+  if(s->s_num_changes < SCANNER_MAX_PENDING_CHANGES) {
+    sc = malloc(sizeof(scanner_change_t));
+    sc->sc_op = op;
+    sc->sc_type = type;
+    sc->sc_url = url ? strdup(url) : NULL;
+    sc->sc_filename = filename ? strdup(filename) : NULL;
+    TAILQ_INSERT_TAIL(&s->s_changes, sc, sc_link);
+    s->s_num_changes++;
+  } else {
+    s->s_change_overflow = 1; // Too much going on, just rescan
+  }
 
-  case FA_NOTIFY_ADD:
-    scanner_entry_setup(s, fa_dir_add(s->s_fd, url, filename, type),
-			"notification");
-    break;
+  int seq = ++s->s_change_seq;
+  hts_mutex_unlock(&s->s_change_mutex);
 
-  case FA_NOTIFY_DIR_CHANGE:
-    rescan(s);
-    return;
-  }
-  analyzer(s, 1);
+  prop_set_int(s->s_change_trigger, seq);
 }
-#endif
+
 
 /**
  *
  */
+static void
+scanner_change_free(scanner_change_t *sc)
+{
+  free(sc->sc_url);
+  free(sc->sc_filename);
+  free(sc);
+}
+
+
+/**
+ *
+ */
+static fa_dir_entry_t *
+scanner_find(scanner_t *s, const char *url)
+{
+  rstr_t *r = rstr_alloc(url);
+  fa_dir_entry_t *fde = fa_dir_find(s->s_fd, r);
+  rstr_release(r);
+  return fde;
+}
+
+
+/**
+ * Apply queued changes on the scanner thread
+ */
+static void
+scanner_apply_changes(void *opaque, int seq)
+{
+  scanner_t *s = opaque;
+  struct scanner_change_queue q;
+  scanner_change_t *sc;
+  fa_dir_entry_t *fde;
+  int changed = 0;
+  int full_rescan;
+
+  hts_mutex_lock(&s->s_change_mutex);
+  TAILQ_MOVE(&q, &s->s_changes, sc_link);
+  s->s_num_changes = 0;
+  full_rescan = s->s_change_overflow;
+  s->s_change_overflow = 0;
+  hts_mutex_unlock(&s->s_change_mutex);
+
+  while((sc = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, sc, sc_link);
+
+    fde = sc->sc_url ? scanner_find(s, sc->sc_url) : NULL;
+
+    switch(sc->sc_op) {
+    case FA_NOTIFY_DEL:
+      if(fde != NULL) {
+	scanner_entry_destroy(s, fde, "notification");
+	changed = 1;
+      }
+      break;
+
+    case FA_NOTIFY_ADD:
+      if(fde == NULL) {
+	fde = fa_dir_add(s->s_fd, sc->sc_url, sc->sc_filename, sc->sc_type);
+	if(fde != NULL) {
+	  fa_dir_entry_stat(fde);
+	  scanner_entry_setup(s, fde, "notification");
+	  changed = 1;
+	}
+	break;
+      }
+      // Replaced an existing entry, FALLTHRU
+    case FA_NOTIFY_CHANGE:
+      if(fde != NULL) {
+	SCAN_TRACE("%s: File %s modified", s->s_url, sc->sc_url);
+	fde->fde_statdone = 0;
+	fa_dir_entry_stat(fde);
+	fde->fde_probestatus = FDE_PROBED_NONE;
+	fde->fde_ignore_cache = 1;
+	changed = 1;
+      }
+      break;
+
+    case FA_NOTIFY_DIR_CHANGE:
+      full_rescan = 1;
+      break;
+    }
+    scanner_change_free(sc);
+  }
+
+  if(changed) {
+    // s_fd is up to date but does not match any listing we've seen
+    set_dirsig(s, 0);
+    analyzer(s, 1);
+  }
+
+  if(full_rescan)
+    rescan(s, 0);
+
+  closedb(s);
+}
+
+
+/**
+ * Unless 'force' is set the listing is only compared entry by entry if
+ * its signature differs from the last one. Listings from protocols that
+ * don't stat() while listing have no signature and are always compared
+ */
 static int
-rescan(scanner_t *s)
+rescan(scanner_t *s, int force)
 {
   fa_dir_t *fd;
   fa_dir_entry_t *a, *b, *n;
   int changed = 0;
   char errbuf[512];
+  uint32_t sig;
+
   if((fd = fa_scandir(s->s_url, errbuf, sizeof(errbuf))) == NULL) {
     SCAN_TRACE("%s: Rescanning failed: %s", s->s_url, errbuf);
     return -1; 
   }
 
+  sig = dir_signature(fd);
+
+  if(!force && sig && sig == s->s_dirsig &&
+     fd->fd_count == s->s_fd->fd_count) {
+    SCAN_TRACE("%s: Unchanged since last scan", s->s_url);
+    fa_dir_free(fd);
+    return 0;
+  }
+
   if(s->s_fd->fd_count != fd->fd_count) {
     SCAN_TRACE("%s: Rescanning found %d items, previously %d",
                s->s_url, fd->fd_count, s->s_fd->fd_count);
@@ -593,11 +1097,89 @@ rescan(scanner_t *s)
   if(changed)
     analyzer(s, 1);
 
+  // Only trust the signature if all changes made it to metadb
+  if(s->s_mode == BROWSER_DIR)
+    set_dirsig(s, sig);
+
   fa_dir_free(fd);
   return 0;
 }
 
 
+/**
+ * Keep the directory live until the scanner changes mode
+ */
+static void
+scanner_watch(scanner_t *s)
+{
+  struct prop_notify_queue q;
+  scanner_change_t *sc;
+  fa_handle_t *n;
+  fa_stat_t st;
+  time_t mtime = 0;
+  int64_t next_poll = 0;
+  int polls = 0;
+
+  s->s_change_trigger = prop_create_root(NULL);
+
+  prop_sub_t *sub =
+    prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE,
+                   PROP_TAG_CALLBACK_INT, scanner_apply_changes, s,
+                   PROP_TAG_ROOT, s->s_change_trigger,
+                   PROP_TAG_COURIER, s->s_pc,
+                   NULL);
+
+  n = fa_notify_start(s->s_url, s, scanner_notification);
+
+  if(n == NULL) {
+    SCAN_TRACE("%s: No change notification, polling every %d seconds",
+               s->s_url, SCANNER_POLL_INTERVAL);
+    if(!fa_stat(s->s_url, &st, NULL, 0))
+      mtime = st.fs_mtime;
+    next_poll = showtime_get_ts() + SCANNER_POLL_INTERVAL * 1000000LL;
+  }
+
+  while(s->s_mode == BROWSER_DIR) {
+    int timeout = 0;
+
+    if(n == NULL)
+      timeout = MAX((next_poll - showtime_get_ts()) / 1000, 1);
+
+    prop_courier_wait(s->s_pc, &q, timeout);
+    prop_notify_dispatch(&q, 0);
+
+    if(n != NULL || s->s_mode != BROWSER_DIR ||
+       showtime_get_ts() < next_poll)
+      continue;
+
+    polls++;
+    const int force = polls % SCANNER_POLL_FULL == 0;
+    if(fa_stat(s->s_url, &st, NULL, 0) || st.fs_mtime != mtime || force) {
+      SCAN_TRACE("%s: Polling for changes", s->s_url);
+      rescan(s, force);
+      closedb(s);
+      if(!fa_stat(s->s_url, &st, NULL, 0))
+        mtime = st.fs_mtime;
+    }
+    next_poll = showtime_get_ts() + SCANNER_POLL_INTERVAL * 1000000LL;
+  }
+
+  if(n != NULL)
+    fa_notify_stop(n);
+
+  prop_unsubscribe(sub);
+  prop_destroy(s->s_change_trigger);
+  s->s_change_trigger = NULL;
+
+  while((sc = TAILQ_FIRST(&s->s_changes)) != NULL) {
+    TAILQ_REMOVE(&s->s_changes, sc, sc_link);
+    scanner_change_free(sc);
+  }
+  s->s_num_changes = 0;
+  s->s_change_overflow = 0;
+}
+
+
 /**
  *
  */
@@ -608,13 +1190,16 @@ doscan(scanner_t *s, int with_notify)
   char errbuf[256];
   int pending_rescan = 0;
   int err = 1;
+  uint32_t sig = 0;
 
   assert(s->s_fd == NULL);
   s->s_fd = metadb_metadata_scandir(getdb(s), s->s_url, NULL);
+  s->s_dirsig = 0;
 
   if(s->s_fd == NULL) {
     s->s_fd = fa_scandir(s->s_url, errbuf, sizeof(errbuf));
     if(s->s_fd != NULL) {
+      sig = dir_signature(s->s_fd);
       SCAN_TRACE("%s: Found %d by directory scanning",
               s->s_url, s->s_fd->fd_count);
 
@@ -630,6 +1215,7 @@ doscan(scanner_t *s, int with_notify)
   } else {
     SCAN_TRACE("%s: Found %d items in cache",
                s->s_url, s->s_fd->fd_count);
+    s->s_dirsig = metadb_item_get_dirsig(getdb(s), s->s_url);
     pending_rescan = 1;
   }
   prop_set_int(s->s_loading, 0);
@@ -640,18 +1226,20 @@ doscan(scanner_t *s, int with_notify)
 
     if(s->s_nodes != NULL) {
 
-      prop_vec_t *pv = prop_vec_create(s->s_fd->fd_count);
-    
+      prop_batch_t *pb = prop_batch_create();
+
       RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link) {
-        make_prop(fde);
-        pv = prop_vec_append(pv, fde->fde_prop);
+        make_prop(fde, pb);
+        prop_batch_set_parent(pb, fde->fde_prop, s->s_nodes);
       }
-    
-      prop_set_parent_vector(pv, s->s_nodes, NULL, NULL);
-      prop_vec_release(pv);
+
+      prop_batch_commit(pb);
     }
     analyzer(s, 1);
 
+    if(sig && s->s_mode == BROWSER_DIR)
+      set_dirsig(s, sig);
+
   } else {
     TRACE(TRACE_INFO, "scanner",
 	  "Unable to scan %s -- %s -- Retrying in background",
@@ -661,21 +1249,17 @@ doscan(scanner_t *s, int with_notify)
 
   if(pending_rescan) {
     SCAN_TRACE("%s: Starting rescan", s->s_url);
-    err = rescan(s);
+    err = rescan(s, 0);
     SCAN_TRACE("%s: Rescan completed: %d", s->s_url, err);
   }
 
   closedb(s);
-#if 0
-  fa_handle_t *n = fa_notify_start(s->s_url, s, scanner_notification);
-#endif
-  while(s->s_mode == BROWSER_DIR)
-    prop_courier_wait_and_dispatch(s->s_pc);
-#if 0
-  if(n != NULL)
-    fa_notify_stop(n);
-#endif
+
+  if(with_notify)
+    scanner_watch(s);
+
   fa_dir_free(s->s_fd);
+  s->s_fd = NULL;
   return err;
 }
 
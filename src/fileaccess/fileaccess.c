@@ -1359,6 +1359,9 @@ fileaccess_init(void)
   fa_protocol_t *fap;
   fa_imageloader_init();
 
+  // API responses and other text, images are never compressed
+  blobcache_set_compression("fa_load", 1);
+
   LIST_FOREACH(fap, &fileaccess_all_protocols, fap_link)
     if(fap->fap_init != NULL)
       fap->fap_init();
@@ -147,6 +147,7 @@ LIST_HEAD(fa_protocol_list, fa_protocol);
 #define FA_NO_RETRIES      0x2000
 #define FA_NO_PARKING      0x4000
 #define FA_BUFFERED_NO_PREFETCH 0x8000
+#define FA_PIPELINE        0x10000 // GET may share a busy HTTP connection
 
 /**
  *
@@ -180,6 +181,7 @@ typedef enum {
   FA_NOTIFY_ADD,
   FA_NOTIFY_DEL,
   FA_NOTIFY_DIR_CHANGE,
+  FA_NOTIFY_CHANGE,
 } fa_notify_op_t;
 
 
@@ -334,12 +336,13 @@ void fa_pathjoin(char *dst, size_t dstlen, const char *p1, const char *p2);
 
 void fa_url_get_last_component(char *dst, size_t dstlen, const char *url);
 
-// Cache (XXX: Remove me)
+// Persistent read-ahead cache
 
 void fa_cache_init(void);
 
 fa_handle_t *fa_cache_open(const char *url, char *errbuf,
-			   size_t errsize, int flags, struct prop *stats);
+			   size_t errsize, int flags,
+                           struct fa_open_extra *foe);
 
 // Buffered I/O
 
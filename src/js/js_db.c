@@ -49,10 +49,10 @@ js_db_finalize(JSContext *cx, JSObject *obj)
   js_db_t *jd = JS_GetPrivate(cx, obj);
 
   if(jd->jd_stmt)
-    sqlite3_finalize(jd->jd_stmt);
+    db_finalize(jd->jd_stmt);
 
   if(jd->jd_db != NULL)
-    sqlite3_close(jd->jd_db);
+    db_close(jd->jd_db);
 
   if(jd->jd_debug)
     TRACE(TRACE_DEBUG, "JS", "Database %s finalized", jd->jd_name);
@@ -117,11 +117,11 @@ js_db_close(JSContext *cx, JSObject *obj, uintN argc,
     return JS_FALSE;
 
   if(jd->jd_stmt) {
-    sqlite3_finalize(jd->jd_stmt);
+    db_finalize(jd->jd_stmt);
     jd->jd_stmt = NULL;
   }
 
-  sqlite3_close(jd->jd_db);
+  db_close(jd->jd_db);
   jd->jd_db = NULL;
 
   return JS_TRUE;
@@ -184,7 +184,7 @@ js_stmt_step(JSContext *cx, js_db_t *jd, jsval *rval)
 
     if(sqlite3_data_count(jd->jd_stmt) == 0) {
       // No data to be returned, close stmt
-      sqlite3_finalize(jd->jd_stmt);
+      db_finalize(jd->jd_stmt);
       jd->jd_stmt = NULL;
     }
   } else {
@@ -213,7 +213,7 @@ js_db_query(JSContext *cx, JSObject *obj, uintN argc,
     return JS_FALSE;
 
   if(jd->jd_stmt) {
-    sqlite3_finalize(jd->jd_stmt);
+    db_finalize(jd->jd_stmt);
     jd->jd_stmt = NULL;
   }
 
@@ -247,7 +247,7 @@ js_db_query(JSContext *cx, JSObject *obj, uintN argc,
       sqlite3_bind_text(stmt, i, JS_GetStringBytes(s), -1, SQLITE_STATIC);
     } else {
       JS_ReportError(cx, "Unable to bind argument %d, invalid type", i);
-      sqlite3_finalize(stmt);
+      db_finalize(stmt);
       return JS_FALSE;
     }
   }
@@ -409,7 +409,7 @@ js_db_txn(JSContext *cx, JSObject *obj, uintN argc,
   jd->jd_transaction = 0;
 
   if(jd->jd_stmt) {
-    sqlite3_finalize(jd->jd_stmt);
+    db_finalize(jd->jd_stmt);
     jd->jd_stmt = NULL;
   }
 
@@ -72,10 +72,10 @@ pb_getProperty(JSContext *cx, JSObject *obj, jsval id, jsval *vp)
   prop_t *p = JS_GetPrivate(cx, obj);
   prop_t *c;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
 
   if(p->hp_type != PROP_DIR) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return JS_TRUE;
   }
 
@@ -96,7 +96,7 @@ pb_getProperty(JSContext *cx, JSObject *obj, jsval id, jsval *vp)
       num--;
     }
   } else {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return JS_FALSE;
   }
 
@@ -135,7 +135,7 @@ pb_getProperty(JSContext *cx, JSObject *obj, jsval id, jsval *vp)
       break;
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return JS_TRUE;
 }
 
@@ -1306,6 +1306,19 @@ mp_dequeue_event(media_pipe_t *mp)
 }
 
 
+/**
+ * Returns true if there are events waiting to be dequeued
+ */
+int
+mp_event_pending(media_pipe_t *mp)
+{
+  hts_mutex_lock(&mp->mp_mutex);
+  int r = TAILQ_FIRST(&mp->mp_eq) != NULL;
+  hts_mutex_unlock(&mp->mp_mutex);
+  return r;
+}
+
+
 /**
  *
  */
@@ -667,6 +667,7 @@ void mb_enqueue_always(media_pipe_t *mp, media_queue_t *mq, media_buf_t *mb);
 void mp_enqueue_event(media_pipe_t *mp, struct event *e);
 struct event *mp_dequeue_event(media_pipe_t *mp);
 struct event *mp_dequeue_event_deadline(media_pipe_t *mp, int timeout);
+int mp_event_pending(media_pipe_t *mp);
 
 struct event *mp_wait_for_empty_queues(media_pipe_t *mp);
 
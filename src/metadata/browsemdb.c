@@ -67,7 +67,7 @@ count_items(void *db, const char *query, const char *url)
   rc = sqlite3_step(stmt);
   if(rc == SQLITE_ROW)
     rval = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   return rval;
 }
 
@@ -198,7 +198,7 @@ video_query(bmdb_t *b, void *db)
     add_item(b, url, parent, ct, NULL, 0, NULL, 0);
     rstr_release(ct);
   }
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 }
 
 
@@ -238,7 +238,7 @@ albums_query(bmdb_t *b, void *db)
              (const char *)sqlite3_column_text(stmt, 2), 0);
   }
   rstr_release(ct);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 }
 
 
@@ -279,7 +279,7 @@ album_query(bmdb_t *b, void *db)
     rstr_release(artist);
   }
 
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 
   rc = db_prepare(db, &stmt, 
                   "SELECT url, audioitem.title, track, duration, "
@@ -307,7 +307,7 @@ album_query(bmdb_t *b, void *db)
              
   }
   rstr_release(ct);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 }
 
 
@@ -343,7 +343,7 @@ artist_query(bmdb_t *b, void *db)
     rstr_release(artist);
   }
 
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 
   rc = db_prepare(db, &stmt, 
                   "SELECT id,title "
@@ -367,7 +367,7 @@ artist_query(bmdb_t *b, void *db)
              (const char *)sqlite3_column_text(stmt, 1), 0, NULL, 0);
   }
   rstr_release(ct);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 }
 
 
@@ -405,7 +405,7 @@ artists_query(bmdb_t *b, void *db)
              (const char *)sqlite3_column_text(stmt, 1), 0, NULL, 0);
   }
   rstr_release(ct);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 }
 
 
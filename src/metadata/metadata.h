@@ -316,6 +316,21 @@ int metadb_metadata_writex(void *db, const char *url, time_t mtime,
                            time_t parent_mtime,
                            metadata_index_status_t indexstatus);
 
+/**
+ * One item for metadb_metadata_write_multi()
+ */
+typedef struct metadb_item_write {
+  const char *miw_url;
+  time_t miw_mtime;
+  const metadata_t *miw_md;
+  metadata_index_status_t miw_indexstatus;
+  int miw_reparent_only;  // Item already stored, just set parent
+} metadb_item_write_t;
+
+void metadb_metadata_write_multi(void *db, const char *parent,
+                                 time_t parent_mtime,
+                                 const metadb_item_write_t *items, int num);
+
 
 metadata_t *metadb_metadata_get(void *db, const char *url, time_t mtime);
 
@@ -327,6 +342,10 @@ void metadb_parent_item(void *db, const char *url, const char *parent_url);
 
 void metadb_unparent_item(void *db, const char *url);
 
+uint32_t metadb_item_get_dirsig(void *db, const char *url);
+
+void metadb_item_set_dirsig(void *db, const char *url, uint32_t sig);
+
 int metadb_item_set_preferred_ds(void *opaque, const char *url, int ds_id);
 
 int metadb_item_get_preferred_ds(const char *url);
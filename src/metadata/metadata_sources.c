@@ -89,7 +89,7 @@ ms_set_enable(void *opaque, int value)
   sqlite3_bind_int(stmt, 2, ms->ms_enabled);
   
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   metadb_close(db);
 }
 
@@ -125,7 +125,7 @@ metadata_add_source(const char *name, const char *description,
 
   rc = db_step(stmt);
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     db_rollback_deadlock(db);
     goto again;
   }
@@ -137,11 +137,11 @@ metadata_add_source(const char *name, const char *description,
     if(sqlite3_column_type(stmt, 1) == SQLITE_INTEGER)
       enabled = sqlite3_column_int(stmt, 2);
 
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
 
   } else {
 
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
 
     rc = db_prepare(db, &stmt,
 		    "INSERT INTO datasource "
@@ -160,7 +160,7 @@ metadata_add_source(const char *name, const char *description,
     sqlite3_bind_int(stmt, 4, enabled);
 
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     if(rc == SQLITE_LOCKED) {
       db_rollback_deadlock(db);
       goto again;
@@ -255,7 +255,7 @@ class_handle_move(metadata_source_t *ms, metadata_source_t *before)
       sqlite3_bind_int(stmt, 2, ms->ms_id);
       
       db_step(stmt);
-      sqlite3_finalize(stmt);
+      db_finalize(stmt);
     }
   }
   metadb_close(db);
@@ -80,7 +80,7 @@ items_clear(void *opaque, prop_event_t event, ...)
 
   if(rc == SQLITE_OK) {
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
   }
 
   if(rc == SQLITE_LOCKED) {
@@ -189,7 +189,7 @@ db_item_get(sqlite3 *db, const char *url, time_t *mtimep)
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
 
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   return rval;
 }
 
@@ -223,7 +223,7 @@ db_item_create(sqlite3 *db, const char *url, int contenttype, time_t mtime,
   sqlite3_bind_int(stmt, 5, indexstatus);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
 
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
@@ -282,7 +282,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
       if(ext_id)
 	sqlite3_bind_text(ins, 3, ext_id, -1, SQLITE_STATIC);
       rc = db_step(ins);
-      sqlite3_finalize(ins);
+      db_finalize(ins);
       if(rc == SQLITE_LOCKED)
 	rval = METADATA_DEADLOCK;
       if(rc == SQLITE_DONE)
@@ -292,7 +292,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
     rval = METADATA_DEADLOCK;
   }
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return rval;
 }
 
@@ -350,7 +350,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
 	sqlite3_bind_text(ins, 4, ext_id, -1, SQLITE_STATIC);
 
       rc = db_step(ins);
-      sqlite3_finalize(ins);
+      db_finalize(ins);
       if(rc == SQLITE_DONE)
 	rval = sqlite3_last_insert_rowid(db);
       if(rc == SQLITE_LOCKED)
@@ -359,7 +359,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return rval;
 }
 
@@ -389,7 +389,7 @@ metadb_insert_albumart(void *db, int64_t album_id, const char *url,
   if(width) sqlite3_bind_int64(ins, 3, width);
   if(height) sqlite3_bind_int64(ins, 4, height);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_finalize(ins);
 }
 
 
@@ -417,7 +417,7 @@ metadb_insert_artistpic(void *db, int64_t artist_id, const char *url,
   if(width) sqlite3_bind_int64(ins, 3, width);
   if(height) sqlite3_bind_int64(ins, 4, height);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_finalize(ins);
 }
 
 /**
@@ -451,7 +451,7 @@ metadb_insert_videoart(void *db, int64_t videoitem_id, const char *url,
   sqlite3_bind_int(ins, 8, titled);
 
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_finalize(ins);
 }
 
 
@@ -472,7 +472,7 @@ metadb_delete_videoart(void *db, int64_t videoitem_id)
   
   sqlite3_bind_int64(ins, 1, videoitem_id);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_finalize(ins);
 }
 
 
@@ -516,7 +516,7 @@ metadb_insert_videocast(void *db, int64_t videoitem_id,
   if(height) sqlite3_bind_int(ins, 9, height);
   sqlite3_bind_text(ins, 10, ext_id, -1, SQLITE_STATIC);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_finalize(ins);
 }
 
 
@@ -537,7 +537,7 @@ metadb_delete_videocast(void *db, int64_t videoitem_id)
   
   sqlite3_bind_int64(ins, 1, videoitem_id);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_finalize(ins);
 }
 
 
@@ -562,7 +562,7 @@ metadb_insert_videogenre(void *db, int64_t videoitem_id, const char *title)
   sqlite3_bind_int64(ins, 1, videoitem_id);
   sqlite3_bind_text(ins, 2, title, -1, SQLITE_STATIC);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_finalize(ins);
 }
 
 
@@ -631,7 +631,7 @@ metadb_insert_audioitem(sqlite3 *db, int64_t item_id, const metadata_t *md,
     sqlite3_bind_int(stmt, 6, md->md_track);
 
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     break;
@@ -694,7 +694,7 @@ metadb_get_album_art(void *db, const char *album, const char *artist)
   sqlite3_bind_text(sel, 1, artist, -1, SQLITE_STATIC);
   sqlite3_bind_text(sel, 2, album, -1, SQLITE_STATIC);
   rstr_t *r = metadb_construct_imageset(sel, 0, 1, 2);
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return r;
 }
 
@@ -726,7 +726,7 @@ metadb_get_video_art(void *db, int64_t videoitem_id, int type)
   if(rc == SQLITE_ROW)
     r = db_rstr(sel, 0);
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return r;
 }
 
@@ -771,7 +771,7 @@ metadb_get_video_genre(sqlite3 *db, int64_t videoitem_id)
 
   sqlite3_bind_int64(sel, 1, videoitem_id);
   rstr_t *r = metadb_construct_list(sel, 0);
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return r;
 }
 
@@ -809,7 +809,7 @@ metadb_get_video_cast(sqlite3 *db, int64_t videoitem_id, metadata_t *md)
     else
       TAILQ_INSERT_TAIL(&md->md_crew, mp, mp_link);
   }
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -845,7 +845,7 @@ metadb_get_artist_pics(void *db, const char *artist,
        sqlite3_column_int(sel, 2));
     rval = 0;
   }
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return rval;
 }
 
@@ -896,7 +896,7 @@ metadb_insert_stream(sqlite3 *db, int64_t videoitem_id,
     sqlite3_bind_text(stmt, 8, rstr_get(ms->ms_title), -1, SQLITE_STATIC);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   return rc2metadatacode(rc);
 }
 
@@ -920,7 +920,7 @@ metadb_set_streams(sqlite3 *db, int64_t videoitem_id, const metadata_t *md)
   sqlite3_bind_int64(stmt, 1, videoitem_id);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   if(rc != SQLITE_DONE)
@@ -971,7 +971,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
 
       rc = db_step(stmt);
       if(rc != SQLITE_ROW) {
-	sqlite3_finalize(stmt);
+	db_finalize(stmt);
 	if(rc == SQLITE_LOCKED)
 	  return METADATA_DEADLOCK;
 	TRACE(TRACE_ERROR, "SQLITE", "SQL Error 0x%x at %s:%d",
@@ -979,7 +979,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
 	return METADATA_PERMANENT_ERROR;
       }
       id = sqlite3_column_int64(stmt, 0);
-      sqlite3_finalize(stmt);
+      db_finalize(stmt);
     }
 
 
@@ -1061,7 +1061,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
     sqlite3_bind_int64(stmt, 18, cfgid);
 
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     if(i == 0)
@@ -1151,7 +1151,7 @@ metadb_insert_imageitem(sqlite3 *db, int64_t item_id, const metadata_t *md)
 		      -1, SQLITE_STATIC);
     
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_finalize(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     break;
@@ -1233,7 +1233,7 @@ metadb_metadata_writex(void *db, const char *url, time_t mtime,
       sqlite3_bind_int(stmt,   5, indexstatus);
 
       rc = db_step(stmt);
-      sqlite3_finalize(stmt);
+      db_finalize(stmt);
       if(rc == METADATA_DEADLOCK)
         return METADATA_DEADLOCK;
     }
@@ -1303,6 +1303,64 @@ metadb_metadata_write(void *db, const char *url, time_t mtime,
 }
 
 
+static int metadb_parent_item0(void *db, const char *url,
+                               const char *parent_url);
+
+/**
+ * Write several items in one transaction. Each item gets a savepoint so
+ * an item that fails to be written does not affect the others
+ */
+void
+metadb_metadata_write_multi(void *db, const char *parent, time_t parent_mtime,
+                            const metadb_item_write_t *items, int num)
+{
+  int i, r;
+
+  if(num == 0)
+    return;
+
+ again:
+  if(db_begin(db))
+    return;
+
+  for(i = 0; i < num; i++) {
+    const metadb_item_write_t *miw = &items[i];
+
+    if(!miw->miw_reparent_only) {
+      switch(miw->miw_md->md_contenttype) {
+      case CONTENT_AUDIO:
+      case CONTENT_VIDEO:
+      case CONTENT_IMAGE:
+      case CONTENT_DIR:
+      case CONTENT_DVD:
+        break;
+      default:
+        continue;
+      }
+    }
+
+    db_one_statement(db, "SAVEPOINT item", NULL);
+
+    if(miw->miw_reparent_only)
+      r = metadb_parent_item0(db, miw->miw_url, parent);
+    else
+      r = metadb_metadata_writex(db, miw->miw_url, miw->miw_mtime,
+                                 miw->miw_md, parent, parent_mtime,
+                                 miw->miw_indexstatus);
+
+    if(r == METADATA_DEADLOCK) {
+      db_rollback_deadlock(db);
+      goto again;
+    }
+
+    if(r)
+      db_one_statement(db, "ROLLBACK TO item", NULL);
+    db_one_statement(db, "RELEASE item", NULL);
+  }
+  db_commit(db);
+}
+
+
 typedef struct get_cache {
   int64_t gc_album_id;
   rstr_t *gc_album_title;
@@ -1353,7 +1411,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1361,7 +1419,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
 
   rstr_release(gc->gc_artist_title);
   gc->gc_artist_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -1394,14 +1452,14 @@ metadb_metadata_get_album(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   gc->gc_album_id = id;
   rstr_release(gc->gc_album_title);
   gc->gc_album_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -1430,7 +1488,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1445,7 +1503,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_duration = sqlite3_column_int(sel, 3) / 1000.0f;
   md->md_track = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -1476,7 +1534,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1487,7 +1545,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_format = rstr_alloc((void *)sqlite3_column_text(sel, 3));
   md->md_year = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return id;
 }
 
@@ -1515,7 +1573,7 @@ metadb_videoitem_set_preferred(void *db, const char *url, int64_t vid)
   sqlite3_bind_int64(stmt, 2, vid);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   return 0;
@@ -1544,7 +1602,7 @@ metadb_videoitem_delete_from_ds(void *db, const char *url, int ds)
   sqlite3_bind_int(stmt, 2, ds);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   return 0;
@@ -1616,7 +1674,7 @@ metadb_videoitem_alternatives0(void *db, prop_t *p, const char *url, int dsid,
   prop_ref_dec(active);
 
   prop_vec_release(pv);
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -1633,7 +1691,7 @@ metadb_videoitem_alternatives(prop_t *p, const char *url, int dsid,
     return;
 
  again:
-  if(db_begin(db)) {
+  if(db_begin_read(db)) {
     metadb_close(db);
     return;
   }
@@ -1670,7 +1728,7 @@ metadb_item_set_preferred_ds(void *db, const char *url, int ds_id)
     sqlite3_bind_null(stmt, 2);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   return 0;
@@ -1706,7 +1764,7 @@ metadb_item_get_preferred_ds(const char *url)
   rc = db_step(stmt);
   if(rc == SQLITE_ROW)
     id = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   metadb_close(db);
   return id;
 }
@@ -1743,7 +1801,7 @@ metadb_item_get_user_title(const char *url)
   if(rc == SQLITE_ROW)
     ret = db_rstr(stmt, 0);
 
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   metadb_close(db);
   return ret;
 }
@@ -1780,7 +1838,7 @@ metadb_item_set_user_title(const char *url, const char *str)
   sqlite3_bind_text(stmt, 2, str, -1, SQLITE_STATIC);
 
   db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   metadb_close(db);
 }
 
@@ -1810,7 +1868,7 @@ metadb_get_videoinfo2(void *db, int64_t id, metadata_t **mdp)
   rc = db_step(sel);
 
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return METADATA_DEADLOCK;
   }
 
@@ -1844,7 +1902,7 @@ metadb_get_videoinfo2(void *db, int64_t id, metadata_t **mdp)
       metadb_get_videoinfo2(db, md->md_parent_id, &md->md_parent);
     *mdp = md;
   }
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -1875,7 +1933,7 @@ metadb_get_videoitem(void *db, const char *url)
     rval = sqlite3_column_int64(stmt, 0);
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   return rval;
 }
 
@@ -1907,19 +1965,19 @@ metadb_get_videoinfo(void *db, const char *url,
 
   rc = db_step(sel);
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return METADATA_DEADLOCK;
   }
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return 0;
   }
 
   int64_t item_id = sqlite3_column_int64(sel, 0);
   int ds_id = sqlite3_column_int(sel, 1);
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
 
   if(fixed_ds)
     *fixed_ds = ds_id;
@@ -2025,7 +2083,7 @@ metadb_get_videoinfo(void *db, const char *url,
       metadb_get_videoinfo2(db, md->md_parent_id, &md->md_parent);
   }
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   *mdp = md;
   return 0;
 }
@@ -2082,7 +2140,7 @@ metadb_metadata_get_streams(sqlite3 *db, metadata_t *md, int64_t videoitem_id)
 			sqlite3_column_int(sel, 5),
 			tn, -1);
   }
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -2110,14 +2168,14 @@ metadb_metadata_get_image(sqlite3 *db, metadata_t *md, int64_t item_id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   md->md_time = sqlite3_column_int(sel, 0);
   md->md_manufacturer = rstr_alloc((void *)sqlite3_column_text(sel, 1));
   md->md_equipment = rstr_alloc((void *)sqlite3_column_text(sel, 2));
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   return 0;
 }
 
@@ -2178,7 +2236,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   int rc;
   sqlite3_stmt *sel;
 
-  if(db_begin(db))
+  if(db_begin_read(db))
     return NULL;
 
   rc = db_prepare(db, &sel,
@@ -2197,7 +2255,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_finalize(sel);
     db_rollback(db);
     return NULL;
   }
@@ -2216,7 +2274,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
       METADATA_CACHE_STATUS_FULL :
       METADATA_CACHE_STATUS_UNPARENTED;
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
   db_rollback(db);
   return md;
 }
@@ -2229,7 +2287,7 @@ fa_dir_t *
 metadb_metadata_scandir(void *db, const char *url, time_t *mtime)
 {
  again:
-  if(db_begin(db))
+  if(db_begin_read(db))
     return NULL;
 
   int64_t parent_id = db_item_get(db, url, mtime);
@@ -2288,7 +2346,7 @@ metadb_metadata_scandir(void *db, const char *url, time_t *mtime)
     }
   }
 
-  sqlite3_finalize(sel);
+  db_finalize(sel);
 
   get_cache_release(&gc);
 
@@ -2335,48 +2393,122 @@ metadb_unparent_item(void *db, const char *url)
     goto again;
   }
 
-  sqlite3_finalize(stmt);
+  db_finalize(stmt);
   db_commit(db);
 }
 
 
 /**
- *
+ * Returns the signature stored by metadb_item_set_dirsig() or 0 if none
+ */
+uint32_t
+metadb_item_get_dirsig(void *db, const char *url)
+{
+  sqlite3_stmt *stmt;
+  uint32_t sig = 0;
+
+  if(db_prepare(db, &stmt, "SELECT dirsig FROM item WHERE url=?1"))
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+
+  if(db_step(stmt) == SQLITE_ROW &&
+     sqlite3_column_type(stmt, 0) == SQLITE_INTEGER)
+    sig = sqlite3_column_int64(stmt, 0);
+
+  db_finalize(stmt);
+  return sig;
+}
+
+
+/**
+ * Store signature of a directory listing, 0 clears it
  */
 void
-metadb_parent_item(void *db, const char *url, const char *parent_url)
+metadb_item_set_dirsig(void *db, const char *url, uint32_t sig)
 {
   int rc;
-  int64_t parent_id;
  again:
   if(db_begin(db))
     return;
 
-  parent_id = db_item_get(db, parent_url, NULL);
-  if(parent_id == METADATA_DEADLOCK) {
+  sqlite3_stmt *stmt;
+
+  rc = db_prepare(db, &stmt, "UPDATE item SET dirsig = ?2 WHERE url=?1");
+
+  if(rc != SQLITE_OK) {
+    db_rollback(db);
+    return;
+  }
+
+  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+  if(sig)
+    sqlite3_bind_int64(stmt, 2, sig);
+  rc = db_step(stmt);
+  db_finalize(stmt);
+
+  if(rc == SQLITE_LOCKED) {
     db_rollback_deadlock(db);
     goto again;
   }
+
+  db_commit(db);
+}
+
+
+/**
+ * Must be called within a transaction
+ */
+static int
+metadb_parent_item0(void *db, const char *url, const char *parent_url)
+{
+  int rc;
+  int64_t parent_id;
+
+  parent_id = db_item_get(db, parent_url, NULL);
+  if(parent_id == METADATA_DEADLOCK)
+    return METADATA_DEADLOCK;
+
   sqlite3_stmt *stmt;
     
   rc = db_prepare(db, &stmt,
 		  "UPDATE item SET parent = ?2 WHERE url=?1");
   
-  if(rc != SQLITE_OK) {
-    db_rollback(db);
-    return;
-  }
+  if(rc != SQLITE_OK)
+    return METADATA_PERMANENT_ERROR;
 
   sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 2, parent_id);
   rc = db_step(stmt);
-  if(rc == SQLITE_LOCKED) {
+  db_finalize(stmt);
+
+  if(rc == SQLITE_LOCKED)
+    return METADATA_DEADLOCK;
+  return 0;
+}
+
+
+/**
+ *
+ */
+void
+metadb_parent_item(void *db, const char *url, const char *parent_url)
+{
+  int r;
+ again:
+  if(db_begin(db))
+    return;
+
+  r = metadb_parent_item0(db, url, parent_url);
+  if(r == METADATA_DEADLOCK) {
     db_rollback_deadlock(db);
     goto again;
   }
 
-  sqlite3_finalize(stmt);
-  db_commit(db);
+  if(r)
+    db_rollback(db);
+  else
+    db_commit(db);
 }
 
 
@@ -29,6 +29,7 @@
 #include "prop/prop_concat.h"
 
 #include "showtime.h"
+#include "task.h"
 #include "media.h"
 #include "htsmsg/htsmsg_json.h"
 #include "misc/str.h"
@@ -1903,25 +1904,21 @@ mlv_direct_query(void *db, rstr_t *url, rstr_t *filename,
 
 
 /**
- *
+ * Load one item from the lazy load queue. Each load is its own task
+ * so the workers get a chance to pick up more urgent work in between
  */
-static void *
-metadata_thread(void *aux)
+static void
+metadata_task(void *aux)
 {
   void *db = NULL;
+  int more;
 
   hts_mutex_lock(&metadata_mutex);
 
-  while(1) {
-
-    metadata_lazy_prop_t *mlp;
-
-    mlp = TAILQ_FIRST(&mlpqueue);
-    if(mlp == NULL)
-      break;
+  metadata_lazy_prop_t *mlp = TAILQ_FIRST(&mlpqueue);
 
-    if(db == NULL)
-      db = metadb_get();
+  if(mlp != NULL) {
+    db = metadb_get();
 
     TAILQ_REMOVE(&mlpqueue, mlp, mlp_link);
     mlp->mlp_queued = 0;
@@ -1929,14 +1926,17 @@ metadata_thread(void *aux)
       mlp->mlp_class->mlc_load(db, mlp);
   }
 
-  metadata_num_threads--;
+  more = !TAILQ_EMPTY(&mlpqueue);
+  if(!more)
+    metadata_num_threads--;
 
   hts_mutex_unlock(&metadata_mutex);
 
   if(db != NULL)
     metadb_close(db);
 
-  return NULL;
+  if(more)
+    task_run_prio(metadata_task, NULL, TASK_PRIO_BACKGROUND);
 }
 
 
@@ -1949,8 +1949,7 @@ metadata_threads_start(void)
   if(metadata_num_threads >= 4)
     return;
   metadata_num_threads++;
-  hts_thread_create_detached("metadata", metadata_thread, NULL,
-                             THREAD_PRIO_METADATA);
+  task_run_prio(metadata_task, NULL, TASK_PRIO_BACKGROUND);
 }
 
 
@@ -25,24 +25,12 @@
 #include "callout.h"
 #include "arch/arch.h"
 
-static LIST_HEAD(, callout) callouts;
+static timerwheel_t callout_wheel;
+static int64_t callout_sleep_until;
 
 static hts_mutex_t callout_mutex;
 static hts_cond_t callout_cond;
 
-/**
- *htsmsg_t *props
- */
-static int
-calloutcmp(callout_t *a, callout_t *b)
-{
-  if(a->c_deadline < b->c_deadline)
-    return -1;
-  else if(a->c_deadline > b->c_deadline)
-    return 1;
- return 0;
-}
-
 
 /**
  *
@@ -56,16 +44,18 @@ callout_arm_abs(callout_t *d, callout_callback_t *callback, void *opaque,
   if(d == NULL)
     d = malloc(sizeof(callout_t));
   else if(d->c_callback != NULL)
-    LIST_REMOVE(d, c_link);
+    timerwheel_disarm(&callout_wheel, &d->c_entry);
     
   d->c_callback = callback;
   d->c_opaque = opaque;
-  d->c_deadline = deadline;
   d->c_armed_by_file = file;
   d->c_armed_by_line = line;
 
-  LIST_INSERT_SORTED(&callouts, d, c_link, calloutcmp, callout_t);
-  hts_cond_signal(&callout_cond);
+  timerwheel_arm(&callout_wheel, &d->c_entry, deadline);
+
+  // Only wake up the callout thread if it would sleep past us
+  if(deadline < callout_sleep_until)
+    hts_cond_signal(&callout_cond);
   hts_mutex_unlock(&callout_mutex);
 }
 
@@ -101,7 +91,7 @@ callout_disarm(callout_t *d)
 {
   hts_mutex_lock(&callout_mutex);
   if(d->c_callback) {
-    LIST_REMOVE(d, c_link);
+    timerwheel_disarm(&callout_wheel, &d->c_entry);
     d->c_callback = NULL;
   }
   hts_mutex_unlock(&callout_mutex);
@@ -114,7 +104,7 @@ callout_disarm(callout_t *d)
 static void *
 callout_loop(void *aux)
 {
-  uint64_t now;
+  int64_t now, next;
   callout_t *c;
   callout_callback_t *cc;
 
@@ -124,9 +114,8 @@ callout_loop(void *aux)
 
     now = showtime_get_ts();
 
-    while((c = LIST_FIRST(&callouts)) != NULL && c->c_deadline <= now) {
+    while((c = (callout_t *)timerwheel_expire(&callout_wheel, now)) != NULL) {
       cc = c->c_callback;
-      LIST_REMOVE(c, c_link);
       c->c_callback = NULL;
       const char *file = c->c_armed_by_file;
       int line         = c->c_armed_by_line;
@@ -140,13 +129,17 @@ callout_loop(void *aux)
       now = ts;
     }
 
-    if((c = LIST_FIRST(&callouts)) != NULL) {
+    next = timerwheel_next(&callout_wheel);
+    callout_sleep_until = next;
 
-      int timeout = (c->c_deadline - now + 999) / 1000;
-      hts_cond_wait_timeout(&callout_cond, &callout_mutex, timeout);
+    if(next != INT64_MAX) {
+      int timeout = (next - now + 999) / 1000;
+      if(timeout > 0)
+        hts_cond_wait_timeout(&callout_cond, &callout_mutex, timeout);
     } else {
       hts_cond_wait(&callout_cond, &callout_mutex);
     }
+    callout_sleep_until = 0;
   }
 
   return NULL;
@@ -192,6 +185,7 @@ callout_init(void)
 
   hts_mutex_init(&callout_mutex);
   hts_cond_init(&callout_cond, &callout_mutex);
+  timerwheel_init(&callout_wheel, showtime_get_ts(), 1000);
 
   hts_thread_create_detached("callout", callout_loop, NULL,
 			     THREAD_PRIO_BGTASK);
@@ -0,0 +1,276 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+#define TW_L0_MASK (TW_L0_SIZE - 1)
+#define TW_LN_MASK (TW_LN_SIZE - 1)
+
+/**
+ * Ticks are rounded up so an entry never fires before its deadline
+ */
+static __inline uint64_t
+tw_ticks(const timerwheel_t *tw, int64_t ts)
+{
+  if(ts < 0)
+    return 0;
+  return (ts + tw->tw_resolution - 1) / tw->tw_resolution;
+}
+
+
+/**
+ *
+ */
+void
+timerwheel_init(timerwheel_t *tw, int64_t now, int resolution)
+{
+  int i, j;
+
+  for(i = 0; i < TW_L0_SIZE; i++)
+    LIST_INIT(&tw->tw_l0[i]);
+
+  for(i = 0; i < TW_LEVELS; i++)
+    for(j = 0; j < TW_LN_SIZE; j++)
+      LIST_INIT(&tw->tw_ln[i][j]);
+
+  LIST_INIT(&tw->tw_expired);
+  tw->tw_resolution = resolution;
+  tw->tw_tick = now / resolution;
+  tw->tw_count = 0;
+}
+
+
+/**
+ *
+ */
+static void
+tw_insert(timerwheel_t *tw, timerwheel_entry_t *twe)
+{
+  struct timerwheel_entry_list *l;
+  uint64_t t = tw_ticks(tw, twe->twe_expire);
+
+  if(t < tw->tw_tick)
+    t = tw->tw_tick;
+
+  uint64_t delta = t - tw->tw_tick;
+
+  if(delta < TW_L0_SIZE) {
+    l = &tw->tw_l0[t & TW_L0_MASK];
+  } else {
+    int shift = TW_L0_BITS;
+    int level = 0;
+
+    while(delta >= 1ULL << (shift + TW_LN_BITS)) {
+      if(level == TW_LEVELS - 1) {
+        // Out of range, park in the farthest slot, re-armed on expiry
+        t = tw->tw_tick + (1ULL << (shift + TW_LN_BITS)) - 1;
+        break;
+      }
+      shift += TW_LN_BITS;
+      level++;
+    }
+    l = &tw->tw_ln[level][(t >> shift) & TW_LN_MASK];
+  }
+  LIST_INSERT_HEAD(l, twe, twe_link);
+}
+
+
+/**
+ *
+ */
+void
+timerwheel_arm(timerwheel_t *tw, timerwheel_entry_t *twe, int64_t expire)
+{
+  twe->twe_expire = expire;
+  tw_insert(tw, twe);
+  tw->tw_count++;
+}
+
+
+/**
+ * Entry must be armed
+ */
+void
+timerwheel_disarm(timerwheel_t *tw, timerwheel_entry_t *twe)
+{
+  LIST_REMOVE(twe, twe_link);
+  tw->tw_count--;
+}
+
+
+/**
+ * Move all entries in a coarse slot one level down (or further)
+ */
+static int
+tw_cascade(timerwheel_t *tw, int level)
+{
+  int shift = TW_L0_BITS + level * TW_LN_BITS;
+  int idx = (tw->tw_tick >> shift) & TW_LN_MASK;
+  struct timerwheel_entry_list *l = &tw->tw_ln[level][idx];
+  timerwheel_entry_t *twe;
+
+  while((twe = LIST_FIRST(l)) != NULL) {
+    LIST_REMOVE(twe, twe_link);
+    tw_insert(tw, twe);
+  }
+  return idx;
+}
+
+
+/**
+ * Process one tick
+ */
+static void
+tw_step(timerwheel_t *tw)
+{
+  timerwheel_entry_t *twe;
+  int idx = tw->tw_tick & TW_L0_MASK;
+
+  if(idx == 0) {
+    for(int level = 0; level < TW_LEVELS; level++)
+      if(tw_cascade(tw, level))
+        break;
+  }
+
+  struct timerwheel_entry_list *l = &tw->tw_l0[idx];
+  while((twe = LIST_FIRST(l)) != NULL) {
+    LIST_REMOVE(twe, twe_link);
+    LIST_INSERT_HEAD(&tw->tw_expired, twe, twe_link);
+  }
+  tw->tw_tick++;
+}
+
+
+/**
+ * Return (and disarm) one entry that has expired at 'now', or NULL
+ * if there is nothing more to do
+ */
+timerwheel_entry_t *
+timerwheel_expire(timerwheel_t *tw, int64_t now)
+{
+  timerwheel_entry_t *twe;
+  uint64_t now_tick = now < 0 ? 0 : now / tw->tw_resolution;
+
+  while(1) {
+    if((twe = LIST_FIRST(&tw->tw_expired)) != NULL) {
+      LIST_REMOVE(twe, twe_link);
+
+      if(twe->twe_expire > now) {
+        // Was parked due to being out of range
+        tw_insert(tw, twe);
+        continue;
+      }
+      tw->tw_count--;
+      return twe;
+    }
+
+    if(tw->tw_tick > now_tick)
+      return NULL;
+
+    if(tw->tw_count == 0) {
+      tw->tw_tick = now_tick + 1;
+      return NULL;
+    }
+
+    // Skip over empty fine slots up to the next cascade
+    while((tw->tw_tick & TW_L0_MASK) && tw->tw_tick <= now_tick &&
+          LIST_EMPTY(&tw->tw_l0[tw->tw_tick & TW_L0_MASK]))
+      tw->tw_tick++;
+
+    if(tw->tw_tick > now_tick)
+      return NULL;
+
+    tw_step(tw);
+  }
+}
+
+
+/**
+ * Earliest tick of the entries in a list, UINT64_MAX if empty
+ */
+static uint64_t
+tw_list_min(const timerwheel_t *tw, const struct timerwheel_entry_list *l)
+{
+  const timerwheel_entry_t *twe;
+  uint64_t r = UINT64_MAX;
+
+  LIST_FOREACH(twe, l, twe_link) {
+    uint64_t t = tw_ticks(tw, twe->twe_expire);
+    if(t < r)
+      r = t;
+  }
+  return r;
+}
+
+
+/**
+ * Return the time when timerwheel_expire() needs to be called next.
+ * INT64_MAX if the wheel is empty
+ */
+int64_t
+timerwheel_next(const timerwheel_t *tw)
+{
+  if(!LIST_EMPTY(&tw->tw_expired))
+    return 0;
+
+  if(tw->tw_count == 0)
+    return INT64_MAX;
+
+  uint64_t t = UINT64_MAX;
+
+  // All entries in the first level are within one turn, first hit is it
+  for(int i = 0; i < TW_L0_SIZE; i++) {
+    uint64_t tick = tw->tw_tick + i;
+    if(!LIST_EMPTY(&tw->tw_l0[tick & TW_L0_MASK])) {
+      t = tick;
+      break;
+    }
+  }
+
+  /*
+   * For the coarse levels the earliest entry is in the first non-empty
+   * slot after the current one. The current slot itself may be either
+   * due right now (not cascaded yet) or a full turn away so if that is
+   * the first non-empty one we also look at the next
+   */
+  for(int level = 0; level < TW_LEVELS; level++) {
+    int shift = TW_L0_BITS + level * TW_LN_BITS;
+    int cur = (tw->tw_tick >> shift) & TW_LN_MASK;
+    int found = 0;
+
+    for(int i = 0; i < TW_LN_SIZE && found < 2; i++) {
+      const struct timerwheel_entry_list *l =
+        &tw->tw_ln[level][(cur + i) & TW_LN_MASK];
+      if(LIST_EMPTY(l))
+        continue;
+      uint64_t m = tw_list_min(tw, l);
+      if(m < t)
+        t = m;
+      found = i ? 2 : 1;
+    }
+  }
+
+  if(t < tw->tw_tick)
+    t = tw->tw_tick;
+  return t * tw->tw_resolution;
+}
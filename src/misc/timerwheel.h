@@ -0,0 +1,72 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+#include "queue.h"
+
+/**
+ * Hierarchical timing wheel
+ *
+ * The first level has one slot per tick (fine/hires slots), the upper
+ * levels each cover 64 times the span of the level below (coarse
+ * slots) and are cascaded down as time advances. Arm and disarm are
+ * O(1). Timers further away than the wheel can represent are parked
+ * in the last slot and re-armed when they surface.
+ *
+ * The wheel does no locking of its own.
+ */
+
+#define TW_L0_BITS 8
+#define TW_LN_BITS 6
+#define TW_LEVELS  3
+
+#define TW_L0_SIZE (1 << TW_L0_BITS)
+#define TW_LN_SIZE (1 << TW_LN_BITS)
+
+LIST_HEAD(timerwheel_entry_list, timerwheel_entry);
+
+typedef struct timerwheel_entry {
+  LIST_ENTRY(timerwheel_entry) twe_link;
+  int64_t twe_expire;
+} timerwheel_entry_t;
+
+
+typedef struct timerwheel {
+  struct timerwheel_entry_list tw_l0[TW_L0_SIZE];
+  struct timerwheel_entry_list tw_ln[TW_LEVELS][TW_LN_SIZE];
+  struct timerwheel_entry_list tw_expired;
+  uint64_t tw_tick;       // Next tick to be processed
+  int tw_resolution;      // Microseconds per tick
+  int tw_count;           // Number of armed entries
+} timerwheel_t;
+
+
+void timerwheel_init(timerwheel_t *tw, int64_t now, int resolution);
+
+void timerwheel_arm(timerwheel_t *tw, timerwheel_entry_t *twe,
+                    int64_t expire);
+
+void timerwheel_disarm(timerwheel_t *tw, timerwheel_entry_t *twe);
+
+timerwheel_entry_t *timerwheel_expire(timerwheel_t *tw, int64_t now);
+
+int64_t timerwheel_next(const timerwheel_t *tw);
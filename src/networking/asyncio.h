@@ -23,12 +23,29 @@
 
 #include "net.h"
 #include "misc/redblack.h"
+#include "misc/timerwheel.h"
 
-extern int64_t async_now;
+/**
+ * There are up to ASYNCIO_MAX_LOOPS event loops, each running on its
+ * own thread (pinned to a core where supported). Loop 0 is the main
+ * loop, it runs INIT_GROUP_ASYNCIO and the asyncio courier.
+ *
+ * An fd belongs to the loop it was added from and a timer to the loop
+ * it was armed from. All operations on them must be done from that
+ * loop. Workers are the only way to hand over work between loops (or
+ * from other threads) and asyncio_wakeup_worker() may be called from
+ * anywhere.
+ */
+#define ASYNCIO_MAX_LOOPS 8
+
+struct asyncio_loop;
+
+extern __thread int64_t async_now; // Only valid on asyncio threads
 
 typedef struct asyncio_timer {
-  LIST_ENTRY(asyncio_timer) at_link;
+  timerwheel_entry_t at_entry; // Must be first
   int64_t at_expire;
+  struct asyncio_loop *at_loop;
   void (*at_fn)(void *opaque);
   void *at_opaque;
 } asyncio_timer_t;
@@ -49,6 +66,12 @@ typedef void (asyncio_read_callback_t)(void *opaque, htsbuf_queue_t *q);
 
 void asyncio_init(void);
 
+int asyncio_num_loops(void);
+
+int asyncio_current_loop(void);
+
+int asyncio_shard(uint32_t key);
+
 /*************************************************************************
  * Low level FD
  *************************************************************************/
@@ -76,6 +99,8 @@ void asyncio_del_fd(asyncio_fd_t *af);
 
 int asyncio_add_worker(void (*fn)(void));
 
+int asyncio_add_worker_on(int loop, void (*fn)(void));
+
 void asyncio_wakeup_worker(int id);
 
 /*************************************************************************
@@ -0,0 +1,170 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+/**
+ * Event loop benchmark
+ *
+ * Registers ASYNCIO_BENCH_IDLE socketpairs that never see any traffic
+ * and ASYNCIO_BENCH_BUSY socketpairs that ping-pong a small message
+ * as fast as the loop allows, and reports round trips per second.
+ * With the poll() backend the rate drops with the number of idle fds,
+ * with epoll it should not.
+ *
+ * Enabled with --enable-asynciobench
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "showtime.h"
+#include "asyncio.h"
+
+#ifndef ASYNCIO_BENCH_IDLE
+#define ASYNCIO_BENCH_IDLE 400
+#endif
+
+#ifndef ASYNCIO_BENCH_BUSY
+#define ASYNCIO_BENCH_BUSY 16
+#endif
+
+#define ASYNCIO_BENCH_INTERVAL 5
+
+typedef struct bench_end {
+  int be_fd;
+  asyncio_fd_t *be_af;
+} bench_end_t;
+
+static bench_end_t bench_idle[ASYNCIO_BENCH_IDLE][2];
+static bench_end_t bench_busy[ASYNCIO_BENCH_BUSY][2];
+
+static asyncio_timer_t bench_timer;
+static int64_t bench_roundtrips;
+static int64_t bench_last_report;
+
+
+/**
+ *
+ */
+static void
+bench_busy_cb(asyncio_fd_t *af, void *opaque, int events, int error)
+{
+  bench_end_t *be = opaque;
+  char buf[64];
+
+  if(events & ASYNCIO_ERROR) {
+    TRACE(TRACE_ERROR, "ASYNCIOBENCH", "Socket error -- %s",
+          strerror(error));
+    asyncio_del_fd(af);
+    return;
+  }
+
+  while(1) {
+    int r = read(be->be_fd, buf, sizeof(buf));
+    if(r <= 0)
+      break;
+    bench_roundtrips++;
+    if(write(be->be_fd, buf, r) != r)
+      TRACE(TRACE_ERROR, "ASYNCIOBENCH", "Short write");
+  }
+}
+
+
+/**
+ *
+ */
+static void
+bench_idle_cb(asyncio_fd_t *af, void *opaque, int events, int error)
+{
+  TRACE(TRACE_ERROR, "ASYNCIOBENCH", "Idle socket got event 0x%x", events);
+}
+
+
+/**
+ *
+ */
+static void
+bench_report(void *aux)
+{
+  int64_t delta = async_now - bench_last_report;
+
+  TRACE(TRACE_INFO, "ASYNCIOBENCH",
+        "%d idle + %d busy fds: %d roundtrips/s",
+        ASYNCIO_BENCH_IDLE, ASYNCIO_BENCH_BUSY,
+        (int)(bench_roundtrips * 1000000LL / (delta ?: 1)));
+
+  bench_roundtrips = 0;
+  bench_last_report = async_now;
+  asyncio_timer_arm(&bench_timer,
+                    async_now + ASYNCIO_BENCH_INTERVAL * 1000000LL);
+}
+
+
+/**
+ *
+ */
+static int
+bench_pair(bench_end_t *be, asyncio_fd_callback_t *cb, const char *name)
+{
+  int fds[2];
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    TRACE(TRACE_ERROR, "ASYNCIOBENCH", "socketpair() failed -- %s",
+          strerror(errno));
+    return -1;
+  }
+
+  for(int i = 0; i < 2; i++) {
+    be[i].be_fd = fds[i];
+    be[i].be_af = asyncio_add_fd(fds[i], ASYNCIO_READ | ASYNCIO_ERROR,
+                                 cb, &be[i], name);
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+asyncio_bench_init(void)
+{
+  int i;
+
+  for(i = 0; i < ASYNCIO_BENCH_IDLE; i++)
+    if(bench_pair(bench_idle[i], bench_idle_cb, "bench idle"))
+      return;
+
+  for(i = 0; i < ASYNCIO_BENCH_BUSY; i++) {
+    if(bench_pair(bench_busy[i], bench_busy_cb, "bench busy"))
+      return;
+    if(write(bench_busy[i][0].be_fd, "ping", 4) != 4)
+      return;
+  }
+
+  bench_last_report = showtime_get_ts();
+  asyncio_timer_init(&bench_timer, bench_report, NULL);
+  asyncio_timer_arm(&bench_timer,
+                    bench_last_report + ASYNCIO_BENCH_INTERVAL * 1000000LL);
+}
+
+INITME(INIT_GROUP_ASYNCIO, asyncio_bench_init);
@@ -19,7 +19,6 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 
-
 #include <assert.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -29,8 +28,17 @@
 #include <errno.h>
 #include <netinet/in.h>
 
+#include "config.h"
+
+#if ENABLE_EPOLL
+#include <sys/epoll.h>
+
+#define ASYNCIO_EPOLL_EVENTS 64
+#endif
+
 #include "showtime.h"
 #include "arch/arch.h"
+#include "arch/atomic.h"
 #include "arch/threads.h"
 #include "asyncio.h"
 #include "misc/queue.h"
@@ -38,60 +46,88 @@
 #include "misc/minmax.h"
 #include "fileaccess/fileaccess.h"
 
+#if defined(linux) && !defined(__ANDROID__)
+#include "arch/linux/linux.h"
+#define ASYNCIO_PIN_THREADS
+#endif
+
+#define ASYNCIO_MAX_WORKERS 64
+
 LIST_HEAD(asyncio_fd_list, asyncio_fd);
-LIST_HEAD(asyncio_worker_list, asyncio_worker);
-LIST_HEAD(asyncio_timer_list, asyncio_timer);
 TAILQ_HEAD(asyncio_dns_req_queue, asyncio_dns_req);
 LIST_HEAD(asyncio_http_req_list, asyncio_http_req);
 
-static hts_thread_t asyncio_thread_id;
 
-static struct asyncio_timer_list asyncio_timers;
+/**
+ *
+ */
+typedef struct asyncio_loop {
+  hts_thread_t al_thread_id;
+  int al_index;
+  char al_name[16];
 
-static hts_mutex_t asyncio_worker_mutex;
-static struct asyncio_worker_list asyncio_workers;
+  timerwheel_t al_timers;
 
-static int asyncio_pipe[2];
-static struct asyncio_fd_list asyncio_fds;
-static int asyncio_num_fds;
+  int al_pipe[2];
+  struct asyncio_fd_list al_fds;
+  int al_num_fds;
 
-struct prop_courier *asyncio_courier;
+#if ENABLE_EPOLL
+  int al_epfd;
+#endif
 
-static hts_mutex_t asyncio_dns_mutex;
-static int asyncio_dns_worker;
-static struct asyncio_dns_req_queue asyncio_dns_pending;
-static struct asyncio_dns_req_queue asyncio_dns_completed;
+  int al_dns_worker;
+  struct asyncio_dns_req_queue al_dns_completed; // asyncio_dns_mutex
 
-static hts_mutex_t asyncio_http_mutex;
-static int asyncio_http_worker;
-static struct asyncio_http_req_list asyncio_http_completed;
+  int al_http_worker;
+  struct asyncio_http_req_list al_http_completed; // asyncio_http_mutex
 
-static void adr_deliver_cb(void);
+} asyncio_loop_t;
 
-static void ahr_deliver_cb(void);
+static asyncio_loop_t asyncio_loops[ASYNCIO_MAX_LOOPS];
+static int asyncio_loop_count;
 
-int64_t async_now;
+static __thread asyncio_loop_t *asyncio_current;
 
-static __inline void asyncio_verify_thread(void) {
-  assert(hts_thread_current() == asyncio_thread_id);
-}
 
 /**
  *
  */
 typedef struct asyncio_worker {
-  LIST_ENTRY(asyncio_worker) link;
   void (*fn)(void);
-  int id;
-  int pending;
+  asyncio_loop_t *loop;
+  atomic_t pending;
 } asyncio_worker_t;
 
+static hts_mutex_t asyncio_worker_mutex;
+static asyncio_worker_t asyncio_workers[ASYNCIO_MAX_WORKERS];
+static int asyncio_num_workers;
+
+struct prop_courier *asyncio_courier;
+static int asyncio_courier_worker;
+
+static hts_mutex_t asyncio_dns_mutex;
+static struct asyncio_dns_req_queue asyncio_dns_pending;
+
+static hts_mutex_t asyncio_http_mutex;
+
+static void adr_deliver_cb(void);
+
+static void ahr_deliver_cb(void);
+
+__thread int64_t async_now;
+
+static __inline void asyncio_verify_loop(const asyncio_loop_t *al) {
+  assert(asyncio_current == al);
+}
+
 
 /**
  *
  */
 struct asyncio_fd {
   LIST_ENTRY(asyncio_fd) af_link;
+  asyncio_loop_t *af_loop;
   asyncio_fd_callback_t *af_callback;
   void *af_opaque;
   char *af_name;
@@ -107,7 +143,7 @@ struct asyncio_fd {
   htsbuf_queue_t af_sendq;
   htsbuf_queue_t af_recvq;
 
-  int64_t af_timeout;
+  asyncio_timer_t af_timer; // Timeout and deferred errors
 
   int af_refcount;
   int af_fd;
@@ -117,6 +153,7 @@ struct asyncio_fd {
   uint16_t af_port;
   uint16_t af_ext_events;
   uint8_t af_connected;
+  uint8_t af_edge;
 };
 
 
@@ -131,57 +168,100 @@ no_sigpipe(int fd)
 
 
 /**
- *
+ * The loop to use for a new fd, timer or worker
  */
-static void
-asyncio_wakeup(int id)
+static asyncio_loop_t *
+asyncio_loop_self(void)
 {
-  char x = id;
-  if(write(asyncio_pipe[1], &x, 1) != 1)
-    TRACE(TRACE_ERROR, "TCP", "Pipe problems");
+  return asyncio_current ?: &asyncio_loops[0];
 }
 
+
 /**
  *
  */
-static void
-asyncio_courier_notify(void *opaque)
+int
+asyncio_num_loops(void)
+{
+  return asyncio_loop_count;
+}
+
+
+/**
+ * Index of the loop we are running on, -1 if not on an asyncio thread
+ */
+int
+asyncio_current_loop(void)
 {
-  asyncio_wakeup(0);
+  return asyncio_current ? asyncio_current->al_index : -1;
 }
 
 
 /**
+ * Map a key (hash of a torrent, a peer address, etc) to a loop.
  *
+ * Loop 0 also carries the courier, HTTP server, STPP and everything
+ * else that is started from INIT_GROUP_ASYNCIO so we keep sharded
+ * work off it when there are other loops to choose from.
+ */
+int
+asyncio_shard(uint32_t key)
+{
+  if(asyncio_loop_count < 2)
+    return 0;
+  return 1 + key % (asyncio_loop_count - 1);
+}
+
+
+/**
+ * Can be called from any thread. Multiple wakeups of a worker before
+ * it gets to run are coalesced into one call
  */
 void
 asyncio_wakeup_worker(int id)
 {
-  return asyncio_wakeup(id);
+  asyncio_worker_t *aw = &asyncio_workers[id];
+  char x = 0;
+
+  if(atomic_add_and_fetch(&aw->pending, 1) != 1)
+    return; // Already signalled
+
+  if(write(aw->loop->al_pipe[1], &x, 1) != 1)
+    TRACE(TRACE_ERROR, "ASYNCIO", "Pipe problems");
 }
 
+
 /**
  *
  */
-void
-asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
-		   void *opaque)
+static void
+asyncio_courier_notify(void *opaque)
 {
-  at->at_fn = fn;
-  at->at_opaque = opaque;
-  at->at_expire = 0;
+  asyncio_wakeup_worker(asyncio_courier_worker);
 }
 
 
 /**
  *
  */
-static int
-at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
+static void
+asyncio_courier_poll(void)
 {
-  if(a->at_expire < b->at_expire)
-    return -1;
-  return 1;
+  prop_courier_poll(asyncio_courier);
+}
+
+
+/**
+ *
+ */
+void
+asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
+		   void *opaque)
+{
+  at->at_fn = fn;
+  at->at_opaque = opaque;
+  at->at_expire = 0;
+  at->at_loop = NULL;
 }
 
 
@@ -191,12 +271,17 @@ at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
 void
 asyncio_timer_arm(asyncio_timer_t *at, int64_t expire)
 {
-  asyncio_verify_thread();
-  if(at->at_expire)
-    LIST_REMOVE(at, at_link);
+  asyncio_loop_t *al = asyncio_current;
+  assert(al != NULL);
+
+  if(at->at_expire) {
+    asyncio_verify_loop(at->at_loop);
+    timerwheel_disarm(&al->al_timers, &at->at_entry);
+  }
 
   at->at_expire = expire;
-  LIST_INSERT_SORTED(&asyncio_timers, at, at_link, at_compar, asyncio_timer_t);
+  at->at_loop = al;
+  timerwheel_arm(&al->al_timers, &at->at_entry, expire);
 }
 
 
@@ -206,9 +291,9 @@ asyncio_timer_arm(asyncio_timer_t *at, int64_t expire)
 void
 asyncio_timer_disarm(asyncio_timer_t *at)
 {
-  asyncio_verify_thread();
   if(at->at_expire) {
-    LIST_REMOVE(at, at_link);
+    asyncio_verify_loop(at->at_loop);
+    timerwheel_disarm(&at->at_loop->al_timers, &at->at_entry);
     at->at_expire = 0;
   }
 }
@@ -220,7 +305,7 @@ asyncio_timer_disarm(asyncio_timer_t *at)
 static void
 af_release(asyncio_fd_t *af)
 {
-  asyncio_verify_thread();
+  asyncio_verify_loop(af->af_loop);
   af->af_refcount--;
   if(af->af_refcount > 0)
     return;
@@ -234,39 +319,149 @@ af_release(asyncio_fd_t *af)
  *
  */
 static void
-asyncio_dopoll(void)
+af_timer_cb(void *opaque)
+{
+  asyncio_fd_t *af = opaque;
+  int err = af->af_pending_errno;
+
+  af->af_refcount++;
+  af->af_pending_errno = 0;
+  if(err)
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
+  else
+    af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
+  af_release(af);
+}
+
+
+/**
+ *
+ */
+static int
+asyncio_run_timers(asyncio_loop_t *al)
 {
   asyncio_timer_t *at;
 
-  while((at = LIST_FIRST(&asyncio_timers)) != NULL &&
-        at->at_expire <= async_now) {
-    LIST_REMOVE(at, at_link);
+  while((at = (asyncio_timer_t *)timerwheel_expire(&al->al_timers,
+                                                   async_now)) != NULL) {
     at->at_expire = 0;
     at->at_fn(at->at_opaque);
   }
 
+  int64_t next = timerwheel_next(&al->al_timers);
+  if(next == INT64_MAX)
+    return -1;
+  return MIN(INT32_MAX, MAX(0, (next - async_now + 999) / 1000));
+}
+
+
+#if ENABLE_EPOLL
+
+/**
+ * Only touches the fds that actually have events
+ */
+static void
+asyncio_dopoll(asyncio_loop_t *al)
+{
+  struct epoll_event ev[ASYNCIO_EPOLL_EVENTS];
   asyncio_fd_t *af;
-  struct pollfd *fds = alloca(asyncio_num_fds * sizeof(struct pollfd));
-  asyncio_fd_t **afds  = alloca(asyncio_num_fds * sizeof(asyncio_fd_t *));
-  int n = 0;
 
-  int timeout = INT32_MAX;
+  int timeout = asyncio_run_timers(al);
+
+  int n = epoll_wait(al->al_epfd, ev, ASYNCIO_EPOLL_EVENTS, timeout);
+
+  async_now = showtime_get_ts();
 
-  LIST_FOREACH(af, &asyncio_fds, af_link) {
-    if(af->af_pending_errno) {
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, af->af_pending_errno);
-      goto release;
+  if(n < 0)
+    return;
+
+  // A callback may delete any of the other fds in this batch
+  for(int i = 0; i < n; i++) {
+    af = ev[i].data.ptr;
+    af->af_refcount++;
+  }
+
+  for(int i = 0; i < n; i++) {
+    af = ev[i].data.ptr;
+    uint32_t e = ev[i].events;
+
+    if(af->af_callback == NULL)
+      continue;
+
+    if(e & EPOLLHUP) {
+      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ECONNRESET);
+      continue;
     }
 
-    if(af->af_timeout) {
-      if(af->af_timeout <= async_now) {
-        af->af_timeout = 0;
-        af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
-        goto release;
-      }
-      timeout = MIN(timeout, (af->af_timeout - async_now + 999) / 1000);
+    if(e & EPOLLERR) {
+      int err;
+      socklen_t errlen = sizeof(int);
+
+      getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
+      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
+      continue;
     }
-  
+
+    int events =
+      (e & (EPOLLIN | EPOLLRDHUP) ? ASYNCIO_READ  : 0) |
+      (e & EPOLLOUT               ? ASYNCIO_WRITE : 0);
+
+    // Edge triggered fds are registered for everything, filter here
+    events &= af->af_ext_events;
+
+    if(events)
+      af->af_callback(af, af->af_opaque, events, 0);
+  }
+
+  for(int i = 0; i < n; i++)
+    af_release(ev[i].data.ptr);
+}
+
+
+/**
+ *
+ */
+static void
+af_epoll_update(asyncio_fd_t *af, int op)
+{
+  struct epoll_event e = {0};
+
+  if(af->af_edge) {
+    if(op == EPOLL_CTL_MOD)
+      return;
+    e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  } else {
+    e.events =
+      (af->af_ext_events & ASYNCIO_READ  ? EPOLLIN  : 0) |
+      (af->af_ext_events & ASYNCIO_WRITE ? EPOLLOUT : 0);
+
+    if(op == EPOLL_CTL_MOD && e.events == af->af_poll_events)
+      return;
+  }
+
+  af->af_poll_events = e.events;
+  e.data.ptr = af;
+  if(epoll_ctl(af->af_loop->al_epfd, op, af->af_fd, &e))
+    TRACE(TRACE_ERROR, "ASYNCIO", "epoll_ctl(%s) failed -- %s",
+          af->af_name, strerror(errno));
+}
+
+#else
+
+/**
+ *
+ */
+static void
+asyncio_dopoll(asyncio_loop_t *al)
+{
+  asyncio_fd_t *af;
+  struct pollfd *fds = alloca(al->al_num_fds * sizeof(struct pollfd));
+  asyncio_fd_t **afds  = alloca(al->al_num_fds * sizeof(asyncio_fd_t *));
+  int n = 0;
+
+  int timeout = asyncio_run_timers(al);
+
+  LIST_FOREACH(af, &al->al_fds, af_link) {
     fds[n].fd = af->af_fd;
     fds[n].events = af->af_poll_events;
     fds[n].revents = 0;
@@ -276,13 +471,7 @@ asyncio_dopoll(void)
     n++;
   }
 
-  assert(n == asyncio_num_fds);
-
-  if((at = LIST_FIRST(&asyncio_timers)) != NULL)
-    timeout = MIN(timeout, (at->at_expire - async_now + 999) / 1000);
-
-  if(timeout == INT32_MAX)
-    timeout = -1;
+  assert(n == al->al_num_fds);
 
   poll(fds, n, timeout);
 
@@ -302,7 +491,7 @@ asyncio_dopoll(void)
     if(fds[i].revents & POLLERR) {
       int err;
       socklen_t errlen = sizeof(int);
-    
+
       getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
       af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
       continue;
@@ -312,25 +501,14 @@ asyncio_dopoll(void)
                     af->af_opaque,
                     (fds[i].revents & POLLIN  ? ASYNCIO_READ  : 0) |
                     (fds[i].revents & POLLOUT ? ASYNCIO_WRITE : 0), 0);
-
-    if(0) {
-      int64_t now = showtime_get_ts();
-
-      if(now - async_now > 10000) {
-        TRACE(TRACE_ERROR, "ASYNCIO", "Long callback on socktet %s (%d µs)",
-              af->af_name, (int) (now - async_now));
-      }
-      async_now = now;
-    }
   }
 
-
- release:
-
   for(int i = 0; i < n; i++)
     af_release(afds[i]);
 }
 
+#endif
+
 
 /**
  *
@@ -338,13 +516,17 @@ asyncio_dopoll(void)
 void
 asyncio_set_events(asyncio_fd_t *af, int events)
 {
-  asyncio_verify_thread();
+  asyncio_verify_loop(af->af_loop);
   af->af_ext_events = events;
 
+#if ENABLE_EPOLL
+  af_epoll_update(af, EPOLL_CTL_MOD);
+#else
   af->af_poll_events =
     (events & ASYNCIO_READ  ? POLLIN            : 0) |
     (events & ASYNCIO_WRITE ? POLLOUT           : 0) |
     (events & ASYNCIO_ERROR ? (POLLHUP|POLLERR) : 0);
+#endif
 }
 
 
@@ -369,43 +551,73 @@ asyncio_rem_events(asyncio_fd_t *af, int events)
 
 
 /**
- *
+ * 'edge' may only be set for fds whose callbacks always read until
+ * EAGAIN and which never drop ASYNCIO_READ from their events
  */
-asyncio_fd_t *
-asyncio_add_fd(int fd, int events, asyncio_fd_callback_t *cb, void *opaque,
-	       const char *name)
+static asyncio_fd_t *
+asyncio_add_fd0(int fd, int events, asyncio_fd_callback_t *cb, void *opaque,
+                const char *name, int edge)
 {
-  asyncio_verify_thread();
+  asyncio_loop_t *al = asyncio_current;
+  assert(al != NULL);
+
   asyncio_fd_t *af = calloc(1, sizeof(asyncio_fd_t));
   htsbuf_queue_init(&af->af_recvq, INT32_MAX);
   htsbuf_queue_init(&af->af_sendq, INT32_MAX);
+  asyncio_timer_init(&af->af_timer, af_timer_cb, af);
+  af->af_loop = al;
   af->af_refcount = 1;
   af->af_fd = fd;
   af->af_name = strdup(name);
-  asyncio_set_events(af, events);
   af->af_callback = cb;
   af->af_opaque = opaque;
 
   net_change_nonblocking(fd, 1);
 
-  LIST_INSERT_HEAD(&asyncio_fds, af, af_link);
-  asyncio_num_fds++;
+#if ENABLE_EPOLL
+  af->af_edge = edge;
+  af->af_ext_events = events;
+  af_epoll_update(af, EPOLL_CTL_ADD);
+#else
+  asyncio_set_events(af, events);
+#endif
+
+  LIST_INSERT_HEAD(&al->al_fds, af, af_link);
+  al->al_num_fds++;
   return af;
 }
 
 
+/**
+ *
+ */
+asyncio_fd_t *
+asyncio_add_fd(int fd, int events, asyncio_fd_callback_t *cb, void *opaque,
+	       const char *name)
+{
+  return asyncio_add_fd0(fd, events, cb, opaque, name, 0);
+}
+
+
 /**
  *
  */
 void
 asyncio_del_fd(asyncio_fd_t *af)
 {
-  asyncio_verify_thread();
-  if(af->af_fd != -1)
+  asyncio_loop_t *al = af->af_loop;
+
+  asyncio_verify_loop(al);
+  asyncio_timer_disarm(&af->af_timer);
+  if(af->af_fd != -1) {
+#if ENABLE_EPOLL
+    epoll_ctl(al->al_epfd, EPOLL_CTL_DEL, af->af_fd, NULL);
+#endif
     close(af->af_fd);
+  }
   af->af_fd = -1;
   LIST_REMOVE(af, af_link);
-  asyncio_num_fds--;
+  al->al_num_fds--;
   af->af_callback = NULL;
   af_release(af);
 }
@@ -417,59 +629,90 @@ asyncio_del_fd(asyncio_fd_t *af)
 void
 asyncio_set_timeout(asyncio_fd_t *af, int64_t timeout)
 {
-  af->af_timeout = timeout;
+  if(timeout)
+    asyncio_timer_arm(&af->af_timer, timeout);
+  else
+    asyncio_timer_disarm(&af->af_timer);
 }
 
+
 /**
- *
+ * Run all signalled workers belonging to this loop
  */
 static void
 asyncio_handle_pipe(asyncio_fd_t *af, void *opaque, int event, int error)
 {
-  char x;
-  if(read(asyncio_pipe[0], &x, 1) != 1)
-    return;
+  asyncio_loop_t *al = opaque;
+  char buf[64];
 
-  if(x == 0) {
-    prop_courier_poll(opaque);
+  if(read(al->al_pipe[0], buf, sizeof(buf)) <= 0)
     return;
-  }
 
-  asyncio_worker_t *aw;
   hts_mutex_lock(&asyncio_worker_mutex);
-
-  LIST_FOREACH(aw, &asyncio_workers, link)
-    if(aw->id == x)
-      break;
-
+  const int num_workers = asyncio_num_workers;
   hts_mutex_unlock(&asyncio_worker_mutex);
 
-  if(aw != NULL)
+  for(int i = 0; i < num_workers; i++) {
+    asyncio_worker_t *aw = &asyncio_workers[i];
+    if(aw->loop != al || atomic_get(&aw->pending) == 0)
+      continue;
+    // Clear before calling so a wakeup during the call is not lost
+    atomic_set(&aw->pending, 0);
     aw->fn();
+  }
 }
 
 
 /**
- *
+ * Worker that runs on the given loop
  */
 int
-asyncio_add_worker(void (*fn)(void))
+asyncio_add_worker_on(int loop, void (*fn)(void))
 {
-  asyncio_worker_t *aw = calloc(1, sizeof(asyncio_worker_t));
+  assert(loop >= 0 && loop < ASYNCIO_MAX_LOOPS);
 
+  hts_mutex_lock(&asyncio_worker_mutex);
+  if(asyncio_num_workers == ASYNCIO_MAX_WORKERS)
+    panic("asyncio: Too many workers");
+
+  const int id = asyncio_num_workers;
+  asyncio_worker_t *aw = &asyncio_workers[id];
   aw->fn = fn;
+  aw->loop = &asyncio_loops[loop];
+  atomic_set(&aw->pending, 0);
+  asyncio_num_workers++;
+  hts_mutex_unlock(&asyncio_worker_mutex);
+  return id;
+}
 
-  static  int generator;
 
-  hts_mutex_lock(&asyncio_worker_mutex);
-  generator++;
-  aw->id = generator;
-  LIST_INSERT_HEAD(&asyncio_workers, aw, link);
-  hts_mutex_unlock(&asyncio_worker_mutex);
-  return aw->id;
+/**
+ * Worker that runs on the caller's loop (main loop if not called from
+ * an asyncio thread)
+ */
+int
+asyncio_add_worker(void (*fn)(void))
+{
+  return asyncio_add_worker_on(asyncio_loop_self()->al_index, fn);
 }
 
 
+/**
+ *
+ */
+static void
+asyncio_pin_thread(asyncio_loop_t *al)
+{
+#ifdef ASYNCIO_PIN_THREADS
+  if(asyncio_loop_count < 2)
+    return;
+
+  if(linux_pin_thread(al->al_index % gconf.concurrency))
+    TRACE(TRACE_INFO, "ASYNCIO", "%s: Unable to pin to CPU -- %s",
+          al->al_name, strerror(errno));
+#endif
+}
+
 
 /**
  *
@@ -477,31 +720,57 @@ asyncio_add_worker(void (*fn)(void))
 static void *
 asyncio_thread(void *aux)
 {
-  hts_mutex_init(&asyncio_worker_mutex);
+  asyncio_loop_t *al = aux;
 
-  arch_pipe(asyncio_pipe);
+  asyncio_current = al;
+  asyncio_pin_thread(al);
 
-  asyncio_courier = prop_courier_create_notify(asyncio_courier_notify, NULL);
+  asyncio_add_fd(al->al_pipe[0], ASYNCIO_READ, asyncio_handle_pipe,
+                 al, "Pipe");
 
-  asyncio_add_fd(asyncio_pipe[0], ASYNCIO_READ, asyncio_handle_pipe,
-                 asyncio_courier, "Pipe");
+  if(al->al_index == 0) {
+    asyncio_courier_worker = asyncio_add_worker(asyncio_courier_poll);
+    asyncio_courier = prop_courier_create_notify(asyncio_courier_notify,
+                                                 NULL);
+    init_group(INIT_GROUP_ASYNCIO);
+  }
 
-  init_group(INIT_GROUP_ASYNCIO);
+  async_now = showtime_get_ts();
 
-  TAILQ_INIT(&asyncio_dns_pending);
-  TAILQ_INIT(&asyncio_dns_completed);
+  while(1)
+    asyncio_dopoll(al);
+  return NULL;
+}
 
-  hts_mutex_init(&asyncio_dns_mutex);
-  asyncio_dns_worker = asyncio_add_worker(adr_deliver_cb);
 
-  hts_mutex_init(&asyncio_http_mutex);
-  asyncio_http_worker = asyncio_add_worker(ahr_deliver_cb);
+/**
+ *
+ */
+static void
+asyncio_loop_init(asyncio_loop_t *al, int index)
+{
+  al->al_index = index;
+  if(index)
+    snprintf(al->al_name, sizeof(al->al_name), "asyncio%d", index);
+  else
+    snprintf(al->al_name, sizeof(al->al_name), "asyncio");
+
+  timerwheel_init(&al->al_timers, showtime_get_ts(), 1000);
+  LIST_INIT(&al->al_fds);
+
+#if ENABLE_EPOLL
+  al->al_epfd = epoll_create(64);
+  if(al->al_epfd == -1)
+    panic("asyncio: Unable to create epoll fd -- %s", strerror(errno));
+#endif
 
-  async_now = showtime_get_ts();
+  arch_pipe(al->al_pipe);
 
-  while(1)
-    asyncio_dopoll();
-  return NULL;
+  TAILQ_INIT(&al->al_dns_completed);
+  LIST_INIT(&al->al_http_completed);
+
+  al->al_dns_worker = asyncio_add_worker_on(index, adr_deliver_cb);
+  al->al_http_worker = asyncio_add_worker_on(index, ahr_deliver_cb);
 }
 
 
@@ -511,8 +780,28 @@ asyncio_thread(void *aux)
 void
 asyncio_init(void)
 {
-  hts_thread_create_joinable("asyncio", &asyncio_thread_id, asyncio_thread,
-                             NULL, THREAD_PRIO_MODEL);
+  int i;
+
+  hts_mutex_init(&asyncio_worker_mutex);
+  hts_mutex_init(&asyncio_dns_mutex);
+  hts_mutex_init(&asyncio_http_mutex);
+  TAILQ_INIT(&asyncio_dns_pending);
+
+  asyncio_loop_count = MAX(1, MIN(gconf.concurrency, ASYNCIO_MAX_LOOPS));
+
+  for(i = 0; i < asyncio_loop_count; i++)
+    asyncio_loop_init(&asyncio_loops[i], i);
+
+  // All loops must exist before INIT_GROUP_ASYNCIO runs on loop 0
+
+  for(i = 0; i < asyncio_loop_count; i++)
+    hts_thread_create_joinable(asyncio_loops[i].al_name,
+                               &asyncio_loops[i].al_thread_id,
+                               asyncio_thread, &asyncio_loops[i],
+                               THREAD_PRIO_MODEL);
+
+  TRACE(TRACE_DEBUG, "ASYNCIO", "Running %d event loop%s",
+        asyncio_loop_count, asyncio_loop_count == 1 ? "" : "s");
 }
 
 
@@ -720,42 +1009,47 @@ asyncio_tcp_connected(asyncio_fd_t *af, void *opaque, int events, int error)
   if(events & ASYNCIO_ERROR) {
     char buf[256];
     snprintf(buf, sizeof(buf), "%s", strerror(error));
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timer);
     af->af_error_callback(af->af_opaque, buf);
     return;
   }
 
-  if(events & ASYNCIO_READ) {
-    af->af_timeout = 0;
-    do_read(af);
-    return;
-  }
-
   if(events & ASYNCIO_WRITE) {
 
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timer);
 
     if(af->af_connected) {
       do_write(af);
-      return;
-    }
-
-    asyncio_rem_events(af, ASYNCIO_WRITE);
-    int err;
-    socklen_t errlen = sizeof(int);
-    
-    getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
-    
-    if(err) {
-      char buf[256];
-      snprintf(buf, sizeof(buf), "%s", strerror(errno));
-      af->af_error_callback(af->af_opaque, buf);
     } else {
+
+      asyncio_rem_events(af, ASYNCIO_WRITE);
+      int err;
+      socklen_t errlen = sizeof(int);
+
+      getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
+
+      if(err) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s", strerror(errno));
+        af->af_error_callback(af->af_opaque, buf);
+        return;
+      }
       af->af_connected = 1;
       af->af_error_callback(af->af_opaque, NULL);
+      if(af->af_callback == NULL)
+        return; // Deleted from callback
       do_write(af);
     }
   }
+
+  /*
+   * With edge triggered notification we might get both read and write
+   * in one go and there will be no second chance, so don't return early
+   */
+  if(events & ASYNCIO_READ && af->af_callback != NULL) {
+    asyncio_timer_disarm(&af->af_timer);
+    do_read(af);
+  }
 }
 
 
@@ -767,7 +1061,7 @@ asyncio_tcp_connected(asyncio_fd_t *af, void *opaque, int events, int error)
 void
 asyncio_send(asyncio_fd_t *af, const void *buf, size_t len, int cork)
 {
-  asyncio_verify_thread();
+  asyncio_verify_loop(af->af_loop);
   htsbuf_append(&af->af_sendq, buf, len);
   if(af->af_fd != -1 && !cork)
     do_write(af);
@@ -780,7 +1074,7 @@ asyncio_send(asyncio_fd_t *af, const void *buf, size_t len, int cork)
 void
 asyncio_sendq(asyncio_fd_t *af, htsbuf_queue_t *q, int cork)
 {
-  asyncio_verify_thread();
+  asyncio_verify_loop(af->af_loop);
   htsbuf_appendq(&af->af_sendq, q);
   if(af->af_fd != -1 && !cork)
     do_write(af);
@@ -812,14 +1106,14 @@ asyncio_connect(const char *name, const net_addr_t *addr,
   si.sin_port = htons(addr->na_port);
   memcpy(&si.sin_addr, addr->na_addr, 4);
 
-  asyncio_fd_t *af = asyncio_add_fd(fd, ASYNCIO_READ,
-				    asyncio_tcp_connected, opaque,
-                                    name);
+  asyncio_fd_t *af = asyncio_add_fd0(fd, ASYNCIO_READ,
+                                     asyncio_tcp_connected, opaque,
+                                     name, 1);
 
   af->af_fd = fd;
   af->af_error_callback = error_cb;
   af->af_read_callback  = read_cb;
-  af->af_timeout = showtime_get_ts() + timeout * 1000;
+  asyncio_timer_arm(&af->af_timer, showtime_get_ts() + timeout * 1000);
 
   int r = connect(fd, (struct sockaddr *)&si, sizeof(struct sockaddr_in));
   if(r == -1) {
@@ -830,6 +1124,7 @@ asyncio_connect(const char *name, const net_addr_t *addr,
       // Got fail directly, but we still want to notify the user about
       // the error asynchronously. Just to make things easier
       af->af_pending_errno = errno;
+      asyncio_timer_arm(&af->af_timer, async_now ?: 1);
     }
   } else {
     asyncio_add_events(af, ASYNCIO_WRITE);
@@ -855,6 +1150,7 @@ struct asyncio_dns_req {
   char *adr_hostname;
   void *adr_opaque;
   void (*adr_cb)(void *opaque, int status, const void *data);
+  asyncio_loop_t *adr_loop;
 
   int adr_status;
   const void *adr_data;
@@ -897,8 +1193,8 @@ adr_resolver(void *aux)
       adr->adr_data = &adr->adr_addr;
     }
     hts_mutex_lock(&asyncio_dns_mutex);
-    TAILQ_INSERT_TAIL(&asyncio_dns_completed, adr, adr_link);
-    asyncio_wakeup(asyncio_dns_worker);
+    TAILQ_INSERT_TAIL(&adr->adr_loop->al_dns_completed, adr, adr_link);
+    asyncio_wakeup_worker(adr->adr_loop->al_dns_worker);
   }
 
   adr_resolver_running = 0;
@@ -922,7 +1218,8 @@ asyncio_dns_lookup_host(const char *hostname,
   adr->adr_hostname = strdup(hostname);
   adr->adr_cb = cb;
   adr->adr_opaque = opaque;
-  
+  adr->adr_loop = asyncio_loop_self();
+
   hts_mutex_lock(&asyncio_dns_mutex);
   TAILQ_INSERT_TAIL(&asyncio_dns_pending, adr, adr_link);
   if(!adr_resolver_running) {
@@ -941,12 +1238,13 @@ asyncio_dns_lookup_host(const char *hostname,
 static void
 adr_deliver_cb(void)
 {
+  asyncio_loop_t *al = asyncio_current;
   asyncio_dns_req_t *adr;
 
   hts_mutex_lock(&asyncio_dns_mutex);
 
-  while((adr = TAILQ_FIRST(&asyncio_dns_completed)) != NULL) {
-    TAILQ_REMOVE(&asyncio_dns_completed, adr, adr_link);
+  while((adr = TAILQ_FIRST(&al->al_dns_completed)) != NULL) {
+    TAILQ_REMOVE(&al->al_dns_completed, adr, adr_link);
     hts_mutex_unlock(&asyncio_dns_mutex);
     adr->adr_cb(adr->adr_opaque, adr->adr_status, adr->adr_data);
 
@@ -1081,6 +1379,7 @@ asyncio_udp_send(asyncio_fd_t *af, const void *data, int size,
 struct asyncio_http_req {
   LIST_ENTRY(asyncio_http_req) ahr_link;
   int ahr_cancelled;
+  asyncio_loop_t *ahr_loop;
 
   http_req_aux_t *ahr_req;
 
@@ -1098,12 +1397,13 @@ asyncio_http_cb(http_req_aux_t *hra, void *opaque, int error)
   asyncio_http_req_t *ahr = opaque;
   ahr->ahr_req = http_req_retain(hra);
 
-  // This arrives on a different thread so we need to reschedule
+  // This may arrive on another loop or a task thread so we need to
+  // reschedule
 
   hts_mutex_lock(&asyncio_http_mutex);
-  LIST_INSERT_HEAD(&asyncio_http_completed, ahr, ahr_link);
+  LIST_INSERT_HEAD(&ahr->ahr_loop->al_http_completed, ahr, ahr_link);
   hts_mutex_unlock(&asyncio_http_mutex);
-  asyncio_wakeup(asyncio_http_worker);
+  asyncio_wakeup_worker(ahr->ahr_loop->al_http_worker);
 }
 
 
@@ -1121,6 +1421,7 @@ asyncio_http_req(const char *url,
 
   ahr->ahr_cb = cb;
   ahr->ahr_opaque = opaque;
+  ahr->ahr_loop = asyncio_loop_self();
 
   va_start(ap, opaque);
   http_reqv(url, ap, asyncio_http_cb, ahr);
@@ -1132,7 +1433,7 @@ asyncio_http_req(const char *url,
 void
 asyncio_http_cancel(asyncio_http_req_t *ahr)
 {
-  asyncio_verify_thread();
+  asyncio_verify_loop(ahr->ahr_loop);
   ahr->ahr_cancelled = 1;
 }
 
@@ -1140,11 +1441,12 @@ asyncio_http_cancel(asyncio_http_req_t *ahr)
 static void
 ahr_deliver_cb(void)
 {
+  asyncio_loop_t *al = asyncio_current;
   asyncio_http_req_t *ahr;
 
   hts_mutex_lock(&asyncio_http_mutex);
 
-  while((ahr = LIST_FIRST(&asyncio_http_completed)) != NULL) {
+  while((ahr = LIST_FIRST(&al->al_http_completed)) != NULL) {
     LIST_REMOVE(ahr, ahr_link);
     hts_mutex_unlock(&asyncio_http_mutex);
 
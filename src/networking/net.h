@@ -86,6 +86,28 @@ void tcp_shutdown(tcpcon_t *tc);
 
 void tcp_set_read_timeout(tcpcon_t *tc, int ms);
 
+/**
+ * TLS on a non-blocking socket, for connections driven by asyncio.
+ * Operations that can't complete until the socket becomes readable or
+ * writable return NET_SSL_WANT_READ or NET_SSL_WANT_WRITE and should be
+ * retried then. Other errors are returned as -1.
+ */
+typedef struct net_ssl net_ssl_t;
+
+#define NET_SSL_WANT_READ  -2
+#define NET_SSL_WANT_WRITE -3
+
+net_ssl_t *net_ssl_create(int fd, const char *hostname,
+                          char *errbuf, size_t errlen);
+
+int net_ssl_handshake(net_ssl_t *ns);
+
+int net_ssl_read(net_ssl_t *ns, void *buf, size_t len);
+
+int net_ssl_write(net_ssl_t *ns, const void *buf, size_t len);
+
+void net_ssl_destroy(net_ssl_t *ns);
+
 
 
 int net_resolve(const char *hostname, net_addr_t *addr, const char **errmsg);
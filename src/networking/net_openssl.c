@@ -124,3 +124,113 @@ net_ssl_init(void)
   CRYPTO_set_id_callback(ssl_tid_fn);
 }
 
+
+/**
+ * Non-blocking TLS
+ */
+struct net_ssl {
+  SSL *ns_ssl;
+};
+
+
+/**
+ *
+ */
+static int
+net_ssl_result(net_ssl_t *ns, int r)
+{
+  if(r > 0)
+    return r;
+
+  switch(SSL_get_error(ns->ns_ssl, r)) {
+  case SSL_ERROR_WANT_READ:
+    return NET_SSL_WANT_READ;
+  case SSL_ERROR_WANT_WRITE:
+    return NET_SSL_WANT_WRITE;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+
+/**
+ *
+ */
+net_ssl_t *
+net_ssl_create(int fd, const char *hostname, char *errbuf, size_t errlen)
+{
+  char errmsg[120];
+
+  if(showtime_ssl_ctx == NULL) {
+    snprintf(errbuf, errlen, "SSL not initialized");
+    return NULL;
+  }
+
+  net_ssl_t *ns = calloc(1, sizeof(net_ssl_t));
+
+  if((ns->ns_ssl = SSL_new(showtime_ssl_ctx)) == NULL) {
+    ERR_error_string(ERR_get_error(), errmsg);
+    snprintf(errbuf, errlen, "SSL: %s", errmsg);
+    free(ns);
+    return NULL;
+  }
+
+  if(SSL_set_fd(ns->ns_ssl, fd) == 0) {
+    ERR_error_string(ERR_get_error(), errmsg);
+    snprintf(errbuf, errlen, "SSL fd: %s", errmsg);
+    SSL_free(ns->ns_ssl);
+    free(ns);
+    return NULL;
+  }
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+  if(hostname != NULL)
+    SSL_set_tlsext_host_name(ns->ns_ssl, hostname);
+#endif
+  return ns;
+}
+
+
+/**
+ *
+ */
+int
+net_ssl_handshake(net_ssl_t *ns)
+{
+  int r = net_ssl_result(ns, SSL_connect(ns->ns_ssl));
+  return r > 0 ? 0 : r == 0 ? -1 : r;
+}
+
+
+/**
+ * Returns 0 when the peer has closed the connection
+ */
+int
+net_ssl_read(net_ssl_t *ns, void *buf, size_t len)
+{
+  return net_ssl_result(ns, SSL_read(ns->ns_ssl, buf, len));
+}
+
+
+/**
+ *
+ */
+int
+net_ssl_write(net_ssl_t *ns, const void *buf, size_t len)
+{
+  int r = net_ssl_result(ns, SSL_write(ns->ns_ssl, buf, len));
+  return r == 0 ? -1 : r;
+}
+
+
+/**
+ *
+ */
+void
+net_ssl_destroy(net_ssl_t *ns)
+{
+  SSL_free(ns->ns_ssl);
+  free(ns);
+}
@@ -87,3 +87,104 @@ void
 net_ssl_init(void)
 {
 }
+
+
+/**
+ * Non-blocking TLS
+ */
+struct net_ssl {
+  ssl_context ns_ssl;
+  ssl_session ns_ssn;
+  havege_state ns_hs;
+  int ns_fd;
+};
+
+
+/**
+ *
+ */
+static int
+net_ssl_result(int r)
+{
+  if(r >= 0)
+    return r;
+  if(r == POLARSSL_ERR_NET_WANT_READ)
+    return NET_SSL_WANT_READ;
+  if(r == POLARSSL_ERR_NET_WANT_WRITE)
+    return NET_SSL_WANT_WRITE;
+  return -1;
+}
+
+
+/**
+ *
+ */
+net_ssl_t *
+net_ssl_create(int fd, const char *hostname, char *errbuf, size_t errlen)
+{
+  net_ssl_t *ns = calloc(1, sizeof(net_ssl_t));
+
+  if(ssl_init(&ns->ns_ssl)) {
+    snprintf(errbuf, errlen, "SSL failed to initialize");
+    free(ns);
+    return NULL;
+  }
+
+  ns->ns_fd = fd;
+  havege_init(&ns->ns_hs);
+
+  ssl_set_endpoint(&ns->ns_ssl, SSL_IS_CLIENT);
+  ssl_set_authmode(&ns->ns_ssl, SSL_VERIFY_NONE);
+
+  ssl_set_rng(&ns->ns_ssl, havege_random, &ns->ns_hs);
+  ssl_set_bio(&ns->ns_ssl, net_recv, &ns->ns_fd, net_send, &ns->ns_fd);
+  ssl_set_ciphersuites(&ns->ns_ssl, ssl_default_ciphersuites);
+  ssl_set_session(&ns->ns_ssl, &ns->ns_ssn);
+  if(hostname != NULL)
+    ssl_set_hostname(&ns->ns_ssl, hostname);
+  return ns;
+}
+
+
+/**
+ *
+ */
+int
+net_ssl_handshake(net_ssl_t *ns)
+{
+  return net_ssl_result(ssl_handshake(&ns->ns_ssl));
+}
+
+
+/**
+ * Returns 0 when the peer has closed the connection
+ */
+int
+net_ssl_read(net_ssl_t *ns, void *buf, size_t len)
+{
+  int r = ssl_read(&ns->ns_ssl, buf, len);
+  if(r == POLARSSL_ERR_SSL_PEER_CLOSE_NOTIFY)
+    return 0;
+  return net_ssl_result(r);
+}
+
+
+/**
+ *
+ */
+int
+net_ssl_write(net_ssl_t *ns, const void *buf, size_t len)
+{
+  return net_ssl_result(ssl_write(&ns->ns_ssl, buf, len));
+}
+
+
+/**
+ *
+ */
+void
+net_ssl_destroy(net_ssl_t *ns)
+{
+  ssl_free(&ns->ns_ssl);
+  free(ns);
+}
@@ -240,6 +240,26 @@ void prop_setdn(prop_sub_t *skipme, prop_t *p, const char *str, ...);
 #define prop_set(p, name, type, ...) \
   prop_set_ex(p, name, __builtin_constant_p(name), type, ##__VA_ARGS__)
 
+/**
+ * Batched mutations. Everything recorded is applied under a single
+ * lock acquisition in prop_batch_commit() and children added to the
+ * same parent are delivered as one PROP_ADD_CHILD_VECTOR
+ */
+typedef struct prop_batch prop_batch_t;
+
+prop_batch_t *prop_batch_create(void);
+
+void prop_batch_set_ex(prop_batch_t *pb, prop_t *p, const char *name,
+                       int noalloc, ...);
+
+#define prop_batch_set(pb, p, name, type, ...) \
+  prop_batch_set_ex(pb, p, name, __builtin_constant_p(name), type, \
+                    ##__VA_ARGS__)
+
+void prop_batch_set_parent(prop_batch_t *pb, prop_t *p, prop_t *parent);
+
+void prop_batch_commit(prop_batch_t *pb);
+
 void prop_set_string_ex(prop_t *p, prop_sub_t *skipme, const char *str,
 			prop_str_type_t type);
 
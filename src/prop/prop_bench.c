@@ -0,0 +1,244 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2014 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+/**
+ * Prop tree contention benchmark
+ *
+ * Starts PROP_BENCH_WRITERS threads that each keep setting an int prop
+ * under global.propbench, PROP_BENCH_READERS threads that look those
+ * props up by name and read them back, and PROP_BENCH_SUBSCRIBERS
+ * threads that subscribe and unsubscribe to them in a loop. Reports
+ * operations per second for each group and the number of notifications
+ * delivered by the benchmark courier.
+ *
+ * Enabled with --enable-propbench
+ */
+
+#include <stdio.h>
+
+#include "showtime.h"
+#include "arch/atomic.h"
+#include "misc/callout.h"
+#include "prop.h"
+
+#ifndef PROP_BENCH_WRITERS
+#define PROP_BENCH_WRITERS 4
+#endif
+
+#ifndef PROP_BENCH_READERS
+#define PROP_BENCH_READERS 4
+#endif
+
+#ifndef PROP_BENCH_SUBSCRIBERS
+#define PROP_BENCH_SUBSCRIBERS 2
+#endif
+
+#define PROP_BENCH_INTERVAL 5
+
+#define PROP_BENCH_BATCH 1000
+
+static prop_t *bench_root;
+static prop_t *bench_props[PROP_BENCH_WRITERS];
+static prop_courier_t *bench_courier;
+
+/**
+ * Operation counters, one per thread so the benchmark itself does not
+ * add contention. Only ever incremented, the reporter diffs them
+ */
+typedef struct bench_counter {
+  volatile unsigned int bc_ops;
+  char bc_pad[60];
+} bench_counter_t;
+
+static bench_counter_t bench_writes[PROP_BENCH_WRITERS];
+static bench_counter_t bench_reads[PROP_BENCH_READERS];
+static bench_counter_t bench_subscribes[PROP_BENCH_SUBSCRIBERS];
+static atomic_t bench_notifies;
+
+static callout_t bench_timer;
+static int64_t bench_last_report;
+
+
+/**
+ *
+ */
+static void *
+bench_writer(void *aux)
+{
+  int id = (intptr_t)aux;
+  prop_t *p = bench_props[id];
+  int i = 0;
+
+  while(1) {
+    for(int j = 0; j < PROP_BENCH_BATCH; j++)
+      prop_set_int(p, i++);
+    bench_writes[id].bc_ops += PROP_BENCH_BATCH;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void *
+bench_reader(void *aux)
+{
+  char name[16];
+  int id = (intptr_t)aux;
+  int i = id;
+
+  while(1) {
+    for(int j = 0; j < PROP_BENCH_BATCH; j++) {
+      snprintf(name, sizeof(name), "w%d", i++ % PROP_BENCH_WRITERS);
+      prop_t *p = prop_get_by_name(PNVEC("global", "propbench", name), 1,
+                                   NULL);
+      if(p != NULL) {
+        prop_get_int(p, NULL);
+        prop_ref_dec(p);
+      }
+    }
+    bench_reads[id].bc_ops += PROP_BENCH_BATCH;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+bench_notify(void *opaque, int value)
+{
+  atomic_inc(&bench_notifies);
+}
+
+
+/**
+ *
+ */
+static void *
+bench_subscriber(void *aux)
+{
+  int id = (intptr_t)aux;
+  int i = id;
+
+  while(1) {
+    for(int j = 0; j < PROP_BENCH_BATCH; j++) {
+      prop_sub_t *s =
+        prop_subscribe(0,
+                       PROP_TAG_CALLBACK_INT, bench_notify, NULL,
+                       PROP_TAG_ROOT, bench_props[i++ % PROP_BENCH_WRITERS],
+                       PROP_TAG_COURIER, bench_courier,
+                       NULL);
+      prop_unsubscribe(s);
+    }
+    bench_subscribes[id].bc_ops += PROP_BENCH_BATCH;
+  }
+  return NULL;
+}
+
+
+/**
+ * Returns the number of operations since last call
+ */
+static unsigned int
+bench_delta(const bench_counter_t *bc, int num, unsigned int *last)
+{
+  unsigned int sum = 0, r;
+
+  for(int i = 0; i < num; i++)
+    sum += bc[i].bc_ops;
+
+  r = sum - *last;
+  *last = sum;
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+bench_report(callout_t *c, void *aux)
+{
+  static unsigned int last_writes, last_reads, last_subscribes;
+  int64_t now = showtime_get_ts();
+  int64_t delta = (now - bench_last_report) ?: 1;
+  unsigned int notifies = atomic_get(&bench_notifies);
+
+  atomic_set(&bench_notifies, 0);
+
+#define RATE(x) (int)((x) * 1000000LL / delta)
+
+  TRACE(TRACE_INFO, "PROPBENCH",
+        "%d writers: %d sets/s, %d readers: %d lookups/s, "
+        "%d subscribers: %d subscribe/s, %d notifications/s",
+        PROP_BENCH_WRITERS,
+        RATE(bench_delta(bench_writes, PROP_BENCH_WRITERS, &last_writes)),
+        PROP_BENCH_READERS,
+        RATE(bench_delta(bench_reads, PROP_BENCH_READERS, &last_reads)),
+        PROP_BENCH_SUBSCRIBERS,
+        RATE(bench_delta(bench_subscribes, PROP_BENCH_SUBSCRIBERS,
+                         &last_subscribes)),
+        RATE(notifies));
+
+#undef RATE
+
+  bench_last_report = now;
+  callout_arm(&bench_timer, bench_report, NULL, PROP_BENCH_INTERVAL);
+}
+
+
+/**
+ *
+ */
+static void
+prop_bench_init(void)
+{
+  char name[16];
+  int i;
+
+  bench_root = prop_create(prop_get_global(), "propbench");
+  bench_courier = prop_courier_create_thread(NULL, "propbench", 0);
+
+  for(i = 0; i < PROP_BENCH_WRITERS; i++) {
+    snprintf(name, sizeof(name), "w%d", i);
+    bench_props[i] = prop_create_r(bench_root, name);
+  }
+
+  for(i = 0; i < PROP_BENCH_WRITERS; i++)
+    hts_thread_create_detached("propbench writer", bench_writer,
+                               (void *)(intptr_t)i, THREAD_PRIO_BGTASK);
+
+  for(i = 0; i < PROP_BENCH_READERS; i++)
+    hts_thread_create_detached("propbench reader", bench_reader,
+                               (void *)(intptr_t)i, THREAD_PRIO_BGTASK);
+
+  for(i = 0; i < PROP_BENCH_SUBSCRIBERS; i++)
+    hts_thread_create_detached("propbench sub", bench_subscriber,
+                               (void *)(intptr_t)i, THREAD_PRIO_BGTASK);
+
+  bench_last_report = showtime_get_ts();
+  callout_arm(&bench_timer, bench_report, NULL, PROP_BENCH_INTERVAL);
+}
+
+INITME(INIT_GROUP_API, prop_bench_init);
@@ -38,7 +38,8 @@ int prop_trace;
 static prop_sub_t *track_sub;
 #endif
 
-hts_mutex_t prop_mutex;
+hts_rwlock_t prop_rwlock;
+static hts_mutex_t prop_courier_mutex;
 hts_mutex_t prop_tag_mutex;
 static prop_t *prop_global;
 
@@ -104,12 +105,12 @@ rstr_t *
 prop_get_name(prop_t *p)
 {
   rstr_t *r;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
   if(p->hp_name != NULL)
     r = rstr_alloc(p->hp_name);
   else
     r = NULL;
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return r;
 }
 
@@ -227,11 +228,11 @@ prop_ref_dec_traced(prop_t *p, const char *file, int line)
   extern void prop_tag_dump(prop_t *p);
   prop_tag_dump(p);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   assert(p->hp_tags == NULL);
   memset(p, 0xdd, sizeof(prop_t));
   pool_put(prop_pool, p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -339,9 +340,9 @@ prop_ref_dec(prop_t *p)
   assert(p->hp_magic == PROP_MAGIC);
   memset(p, 0xdd, sizeof(prop_t));
 #endif
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   pool_put(prop_pool, p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -385,10 +386,10 @@ prop_t *
 prop_xref_addref(prop_t *p)
 {
   if(p != NULL) {
-    hts_mutex_lock(&prop_mutex);
+    hts_rwlock_wrlock(&prop_rwlock);
     assert(p->hp_xref < 255);
     p->hp_xref++;
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
   }
   return p;
 }
@@ -888,7 +889,7 @@ prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
       prop_dispatch_one(n);
   }
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   for(n = TAILQ_FIRST(q); n != NULL; n = next) {
     next = TAILQ_NEXT(n, hpn_link);
@@ -896,11 +897,114 @@ prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
     prop_sub_ref_dec_locked(n->hpn_sub);
     pool_put(notify_pool, n);
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
 
+/**
+ * Value updates that fully replace whatever the subscriber got before
+ */
+static int
+notify_is_value(prop_event_t event)
+{
+  switch(event) {
+  case PROP_SET_RSTRING:
+  case PROP_SET_CSTRING:
+  case PROP_SET_RLINK:
+  case PROP_SET_INT:
+  case PROP_SET_FLOAT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ * Drain one of the inbox stacks into 'q'
+ *
+ * The stack is newest first so when walking it we know if a
+ * subscription has a newer value update pending. If so, and nothing
+ * else has been sent to the subscription in between, the older update
+ * is redundant and is parked on pc_coalesced instead.
+ *
+ * Subscriptions following multiple props or ignoring void updates
+ * may not end up in the same state with fewer updates, so they are
+ * left alone.
+ */
+static void
+courier_collect_inbox(prop_courier_t *pc, struct prop_notify **inbox,
+                      struct prop_notify_queue *q)
+{
+  struct prop_notify_queue tmp;
+  prop_notify_t *n, *next;
+
+  n = atomic_xchg_ptr((void **)inbox, NULL);
+  if(n == NULL)
+    return;
+
+  TAILQ_INIT(&tmp);
+
+  for(; n != NULL; n = next) {
+    next = n->hpn_inbox_next;
+    prop_sub_t *s = n->hpn_sub;
+
+    if(s->hps_flags & (PROP_SUB_MULTI | PROP_SUB_IGNORE_VOID)) {
+
+    } else if(notify_is_value(n->hpn_event)) {
+      if(s->hps_coalesce) {
+        TAILQ_INSERT_TAIL(&pc->pc_coalesced, n, hpn_link);
+        continue;
+      }
+      s->hps_coalesce = 1;
+    } else if(n->hpn_event == PROP_SET_VOID) {
+      s->hps_coalesce = 1;
+    } else {
+      s->hps_coalesce = 0;
+    }
+    TAILQ_INSERT_HEAD(&tmp, n, hpn_link);
+  }
+
+  TAILQ_FOREACH(n, &tmp, hpn_link)
+    n->hpn_sub->hps_coalesce = 0;
+
+  TAILQ_MERGE(q, &tmp, hpn_link);
+}
+
+
+/**
+ * Move everything pushed by producers over to pc_queue_exp and
+ * pc_queue_nor
+ *
+ * Must only be called by the consumer side of the courier (the courier
+ * thread or whoever polls it). Does not need prop_rwlock
+ */
+void
+prop_courier_collect(prop_courier_t *pc)
+{
+  courier_collect_inbox(pc, &pc->pc_inbox_exp, &pc->pc_queue_exp);
+  courier_collect_inbox(pc, &pc->pc_inbox_nor, &pc->pc_queue_nor);
+}
+
+
+/**
+ * Free notifications dropped by prop_courier_collect()
+ *
+ * prop_rwlock must be write locked
+ */
+void
+prop_courier_release_coalesced(prop_courier_t *pc)
+{
+  prop_notify_t *n;
+
+  while((n = TAILQ_FIRST(&pc->pc_coalesced)) != NULL) {
+    TAILQ_REMOVE(&pc->pc_coalesced, n, hpn_link);
+    prop_notify_free(n);
+  }
+}
+
+
 /**
  * Thread for dispatching prop_notify entries
  */
@@ -914,18 +1018,30 @@ prop_courier(void *aux)
   if(pc->pc_prologue)
     pc->pc_prologue();
   
-  hts_mutex_lock(&prop_mutex);
+  while(1) {
 
-  while(pc->pc_run) {
+    hts_mutex_lock(&prop_courier_mutex);
+    prop_courier_collect(pc);
 
-    if(TAILQ_FIRST(&pc->pc_queue_exp) == NULL &&
+    if(pc->pc_run &&
+       TAILQ_FIRST(&pc->pc_queue_exp) == NULL &&
        TAILQ_FIRST(&pc->pc_queue_nor) == NULL) {
-      hts_cond_wait(&pc->pc_cond, &prop_mutex);
+      hts_cond_wait(&pc->pc_cond, &prop_courier_mutex);
+      hts_mutex_unlock(&prop_courier_mutex);
       continue;
     }
+    hts_mutex_unlock(&prop_courier_mutex);
+
+    if(!pc->pc_run)
+      break;
+
+    if(TAILQ_FIRST(&pc->pc_coalesced) != NULL) {
+      hts_rwlock_wrlock(&prop_rwlock);
+      prop_courier_release_coalesced(pc);
+      hts_rwlock_unlock(&prop_rwlock);
+    }
 
     TAILQ_MOVE(&q_exp, &pc->pc_queue_exp, hpn_link);
-    TAILQ_INIT(&pc->pc_queue_exp);
 
     TAILQ_INIT(&q_nor);
     if((n = TAILQ_FIRST(&pc->pc_queue_nor)) != NULL) {
@@ -935,12 +1051,15 @@ prop_courier(void *aux)
 
     const char *tt = pc->pc_flags & PROP_COURIER_TRACE_TIMES ?
       pc->pc_name : NULL;
-    hts_mutex_unlock(&prop_mutex);
     prop_notify_dispatch(&q_exp, tt);
     prop_notify_dispatch(&q_nor, tt);
-    hts_mutex_lock(&prop_mutex);
   }
 
+  hts_rwlock_wrlock(&prop_rwlock);
+
+  prop_courier_collect(pc);
+  prop_courier_release_coalesced(pc);
+
   while((n = TAILQ_FIRST(&pc->pc_queue_exp)) != NULL) {
     TAILQ_REMOVE(&pc->pc_queue_exp, n, hpn_link);
     prop_notify_free(n);
@@ -954,7 +1073,7 @@ prop_courier(void *aux)
   if(pc->pc_detached)
     free(pc);
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 
   if(pc->pc_epilogue)
     pc->pc_epilogue();
@@ -968,13 +1087,43 @@ prop_courier(void *aux)
 static void
 courier_notify(prop_courier_t *pc)
 {
-  if(pc->pc_has_cond)
+  if(pc->pc_has_cond) {
+    hts_mutex_lock(&prop_courier_mutex);
     hts_cond_signal(&pc->pc_cond);
-  else if(pc->pc_notify != NULL)
+    hts_mutex_unlock(&prop_courier_mutex);
+  } else if(pc->pc_notify != NULL)
     pc->pc_notify(pc->pc_opaque);
 }
 
 
+/**
+ * Push a notification onto one of the courier inbox stacks
+ *
+ * The consumer is only woken up when the stack goes from empty to
+ * non-empty, it will pick up everything pushed after that in the same
+ * round anyway. The consumers waiting on pc_cond collect while holding
+ * prop_courier_mutex and courier_notify() signals under the same
+ * mutex, so a push can not slip in between collect and wait unseen.
+ */
+static void
+courier_push(prop_courier_t *pc, struct prop_notify **inbox,
+             prop_notify_t *n)
+{
+  prop_notify_t *old = NULL, *cur;
+
+  while(1) {
+    n->hpn_inbox_next = old;
+    cur = atomic_cas_ptr((void **)inbox, old, n);
+    if(cur == old)
+      break;
+    old = cur;
+  }
+
+  if(old == NULL)
+    courier_notify(pc);
+}
+
+
 /**
  *
  */
@@ -984,10 +1133,9 @@ courier_enqueue(prop_sub_t *s, prop_notify_t *n)
   prop_courier_t *pc = s->hps_courier;
   
   if(s->hps_flags & PROP_SUB_EXPEDITE)
-    TAILQ_INSERT_TAIL(&pc->pc_queue_exp, n, hpn_link);
+    courier_push(pc, &pc->pc_inbox_exp, n);
   else
-    TAILQ_INSERT_TAIL(&pc->pc_queue_nor, n, hpn_link);
-  courier_notify(pc);
+    courier_push(pc, &pc->pc_inbox_nor, n);
 }
 
 
@@ -1221,10 +1369,9 @@ prop_notify_destroyed(prop_sub_t *s)
 
   prop_courier_t *pc = s->hps_courier;  
   if(s->hps_flags & (PROP_SUB_EXPEDITE | PROP_SUB_TRACK_DESTROY_EXP))
-    TAILQ_INSERT_TAIL(&pc->pc_queue_exp, n, hpn_link);
+    courier_push(pc, &pc->pc_inbox_exp, n);
   else
-    TAILQ_INSERT_TAIL(&pc->pc_queue_nor, n, hpn_link);
-  courier_notify(pc);
+    courier_push(pc, &pc->pc_inbox_nor, n);
 }
 
 
@@ -1467,9 +1614,9 @@ prop_send_subscription_monitor_active(prop_t *p)
 void
 prop_send_ext_event(prop_t *p, event_t *e)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_send_ext_event0(p, e);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -1654,7 +1801,7 @@ prop_create_ex(prop_t *parent, const char *name, prop_sub_t *skipme,
 	       int noalloc, int incref)
 {
   prop_t *p;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   if(parent != NULL && parent->hp_type != PROP_ZOMBIE) {
     p = prop_create0(parent, name, skipme, noalloc);
   } else {
@@ -1662,7 +1809,7 @@ prop_create_ex(prop_t *parent, const char *name, prop_sub_t *skipme,
   }
   if(incref)
     p = prop_ref_inc(p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return p;
 }
 
@@ -1673,9 +1820,9 @@ prop_create_ex(prop_t *parent, const char *name, prop_sub_t *skipme,
 prop_t *
 prop_create_root_ex(const char *name, int noalloc)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_t *p = prop_make(name, noalloc, NULL);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return p;
 }
 
@@ -1693,10 +1840,10 @@ prop_create_multi(prop_t *p, ...)
   if(p == NULL)
     return NULL;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type != PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return p;
   }
 
@@ -1704,7 +1851,7 @@ prop_create_multi(prop_t *p, ...)
     p = prop_create0(p, name, NULL, 0);
 
   p = prop_ref_inc(p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return p;
 }
 
@@ -1717,7 +1864,7 @@ prop_create_after(prop_t *parent, const char *name, prop_t *after,
 		  prop_sub_t *skipme)
 {
   prop_t *p;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(parent != NULL && parent->hp_type != PROP_ZOMBIE) {
 
@@ -1768,7 +1915,7 @@ prop_create_after(prop_t *parent, const char *name, prop_t *after,
     p = NULL;
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return p;
 }
 
@@ -1810,9 +1957,9 @@ prop_set_parent_ex(prop_t *p, prop_t *parent, prop_t *before,
   if(parent == NULL)
     return -1;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   r = prop_set_parent0(p, parent, before, skipme);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return r;
 }
 
@@ -1820,14 +1967,12 @@ prop_set_parent_ex(prop_t *p, prop_t *parent, prop_t *before,
 /**
  *
  */
-void
-prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
-		       prop_sub_t *skipme)
+static void
+prop_set_parent_vector0(prop_vec_t *pv, prop_t *parent, prop_t *before,
+                        prop_sub_t *skipme)
 {
   int i;
 
-  hts_mutex_lock(&prop_mutex);
-
   if(parent == NULL || parent->hp_type == PROP_ZOMBIE) {
 
   for(i = 0; i < pv->pv_length; i++)
@@ -1854,7 +1999,19 @@ prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
     prop_notify_childv(pv, parent, before ? PROP_ADD_CHILD_VECTOR_BEFORE : 
 		       PROP_ADD_CHILD_VECTOR, skipme, before);
   }
-  hts_mutex_unlock(&prop_mutex);
+}
+
+
+/**
+ *
+ */
+void
+prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
+		       prop_sub_t *skipme)
+{
+  hts_rwlock_wrlock(&prop_rwlock);
+  prop_set_parent_vector0(pv, parent, before, skipme);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -1885,9 +2042,9 @@ prop_unparent0(prop_t *p, prop_sub_t *skipme)
 void
 prop_unparent_ex(prop_t *p, prop_sub_t *skipme)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_unparent0(p, skipme);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 /**
@@ -1896,7 +2053,7 @@ prop_unparent_ex(prop_t *p, prop_sub_t *skipme)
 void
 prop_unparent_childs(prop_t *p)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   if(p->hp_type == PROP_DIR) {
     prop_t *c, *next;
     for(c = TAILQ_FIRST(&p->hp_childs); c != NULL; c = next) {
@@ -1904,7 +2061,7 @@ prop_unparent_childs(prop_t *p)
       prop_unparent0(p, NULL);
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2058,9 +2215,9 @@ prop_destroy(prop_t *p)
 {
   if(p == NULL)
     return;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_destroy0(p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2086,10 +2243,10 @@ prop_destroy_childs(prop_t *p)
 {
   if(p == NULL)
     return;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   if(p->hp_type == PROP_DIR)
     prop_destroy_childs0(p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2122,9 +2279,9 @@ prop_void_childs(prop_t *p)
 {
   if(p == NULL)
     return;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_void_childs0(p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 /**
@@ -2133,7 +2290,7 @@ prop_void_childs(prop_t *p)
 void
 prop_destroy_by_name(prop_t *p, const char *name)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   if(p->hp_type == PROP_DIR) {
     prop_t *c;
     if(name == NULL) {
@@ -2152,7 +2309,7 @@ prop_destroy_by_name(prop_t *p, const char *name)
       }
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2162,13 +2319,13 @@ prop_destroy_by_name(prop_t *p, const char *name)
 void
 prop_destroy_first(prop_t *p)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   if(p->hp_type == PROP_DIR) {
     prop_t *c = TAILQ_FIRST(&p->hp_childs);
     if(c != NULL)
       prop_destroy_child(p, c);
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2267,9 +2424,9 @@ prop_move0(prop_t *p, prop_t *before, prop_sub_t *skipme)
 void
 prop_move(prop_t *p, prop_t *before)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_move0(p, before, NULL);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2297,9 +2454,53 @@ prop_req_move0(prop_t *p, prop_t *before, prop_sub_t *skipme)
 void
 prop_req_move(prop_t *p, prop_t *before)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_req_move0(p, before, NULL);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
+}
+
+
+/**
+ * Like prop_subfind() but never modifies the tree. Returns NULL if
+ * anything along the path does not exist yet.
+ *
+ * Only needs prop_rwlock read locked
+ */
+static prop_t *
+prop_subfind_existing(prop_t *p, const char **name, int follow_symlinks)
+{
+  prop_t *c;
+
+  while(name[0] != NULL) {
+    while(follow_symlinks && p->hp_originator != NULL)
+      p = p->hp_originator;
+
+    if(p->hp_type != PROP_DIR)
+      return NULL;
+
+    if(name[0][0] == '*') {
+      unsigned int i = atoi(name[0]+1);
+      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
+	if(i == 0)
+	  break;
+	i--;
+      }
+    } else {
+      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
+	if(c->hp_name != NULL && !strcmp(c->hp_name, name[0]))
+	  break;
+      }
+    }
+    if(c == NULL)
+      return NULL;
+    p = c;
+    name++;
+  }
+
+  while(follow_symlinks && p->hp_originator != NULL)
+    p = p->hp_originator;
+
+  return p;
 }
 
 
@@ -2410,7 +2611,7 @@ prop_resolve_tree(const char *name, struct prop_root_list *prl)
 prop_t *
 prop_get_by_name(const char **name, int follow_symlinks, ...)
 {
-  prop_t *p;
+  prop_t *p, *c;
   prop_root_t *pr;
   struct prop_root_list proproots;
   int tag;
@@ -2456,12 +2657,24 @@ prop_get_by_name(const char **name, int follow_symlinks, ...)
     return NULL;
 
   name++;
-  hts_mutex_lock(&prop_mutex);
+
+  /*
+   * Most lookups hit props that already exist, try that under the
+   * read lock first so we don't serialize with everyone else
+   */
+  hts_rwlock_rdlock(&prop_rwlock);
+  c = prop_ref_inc(prop_subfind_existing(p, name, follow_symlinks));
+  hts_rwlock_unlock(&prop_rwlock);
+
+  if(c != NULL)
+    return c;
+
+  hts_rwlock_wrlock(&prop_rwlock);
   p = prop_subfind(p, name, follow_symlinks, 1, NULL);
 
   p = prop_ref_inc(p);
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return p;
 }
 
@@ -2668,7 +2881,7 @@ prop_subscribe(int flags, ...)
 
     canonical = value = pr ? pr->p : NULL;
     if(dolock)
-      hts_mutex_lock(&prop_mutex);
+      hts_rwlock_wrlock(&prop_rwlock);
 
   } else {
 
@@ -2680,7 +2893,7 @@ prop_subscribe(int flags, ...)
     }
 
     if(dolock)
-      hts_mutex_lock(&prop_mutex);
+      hts_rwlock_wrlock(&prop_rwlock);
 
     if(p != NULL) {
       /* Canonical name is the resolved props without following symlinks */
@@ -2696,7 +2909,7 @@ prop_subscribe(int flags, ...)
   if(flags & PROP_SUB_SINGLETON) {
     LIST_FOREACH(s, &value->hp_value_subscriptions, hps_value_prop_link) {
       if(s->hps_callback == cb && s->hps_opaque == opaque) {
-	hts_mutex_unlock(&prop_mutex);
+	hts_rwlock_unlock(&prop_rwlock);
 	return NULL;
       }
     }
@@ -2852,7 +3065,7 @@ prop_subscribe(int flags, ...)
     }
   }
   if(dolock)
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
   return s;
 }
 
@@ -2934,9 +3147,9 @@ prop_unsubscribe(prop_sub_t *s)
   if(s == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_unsubscribe0(s);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2949,9 +3162,9 @@ prop_sub_reemit(prop_sub_t *s)
   if(s == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_build_notify_value(s, 0, "reemit", s->hps_value_prop, NULL, 0);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -2962,7 +3175,8 @@ prop_sub_reemit(prop_sub_t *s)
 void
 prop_init(void)
 {
-  hts_mutex_init(&prop_mutex);
+  hts_rwlock_init(&prop_rwlock);
+  hts_mutex_init(&prop_courier_mutex);
   hts_mutex_init(&prop_tag_mutex);
 
   prop_pool   = pool_create("prop", sizeof(prop_t), 0);
@@ -2970,9 +3184,9 @@ prop_init(void)
   sub_pool    = pool_create("subs", sizeof(prop_sub_t), 0);
   pot_pool    = pool_create("pots", sizeof(prop_originator_tracking_t), 0);
   
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_global = prop_make("global", 1, NULL);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 
   global_courier = prop_courier_create_thread(NULL, "global", 
                                               PROP_COURIER_TRACE_TIMES);
@@ -2997,7 +3211,7 @@ prop_set_epilogue(prop_sub_t *skipme, prop_t *p, const char *origin)
 {
   prop_notify_value(p, skipme, origin, 0);
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3041,9 +3255,9 @@ prop_set_string_ex(prop_t *p, prop_sub_t *skipme, const char *str,
     return;
   }
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_set_string_exl(p, skipme, str, type);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3090,9 +3304,9 @@ prop_set_rstring_ex(prop_t *p, prop_sub_t *skipme, rstr_t *rstr)
     return;
   }
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_set_rstring_exl(p, skipme, rstr);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3136,9 +3350,9 @@ prop_set_cstring_ex(prop_t *p, prop_sub_t *skipme, const char *cstr)
     return;
   }
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_set_cstring_exl(p, skipme, cstr);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3157,23 +3371,23 @@ prop_set_link_ex(prop_t *p, prop_sub_t *skipme, const char *title,
     return;
   }
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return;
   }
 
   if(p->hp_type != PROP_LINK) {
 
     if(prop_clean(p)) {
-      hts_mutex_unlock(&prop_mutex);
+      hts_rwlock_unlock(&prop_rwlock);
       return;
     }
 
   } else if(!strcmp(rstr_get(p->hp_link_rtitle) ?: "", title ?: "") &&
 	    !strcmp(rstr_get(p->hp_link_rurl)   ?: "", url   ?: "")) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return;
   } else {
     rstr_release(p->hp_link_rtitle);
@@ -3307,9 +3521,9 @@ prop_set_float_exl(prop_t *p, prop_sub_t *skipme, float v, int how)
 void
 prop_set_float_ex(prop_t *p, prop_sub_t *skipme, float v, int how)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_set_float_exl(p, skipme, v, how);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3319,7 +3533,7 @@ prop_set_float_ex(prop_t *p, prop_sub_t *skipme, float v, int how)
 void
 prop_add_float_ex(prop_t *p, prop_sub_t *skipme, float v)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if((p = prop_get_float_locked(p, NULL)) != NULL) {
     float n = p->hp_float + v;
@@ -3336,7 +3550,7 @@ prop_add_float_ex(prop_t *p, prop_sub_t *skipme, float v)
       prop_notify_value(p, skipme, "prop_add_float()", 0);
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3346,7 +3560,7 @@ prop_add_float_ex(prop_t *p, prop_sub_t *skipme, float v)
 void
 prop_set_float_clipping_range(prop_t *p, float min, float max)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if((p = prop_get_float_locked(p, NULL)) != NULL) {
 
@@ -3368,7 +3582,7 @@ prop_set_float_clipping_range(prop_t *p, float min, float max)
     }
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3415,9 +3629,9 @@ prop_set_int_ex(prop_t *p, prop_sub_t *skipme, int v)
   if(p == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_set_int_exl(p, skipme, v);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3431,10 +3645,10 @@ prop_add_int_ex(prop_t *p, prop_sub_t *skipme, int v)
   if(p == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return;
   }
 
@@ -3443,7 +3657,7 @@ prop_add_int_ex(prop_t *p, prop_sub_t *skipme, int v)
     if(p->hp_type == PROP_FLOAT) {
       prop_float_to_int(p);
     } else if(prop_clean(p)) {
-      hts_mutex_unlock(&prop_mutex);
+      hts_rwlock_unlock(&prop_rwlock);
       return;
     } else {
       p->hp_int = 0;
@@ -3465,7 +3679,7 @@ prop_add_int_ex(prop_t *p, prop_sub_t *skipme, int v)
     p->hp_int = n;
     prop_notify_value(p, skipme, "prop_add_int()", 0);
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3478,10 +3692,10 @@ prop_toggle_int_ex(prop_t *p, prop_sub_t *skipme)
   if(p == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return;
   }
 
@@ -3490,7 +3704,7 @@ prop_toggle_int_ex(prop_t *p, prop_sub_t *skipme)
     if(p->hp_type == PROP_FLOAT) {
       prop_float_to_int(p);
     } else if(prop_clean(p)) {
-      hts_mutex_unlock(&prop_mutex);
+      hts_rwlock_unlock(&prop_rwlock);
       return;
     } else {
       p->hp_int = 0;
@@ -3514,10 +3728,10 @@ prop_set_int_clipping_range(prop_t *p, int min, int max)
   if(p == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return;
   }
 
@@ -3526,7 +3740,7 @@ prop_set_int_clipping_range(prop_t *p, int min, int max)
     if(p->hp_type == PROP_FLOAT) {
       prop_float_to_int(p);
     } else if(prop_clean(p)) {
-      hts_mutex_unlock(&prop_mutex);
+      hts_rwlock_unlock(&prop_rwlock);
       return;
     } else {
       p->hp_int = 0;
@@ -3551,7 +3765,7 @@ prop_set_int_clipping_range(prop_t *p, int min, int max)
     prop_notify_value(p, NULL, "prop_set_int_clipping_range()", 0);
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -3584,9 +3798,9 @@ prop_set_void_ex(prop_t *p, prop_sub_t *skipme)
   if(p == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_set_void_exl(p, skipme);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 /**
@@ -3598,7 +3812,7 @@ prop_copy_ex(prop_t *dst, prop_sub_t *skipme, prop_t *src)
   if(dst == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(src == NULL) {
     prop_set_void_exl(dst, skipme);
@@ -3623,7 +3837,7 @@ prop_copy_ex(prop_t *dst, prop_sub_t *skipme, prop_t *src)
     }
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4125,9 +4339,9 @@ prop_link_ex(prop_t *src, prop_t *dst, prop_sub_t *skipme, int hard, int debug)
   if(src == NULL || dst == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_link0(src, dst, skipme, hard, debug);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4142,17 +4356,17 @@ prop_unlink_ex(prop_t *p, prop_sub_t *skipme)
   if(p == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return;
   }
 
   if(p->hp_originator != NULL)
     prop_unlink0(p, skipme, "prop_unlink()/childs", NULL);
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4162,13 +4376,13 @@ prop_unlink_ex(prop_t *p, prop_sub_t *skipme)
 prop_t *
 prop_follow(prop_t *p)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
 
   while(p->hp_originator != NULL)
     p = p->hp_originator;
   
   p = prop_ref_inc(p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return p;
 }
 
@@ -4179,7 +4393,7 @@ prop_follow(prop_t *p)
 int
 prop_compare(const prop_t *a, const prop_t *b)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
 
   while(a->hp_originator != NULL)
     a = a->hp_originator;
@@ -4187,7 +4401,7 @@ prop_compare(const prop_t *a, const prop_t *b)
   while(b->hp_originator != NULL)
     b = b->hp_originator;
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return a == b;
 }
 
@@ -4200,10 +4414,10 @@ prop_select_ex(prop_t *p, prop_t *extra, prop_sub_t *skipme)
 {
   prop_t *parent;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE) {
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
     return;
   }
 
@@ -4215,7 +4429,7 @@ prop_select_ex(prop_t *p, prop_t *extra, prop_sub_t *skipme)
     parent->hp_selected = p;
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4225,14 +4439,14 @@ prop_select_ex(prop_t *p, prop_t *extra, prop_sub_t *skipme)
 void
 prop_unselect_ex(prop_t *parent, prop_sub_t *skipme)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(parent->hp_type == PROP_DIR) {
     prop_notify_child(NULL, parent, PROP_SELECT_CHILD, skipme, 0);
     parent->hp_selected = NULL;
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4242,7 +4456,7 @@ prop_unselect_ex(prop_t *parent, prop_sub_t *skipme)
 void
 prop_select_by_value_ex(prop_t *p, const char *name, prop_sub_t *skipme)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_DIR) {
     prop_t *c;
@@ -4253,7 +4467,7 @@ prop_select_by_value_ex(prop_t *p, const char *name, prop_sub_t *skipme)
     prop_notify_child(c, p, PROP_SELECT_CHILD, skipme, 0);
     p->hp_selected = c;
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4283,9 +4497,9 @@ prop_suggest_focus0(prop_t *p)
 void
 prop_suggest_focus(prop_t *p)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_suggest_focus0(p);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4325,9 +4539,9 @@ prop_find(prop_t *p, ...)
   va_list ap;
   va_start(ap, p);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
   prop_t *c = prop_ref_inc(prop_find0(p, ap));
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   va_end(ap);
   return c;
 }
@@ -4339,10 +4553,10 @@ prop_find(prop_t *p, ...)
 prop_t *
 prop_first_child(prop_t *p)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
   prop_t *c = p && p->hp_type == PROP_DIR ? TAILQ_FIRST(&p->hp_childs) : NULL;
   c = prop_ref_inc(c);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return c;
 }
 
@@ -4353,12 +4567,12 @@ prop_first_child(prop_t *p)
 void
 prop_request_new_child(prop_t *p)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_DIR || p->hp_type == PROP_VOID)
     prop_notify_child(NULL, p, PROP_REQ_NEW_CHILD, NULL, 0);
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4369,7 +4583,7 @@ void
 prop_request_delete(prop_t *c)
 {
   prop_t *p;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(c->hp_type != PROP_ZOMBIE) {
     p = c->hp_parent;
@@ -4381,7 +4595,7 @@ prop_request_delete(prop_t *c)
       prop_vec_release(pv);
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4391,10 +4605,10 @@ prop_request_delete(prop_t *c)
 void
 prop_request_delete_multi(prop_vec_t *pv)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_notify_childv(pv, pv->pv_vec[0]->hp_parent,
 		     PROP_REQ_DELETE_VECTOR, NULL, NULL);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 /**
@@ -4406,6 +4620,7 @@ prop_courier_create(void)
   prop_courier_t *pc = calloc(1, sizeof(prop_courier_t));
   TAILQ_INIT(&pc->pc_queue_nor);
   TAILQ_INIT(&pc->pc_queue_exp);
+  TAILQ_INIT(&pc->pc_coalesced);
   TAILQ_INIT(&pc->pc_dispatch_queue);
   TAILQ_INIT(&pc->pc_free_queue);
   return pc;
@@ -4425,7 +4640,7 @@ prop_courier_create_thread(hts_mutex_t *entrymutex, const char *name,
   snprintf(buf, sizeof(buf), "PC:%s", name);
   pc->pc_flags = flags;
   pc->pc_has_cond = 1;
-  hts_cond_init(&pc->pc_cond, &prop_mutex);
+  hts_cond_init(&pc->pc_cond, &prop_courier_mutex);
 
   pc->pc_name = strdup(name);
   pc->pc_run = 1;
@@ -4470,7 +4685,7 @@ prop_courier_create_waitable(void)
   prop_courier_t *pc = prop_courier_create();
   
   pc->pc_has_cond = 1;
-  hts_cond_init(&pc->pc_cond, &prop_mutex);
+  hts_cond_init(&pc->pc_cond, &prop_courier_mutex);
 
   return pc;
 }
@@ -4495,7 +4710,7 @@ prop_courier_create_lockmgr(const char *name, prop_lockmgr_t *mgr, void *lock,
   snprintf(buf, sizeof(buf), "PC:%s", name);
 
   pc->pc_has_cond = 1;
-  hts_cond_init(&pc->pc_cond, &prop_mutex);
+  hts_cond_init(&pc->pc_cond, &prop_courier_mutex);
 
   pc->pc_run = 1;
   hts_thread_create_joinable(buf, &pc->pc_thread, prop_courier, pc,
@@ -4511,18 +4726,26 @@ int
 prop_courier_wait(prop_courier_t *pc, struct prop_notify_queue *q, int timeout)
 {
   int r = 0;
-  hts_mutex_lock(&prop_mutex);
+  hts_mutex_lock(&prop_courier_mutex);
+  prop_courier_collect(pc);
   if(TAILQ_FIRST(&pc->pc_queue_exp) == NULL &&
      TAILQ_FIRST(&pc->pc_queue_nor) == NULL) {
     if(timeout)
-      r = hts_cond_wait_timeout(&pc->pc_cond, &prop_mutex, timeout);
+      r = hts_cond_wait_timeout(&pc->pc_cond, &prop_courier_mutex, timeout);
     else
-      hts_cond_wait(&pc->pc_cond, &prop_mutex);
+      hts_cond_wait(&pc->pc_cond, &prop_courier_mutex);
+    prop_courier_collect(pc);
+  }
+  hts_mutex_unlock(&prop_courier_mutex);
+
+  if(TAILQ_FIRST(&pc->pc_coalesced) != NULL) {
+    hts_rwlock_wrlock(&prop_rwlock);
+    prop_courier_release_coalesced(pc);
+    hts_rwlock_unlock(&prop_rwlock);
   }
 
   TAILQ_MOVE(q, &pc->pc_queue_exp, hpn_link);
   TAILQ_MERGE(q, &pc->pc_queue_nor, hpn_link);
-  hts_mutex_unlock(&prop_mutex);
   return r;
 }
 
@@ -4550,10 +4773,10 @@ prop_courier_destroy(prop_courier_t *pc)
 	  "Refcnt is %d on courier destroy", pc->pc_refcount);
 
   if(pc->pc_run) {
-    hts_mutex_lock(&prop_mutex);
+    hts_mutex_lock(&prop_courier_mutex);
     pc->pc_run = 0;
     hts_cond_signal(&pc->pc_cond);
-    hts_mutex_unlock(&prop_mutex);
+    hts_mutex_unlock(&prop_courier_mutex);
 
     hts_thread_join(&pc->pc_thread);
   }
@@ -4586,10 +4809,14 @@ void
 prop_courier_poll(prop_courier_t *pc)
 {
   struct prop_notify_queue q;
-  hts_mutex_lock(&prop_mutex);
+  prop_courier_collect(pc);
   TAILQ_MOVE(&q, &pc->pc_queue_exp, hpn_link);
   TAILQ_MERGE(&q, &pc->pc_queue_nor, hpn_link);
-  hts_mutex_unlock(&prop_mutex);
+  if(TAILQ_FIRST(&pc->pc_coalesced) != NULL) {
+    hts_rwlock_wrlock(&prop_rwlock);
+    prop_courier_release_coalesced(pc);
+    hts_rwlock_unlock(&prop_rwlock);
+  }
   prop_notify_dispatch(&q, 0);
 }
 
@@ -4605,9 +4832,12 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
 
   prop_notify_t *n, *next;
 
-  if(!hts_mutex_trylock(&prop_mutex)) {
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+  prop_courier_collect(pc);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+
+  if(!hts_rwlock_trywrlock(&prop_rwlock)) {
+    prop_courier_release_coalesced(pc);
 
     for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
       next = TAILQ_NEXT(n, hpn_link);
@@ -4617,7 +4847,7 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
     }
     TAILQ_INIT(&pc->pc_free_queue);
 
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
   }
 
   int64_t ts = showtime_get_ts();
@@ -4638,10 +4868,9 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
 int
 prop_courier_check(prop_courier_t *pc)
 {
-  hts_mutex_lock(&prop_mutex);
-  int r = TAILQ_FIRST(&pc->pc_queue_exp) || TAILQ_FIRST(&pc->pc_queue_nor);
-  hts_mutex_unlock(&prop_mutex);
-  return r;
+  return TAILQ_FIRST(&pc->pc_queue_exp) || TAILQ_FIRST(&pc->pc_queue_nor) ||
+    *(struct prop_notify * volatile *)&pc->pc_inbox_exp != NULL ||
+    *(struct prop_notify * volatile *)&pc->pc_inbox_nor != NULL;
 
 }
 
@@ -4658,7 +4887,7 @@ prop_get_string(prop_t *p, ...)
 
   va_start(ap, p);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
   p = prop_find0(p, ap);
 
   if(p != NULL) {
@@ -4685,7 +4914,7 @@ prop_get_string(prop_t *p, ...)
       break;
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   va_end(ap);
   return r;
 }
@@ -4702,7 +4931,7 @@ prop_get_int(prop_t *p, ...)
 
   va_start(ap, p);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
   p = prop_find0(p, ap);
 
   if(p != NULL) {
@@ -4727,7 +4956,7 @@ prop_get_int(prop_t *p, ...)
       break;
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   va_end(ap);
   return r;
 }
@@ -4793,7 +5022,7 @@ prop_setv_ex(prop_sub_t *skipme, prop_t *p, ...)
 
   va_start(ap, p);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type == PROP_ZOMBIE)
     goto bad;
@@ -4815,7 +5044,7 @@ prop_setv_ex(prop_sub_t *skipme, prop_t *p, ...)
   prop_seti(skipme, p, ap);
 
  bad:
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   va_end(ap);
 }
 
@@ -4834,7 +5063,7 @@ prop_setdn(prop_sub_t *skipme, prop_t *p, const char *str, ...)
 
   va_start(ap, str);
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   while(1) {
     if(p->hp_type == PROP_ZOMBIE)
@@ -4868,7 +5097,7 @@ prop_setdn(prop_sub_t *skipme, prop_t *p, const char *str, ...)
   prop_seti(skipme, p, ap);
 
  bad:
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   va_end(ap);
 }
 
@@ -4885,7 +5114,7 @@ prop_set_ex(prop_t *p, const char *name, int noalloc, ...)
   if(p == NULL)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(p->hp_type != PROP_ZOMBIE) {
     p = prop_create0(p, name, NULL, noalloc);
@@ -4893,7 +5122,321 @@ prop_set_ex(prop_t *p, const char *name, int noalloc, ...)
     prop_seti(NULL, p, ap);
     va_end(ap);
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
+}
+
+
+/**
+ * A recorded prop_batch_set() or prop_batch_set_parent()
+ */
+typedef struct prop_batch_op {
+  prop_t *pbo_prop;
+  prop_t *pbo_parent;    // Set for parent ops
+  const char *pbo_name;
+  char pbo_name_alloced;
+  int pbo_event;
+  union {
+    int i;
+    float f;
+    rstr_t *rstr;
+  } u;
+} prop_batch_op_t;
+
+struct prop_batch {
+  prop_batch_op_t *pb_ops;
+  int pb_count;
+  int pb_capacity;
+};
+
+
+/**
+ *
+ */
+prop_batch_t *
+prop_batch_create(void)
+{
+  return calloc(1, sizeof(prop_batch_t));
+}
+
+
+/**
+ *
+ */
+static prop_batch_op_t *
+prop_batch_op_add(prop_batch_t *pb, prop_t *p)
+{
+  if(pb->pb_count == pb->pb_capacity) {
+    pb->pb_capacity = pb->pb_capacity ? pb->pb_capacity * 2 : 16;
+    pb->pb_ops = realloc(pb->pb_ops,
+                         pb->pb_capacity * sizeof(prop_batch_op_t));
+  }
+  prop_batch_op_t *pbo = &pb->pb_ops[pb->pb_count++];
+  memset(pbo, 0, sizeof(prop_batch_op_t));
+  pbo->pbo_prop = prop_ref_inc(p);
+  return pbo;
+}
+
+
+/**
+ * Record a prop_set() to be done at commit time. Takes the same
+ * arguments as prop_set(), name may be NULL to set 'p' itself
+ */
+void
+prop_batch_set_ex(prop_batch_t *pb, prop_t *p, const char *name,
+                  int noalloc, ...)
+{
+  const char *str;
+  va_list ap;
+
+  if(p == NULL)
+    return;
+
+  prop_batch_op_t *pbo = prop_batch_op_add(pb, p);
+
+  if(name != NULL && !noalloc) {
+    pbo->pbo_name = strdup(name);
+    pbo->pbo_name_alloced = 1;
+  } else {
+    pbo->pbo_name = name;
+  }
+
+  va_start(ap, noalloc);
+  pbo->pbo_event = va_arg(ap, prop_event_t);
+
+  switch(pbo->pbo_event) {
+  case PROP_SET_STRING:
+    str = va_arg(ap, const char *);
+    if(str == NULL)
+      pbo->pbo_event = PROP_SET_VOID;
+    else
+      pbo->u.rstr = rstr_alloc(str);
+    break;
+  case PROP_SET_RSTRING:
+    pbo->u.rstr = rstr_dup(va_arg(ap, rstr_t *));
+    if(pbo->u.rstr == NULL)
+      pbo->pbo_event = PROP_SET_VOID;
+    break;
+  case PROP_ADOPT_RSTRING:
+    pbo->u.rstr = va_arg(ap, rstr_t *);
+    if(pbo->u.rstr == NULL)
+      pbo->pbo_event = PROP_SET_VOID;
+    break;
+  case PROP_SET_INT:
+    pbo->u.i = va_arg(ap, int);
+    break;
+  case PROP_SET_FLOAT:
+    pbo->u.f = va_arg(ap, double);
+    break;
+  case PROP_SET_VOID:
+    break;
+  default:
+    fprintf(stderr, "Unable to handle event: %d\n", pbo->pbo_event);
+    assert(0);
+    break;
+  }
+  va_end(ap);
+}
+
+
+/**
+ * Record that 'p' should be added as the last child of 'parent'
+ *
+ * A prop should only be given a parent once per batch
+ */
+void
+prop_batch_set_parent(prop_batch_t *pb, prop_t *p, prop_t *parent)
+{
+  if(p == NULL)
+    return;
+
+  prop_batch_op_t *pbo = prop_batch_op_add(pb, p);
+  pbo->pbo_parent = prop_ref_inc(parent);
+  pbo->pbo_event = PROP_ADD_CHILD;
+}
+
+
+/**
+ *
+ */
+static void
+prop_batch_apply_set(prop_batch_op_t *pbo)
+{
+  prop_t *p = pbo->pbo_prop;
+
+  if(p->hp_type == PROP_ZOMBIE)
+    return;
+
+  if(pbo->pbo_name != NULL)
+    p = prop_create0(p, pbo->pbo_name, NULL, !pbo->pbo_name_alloced);
+
+  switch(pbo->pbo_event) {
+  case PROP_SET_STRING:
+  case PROP_SET_RSTRING:
+  case PROP_ADOPT_RSTRING:
+    prop_set_rstring_exl(p, NULL, pbo->u.rstr);
+    break;
+  case PROP_SET_INT:
+    prop_set_int_exl(p, NULL, pbo->u.i);
+    break;
+  case PROP_SET_FLOAT:
+    prop_set_float_exl(p, NULL, pbo->u.f, 0);
+    break;
+  case PROP_SET_VOID:
+    prop_set_void_exl(p, NULL);
+    break;
+  }
+}
+
+
+/**
+ * All children going to the same parent
+ */
+typedef struct prop_batch_group {
+  prop_t *pbg_parent;
+  prop_vec_t *pbg_childs;
+  int pbg_last;
+} prop_batch_group_t;
+
+
+/**
+ *
+ */
+static int
+prop_batch_group_cmp(const void *A, const void *B)
+{
+  const prop_batch_group_t *a = A;
+  const prop_batch_group_t *b = B;
+  return a->pbg_last - b->pbg_last;
+}
+
+
+/**
+ * Apply everything recorded in the batch and free it
+ *
+ * All sets are done first, in the order they were recorded. Since
+ * freshly built items normally have no subscribers yet this does not
+ * generate any notifications. Then all children going to the same
+ * parent are inserted in one go, so each subscriber of that parent
+ * gets a single PROP_ADD_CHILD_VECTOR. Parents are processed in the
+ * order of their last prop_batch_set_parent() so nested items are
+ * complete before they are added to the final parent.
+ *
+ * As with prop_set_parent_vector() the children are destroyed if the
+ * parent is gone.
+ */
+void
+prop_batch_commit(prop_batch_t *pb)
+{
+  prop_batch_group_t *groups = NULL;
+  prop_batch_group_t **hash = NULL;
+  unsigned int mask = 0;
+  int i, num_groups = 0;
+
+  for(i = 0; i < pb->pb_count; i++)
+    if(pb->pb_ops[i].pbo_parent != NULL)
+      num_groups++;
+
+  if(num_groups) {
+    // Open addressing, parent -> group
+    mask = 15;
+    while(mask < num_groups * 2)
+      mask = mask * 2 + 1;
+    hash = calloc(mask + 1, sizeof(prop_batch_group_t *));
+    groups = malloc(num_groups * sizeof(prop_batch_group_t));
+    num_groups = 0;
+
+    for(i = 0; i < pb->pb_count; i++) {
+      prop_batch_op_t *pbo = &pb->pb_ops[i];
+      if(pbo->pbo_parent == NULL)
+        continue;
+
+      unsigned int h = ((intptr_t)pbo->pbo_parent >> 4) & mask;
+      while(hash[h] != NULL && hash[h]->pbg_parent != pbo->pbo_parent)
+        h = (h + 1) & mask;
+
+      prop_batch_group_t *pbg = hash[h];
+      if(pbg == NULL) {
+        pbg = hash[h] = &groups[num_groups++];
+        pbg->pbg_parent = pbo->pbo_parent;
+        pbg->pbg_childs = prop_vec_create(4);
+      }
+      pbg->pbg_last = i;
+    }
+  }
+
+  hts_rwlock_wrlock(&prop_rwlock);
+
+  for(i = 0; i < pb->pb_count; i++)
+    if(pb->pb_ops[i].pbo_parent == NULL)
+      prop_batch_apply_set(&pb->pb_ops[i]);
+
+  if(num_groups) {
+    for(i = 0; i < pb->pb_count; i++) {
+      prop_batch_op_t *pbo = &pb->pb_ops[i];
+      if(pbo->pbo_parent == NULL)
+        continue;
+
+      unsigned int h = ((intptr_t)pbo->pbo_parent >> 4) & mask;
+      while(hash[h]->pbg_parent != pbo->pbo_parent)
+        h = (h + 1) & mask;
+
+      prop_batch_group_t *pbg = hash[h];
+      prop_t *p = pbo->pbo_prop;
+
+      if(p->hp_type == PROP_ZOMBIE)
+        continue;
+
+      if(p->hp_parent == NULL) {
+        pbg->pbg_childs = prop_vec_append(pbg->pbg_childs, p);
+      } else if(pbg->pbg_parent->hp_type != PROP_ZOMBIE) {
+        // Already has a parent, can't be part of the vector insert
+        prop_set_parent0(p, pbg->pbg_parent, NULL, NULL);
+      }
+    }
+
+    qsort(groups, num_groups, sizeof(prop_batch_group_t),
+          prop_batch_group_cmp);
+
+    for(i = 0; i < num_groups; i++) {
+      prop_vec_t *pv = groups[i].pbg_childs;
+      prop_t *parent = groups[i].pbg_parent;
+
+      if(pv->pv_length == 1 && parent->hp_type != PROP_ZOMBIE)
+        prop_set_parent0(pv->pv_vec[0], parent, NULL, NULL);
+      else if(pv->pv_length > 0)
+        prop_set_parent_vector0(pv, parent, NULL, NULL);
+    }
+  }
+
+  for(i = 0; i < pb->pb_count; i++) {
+    prop_batch_op_t *pbo = &pb->pb_ops[i];
+    prop_ref_dec_locked(pbo->pbo_prop);
+    if(pbo->pbo_parent != NULL)
+      prop_ref_dec_locked(pbo->pbo_parent);
+  }
+
+  hts_rwlock_unlock(&prop_rwlock);
+
+  for(i = 0; i < num_groups; i++)
+    prop_vec_release(groups[i].pbg_childs);
+
+  for(i = 0; i < pb->pb_count; i++) {
+    prop_batch_op_t *pbo = &pb->pb_ops[i];
+    if(pbo->pbo_name_alloced)
+      free((void *)pbo->pbo_name);
+    switch(pbo->pbo_event) {
+    case PROP_SET_STRING:
+    case PROP_SET_RSTRING:
+    case PROP_ADOPT_RSTRING:
+      rstr_release(pbo->u.rstr);
+      break;
+    }
+  }
+
+  free(hash);
+  free(groups);
+  free(pb->pb_ops);
+  free(pb);
 }
 
 
@@ -4910,7 +5453,7 @@ prop_get_name_of_childs(prop_t *p)
   if(p->hp_type != PROP_DIR)
     return NULL;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_rdlock(&prop_rwlock);
 
   TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
     if(c->hp_type == PROP_VOID || c->hp_type == PROP_ZOMBIE)
@@ -4926,7 +5469,7 @@ prop_get_name_of_childs(prop_t *p)
     i++;
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 
   return rval;
 }
@@ -4949,9 +5492,9 @@ prop_want_more_childs0(prop_sub_t *s)
 void
 prop_want_more_childs(prop_sub_t *s)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_want_more_childs0(s);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4972,9 +5515,9 @@ prop_have_more_childs0(prop_t *p, int yes)
 void
 prop_have_more_childs(prop_t *p, int yes)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_have_more_childs0(p, yes);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -4985,12 +5528,12 @@ void
 prop_mark_childs(prop_t *p)
 {
   prop_t *c;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   if(p->hp_type == PROP_DIR) {
     TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
       c->hp_flags |= PROP_MARKED;
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -5002,9 +5545,9 @@ prop_unmark(prop_t *p)
 {
   if(p == NULL)
     return;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   p->hp_flags &= ~PROP_MARKED;
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -5024,7 +5567,7 @@ prop_is_marked(prop_t *p)
 void
 prop_destroy_marked_childs(prop_t *p)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   if(p->hp_type == PROP_DIR) {
     prop_t *c, *next;
     for(c = TAILQ_FIRST(&p->hp_childs); c != NULL; c = next) {
@@ -5033,7 +5576,7 @@ prop_destroy_marked_childs(prop_t *p)
         prop_destroy0(c);
     }
   }
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -5157,9 +5700,9 @@ prop_print_tree0(prop_t *p, int indent, int flags)
 void
 prop_print_tree(prop_t *p, int followlinks)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_print_tree0(p, 0, followlinks);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -5176,7 +5719,7 @@ prop_report_stats(callout_t *c, void *aux)
   int num_subs = 0;
   int origin_link_hist[4] = {};
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   LIST_FOREACH(s, &all_subs, hps_all_sub_link) {
     num_subs++;
 
@@ -5197,7 +5740,7 @@ prop_report_stats(callout_t *c, void *aux)
   }
 
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   printf("%d subs: %d %d %d %d\n",
 	 num_subs, 
 	 origin_link_hist[0],
@@ -322,13 +322,13 @@ prop_grouper_create(prop_t *dst, prop_t *src, const char *groupkey,
 
   pg->pg_groupingpath = strvec_split(groupkey, '.');
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   pg->pg_srcsub = prop_subscribe(PROP_SUB_INTERNAL | PROP_SUB_DONTLOCK,
 				 PROP_TAG_CALLBACK, src_cb, pg,
 				 PROP_TAG_ROOT, src,
 				 NULL);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return pg;
 }
 
@@ -340,7 +340,7 @@ prop_grouper_create(prop_t *dst, prop_t *src, const char *groupkey,
 void
 prop_grouper_destroy(prop_grouper_t *pg)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   pg_clear(pg);
   prop_unsubscribe0(pg->pg_srcsub);
@@ -348,7 +348,7 @@ prop_grouper_destroy(prop_grouper_t *pg)
 
   assert(LIST_FIRST(&pg->pg_nodes) == NULL);
   assert(LIST_FIRST(&pg->pg_groups) == NULL);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 
   strvec_free(pg->pg_groupingpath);
   free(pg);
@@ -29,7 +29,7 @@
 #include "prop.h"
 #include "misc/pool.h"
 
-extern hts_mutex_t prop_mutex;
+extern hts_rwlock_t prop_rwlock;
 extern hts_mutex_t prop_tag_mutex;
 extern pool_t *prop_pool;
 extern pool_t *notify_pool;
@@ -48,9 +48,27 @@ LIST_HEAD(prop_sub_list, prop_sub);
  */
 struct prop_courier {
 
+  /**
+   * Producers push notifications onto these lock free stacks (newest
+   * first). They are drained into pc_queue_nor / pc_queue_exp by
+   * prop_courier_collect()
+   */
+  struct prop_notify *pc_inbox_nor;
+  struct prop_notify *pc_inbox_exp;
+
+  /**
+   * Notifications waiting for dispatch. Only touched by the consumer
+   * side of the courier
+   */
   struct prop_notify_queue pc_queue_nor;
   struct prop_notify_queue pc_queue_exp;
 
+  /**
+   * Notifications superseded by a newer value for the same
+   * subscription. Released by prop_courier_release_coalesced()
+   */
+  struct prop_notify_queue pc_coalesced;
+
   struct prop_notify_queue pc_dispatch_queue;
   struct prop_notify_queue pc_free_queue;
 
@@ -82,6 +100,7 @@ struct prop_courier {
  */
 typedef struct prop_notify {
   TAILQ_ENTRY(prop_notify) hpn_link;
+  struct prop_notify *hpn_inbox_next;
   prop_sub_t *hpn_sub;
   prop_event_t hpn_event;
 
@@ -398,6 +417,13 @@ struct prop_sub {
   uint8_t hps_pending_unlink : 1;
   uint8_t hps_multiple_origins : 1;
 
+  /**
+   * Set while coalescing a batch of notifications if a newer value
+   * update has been seen. Only touched by the consumer side of
+   * hps_courier
+   */
+  uint8_t hps_coalesce;
+
   /**
    * Flags as passed to prop_subscribe(). May never be changed
    */
@@ -469,4 +495,8 @@ void prop_sub_ref_dec_locked(prop_sub_t *s);
 
 void prop_dispatch_one(prop_notify_t *n);
 
+void prop_courier_collect(prop_courier_t *pc);
+
+void prop_courier_release_coalesced(prop_courier_t *pc);
+
 #endif // PROP_I_H__
@@ -1161,7 +1161,7 @@ prop_nf_create(prop_t *dst, prop_t *src, prop_t *filter, int flags)
   nf->dst = flags & PROP_NF_TAKE_DST_OWNERSHIP ? dst : prop_xref_addref(dst);
   nf->src = src;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
 
   if(filter != NULL)
     nf->filtersub = prop_subscribe(PROP_SUB_INTERNAL | PROP_SUB_DONTLOCK,
@@ -1182,7 +1182,7 @@ prop_nf_create(prop_t *dst, prop_t *src, prop_t *filter, int flags)
 			      NULL);
 
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 
   return nf;
 }
@@ -1194,9 +1194,9 @@ prop_nf_create(prop_t *dst, prop_t *src, prop_t *filter, int flags)
 void
 prop_nf_release(struct prop_nf *pnf)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   prop_nf_release0(pnf);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -1206,9 +1206,9 @@ prop_nf_release(struct prop_nf *pnf)
 struct prop_nf *
 prop_nf_retain(struct prop_nf *pnf)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   pnf->pnf_refcount++;
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return pnf;
 }
 
@@ -1281,9 +1281,9 @@ prop_nf_pred_str_add(struct prop_nf *nf,
 {
   struct prop_nf_pred *pnp = calloc(1, sizeof(struct prop_nf_pred));
   pnp->pnp_str = strdup(str);
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   int id = prop_nf_pred_add(nf, path, cf, enable, mode, pnp);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return id;
 }
 
@@ -1299,9 +1299,9 @@ prop_nf_pred_int_add(struct prop_nf *nf,
 {
   struct prop_nf_pred *pnp = calloc(1, sizeof(struct prop_nf_pred));
   pnp->pnp_int = value;
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   int id = prop_nf_pred_add(nf, path, cf, enable, mode, pnp);
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
   return id;
 }
 
@@ -1319,7 +1319,7 @@ prop_nf_pred_remove(struct prop_nf *nf, int id)
   if(id == 0)
     return;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   LIST_FOREACH(pnp, &nf->preds, pnp_link)
     if(pnp->pnp_id == id)
       break;
@@ -1338,7 +1338,7 @@ prop_nf_pred_remove(struct prop_nf *nf, int id)
     nf_destroy_pred(pnp);
   }
 
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
 
 
@@ -1365,7 +1365,7 @@ prop_nf_sort(struct prop_nf *nf, const char *path, int desc, unsigned int idx,
   nfnode_t *nfn;
   int m = desc ? -1 : 1;
 
-  hts_mutex_lock(&prop_mutex);
+  hts_rwlock_wrlock(&prop_rwlock);
   
   assert(idx < MAX_SORT_KEYS);
 
@@ -1409,5 +1409,5 @@ prop_nf_sort(struct prop_nf *nf, const char *path, int desc, unsigned int idx,
   TAILQ_FOREACH(nfn, &nf->in, in_link)
     nf_update_order_x(nf, nfn, idx);
  done:
-  hts_mutex_unlock(&prop_mutex);
+  hts_rwlock_unlock(&prop_rwlock);
 }
@@ -48,9 +48,12 @@ prop_courier_poll_with_alarm(prop_courier_t *pc, int maxtime)
 {
   prop_notify_t *n, *next;
 
-  if(!hts_mutex_trylock(&prop_mutex)) {
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+  prop_courier_collect(pc);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
+  TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+
+  if(!hts_rwlock_trywrlock(&prop_rwlock)) {
+    prop_courier_release_coalesced(pc);
 
     for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
       next = TAILQ_NEXT(n, hpn_link);
@@ -60,7 +63,7 @@ prop_courier_poll_with_alarm(prop_courier_t *pc, int maxtime)
     }
     TAILQ_INIT(&pc->pc_free_queue);
 
-    hts_mutex_unlock(&prop_mutex);
+    hts_rwlock_unlock(&prop_rwlock);
   }
 
   if(TAILQ_FIRST(&pc->pc_dispatch_queue) == NULL)
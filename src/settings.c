@@ -1407,6 +1407,9 @@ init_dev_settings(void)
 
   add_dev_bool(s, "Log AV-diff stats",
 	       "detailedavdiff", &gconf.enable_detailed_avdiff);
+
+  add_dev_bool(s, "Record HLS bitrate switching decisions",
+	       "hlsabrlog", &gconf.enable_hls_abr_log);
 #ifdef PS3
   add_dev_bool(s, "Log memory usage",
 	       "memdebug", &gconf.enable_mem_debug);
@@ -232,6 +232,7 @@ typedef struct gconf {
   int enable_experimental;
   int enable_detailed_avdiff;
   int enable_hls_debug;
+  int enable_hls_abr_log;
   int enable_ftp_client_debug;
   int enable_ftp_server_debug;
   int enable_cec_debug;
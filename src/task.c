@@ -21,26 +21,243 @@
 
 #include "showtime.h"
 #include "arch/threads.h"
+#include "arch/atomic.h"
 
 #include "task.h"
 #include "misc/queue.h"
+#include "misc/pool.h"
+#include "misc/callout.h"
+#include "misc/cancellable.h"
+#include "prop/prop.h"
 
 #define MAX_TASK_THREADS 16
 #define MAX_IDLE_TASK_THREADS 2
 
+// One extra slot per class so a class never ends up without a worker
+#define TASK_SLOTS (MAX_TASK_THREADS + TASK_PRIO_num)
+
 TAILQ_HEAD(task_queue, task);
 
 typedef struct task {
   TAILQ_ENTRY(task) t_link;
   task_fn_t *t_fn;
   void *t_opaque;
+  task_group_t *t_group;
+  int64_t t_enqueued;
+  task_prio_t t_prio;
 } task_t;
 
-static struct task_queue tasks = TAILQ_HEAD_INITIALIZER(tasks);
+
+/**
+ * Per priority class statistics. Updated under the mutex of the
+ * worker slot that ran the task, once the task function has returned
+ */
+typedef struct task_stats {
+  int64_t ts_latency_sum;
+  int ts_latency_peak;
+  int ts_completed;
+} task_stats_t;
+
+
+/**
+ * A worker slot. Each slot owns one deque per priority class and its
+ * own descriptor pool, all protected by tw_mutex. Tasks are allocated
+ * from, queued on and returned to the same slot so a steal never
+ * touches more than one lock
+ */
+typedef struct task_worker {
+  hts_mutex_t tw_mutex;
+  struct task_queue tw_queues[TASK_PRIO_num];
+  volatile int tw_queued[TASK_PRIO_num];
+  task_stats_t tw_stats[TASK_PRIO_num];
+  pool_t *tw_pool;
+  int tw_running;   // Protected by task_sleep_mutex
+  int tw_index;
+  task_prio_t tw_class;  // Runs tasks of this class and more urgent ones
+} task_worker_t;
+
+
+struct task_group {
+  hts_mutex_t tg_mutex;
+  hts_cond_t tg_cond;
+  int tg_pending;
+  cancellable_t *tg_cancellable;
+  cancellable_t tg_own_cancellable;
+};
+
+
+static task_worker_t task_workers[TASK_SLOTS];
+static __thread task_worker_t *task_current_worker;
+
+static atomic_t task_pending_prio[TASK_PRIO_num];
+static atomic_t task_rr;
+
+// Protected by task_sleep_mutex
 static unsigned int num_task_threads;
-static unsigned int num_task_threads_avail;
-static hts_mutex_t task_mutex;
-static hts_cond_t task_cond;
+static int task_sleepers[TASK_PRIO_num];
+static int task_workers_running[TASK_PRIO_num];
+
+static hts_mutex_t task_sleep_mutex;
+static hts_cond_t task_sleep_cond[TASK_PRIO_num];
+
+/**
+ * Workers are launched for a class and run at its thread priority
+ */
+static const int task_thread_prio[TASK_PRIO_num] = {
+  [TASK_PRIO_INTERACTIVE] = THREAD_PRIO_UI_WORKER_MED,
+  [TASK_PRIO_BACKGROUND]  = THREAD_PRIO_METADATA,
+  [TASK_PRIO_BULK]        = THREAD_PRIO_BGTASK,
+};
+
+static const char *task_prio_names[TASK_PRIO_num] = {
+  [TASK_PRIO_INTERACTIVE] = "interactive",
+  [TASK_PRIO_BACKGROUND]  = "background",
+  [TASK_PRIO_BULK]        = "bulk",
+};
+
+
+/**
+ * Pick the slot a new task should be queued on. Workers push to their
+ * own slot, other threads spread over the running workers
+ */
+static task_worker_t *
+task_pick_worker(void)
+{
+  if(task_current_worker != NULL)
+    return task_current_worker;
+
+  int start = atomic_add_and_fetch(&task_rr, 1) & 0x7fffffff;
+  for(int i = 0; i < TASK_SLOTS; i++) {
+    task_worker_t *tw = &task_workers[(start + i) % TASK_SLOTS];
+    if(tw->tw_running)
+      return tw;
+  }
+  return &task_workers[start % TASK_SLOTS];
+}
+
+
+/**
+ * Try to dequeue a task of the given class from a slot.
+ * On success the descriptor has been copied to *out and returned to
+ * the slot's pool
+ */
+static int
+task_take(task_worker_t *tw, task_prio_t prio, task_t *out)
+{
+  task_t *t;
+
+  if(!tw->tw_queued[prio])
+    return 0;
+
+  hts_mutex_lock(&tw->tw_mutex);
+  t = TAILQ_FIRST(&tw->tw_queues[prio]);
+  if(t == NULL) {
+    hts_mutex_unlock(&tw->tw_mutex);
+    return 0;
+  }
+  TAILQ_REMOVE(&tw->tw_queues[prio], t, t_link);
+  tw->tw_queued[prio]--;
+  *out = *t;
+  pool_put(tw->tw_pool, t);
+  hts_mutex_unlock(&tw->tw_mutex);
+
+  atomic_dec(&task_pending_prio[prio]);
+  return 1;
+}
+
+
+/**
+ * Own deque first, then steal from the others, one class at a time.
+ * Only classes the worker is allowed to run are considered
+ */
+static int
+task_dequeue(task_worker_t *self, task_t *out)
+{
+  for(int prio = 0; prio <= self->tw_class; prio++) {
+    if(!atomic_get(&task_pending_prio[prio]))
+      continue;
+
+    if(task_take(self, prio, out))
+      return 1;
+
+    for(int i = 1; i < TASK_SLOTS; i++) {
+      task_worker_t *tw =
+        &task_workers[(self->tw_index + i) % TASK_SLOTS];
+      if(task_take(tw, prio, out))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+task_execute(const task_t *t)
+{
+  task_group_t *tg = t->t_group;
+
+  if(tg == NULL) {
+    t->t_fn(t->t_opaque);
+    return;
+  }
+
+  if(!cancellable_is_cancelled(tg->tg_cancellable))
+    t->t_fn(t->t_opaque);
+
+  hts_mutex_lock(&tg->tg_mutex);
+  tg->tg_pending--;
+  if(tg->tg_pending == 0)
+    hts_cond_broadcast(&tg->tg_cond);
+  hts_mutex_unlock(&tg->tg_mutex);
+}
+
+
+/**
+ * Account a finished task. Latency is the time spent queued
+ */
+static void
+task_completed(task_worker_t *tw, const task_t *t, int64_t started)
+{
+  const int latency = started - t->t_enqueued;
+
+  hts_mutex_lock(&tw->tw_mutex);
+  task_stats_t *ts = &tw->tw_stats[t->t_prio];
+  ts->ts_latency_sum += latency;
+  if(latency > ts->ts_latency_peak)
+    ts->ts_latency_peak = latency;
+  ts->ts_completed++;
+  hts_mutex_unlock(&tw->tw_mutex);
+}
+
+
+/**
+ * Returns non-zero if there is anything a worker of the given class
+ * can run
+ */
+static int
+task_pending_for(task_prio_t cls)
+{
+  for(int prio = 0; prio <= cls; prio++)
+    if(atomic_get(&task_pending_prio[prio]))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Must be called with task_sleep_mutex held
+ */
+static int
+task_num_sleepers(void)
+{
+  int n = 0;
+  for(int prio = 0; prio < TASK_PRIO_num; prio++)
+    n += task_sleepers[prio];
+  return n;
+}
 
 
 /**
@@ -49,43 +266,141 @@ static hts_cond_t task_cond;
 static void *
 task_thread(void *aux)
 {
-  task_t *t;
+  task_worker_t *tw = aux;
+  const task_prio_t cls = tw->tw_class;
+  task_t t;
+
+  task_current_worker = tw;
 
-  hts_mutex_lock(&task_mutex);
   while(1) {
-    t = TAILQ_FIRST(&tasks);
-    if(t == NULL) {
+    if(task_dequeue(tw, &t)) {
+      const int64_t started = showtime_get_ts();
+      task_execute(&t);
+      task_completed(tw, &t, started);
+      continue;
+    }
+
+    hts_mutex_lock(&task_sleep_mutex);
+    task_sleepers[cls]++;
 
-      if(num_task_threads_avail == MAX_IDLE_TASK_THREADS)
+    if(!task_pending_for(cls)) {
+
+      if(task_num_sleepers() > MAX_IDLE_TASK_THREADS)
         break;
 
-      num_task_threads_avail++;
-      hts_cond_wait(&task_cond, &task_mutex);
-      num_task_threads_avail--;
-      continue;
+      hts_cond_wait(&task_sleep_cond[cls], &task_sleep_mutex);
     }
-    TAILQ_REMOVE(&tasks, t, t_link);
-
-    hts_mutex_unlock(&task_mutex);
-    t->t_fn(t->t_opaque);
-    free(t);
-    hts_mutex_lock(&task_mutex);
+    task_sleepers[cls]--;
+    hts_mutex_unlock(&task_sleep_mutex);
   }
 
+  /*
+   * Nothing we can run was pending when we decided to exit. A
+   * submitter bumps the pending count before it takes
+   * task_sleep_mutex, so whatever is queued after that check will see
+   * us gone and wake or launch another worker, which steals it from
+   * our deques
+   */
+  task_sleepers[cls]--;
+  task_workers_running[cls]--;
+  tw->tw_running = 0;
   num_task_threads--;
-  hts_mutex_unlock(&task_mutex);
+  hts_mutex_unlock(&task_sleep_mutex);
+  task_current_worker = NULL;
   return NULL;
 }
 
 
+/**
+ * Must be called with task_sleep_mutex held
+ */
+static void
+task_launch_thread(task_prio_t cls)
+{
+  for(int i = 0; i < TASK_SLOTS; i++) {
+    task_worker_t *tw = &task_workers[i];
+    if(tw->tw_running)
+      continue;
+    tw->tw_running = 1;
+    tw->tw_class = cls;
+    task_workers_running[cls]++;
+    num_task_threads++;
+    hts_thread_create_detached("tasks", task_thread, tw,
+                               task_thread_prio[cls]);
+    return;
+  }
+}
+
+
+/**
+ * Get a worker going for a newly queued task of class 'prio'.
+ * Prefer an idle worker of the same class, then a new one, then an
+ * idle worker of a less urgent class (it will run at a lower thread
+ * priority but can still take the task).
+ * Must be called with task_sleep_mutex held
+ */
+static void
+task_wakeup(task_prio_t prio)
+{
+  if(task_sleepers[prio] > 0) {
+    hts_cond_signal(&task_sleep_cond[prio]);
+    return;
+  }
+
+  if(num_task_threads < MAX_TASK_THREADS) {
+    task_launch_thread(prio);
+    return;
+  }
+
+  int eligible = 0;
+  for(int cls = prio; cls < TASK_PRIO_num; cls++) {
+    if(task_sleepers[cls] > 0) {
+      hts_cond_signal(&task_sleep_cond[cls]);
+      return;
+    }
+    eligible += task_workers_running[cls];
+  }
+
+  // All busy, but make sure there is someone that can take it at all
+  if(eligible == 0)
+    task_launch_thread(prio);
+}
+
+
 /**
  *
  */
 static void
-task_launch_thread(void)
+task_enqueue(task_fn_t *fn, void *opaque, task_prio_t prio, task_group_t *tg)
+{
+  task_worker_t *tw = task_pick_worker();
+
+  hts_mutex_lock(&tw->tw_mutex);
+  task_t *t = pool_get(tw->tw_pool);
+  t->t_fn = fn;
+  t->t_opaque = opaque;
+  t->t_group = tg;
+  t->t_enqueued = showtime_get_ts();
+  t->t_prio = prio;
+  TAILQ_INSERT_TAIL(&tw->tw_queues[prio], t, t_link);
+  tw->tw_queued[prio]++;
+  hts_mutex_unlock(&tw->tw_mutex);
+
+  atomic_inc(&task_pending_prio[prio]);
+
+  hts_mutex_lock(&task_sleep_mutex);
+  task_wakeup(prio);
+  hts_mutex_unlock(&task_sleep_mutex);
+}
+
+
+/**
+ *
+ */
+void
+task_run_prio(task_fn_t *fn, void *opaque, task_prio_t prio)
 {
-  num_task_threads++;
-  hts_thread_create_detached("tasks", task_thread, NULL, THREAD_PRIO_BGTASK);
+  task_enqueue(fn, opaque, prio, NULL);
 }
 
 
@@ -95,28 +410,185 @@ task_launch_thread(void)
 void
 task_run(task_fn_t *fn, void *opaque)
 {
-  task_t *t = calloc(1, sizeof(task_t));
-  t->t_fn = fn;
-  t->t_opaque = opaque;
-  hts_mutex_lock(&task_mutex);
-  TAILQ_INSERT_TAIL(&tasks, t, t_link);
-
-  if(num_task_threads_avail > 0) {
-    hts_cond_signal(&task_cond);
-  } else {
-    if(num_task_threads < MAX_TASK_THREADS) {
-      task_launch_thread();
+  task_enqueue(fn, opaque, TASK_PRIO_BACKGROUND, NULL);
+}
+
+
+/**
+ *
+ */
+task_group_t *
+task_group_create(cancellable_t *c)
+{
+  task_group_t *tg = calloc(1, sizeof(task_group_t));
+  hts_mutex_init(&tg->tg_mutex);
+  hts_cond_init(&tg->tg_cond, &tg->tg_mutex);
+  tg->tg_cancellable = c ?: &tg->tg_own_cancellable;
+  return tg;
+}
+
+
+/**
+ *
+ */
+void
+task_group_run(task_group_t *tg, task_fn_t *fn, void *opaque,
+               task_prio_t prio)
+{
+  hts_mutex_lock(&tg->tg_mutex);
+  tg->tg_pending++;
+  hts_mutex_unlock(&tg->tg_mutex);
+  task_enqueue(fn, opaque, prio, tg);
+}
+
+
+/**
+ *
+ */
+cancellable_t *
+task_group_cancellable(task_group_t *tg)
+{
+  return tg->tg_cancellable;
+}
+
+
+/**
+ *
+ */
+void
+task_group_cancel(task_group_t *tg)
+{
+  cancellable_cancel(tg->tg_cancellable);
+}
+
+
+/**
+ * Wait for all tasks in the group to finish (or be dropped)
+ */
+void
+task_group_join(task_group_t *tg)
+{
+  hts_mutex_lock(&tg->tg_mutex);
+  while(tg->tg_pending)
+    hts_cond_wait(&tg->tg_cond, &tg->tg_mutex);
+  hts_mutex_unlock(&tg->tg_mutex);
+}
+
+
+/**
+ *
+ */
+void
+task_group_destroy(task_group_t *tg)
+{
+  task_group_join(tg);
+  hts_cond_destroy(&tg->tg_cond);
+  hts_mutex_destroy(&tg->tg_mutex);
+  free(tg);
+}
+
+
+/**
+ * Statistics
+ */
+static callout_t task_stats_timer;
+static prop_t *task_prop_threads;
+static prop_t *task_prop_idle;
+
+static struct {
+  prop_t *queued;
+  prop_t *completed;
+  prop_t *latency;
+  prop_t *peak;
+  int total_completed;
+} task_prio_props[TASK_PRIO_num];
+
+
+/**
+ *
+ */
+static void
+task_stats_update(callout_t *c, void *aux)
+{
+  task_stats_t sum[TASK_PRIO_num] = {};
+
+  callout_arm(&task_stats_timer, task_stats_update, NULL, 1);
+
+  for(int i = 0; i < TASK_SLOTS; i++) {
+    task_worker_t *tw = &task_workers[i];
+    hts_mutex_lock(&tw->tw_mutex);
+    for(int p = 0; p < TASK_PRIO_num; p++) {
+      task_stats_t *ts = &tw->tw_stats[p];
+      sum[p].ts_latency_sum += ts->ts_latency_sum;
+      sum[p].ts_completed   += ts->ts_completed;
+      if(ts->ts_latency_peak > sum[p].ts_latency_peak)
+        sum[p].ts_latency_peak = ts->ts_latency_peak;
+      memset(ts, 0, sizeof(task_stats_t));
     }
+    hts_mutex_unlock(&tw->tw_mutex);
+  }
+
+  hts_mutex_lock(&task_sleep_mutex);
+  const int threads = num_task_threads;
+  const int idle = task_num_sleepers();
+  hts_mutex_unlock(&task_sleep_mutex);
+
+  prop_set_int(task_prop_threads, threads);
+  prop_set_int(task_prop_idle, idle);
+
+  for(int p = 0; p < TASK_PRIO_num; p++) {
+    task_prio_props[p].total_completed += sum[p].ts_completed;
+    prop_set_int(task_prio_props[p].queued,
+                 atomic_get(&task_pending_prio[p]));
+    prop_set_int(task_prio_props[p].completed,
+                 task_prio_props[p].total_completed);
+    prop_set_int(task_prio_props[p].latency, sum[p].ts_completed ?
+                 sum[p].ts_latency_sum / sum[p].ts_completed : 0);
+    prop_set_int(task_prio_props[p].peak, sum[p].ts_latency_peak);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+task_stats_init(void)
+{
+  prop_t *root = prop_create(prop_get_global(), "tasks");
+  task_prop_threads = prop_create(root, "threads");
+  task_prop_idle    = prop_create(root, "idle");
+
+  prop_t *queues = prop_create(root, "queues");
+
+  for(int p = 0; p < TASK_PRIO_num; p++) {
+    prop_t *q = prop_create(queues, task_prio_names[p]);
+    task_prio_props[p].queued    = prop_create(q, "queued");
+    task_prio_props[p].completed = prop_create(q, "completed");
+    task_prio_props[p].latency   = prop_create(q, "latency");
+    task_prio_props[p].peak      = prop_create(q, "peakLatency");
   }
-  hts_mutex_unlock(&task_mutex);
+  task_stats_update(NULL, NULL);
 }
 
+INITME(INIT_GROUP_API, task_stats_init);
+
 
 /**
  *
  */
 INITIALIZER(taskinit)
 {
-  hts_mutex_init(&task_mutex);
-  hts_cond_init(&task_cond, &task_mutex);
+  hts_mutex_init(&task_sleep_mutex);
+  for(int p = 0; p < TASK_PRIO_num; p++)
+    hts_cond_init(&task_sleep_cond[p], &task_sleep_mutex);
+
+  for(int i = 0; i < TASK_SLOTS; i++) {
+    task_worker_t *tw = &task_workers[i];
+    hts_mutex_init(&tw->tw_mutex);
+    for(int p = 0; p < TASK_PRIO_num; p++)
+      TAILQ_INIT(&tw->tw_queues[p]);
+    tw->tw_pool = pool_create("tasks", sizeof(task_t), 0);
+    tw->tw_index = i;
+  }
 }
@@ -21,7 +21,46 @@
 
 #pragma once
 
+struct cancellable;
+
 typedef void (task_fn_t)(void *opaque);
 
+/**
+ * Priority classes. Workers always drain higher classes (lower value)
+ * before looking at lower ones. Each class also has its own workers
+ * running at a matching thread priority (UI_WORKER_MED, METADATA and
+ * BGTASK respectively) that never pick up less urgent work.
+ */
+typedef enum {
+  TASK_PRIO_INTERACTIVE,
+  TASK_PRIO_BACKGROUND,
+  TASK_PRIO_BULK,
+  TASK_PRIO_num,
+} task_prio_t;
+
+typedef struct task_group task_group_t;
+
 void task_run(task_fn_t *fn, void *opaque);
 
+void task_run_prio(task_fn_t *fn, void *opaque, task_prio_t prio);
+
+/**
+ * Task groups
+ *
+ * If a cancellable is given it is used as the group's cancellation
+ * token (so cancelling it also cancels whatever the running tasks have
+ * bound it to). Tasks that have not yet started when the group is
+ * cancelled are dropped without being called.
+ */
+task_group_t *task_group_create(struct cancellable *c);
+
+void task_group_run(task_group_t *tg, task_fn_t *fn, void *opaque,
+                    task_prio_t prio);
+
+struct cancellable *task_group_cancellable(task_group_t *tg);
+
+void task_group_cancel(task_group_t *tg);
+
+void task_group_join(task_group_t *tg);
+
+void task_group_destroy(task_group_t *tg);